@@ -0,0 +1,71 @@
+/* This file is automatically generated by gen_syscalls.sh - do not edit! */
+#define SYSCALL_exit 0
+#define SYSCALL_read 1
+#define SYSCALL_write 2
+#define SYSCALL_open 3
+#define SYSCALL_close 4
+#define SYSCALL_unlink 5
+#define SYSCALL_seek 6
+#define SYSCALL_clone 7
+#define SYSCALL_waitpid 8
+#define SYSCALL_execve 9
+#define SYSCALL_vmop 10
+#define SYSCALL_dupfd 11
+#define SYSCALL_rename 12
+#define SYSCALL_stat 13
+#define SYSCALL_chdir 14
+#define SYSCALL_fstat 15
+#define SYSCALL_fchdir 16
+#define SYSCALL_fcntl 17
+#define SYSCALL_link 18
+#define SYSCALL_utime 19
+#define SYSCALL_readv 20
+#define SYSCALL_writev 21
+#define SYSCALL_pread 22
+#define SYSCALL_pwrite 23
+#define SYSCALL_ring_setup 24
+#define SYSCALL_ring_enter 25
+#define SYSCALL_pipe 26
+#define SYSCALL_poll 27
+#define SYSCALL_evq_create 28
+#define SYSCALL_evq_ctl 29
+#define SYSCALL_evq_wait 30
+
+#ifndef ASM
+#ifdef KERNEL
+ #define ARG_CURTHREAD thread_t* curthread,
+#else
+ #define ARG_CURTHREAD
+#endif
+void sys_exit(ARG_CURTHREAD int exitcode); 
+errorcode_t sys_read(ARG_CURTHREAD handleindex_t index, void* buf, size_t* len); 
+errorcode_t sys_write(ARG_CURTHREAD handleindex_t index, const void* buf, size_t* len); 
+errorcode_t sys_open(ARG_CURTHREAD const char* path, int flags, int mode, handleindex_t* out); 
+errorcode_t sys_close(ARG_CURTHREAD handleindex_t handle); 
+errorcode_t sys_unlink(ARG_CURTHREAD const char* path); 
+errorcode_t sys_seek(ARG_CURTHREAD handleindex_t handle, off_t* offset, int whence); 
+errorcode_t sys_clone(ARG_CURTHREAD int flags, pid_t* out); 
+errorcode_t sys_waitpid(ARG_CURTHREAD pid_t* pid, int* stat_loc, int options); 
+errorcode_t sys_execve(ARG_CURTHREAD const char* path, const char** argv, const char** envp); 
+errorcode_t sys_vmop(ARG_CURTHREAD struct VMOP_OPTIONS* opts); 
+errorcode_t sys_dupfd(ARG_CURTHREAD handleindex_t index, int flags, handleindex_t* out); 
+errorcode_t sys_rename(ARG_CURTHREAD const char* oldpath, const char* newpath); 
+errorcode_t sys_stat(ARG_CURTHREAD const char* path, struct stat* buf); 
+errorcode_t sys_chdir(ARG_CURTHREAD const char* path); 
+errorcode_t sys_fstat(ARG_CURTHREAD handleindex_t index, struct stat* buf); 
+errorcode_t sys_fchdir(ARG_CURTHREAD handleindex_t index); 
+errorcode_t sys_fcntl(ARG_CURTHREAD handleindex_t index, int cmd, const void* in, void* out); 
+errorcode_t sys_link(ARG_CURTHREAD const char* oldpath, const char* newpath); 
+errorcode_t sys_utime(ARG_CURTHREAD const char* path, const struct utimbuf* times); 
+errorcode_t sys_readv(ARG_CURTHREAD handleindex_t index, const struct iovec* iov, int iovcnt, size_t* len); 
+errorcode_t sys_writev(ARG_CURTHREAD handleindex_t index, const struct iovec* iov, int iovcnt, size_t* len); 
+errorcode_t sys_pread(ARG_CURTHREAD handleindex_t index, void* buf, size_t* len, const off_t* offset); 
+errorcode_t sys_pwrite(ARG_CURTHREAD handleindex_t index, const void* buf, size_t* len, const off_t* offset); 
+errorcode_t sys_ring_setup(ARG_CURTHREAD struct RING* ring, size_t len); 
+errorcode_t sys_ring_enter(ARG_CURTHREAD unsigned int* num); 
+errorcode_t sys_pipe(ARG_CURTHREAD handleindex_t* hindex); 
+errorcode_t sys_poll(ARG_CURTHREAD struct pollfd* fds, size_t nfds, int timeout, size_t* nready); 
+errorcode_t sys_evq_create(ARG_CURTHREAD handleindex_t* out); 
+errorcode_t sys_evq_ctl(ARG_CURTHREAD handleindex_t index, int op, const struct EVQ_EVENT* ev); 
+errorcode_t sys_evq_wait(ARG_CURTHREAD handleindex_t index, struct EVQ_EVENT* events, size_t* num, int timeout); 
+#endif /* ASM */
@@ -137,6 +137,24 @@ write_cr0(uint64_t val)
 	: : "a" (val));
 }
 
+static inline uint64_t
+read_cr3()
+{
+	uint64_t r;
+	__asm __volatile(
+		"movq %%cr3, %0\n"
+	: "=a" (r));
+	return r;
+}
+
+static inline void
+write_cr3(uint64_t val)
+{
+	__asm __volatile(
+		"movq %0, %%cr3\n"
+	: : "a" (val) : "memory");
+}
+
 static inline uint64_t
 read_cr4()
 {
@@ -154,6 +172,14 @@ write_cr4(uint64_t val)
 		"movq %0, %%cr4\n"
 	: : "a" (val));
 }
+
+static inline void
+cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx)
+{
+	__asm __volatile(
+		"cpuid\n"
+	: "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx) : "a" (leaf), "c" (0));
+}
 #endif /* ASM */
 
 #endif /* __AMD64_MACRO_H__ */
@@ -20,7 +20,9 @@
 	 */									\
 	void		*fpu_context;						\
 	/* Per-cpu interrupt tick counter */					\
-	uint32_t	tickcount;
+	uint32_t	tickcount;						\
+	/* vmspace whose page tables are currently loaded, if any */		\
+	void		*vmspace;
 
 #define PCPU_TYPE(x) \
 	__typeof(((struct PCPU*)0)->x)
@@ -80,7 +80,8 @@ struct FPUREGS {
 	struct PAGE* md_kstack_page; \
 	struct FPUREGS	md_fpu_ctx __attribute__ ((aligned(16))); \
 	void*		md_stack; \
-	void*		md_kstack;
+	void*		md_kstack; \
+	register_t	md_onfault;
 
 #define md_cpu_relax() \
 	__asm __volatile("hlt")
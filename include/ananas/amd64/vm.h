@@ -51,6 +51,9 @@
 #define KMEM_DYNAMIC_VA_START 0xffffc80000000000
 #define KMEM_DYNAMIC_VA_END   0xffffc8000fffffff
 
+/* Userland addresses are below the canonical hole */
+#define USER_VA_END		0x0000800000000000
+
 /* Physical addresses that can be directly mapped */
 #define KMEM_DIRECT_PA_START	0
 #define KMEM_DIRECT_PA_END		(KMEM_DIRECT_VA_END - KMEM_DIRECT_VA_START)
@@ -97,9 +100,22 @@
 #define CR0_TS			(1 << 3)	/* Task switched */
 #define CR0_WP      (1 << 16)	/* Write protect */
 
+/* CR3 specific flags */
+#define CR3_PCID_MASK		0xfff		/* Process-Context Identifier */
+#define CR3_NOFLUSH		(1ULL << 63)	/* Keep TLB entries of the PCID */
+
 /* CR4 specific flags */
+#define CR4_PGE			(1 << 7)	/* Page Global Enable */
 #define CR4_OSFXSR		(1 << 9)	/* OS saves/restores SSE state */
 #define CR4_OSXMMEXCPT		(1 << 10)	/* OS will handle SIMD exceptions */
+#define CR4_PCIDE		(1 << 17)	/* PCID Enable */
+#define CR4_SMAP		(1 << 21)	/* Supervisor Mode Access Prevention */
+
+/* CPUID leaf 1 %ecx flags */
+#define CPUID_1_ECX_PCID	(1 << 17)	/* Process-Context Identifiers */
+
+/* CPUID leaf 7 %ebx flags */
+#define CPUID_7_EBX_SMAP	(1 << 20)	/* Supervisor Mode Access Prevention */
 
 /*
  * GDT entry selectors, which are the offset in the GDT. We don't use indexes
@@ -120,9 +136,31 @@ void md_map_kernel(vmspace_t* vs);
 /* Maps 'num_pages' at physical address 'phys' to virtual address 'virt' for vmspace 'vs' with flags 'flags' */
 void md_map_pages(vmspace_t* vs, addr_t virt, addr_t phys, size_t num_pages, int flags);
 
+/*
+ * Maps 'num_pages' consecutive virtual pages starting at 'virt', where page n
+ * is backed by physical address phys[n]; entries set to 0 are skipped. Page 0
+ * is never handed out by the page allocator, so this is not ambiguous.
+ */
+void md_map_pages_vector(vmspace_t* vs, addr_t virt, const addr_t* phys, size_t num_pages, int flags);
+
 /* Unmaps 'num_pages' at virtual address virt for vmspace 'vs' */
 void md_unmap_pages(vmspace_t* vs, addr_t virt, size_t num_pages);
 
+/* Invalidates 'num_pages' at 'virt' from the TLB of the current CPU */
+void md_tlb_invalidate(addr_t virt, size_t num_pages, int global);
+
+/* Returns the %cr3 value to use for vmspace 'vs' */
+uint64_t md_vmspace_get_cr3(vmspace_t* vs);
+
+/* Loads %cr3 for vmspace 'vs' (NULL for kernel threads) on the current CPU */
+void md_vmspace_activate(vmspace_t* vs, uint64_t cr3);
+
+/* Non-zero if address spaces are tagged using PCID */
+extern int md_pcid_enabled;
+
+/* Non-zero if the CPU has SMAP; user copies are bracketed by stac/clac */
+extern int md_smap_supported;
+
 #endif
 
 #endif /* __AMD64_VM_H__ */
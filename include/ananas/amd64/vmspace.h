@@ -2,6 +2,9 @@
 #define ANANAS_AMD64_VMSPACE_H
 
 #define MD_VMSPACE_FIELDS \
-	uint64_t*	vs_md_pagedir;
+	uint64_t*	vs_md_pagedir; \
+	unsigned int	vs_md_pcid;		/* PCID tag, 0 if none */ \
+	volatile uint32_t vs_md_cpu_active;	/* CPUs which have us loaded */ \
+	volatile uint32_t vs_md_cpu_stale;	/* CPUs which must flush on load */
 
 #endif /* ANANAS_AMD64_VMSPACE_H */
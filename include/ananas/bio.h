@@ -45,6 +45,7 @@ struct BIO {
 
 /* Flags of BIO_READ */
 #define BIO_READ_NODATA		0x0001	/* Caller is not interested in the data */
+#define BIO_READ_ASYNC		0x0002	/* Do not wait for the read to complete */
 
 void bio_set_error(struct BIO* bio);
 void bio_set_available(struct BIO* bio);
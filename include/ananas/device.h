@@ -6,6 +6,7 @@
 #include <ananas/list.h>
 #include <ananas/lock.h>
 #include <ananas/init.h>
+#include <ananas/poll.h>
 #include <ananas/cdefs.h>
 #include <ananas/resourceset.h>
 
@@ -45,6 +46,13 @@ public:
 	{
 		return ananas_make_error(ANANAS_ERROR_UNSUPPORTED);
 	}
+
+	// Returns the POLL... events that can be handled without blocking; devices
+	// which can block must call poll_wakeup() on d_PollQueue once this changes
+	virtual unsigned int GetReadiness()
+	{
+		return POLLIN | POLLOUT;
+	}
 };
 
 class IBIODeviceOperations {
@@ -126,6 +134,7 @@ public:
 	ResourceSet d_ResourceSet;
 	dma_tag_t d_DMA_tag = nullptr;
 	semaphore_t d_Waiters;
+	struct POLL_QUEUE d_PollQueue;
 
 	Device(const Device&) = delete;
 	Device& operator=(const Device&) = delete;
@@ -0,0 +1,21 @@
+#ifndef __ANANAS_ELFINFO_H__
+#define __ANANAS_ELFINFO_H__
+
+#include <ananas/types.h>
+
+/*
+ * Passed to the interpreter (runtime loader) of a dynamically-linked program.
+ * The interpreter is started with the PROCINFO as first argument and the
+ * address of this structure as second argument; once it is done, it must
+ * invoke ei_entry with just the PROCINFO.
+ */
+struct ANANAS_ELF_INFO {
+	size_t		ei_size;		/* structure length */
+	addr_t		ei_interpreter_base;	/* load address of the interpreter */
+	addr_t		ei_base;		/* load address of the program (0 for ET_EXEC) */
+	addr_t		ei_entry;		/* entry point of the program */
+	addr_t		ei_phdr;		/* program headers of the program */
+	size_t		ei_phdr_entries;	/* number of program headers */
+};
+
+#endif /* __ANANAS_ELFINFO_H__ */
@@ -28,6 +28,8 @@
 #define ANANAS_ERROR_CROSS_DEVICE	22		/* Cross device operation */
 #define ANANAS_ERROR_UNSUPPORTED	23		/* Unsupported operation */
 #define ANANAS_ERROR_READ_ONLY		24		/* Writing is prohibited */
+#define ANANAS_ERROR_BROKEN_PIPE	25		/* Writing without any readers */
+#define ANANAS_ERROR_WOULD_BLOCK	26		/* Operation would have to wait */
 
 static inline errorcode_t ananas_success()
 {
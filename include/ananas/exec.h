@@ -5,8 +5,10 @@
 #include <ananas/list.h>
 #include <ananas/error.h>
 #include <ananas/init.h>
+#include <ananas/process.h>
 
 struct DENTRY;
+struct VFS_INODE;
 
 typedef errorcode_t (*exec_handler_t)(vmspace_t* vs, struct DENTRY* dentry, addr_t* exec_addr, register_t* exec_arg);
 
@@ -39,8 +41,44 @@ LIST_DEFINE(EXEC_FORMATS, struct EXEC_FORMAT);
 	INIT_FUNCTION(register_##handler, SUBSYSTEM_THREAD, ORDER_MIDDLE); \
 	EXIT_FUNCTION(unregister_##handler);
 
+/*
+ * Executable formats may keep whatever they parsed from a file with its inode,
+ * so that executing the same file again need not read and validate all
+ * headers again. The cache is dropped once the file is written to or the inode
+ * is recycled; anyone using it must hold a reference.
+ */
+struct EXEC_CACHE {
+	refcount_t	ec_refcount;
+	/* Frees the entire cache; also identifies the format that made it */
+	void		(*ec_free)(struct EXEC_CACHE* ec);
+};
+
 errorcode_t exec_load(vmspace_t* vs, struct DENTRY* dentry, addr_t* exec_addr, register_t* exec_arg);
 errorcode_t exec_register_format(struct EXEC_FORMAT* ef);
 errorcode_t exec_unregister_format(struct EXEC_FORMAT* ef);
 
+/* Location of the argument and environment vectors of a new program */
+struct EXEC_ARGS {
+	int		ea_argc;
+	addr_t		ea_argv;
+	addr_t		ea_envp;
+	char		ea_name[PROCESS_MAX_NAME_LEN + 1];	/* argv[0], truncated */
+};
+
+/*
+ * Places argv and envp in a new area of 'vs', which need not be active: the
+ * strings are copied straight into the pages of that area. If 'from_user' is
+ * set, the vectors and their strings are userland pointers of the current
+ * vmspace. Either vector may be NULL, which yields an empty one.
+ */
+errorcode_t exec_prepare_args(vmspace_t* vs, const char* const* argv, const char* const* envp, bool from_user, struct EXEC_ARGS* ea);
+
+/* Returns the referenced cache of the inode, or NULL if there is none */
+struct EXEC_CACHE* exec_cache_get(struct VFS_INODE* inode);
+/* Attaches 'ec' to the inode, unless it already has one; returns the cache in use, referenced */
+struct EXEC_CACHE* exec_cache_set(struct VFS_INODE* inode, struct EXEC_CACHE* ec);
+void exec_cache_deref(struct EXEC_CACHE* ec);
+/* Throws away the cache of the inode; called whenever its contents change */
+void exec_cache_invalidate(struct VFS_INODE* inode);
+
 #endif /* __ANANAS_EXEC_H__ */
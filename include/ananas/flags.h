@@ -26,4 +26,7 @@
 
 #define FD_CLOEXEC 1
 
+/* clone() */
+#define CLONE_FLAG_VFORK	(1 << 0)	/* Share parent's memory until exec/exit */
+
 #endif /* __ANANAS_FLAGS_H__ */
@@ -2,7 +2,6 @@
 #define __SYS_HANDLE_H__
 
 #include <ananas/lock.h>
-#include <ananas/cbuffer.h>
 #include <ananas/list.h>
 #include <ananas/lock.h>
 #include <ananas/vfs/types.h>
@@ -14,52 +13,62 @@ typedef unsigned int handle_event_result_t;
 #define HANDLE_TYPE_UNUSED	0
 #define HANDLE_TYPE_FILE	1
 #define HANDLE_TYPE_PIPE	2
+#define HANDLE_TYPE_EVQ		3
+#define HANDLE_NUM_TYPES	4	/* Highest type + 1 */
 
 #define HANDLE_VALUE_INVALID	0
 
 struct THREAD;
 struct HANDLE_OPS;
+struct POLL_ENTRY;
 
-struct HANDLE_PIPE_BUFFER {
-	mutex_t hpb_mutex;
-	refcount_t hpb_read_count;
-	refcount_t hpb_write_count;
-	CBUFFER_FIELDS;
-	char hpb_buffer[1];
-};
+/* Event queues are private to the event queue implementation */
+struct EVENT_QUEUE;
+struct EVQ_INTEREST;
+LIST_DEFINE(EVQ_INTEREST_LIST, struct EVQ_INTEREST);
+
+/* Pipe buffers are private to the pipe implementation */
+struct HANDLE_PIPE_BUFFER;
 
 struct HANDLE_PIPE_INFO {
 	int hpi_flags;
 #define HPI_FLAG_READ	0x0001
 #define HPI_FLAG_WRITE	0x0002
 	struct HANDLE_PIPE_BUFFER* hpi_buffer;
-	/*
-	 * All HANDLE_PIPE_INFO structs that belong to the same buffer are
-	 * in a circular linked list - this is done so that they can be
-	 * woken up once any of them is written/read/closed. This also
-	 * means we need the handle itself. XXX KLUDGE
-	 */
-	struct HANDLE_PIPE_INFO* hpi_next;
-	struct HANDLE* hpi_handle;
 };
 
 struct HANDLE {
 	int h_type;				/* one of HANDLE_TYPE_... */
-	int h_flags;				/* flags */
+	int h_flags;				/* flags (O_NONBLOCK) */
 	process_t* h_process;			/* owning process */
+	refcount_t h_refcount;			/* references; the handle table holds one */
 	mutex_t h_mutex;			/* mutex guarding the handle */
 	struct HANDLE_OPS* h_hops;		/* handle operations */
 	LIST_FIELDS(struct HANDLE);		/* used for the queue structure */
+	struct EVQ_INTEREST_LIST h_evq_interests; /* event queues watching us */
 
 	/* Waiters are those who are waiting on this handle */
 	union {
 		struct VFS_FILE d_vfs_file;
 		struct HANDLE_PIPE_INFO d_pipe;
+		struct EVENT_QUEUE* d_evq;
 	} h_data;
 };
 
 LIST_DEFINE(HANDLE_QUEUE, struct HANDLE);
 
+/*
+ * Per-process handle table. This is replaced by a larger copy whenever it
+ * runs full; older tables are kept (chained using htab_prev) until the
+ * process is destroyed, as handle_lookup() may still be looking at them
+ * without holding the process lock.
+ */
+struct HANDLE_TABLE {
+	unsigned int htab_size;			/* Number of slots, power of two */
+	struct HANDLE_TABLE* htab_prev;		/* Table we replaced, if any */
+	struct HANDLE* volatile htab_handle[1];	/* Handles, NULL if unused */
+};
+
 /*
  * Handle operations map almost directly to the syscalls invoked on them.
  */
@@ -69,41 +78,69 @@ struct SUMMON_OPTIONS;
 struct CLONE_OPTIONS;
 typedef errorcode_t (*handle_read_fn)(thread_t* thread, handleindex_t index, struct HANDLE* handle, void* buf, size_t* len);
 typedef errorcode_t (*handle_write_fn)(thread_t* thread, handleindex_t index, struct HANDLE* handle, const void* buf, size_t* len);
+typedef errorcode_t (*handle_pread_fn)(thread_t* thread, handleindex_t index, struct HANDLE* handle, void* buf, size_t* len, off_t offset);
+typedef errorcode_t (*handle_pwrite_fn)(thread_t* thread, handleindex_t index, struct HANDLE* handle, const void* buf, size_t* len, off_t offset);
 typedef errorcode_t (*handle_open_fn)(thread_t* thread, handleindex_t index, struct HANDLE* result, const char* path, int flags, int mode);
 typedef errorcode_t (*handle_free_fn)(process_t* proc, struct HANDLE* handle);
 typedef errorcode_t (*handle_unlink_fn)(thread_t* thread, handleindex_t index, struct HANDLE* handle);
 typedef errorcode_t (*handle_clone_fn)(process_t* proc_in, handleindex_t index, struct HANDLE* handle, struct CLONE_OPTIONS* opts, process_t* proc_out, struct HANDLE** handle_out, handleindex_t index_out_min, handleindex_t* index_out);
 
+/*
+ * Stores the POLL... events the handle is ready for in 'events'. If 'pe' is
+ * not NULL, it is registered with the poll queue of whatever the handle
+ * waits on, so that it gets notified of changes; this must happen before the
+ * readiness is determined to avoid missing any. Handles without hop_poll
+ * never block.
+ */
+typedef errorcode_t (*handle_poll_fn)(thread_t* thread, handleindex_t index, struct HANDLE* handle, struct POLL_ENTRY* pe, unsigned int* events);
+
 struct HANDLE_OPS {
 	handle_read_fn hop_read;
 	handle_write_fn hop_write;
+	handle_pread_fn hop_pread;
+	handle_pwrite_fn hop_pwrite;
 	handle_open_fn hop_open;
 	handle_free_fn hop_free;
 	handle_unlink_fn hop_unlink;
 	handle_clone_fn hop_clone;
+	handle_poll_fn hop_poll;
 };
 
 /* Registration of handle types */
 struct HANDLE_TYPE {
 	const char* ht_name;
-	int ht_id;
+	int ht_id;				/* HANDLE_TYPE_..., indexes the type table */
 	struct HANDLE_OPS* ht_hops;
-	LIST_FIELDS(struct HANDLE_TYPE);
 };
-LIST_DEFINE(HANDLE_TYPES, struct HANDLE_TYPE);
 
 void handle_init();
 errorcode_t handle_alloc(int type, process_t* p, handleindex_t index_from, struct HANDLE** handle_out, handleindex_t* index_out);
 errorcode_t handle_free(struct HANDLE* h);
 errorcode_t handle_free_byindex(process_t* p, handleindex_t index);
 errorcode_t handle_lookup(process_t* p, handleindex_t index, int type, struct HANDLE** handle_out);
+void handle_ref(struct HANDLE* h);
+void handle_deref(struct HANDLE* h);
+void handle_table_destroy(process_t* p);
 errorcode_t handle_clone(process_t* p_in, handleindex_t index, struct CLONE_OPTIONS* opts, process_t* p_out, struct HANDLE** handle_out, handleindex_t index_out_min, handleindex_t* index_out);
+errorcode_t handle_poll(thread_t* t, handleindex_t index, struct HANDLE* handle, struct POLL_ENTRY* pe, unsigned int* events);
 
 /* Only to be used from handle implementation code */
 errorcode_t handle_clone_generic(struct HANDLE* handle, process_t* p_out, struct HANDLE** out, handleindex_t index_out_min, handleindex_t* index);
 errorcode_t handle_register_type(struct HANDLE_TYPE* ht);
 errorcode_t handle_unregister_type(struct HANDLE_TYPE* ht);
 
+/* Hooks a new pipe to a read and a write handle, both of HANDLE_TYPE_PIPE */
+errorcode_t pipe_connect(struct HANDLE* read_handle, struct HANDLE* write_handle);
+
+/* Event queues; 'handle' must be of HANDLE_TYPE_EVQ */
+struct EVQ_EVENT;
+errorcode_t evq_connect(struct HANDLE* handle);
+errorcode_t evq_control(thread_t* t, struct HANDLE* handle, int op, const struct EVQ_EVENT* ev);
+errorcode_t evq_collect(thread_t* t, struct HANDLE* handle, struct EVQ_EVENT* events, size_t* num, int timeout);
+
+/* Stops all event queues from watching 'handle'; called once it is closed */
+void evq_handle_closed(struct HANDLE* handle);
+
 #define HANDLE_TYPE(id, name, ops) \
 	static struct HANDLE_TYPE ht_##id = { \
 		.ht_name = name, \
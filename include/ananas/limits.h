@@ -7,4 +7,7 @@
 /* Maximum path size */
 #define MAX_PATH	256
 
+/* Maximum number of bytes of arguments and environment, including pointers */
+#define ARG_MAX		(1024 * 1024)
+
 #endif /* __ANANAS_LIMITS_H__ */
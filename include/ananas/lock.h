@@ -54,6 +54,7 @@ typedef struct MUTEX mutex_t;
 void spinlock_lock(spinlock_t* l);
 void spinlock_unlock(spinlock_t* l);
 void spinlock_init(spinlock_t* l);
+int spinlock_trylock(spinlock_t* l);
 
 /* Unpremptible spinlocks disable the interrupt flag while they are active */
 register_t spinlock_lock_unpremptible(spinlock_t* l);
@@ -48,7 +48,7 @@ LIST_DEFINE(zone_list, struct PAGE_ZONE);
 /* Add a chunk of memory to use for page allocation */
 void page_zone_add(addr_t base, size_t length);
 
-/* Allocates a block of 2^order pages */
+/* Allocates a block of 2^order pages; returns NULL if there is no memory left */
 struct PAGE* page_alloc_order(int order);
 
 /* Allocates a single page */
@@ -74,6 +74,12 @@ struct PAGE* page_alloc_length(size_t length);
 /* Allocates enough pages to hold length bytes and maps it to kernel memory */
 void* page_alloc_length_mapped(size_t length, struct PAGE** p, int vm_flags);
 
+/* Allocates a single page which is filled with zeroes, or returns NULL */
+struct PAGE* page_alloc_zeroed();
+
+/* Adds a zeroed page to the pool, if needed; returns non-zero if work was done */
+int page_zero_pool_fill();
+
 /* Retrieve the page statistics */
 void page_get_stats(unsigned int* total_pages, unsigned int* avail_pages);
 
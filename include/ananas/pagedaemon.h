@@ -0,0 +1,16 @@
+#include <ananas/types.h>
+
+#ifndef __PAGEDAEMON_H__
+#define __PAGEDAEMON_H__
+
+/* Number of pages the page daemon tries to reclaim in a single pass */
+#define PAGEDAEMON_BATCH 32
+
+/* The page daemon is woken up below the low-water mark and runs until the high-water mark is reached */
+#define PAGEDAEMON_LOW_WATER(total) ((total) / 32)
+#define PAGEDAEMON_HIGH_WATER(total) ((total) / 16)
+
+void pagedaemon_wakeup();
+size_t pagedaemon_reclaim(size_t num_pages);
+
+#endif /* __PAGEDAEMON_H__ */
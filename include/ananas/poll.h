@@ -0,0 +1,97 @@
+#ifndef __ANANAS_POLL_H__
+#define __ANANAS_POLL_H__
+
+#include <ananas/types.h>
+
+/* Readiness events; POLLERR, POLLHUP and POLLNVAL are always reported */
+#define POLLIN		0x0001	/* Data can be read without blocking */
+#define POLLRDNORM	0x0002	/* Normal data can be read without blocking */
+#define POLLRDBAND	0x0004	/* Priority data can be read without blocking */
+#define POLLPRI		0x0008	/* High-priority data can be read without blocking */
+#define POLLOUT		0x0010	/* Data can be written without blocking */
+#define POLLWRNORM	POLLOUT
+#define POLLWRBAND	0x0020	/* Priority data can be written without blocking */
+#define POLLERR		0x0040	/* An error has occurred */
+#define POLLHUP		0x0080	/* The other side has gone away */
+#define POLLNVAL	0x0100	/* Not a valid handle */
+
+/* Maximum number of entries accepted by poll() and evq_wait() */
+#define POLL_MAX	1024
+
+struct pollfd {
+	int	fd;		/* Handle to poll, ignored if negative */
+	short	events;		/* Events of interest */
+	short	revents;	/* Events that occurred */
+};
+
+/*
+ * An event queue holds a persistent set of handles and the events of
+ * interest for each; evq_wait() returns the handles that became ready since
+ * they were last reported. This is edge-triggered: a handle is only reported
+ * again once it signals a new event, so the caller should keep reading or
+ * writing until the operation would block.
+ */
+#define EVQ_CTL_ADD	1	/* Start watching ev_handle */
+#define EVQ_CTL_MOD	2	/* Change ev_events/ev_data of ev_handle */
+#define EVQ_CTL_DEL	3	/* Stop watching ev_handle */
+
+struct EVQ_EVENT {
+	handleindex_t	ev_handle;
+	unsigned int	ev_events;	/* POLL... */
+	void*		ev_data;	/* Returned as-is by evq_wait() */
+};
+
+#ifdef KERNEL
+#include <ananas/list.h>
+#include <ananas/lock.h>
+
+struct POLL_ENTRY;
+
+/*
+ * Called by poll_wakeup() for every matching entry; this happens with the
+ * queue lock held, so it must not sleep.
+ */
+typedef void (*poll_notify_fn)(struct POLL_ENTRY* pe, unsigned int events);
+
+/*
+ * A poll queue is embedded in every object a handle can wait on, such as a
+ * pipe or a device. Whoever wants to know about readiness changes hooks a
+ * poll entry to it; the object calls poll_wakeup() whenever it may have
+ * become readable or writable, or has gone away.
+ */
+struct POLL_ENTRY {
+	struct POLL_QUEUE* pe_queue;	/* Queue we are on, if any */
+	unsigned int pe_events;		/* Events of interest */
+	poll_notify_fn pe_notify;
+	void* pe_context;		/* For use by pe_notify */
+	LIST_FIELDS(struct POLL_ENTRY);
+};
+
+LIST_DEFINE(POLL_ENTRY_LIST, struct POLL_ENTRY);
+
+struct POLL_QUEUE {
+	spinlock_t pq_lock;
+	struct POLL_ENTRY_LIST pq_entries;
+};
+
+void poll_queue_init(struct POLL_QUEUE* pq);
+void poll_register(struct POLL_QUEUE* pq, struct POLL_ENTRY* pe);
+void poll_unregister(struct POLL_ENTRY* pe);
+void poll_wakeup(struct POLL_QUEUE* pq, unsigned int events);
+
+/* Computes the deadline for a timeout in milliseconds */
+uint64_t poll_deadline(int timeout);
+
+/*
+ * Waits until 'sem' is signalled; a timeout of zero never waits and a
+ * negative timeout waits forever. Returns zero if the deadline passed.
+ */
+int poll_sleep(semaphore_t* sem, int timeout, uint64_t deadline);
+#else
+/* libc helpers; these return -1 and set errno on failure */
+int evq_create(void);
+int evq_ctl(int evq, int op, int fd, unsigned int events, void* data);
+int evq_wait(int evq, struct EVQ_EVENT* events, int max, int timeout);
+#endif
+
+#endif /* __ANANAS_POLL_H__ */
@@ -5,10 +5,16 @@
 #include <ananas/lock.h>
 
 struct DENTRY;
+struct HANDLE;
+struct HANDLE_TABLE;
 struct PROCINFO;
+struct EXEC_ARGS;
 
 /* Maximum number of handles per process */
-#define PROCESS_MAX_HANDLES 64
+#define PROCESS_MAX_HANDLES 65536
+
+/* Maximum length of the program name kept with the process */
+#define PROCESS_MAX_NAME_LEN 255
 
 #define PROCESS_STATE_ACTIVE	1
 #define PROCESS_STATE_ZOMBIE	2
@@ -30,17 +36,31 @@ struct PROCESS {
 
 	struct PROCINFO* p_info;	/* Process startup information */
 	addr_t p_info_va;
+	char p_name[PROCESS_MAX_NAME_LEN + 1];	/* argv[0] of the program, truncated */
 
 	thread_t* p_mainthread;		/* Main thread */
 
-	struct HANDLE* p_handle[PROCESS_MAX_HANDLES];	/* Handles */
+	struct HANDLE_TABLE* volatile p_handle_table;	/* Handles, grows as needed */
+	uint32_t* p_handle_bitmap;	/* Slots in use, one bit each */
+	struct HANDLE* p_handle_cache;	/* Freed handles for reuse */
+	unsigned int p_handle_cache_count;
 
 	struct DENTRY* p_cwd;		/* Current path */
 
-	struct PROCESS_QUEUE	p_children;	/* Queue of this process' children */
+	struct PROCESS_QUEUE	p_children;	/* Queue of this process' living children */
+	struct PROCESS_QUEUE	p_zombies;	/* Exited children not yet waited for */
+	semaphore_t p_child_sem;	/* Signalled when a child becomes a zombie */
+
+	struct VM_SPACE* p_vfork_vmspace;	/* Own vmspace while borrowing the parent's */
+	semaphore_t p_vfork_sem;	/* Signalled when the parent's vmspace is released */
+
+	struct RING* p_ring;		/* Submission ring, in process memory */
+	unsigned int p_ring_sq_entries;
+	unsigned int p_ring_cq_entries;
 
-        LIST_FIELDS_IT(struct PROCESS, all);
-        LIST_FIELDS_IT(struct PROCESS, children);
+	LIST_FIELDS_IT(struct PROCESS, all);
+	LIST_FIELDS_IT(struct PROCESS, children);	/* On the parent's p_children or p_zombies */
+	LIST_FIELDS_IT(struct PROCESS, hash);		/* PID lookup chain */
 };
 
 static inline void process_lock(process_t* p)
@@ -58,11 +78,11 @@ errorcode_t process_alloc(process_t* parent, process_t** dest);
 void process_ref(process_t* p);
 void process_deref(process_t* p);
 void process_exit(process_t* p, int status);
-errorcode_t process_set_args(process_t* p, const char* args, size_t args_len);
-errorcode_t process_set_environment(process_t* p, const char* env, size_t env_len);
+void process_set_args(process_t* p, const struct EXEC_ARGS* ea);
 errorcode_t process_clone(process_t* p, int flags, process_t** out_p);
 errorcode_t process_wait_and_lock(process_t* p, int flags, process_t** p_out);
 process_t* process_lookup_by_id_and_ref(pid_t pid);
+void process_vfork_release(process_t* p);
 
 /*
  * Process callback functions are provided so that modules can take action upon
@@ -4,9 +4,6 @@
 #ifndef __SYS_PROCINFO_H__
 #define __SYS_PROCINFO_H__
 
-#define PROCINFO_ARGS_LENGTH	1024
-#define PROCINFO_ENV_LENGTH	1024
-
 struct PROCINFO {
 	int		pi_size;				/* structure length */
 	pid_t		pi_pid;					/* process ID */
@@ -15,8 +12,9 @@ struct PROCINFO {
 	gid_t		pi_gid;					/* group ID */
 	uid_t		pi_euid;				/* effective user ID */
 	gid_t		pi_egid;				/* effective group ID */
-	char		pi_args[PROCINFO_ARGS_LENGTH];	/* commandline arguments */
-	char		pi_env[PROCINFO_ENV_LENGTH];		/* environment */
+	int		pi_argc;				/* number of arguments */
+	char**		pi_argv;				/* arguments, NULL-terminated */
+	char**		pi_envp;				/* environment, NULL-terminated */
 };
 
 #ifndef KERNEL
@@ -0,0 +1,89 @@
+#ifndef ANANAS_SYSCALL_RING_H
+#define ANANAS_SYSCALL_RING_H
+
+#include <ananas/types.h>
+
+/*
+ * A ring allows a process to submit a batch of operations using a single
+ * system call. It resides in process memory and consists of a header,
+ * followed by the submission entries and then the completion entries:
+ *
+ * +--------+-----------------------------+----------------------------+
+ * | header | r_sq_entries * RING_SQE     | r_cq_entries * RING_CQE    |
+ * +--------+-----------------------------+----------------------------+
+ *
+ * The process fills submission entries and advances r_sq_tail; the kernel
+ * consumes them in order, advancing r_sq_head, and posts a completion for
+ * every entry at r_cq_tail. The process consumes completions by advancing
+ * r_cq_head. Indices are free-running and are reduced modulo the number of
+ * entries, which must be a power of two.
+ */
+typedef enum {
+	RING_OP_NOP,
+	RING_OP_READ,	/* sqe_handle, sqe_buf, sqe_len, sqe_offset */
+	RING_OP_WRITE,	/* sqe_handle, sqe_buf, sqe_len, sqe_offset */
+	RING_OP_OPEN,	/* sqe_path, sqe_flags, sqe_mode */
+	RING_OP_CLOSE,	/* sqe_handle */
+	RING_OP_STAT,	/* sqe_path, sqe_buf */
+	RING_OP_FSTAT,	/* sqe_handle, sqe_buf */
+	RING_OP_SEEK,	/* sqe_handle, sqe_offset, sqe_flags (whence) */
+} RING_OPERATION;
+
+/* Maximum number of submission and completion entries */
+#define RING_MAX_ENTRIES	256
+
+struct RING_SQE {
+	RING_OPERATION	sqe_op;
+	handleindex_t	sqe_handle;
+	const char*	sqe_path;
+	void*		sqe_buf;
+	size_t		sqe_len;
+	off_t		sqe_offset;	/* read/write: -1 uses and updates the handle's offset */
+	int		sqe_flags;
+	int		sqe_mode;
+	uint64_t	sqe_user_data;	/* Copied to the completion as-is */
+};
+
+struct RING_CQE {
+	uint64_t	cqe_user_data;
+	errorcode_t	cqe_result;
+	size_t		cqe_length;	/* read/write: bytes transferred */
+	off_t		cqe_offset;	/* seek: new offset */
+	handleindex_t	cqe_handle;	/* open: new handle */
+};
+
+struct RING {
+	unsigned int	r_sq_entries;
+	unsigned int	r_cq_entries;
+	volatile unsigned int	r_sq_head;	/* Next entry to be consumed by the kernel */
+	volatile unsigned int	r_sq_tail;	/* Next entry to be filled by the process */
+	volatile unsigned int	r_cq_head;	/* Next entry to be consumed by the process */
+	volatile unsigned int	r_cq_tail;	/* Next entry to be filled by the kernel */
+};
+
+#define RING_LENGTH(sq, cq) \
+	(sizeof(struct RING) + (sq) * sizeof(struct RING_SQE) + (cq) * sizeof(struct RING_CQE))
+
+static inline struct RING_SQE*
+ring_sqe(struct RING* r, unsigned int n)
+{
+	return (struct RING_SQE*)(r + 1) + (n & (r->r_sq_entries - 1));
+}
+
+static inline struct RING_CQE*
+ring_cqe(struct RING* r, unsigned int n)
+{
+	return (struct RING_CQE*)((struct RING_SQE*)(r + 1) + r->r_sq_entries) + (n & (r->r_cq_entries - 1));
+}
+
+#ifndef KERNEL
+/* libc helpers */
+struct RING* ring_create(unsigned int sq_entries, unsigned int cq_entries);
+void ring_destroy(struct RING* r);
+struct RING_SQE* ring_get_sqe(struct RING* r);
+int ring_submit(struct RING* r);
+struct RING_CQE* ring_peek_cqe(struct RING* r);
+void ring_cqe_seen(struct RING* r);
+#endif
+
+#endif /* ANANAS_SYSCALL_RING_H */
@@ -21,6 +21,12 @@ typedef enum {
 /* If set, vo_handle / vo_offset will back the mapping */
 #define VMOP_FLAG_HANDLE	0x0020
 
+/* If set, all pages are faulted in immediately instead of on first access */
+#define VMOP_FLAG_POPULATE	0x0040
+
+/* If set, the mapping is placed at vo_addr, replacing anything there */
+#define VMOP_FLAG_FIXED		0x0080
+
 struct VMOP_OPTIONS {
 	size_t		vo_size;	/* must be sizeof(VMOP_OPTIONS) */
 	VMOP_OPERATION	vo_op;
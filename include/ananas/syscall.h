@@ -10,13 +10,18 @@ struct SYSCALL_ARGS {
 };
 
 struct HANDLE;
-struct VFS_FILE;
 
 register_t syscall(struct SYSCALL_ARGS* args);
 
+/* Copies to/from userland; these fail with BAD_ADDRESS instead of faulting */
+errorcode_t copyin(void* kaddr, const void* uaddr, size_t len);
+errorcode_t copyout(void* uaddr, const void* kaddr, size_t len);
+errorcode_t copyinstr(char* kaddr, const void* uaddr, size_t max, size_t* len);
+
 errorcode_t syscall_get_handle(thread_t* t, handleindex_t handle, struct HANDLE** out);
-errorcode_t syscall_get_file(thread_t* t, handleindex_t handle, struct VFS_FILE** out);
 errorcode_t syscall_map_string(thread_t* t, const void* ptr, const char** out);
+/* Copies a path of at most MAX_PATH bytes (including terminator) to 'out' */
+errorcode_t syscall_fetch_path(thread_t* t, const char* ptr, char* out);
 errorcode_t syscall_map_buffer(thread_t* t, const void* ptr, size_t len, int flags, void** out);
 errorcode_t syscall_fetch_size(thread_t* t, const void* ptr, size_t* out);
 errorcode_t syscall_set_size(thread_t* t, void* ptr, size_t len);
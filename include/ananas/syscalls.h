@@ -3,5 +3,9 @@
 #include <ananas/stat.h>
 
 struct utimbuf;
+struct iovec;
+struct RING;
+struct pollfd;
+struct EVQ_EVENT;
 
 #include <_gen/syscalls.h>
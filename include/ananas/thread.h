@@ -106,11 +106,22 @@ void md_thread_set_argument(thread_t* thread, addr_t arg);
 void* md_thread_map(thread_t* thread, void* to, void* from, size_t length, int flags);
 errorcode_t thread_unmap(thread_t* t, addr_t virt, size_t len);
 void* md_map_thread_memory(thread_t* thread, void* ptr, size_t length, int write);
+
+/*
+ * Copies between kernel and user memory; faults on the user side are caught
+ * and turned into a -1 return value. md_copy_user_string() copies up to 'max'
+ * bytes including the terminator, returns 1 if none was found and always
+ * stores the number of bytes copied in 'len'.
+ */
+extern "C" int md_copy_user(void* dst, const void* src, size_t len);
+extern "C" int md_copy_user_string(char* dst, const void* src, size_t max, size_t* len);
 void md_thread_clone(thread_t* t, thread_t* parent, register_t retval);
 errorcode_t md_thread_unmap(thread_t* thread, addr_t virt, size_t length);
 int md_thread_peek_32(thread_t* thread, addr_t virt, uint32_t* val);
 int md_thread_is_mapped(thread_t* thread, addr_t virt, int flags, addr_t* va);
 void md_setup_post_exec(thread_t* thread, addr_t exec_addr, register_t exec_arg);
+void md_thread_reload_vmspace(thread_t* thread);
+void md_thread_restore_all(thread_t* thread);
 
 void thread_suspend(thread_t* t);
 void thread_resume(thread_t* t);
@@ -1,6 +1,8 @@
 #ifndef __TIMER_H__
 #define __TIMER_H__
 
+#define HZ 100 /* Timer ticks per second */
+
 /* Returns the number of timer ticks since boot */
 uint64_t timer_get_ticks();
 
@@ -0,0 +1,15 @@
+#ifndef __ANANAS_UIO_H__
+#define __ANANAS_UIO_H__
+
+#include <machine/_types.h>
+#include <ananas/_types/size.h>
+
+/* Maximum number of entries accepted by readv() and writev() */
+#define IOV_MAX		64
+
+struct iovec {
+	void*	iov_base;	/* Base address */
+	size_t	iov_len;	/* Length in bytes */
+};
+
+#endif /* __ANANAS_UIO_H__ */
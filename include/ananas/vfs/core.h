@@ -41,6 +41,7 @@ bool vfs_is_filesystem_sane(struct VFS_MOUNTED_FS* fs);
 errorcode_t vfs_open(const char* fname, struct DENTRY* cwd, struct VFS_FILE* file);
 errorcode_t vfs_close(struct VFS_FILE* file);
 errorcode_t vfs_read(struct VFS_FILE* file, void* buf, size_t* len);
+errorcode_t vfs_read_cached(struct VFS_FILE* file, void* buf, size_t* len); /* through the page cache; not for filesystems */
 errorcode_t vfs_write(struct VFS_FILE* file, const void* buf, size_t* len);
 errorcode_t vfs_seek(struct VFS_FILE* file, off_t offset);
 errorcode_t vfs_create(struct DENTRY* parent, struct VFS_FILE* destfile, const char* dentry, int mode);
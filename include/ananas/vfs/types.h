@@ -13,6 +13,7 @@ namespace Ananas {
 class Device;
 };
 struct DENTRY;
+struct EXEC_CACHE;
 struct VFS_MOUNTED_FS;
 struct VFS_INODE_OPS;
 struct VFS_FILESYSTEM_OPS;
@@ -43,6 +44,7 @@ struct VFS_INODE {
 	ino_t		i_inum;			/* Inode number */
 
 	struct VM_PAGE_LIST	i_pages;	/* Backing VM pages, if any */
+	struct EXEC_CACHE*	i_exec_cache;	/* Parsed executable, if any */
 };
 
 /*
@@ -13,10 +13,14 @@ struct PAGE;
 #define VM_PAGE_FLAG_COW       (1 << 2)  /* page must be copied on write */
 #define VM_PAGE_FLAG_PENDING   (1 << 3)  /* page is pending a read */
 #define VM_PAGE_FLAG_LINK      (1 << 4)  /* link to another page */
+#define VM_PAGE_FLAG_REFERENCED (1 << 5) /* page cache entry was recently used */
 
 struct VM_PAGE {
 	LIST_FIELDS(struct VM_PAGE);
 
+	/* Links in the list of reclaimable inode pages */
+	LIST_FIELDS_IT(struct VM_PAGE, cache);
+
 	mutex_t vp_mtx;
 	vmarea_t* vp_vmarea;
 
@@ -55,18 +59,38 @@ void vmpage_deref(struct VM_PAGE* vmpage);
 
 struct VM_PAGE* vmpage_lookup_locked(vmarea_t* va, struct VFS_INODE* inode, off_t offs);
 struct VM_PAGE* vmpage_lookup_vaddr_locked(vmarea_t* va, addr_t vaddr);
+void vmpage_lookup_cached_range_locked(struct VFS_INODE* inode, off_t offs, size_t num_pages, struct VM_PAGE** vp_out);
 struct VM_PAGE* vmpage_create_shared(struct VFS_INODE* inode, off_t offs, int flags);
+/* These return nullptr if no memory is available */
 struct VM_PAGE* vmpage_create_private(vmarea_t* va, int flags);
+struct VM_PAGE* vmpage_create_zeroed(vmarea_t* va, int flags);
+struct VM_PAGE* vmpage_link_zero(vmarea_t* va);
 struct PAGE* vmpage_get_page(struct VM_PAGE* vp);
 
+/* Returns nullptr if no memory is available; vp is left locked regardless */
 struct VM_PAGE* vmpage_clone(vmspace_t* vs, vmarea_t* va_source, vmarea_t* va_dest, struct VM_PAGE* vp);
 struct VM_PAGE* vmpage_link(vmarea_t* va, struct VM_PAGE* vp);
 void vmpage_map(vmspace_t* vs, vmarea_t* va, struct VM_PAGE* vp);
-void vmpage_zero(vmspace_t* vs, struct VM_PAGE* vp);
+/* Returns nullptr if no memory is available, in which case vp is left as-is and locked */
 struct VM_PAGE* vmpage_promote(vmspace_t* vs, vmarea_t* va, struct VM_PAGE* vp);
 
 void vmpage_dump(struct VM_PAGE* vp, const char* prefix);
 
+/*
+ * Evicts up to num_pages unused pages from the inode page caches; returns the
+ * number of pages freed. This never sleeps, so it is safe to call while
+ * allocating memory. The VM_PAGE structures themselves are only released by
+ * vmpage_reclaim_finish().
+ */
+size_t vmpage_reclaim(size_t num_pages);
+void vmpage_reclaim_finish();
+
+/* Throws away all cached pages of an inode that is about to be discarded */
+void vmpage_discard_inode(struct VFS_INODE* inode);
+
+/* Copies data just written to an inode into the cached pages covering it */
+void vmpage_update_inode(struct VFS_INODE* inode, off_t offset, const void* buf, size_t len);
+
 /*
  * Copies a (piece of) vp_src to vp_dst:
  *
@@ -24,7 +24,8 @@
  *       +-------+         |      |
  *                         +------+
  *
- * Note that we'll only fault one page at a time.
+ * Faults are handled one page at a time, but file-backed pages surrounding
+ * the fault are mapped as well if they are already in the inode's page cache.
  *
  */
 struct VM_AREA {
@@ -63,6 +64,7 @@ struct VM_SPACE {
 };
 
 #define VMSPACE_CLONE_EXEC 1
+#define VMSPACE_CLONE_VFORK 2	/* only recreate MD-specific areas, without contents */
 
 errorcode_t vmspace_create(vmspace_t** vs);
 void vmspace_cleanup(vmspace_t* vs); /* frees all mappings, but not MD-things */
@@ -72,7 +74,10 @@ errorcode_t vmspace_mapto_dentry(vmspace_t* vs, addr_t virt, off_t vskip, size_t
 errorcode_t vmspace_map(vmspace_t* vs, size_t len /* bytes */, uint32_t flags, vmarea_t** va_out);
 errorcode_t vmspace_area_resize(vmspace_t* vs, vmarea_t* va, size_t new_length /* in bytes */);
 errorcode_t vmspace_handle_fault(vmspace_t* vs, addr_t virt, int flags);
+errorcode_t vmspace_get_dentry_page(struct DENTRY* dentry, off_t offset, struct VM_PAGE** vp_out); /* returns page locked */
+errorcode_t vmspace_area_populate(vmspace_t* vs, vmarea_t* va); /* faults in all pages of va */
 errorcode_t vmspace_clone(vmspace_t* vs_source, vmspace_t* vs_dest, int flags);
+void vmspace_set_next_mapping(vmspace_t* vs, addr_t min); /* places dynamic mappings beyond all areas and 'min' */
 void vmspace_area_free(vmspace_t* vs, vmarea_t* va);
 void vmspace_dump(vmspace_t* vs);
 
@@ -4,6 +4,7 @@
 #define SMP_IPI_FIRST		0xf0
 #define SMP_IPI_COUNT		4
 #define SMP_IPI_PANIC		0xf0	/* IPI used to trigger panic situation on other CPU's */
+#define SMP_IPI_TLB_SHOOTDOWN	0xf1	/* IPI used to invalidate TLB entries */
 #define SMP_IPI_SCHEDULE	0xf2	/* IPI used to trigger re-schedule */
 
 #ifndef ASM
@@ -50,6 +51,7 @@ void smp_prepare();
 void smp_prepare_config(struct X86_SMP_CONFIG* cfg);
 void smp_panic_others();
 void smp_broadcast_schedule();
+void smp_tlb_shootdown(uint32_t cpu_mask, addr_t virt, size_t num_pages, int global);
 #endif
 
 #endif /* __X86_SMP_H__ */
@@ -86,7 +86,11 @@ struct EXT2_SUPERBLOCK {
 	uint8_t		_padding1[3];
 	uint32_t	s_default_mount_options;
 	uint32_t	s_first_meta_bg;
-	uint8_t		_reserved[760];
+	uint8_t		_reserved0[88];
+	uint32_t	s_flags;
+#define EXT2_FLAGS_SIGNED_HASH		0x0001
+#define EXT2_FLAGS_UNSIGNED_HASH	0x0002
+	uint8_t		_reserved[668];
 } __attribute__((packed));
 
 struct EXT2_BLOCKGROUP {
@@ -182,6 +186,36 @@ struct EXT2_DIRENTRY {
 	uint8_t		name[0];
 } __attribute__((packed));
 
+/*
+ * Hashed directories (dir_index); the first directory block contains the
+ * root, which is disguised as the '.' and '..' entries followed by an
+ * EXT2_DX_ROOT_INFO and the index entries. Intermediate nodes start with an
+ * empty directory entry spanning the entire block, followed by the entries.
+ *
+ * The first index entry is special: its hash field holds the EXT2_DX_COUNTLIMIT
+ * instead, and its hash is implicitly zero.
+ */
+struct EXT2_DX_ROOT_INFO {
+	uint32_t	reserved_zero;
+	uint8_t		hash_version;
+#define EXT2_DX_HASH_LEGACY	0
+#define EXT2_DX_HASH_HALF_MD4	1
+#define EXT2_DX_HASH_TEA	2
+	uint8_t		info_length;
+	uint8_t		indirect_levels;
+	uint8_t		unused_flags;
+} __attribute__((packed));
+
+struct EXT2_DX_COUNTLIMIT {
+	uint16_t	limit;
+	uint16_t	count;
+} __attribute__((packed));
+
+struct EXT2_DX_ENTRY {
+	uint32_t	hash;
+	uint32_t	block;
+} __attribute__((packed));
+
 /* Values for old filesystems (that have the good old revision) */
 #define EXT2_GOOD_OLD_INODE_SIZE 128
 
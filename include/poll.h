@@ -0,0 +1,15 @@
+#ifndef __POLL_H__
+#define __POLL_H__
+
+#include <ananas/poll.h> /* for struct pollfd */
+#include <sys/cdefs.h>
+
+typedef unsigned int nfds_t;
+
+__BEGIN_DECLS
+
+int poll(struct pollfd fds[], nfds_t nfds, int timeout);
+
+__END_DECLS
+
+#endif /* __POLL_H__ */
@@ -16,6 +16,7 @@
 #define MAP_FIXED	(1 << 2)
 #define MAP_ANON	(1 << 3)	/* not part of POSIX */
 #define MAP_ANONYMOUS	MAP_ANON
+#define MAP_POPULATE	(1 << 4)	/* not part of POSIX */
 
 #define MAP_FAILED	((void*)-1)
 
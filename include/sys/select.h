@@ -6,8 +6,12 @@
 
 struct timeval;
 
+#define FD_SETSIZE 1024
+
+#define __NFDBITS (8 * sizeof(unsigned long))
+
 typedef struct {
-	long fds_bits;
+	unsigned long fds_bits[(FD_SETSIZE + __NFDBITS - 1) / __NFDBITS];
 } fd_set;
 
 __BEGIN_DECLS
@@ -16,11 +20,13 @@ int select(int nfds, fd_set* readfds, fd_set* writefds, fd_set* errorfds, struct
 
 __END_DECLS
 
-#define FD_CLR(fd, fdset)
-#define FD_ISSET(fd, fdset) (0)
-#define FD_SET(fd, fdset)
-#define FD_ZERO(fdset)
-
-#define FD_SETSIZE 64 /* XXX */
+#define FD_CLR(fd, fdset) ((fdset)->fds_bits[(fd) / __NFDBITS] &= ~(1UL << ((fd) % __NFDBITS)))
+#define FD_ISSET(fd, fdset) (((fdset)->fds_bits[(fd) / __NFDBITS] & (1UL << ((fd) % __NFDBITS))) != 0)
+#define FD_SET(fd, fdset) ((fdset)->fds_bits[(fd) / __NFDBITS] |= (1UL << ((fd) % __NFDBITS)))
+#define FD_ZERO(fdset) \
+	do { \
+		for (unsigned int __n = 0; __n < sizeof((fdset)->fds_bits) / sizeof((fdset)->fds_bits[0]); __n++) \
+			(fdset)->fds_bits[__n] = 0; \
+	} while(0)
 
 #endif /* __SYS_SELECT_H__ */
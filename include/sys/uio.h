@@ -0,0 +1,15 @@
+#ifndef __SYS_UIO_H__
+#define __SYS_UIO_H__
+
+#include <ananas/uio.h> /* for struct iovec */
+#include <ananas/_types/ssize.h>
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+ssize_t readv(int, const struct iovec*, int);
+ssize_t writev(int, const struct iovec*, int);
+
+__END_DECLS
+
+#endif /* __SYS_UIO_H__ */
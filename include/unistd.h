@@ -33,7 +33,10 @@ void	_exit(int status);
 ssize_t read(int fd, void* buf, size_t len);
 ssize_t write(int fd, const void* buf, size_t len);
 off_t	lseek(int fd, off_t offset, int whence);
+ssize_t pread(int fd, void* buf, size_t len, off_t offset);
+ssize_t pwrite(int fd, const void* buf, size_t len, off_t offset);
 pid_t	fork(void);
+pid_t	vfork(void);
 int	close(int filedes);
 int	dup(int filedes);
 int	dup2(int filedes, int filedes2);
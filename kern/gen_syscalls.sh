@@ -47,19 +47,30 @@ $AWK '
 #   #define SYSCALL_foo 1234
 #   void sys_foo(thread_t* curthread, int a, int b, int c);
 #
+# The numbers come first so that assembly code (which defines ASM) can use
+# them as well; the prototypes are hidden from it.
+#
 $AWK '
 	BEGIN {
 		print "/* This file is automatically generated by gen_syscalls.sh - do not edit! */";
+		NUM=0
+	}
+	/^#/ { next; }
+	/^[0-9]+/ {
+		print "#define SYSCALL_" substr($4, 1, index($4, "(") - 1) " "$1;
+		PROTO[NUM++]=$3 " sys_" substr($4, 1, index($4, "(")) "ARG_CURTHREAD " substr($0, index($0, "(") + 1, index($0, "}") - index($0, "(") - 1)
+	}
+	END {
+		print ""
+		print "#ifndef ASM"
 		print "#ifdef KERNEL"
 		print " #define ARG_CURTHREAD thread_t* curthread,"
 		print "#else"
 		print " #define ARG_CURTHREAD"
 		print "#endif"
-	}
-	/^#/ { next; }
-	/^[0-9]+/ {
-		print "#define SYSCALL_" substr($4, 1, index($4, "(") - 1) " "$1;
-		print $3 " sys_" substr($4, 1, index($4, "(")) "ARG_CURTHREAD " substr($0, index($0, "(") + 1, index($0, "}") - index($0, "(") - 1)
+		for (i = 0; i < NUM; i++)
+			print PROTO[i]
+		print "#endif /* ASM */"
 	}
 ' < $1 > $3
 
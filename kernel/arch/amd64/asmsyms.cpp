@@ -35,6 +35,7 @@ ASM_SYMBOL(SF_SIZE,   sizeof(struct STACKFRAME));
 
 ASM_SYMBOL(T_FRAME,   offsetof(struct THREAD, t_frame));
 ASM_SYMBOL(T_MDFLAGS, offsetof(struct THREAD, t_md_flags));
+ASM_SYMBOL(T_ONFAULT, offsetof(struct THREAD, md_onfault));
 
 ASM_SYMBOL(PCPU_CURTHREAD, offsetof(struct PCPU, curthread));
 ASM_SYMBOL(PCPU_NESTEDIRQ, offsetof(struct PCPU, nested_irq));
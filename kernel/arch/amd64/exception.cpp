@@ -136,6 +136,12 @@ exception_pf(struct STACKFRAME* sf)
 			return; /* fault handeled */
 	}
 
+	// If this happened during a user copy, resume at its recovery address
+	if (curthread != NULL && (sf->sf_cs & 3) == SEG_DPL_SUPERVISOR && curthread->md_onfault != 0) {
+		sf->sf_rip = curthread->md_onfault;
+		return;
+	}
+
 	// Couldn't be handled; chain through
 	exception_generic(sf);
 }
@@ -1,4 +1,6 @@
 #include <ananas/types.h>
+#include <machine/interrupts.h>
+#include <machine/macro.h>
 #include <machine/vm.h>
 #include <machine/param.h>
 #include <ananas/mm.h>
@@ -9,9 +11,26 @@
 #include <ananas/thread.h>
 #include <ananas/vm.h>
 #include <ananas/vmspace.h>
+#include "options.h"
+
+#ifdef OPTION_SMP
+#include <ananas/x86/smp.h>
+
+extern "C" volatile int num_smp_launched;
+#endif
+
+/* Above this number of pages, flushing the entire TLB is cheaper than invlpg */
+#define MD_TLB_INVLPG_MAX 32
 
 extern uint64_t* kernel_pagedir;
 
+/* Range of virtual addresses whose mappings have changed and must leave the TLB */
+struct MD_TLB_BATCH {
+	addr_t tb_start;
+	addr_t tb_end;
+	bool tb_global;
+};
+
 static addr_t
 get_nextpage(vmspace_t* vs, uint64_t page_flags)
 {
@@ -40,10 +59,9 @@ pt_resolve_addr(uint64_t entry)
 	return (uint64_t*)(KMEM_DIRECT_VA_START + (entry & ADDR_MASK));
 }
 
-void
-md_map_pages(vmspace_t* vs, addr_t virt, addr_t phys, size_t num_pages, int flags)
+static uint64_t
+md_pt_flags(int flags)
 {
-	/* Flags for the mapped pages themselves */
 	uint64_t pt_flags = 0;
 	if (flags & VM_FLAG_READ)
 		pt_flags |= PE_P;	/* XXX */
@@ -55,56 +73,181 @@ md_map_pages(vmspace_t* vs, addr_t virt, addr_t phys, size_t num_pages, int flag
 		pt_flags |= PE_PCD | PE_PWT;
 	if ((flags & VM_FLAG_EXECUTE) == 0)
 		pt_flags |= PE_NX;
+	return pt_flags;
+}
 
+/*
+ * Walks the page directories leading up to the pagetable holding 'virt',
+ * creating them as needed. Updates pt_flags if the mapping is to be global.
+ */
+static uint64_t*
+md_get_pagetable(vmspace_t* vs, addr_t virt, uint64_t* pt_flags)
+{
 	/* Flags for the page-directory leading up to the mapped page */
 	uint64_t pd_flags = PE_US | PE_P | PE_RW;
 
 	/* XXX we don't yet strip off bits 52-63 yet */
 	uint64_t* pagedir = (vs != NULL) ? vs->vs_md_pagedir : kernel_pagedir;
-	while(num_pages--) {
-		if (pagedir[(virt >> 39) & 0x1ff] == 0) {
-			pagedir[(virt >> 39) & 0x1ff] = get_nextpage(vs, pd_flags);
-		}
+	if (pagedir[(virt >> 39) & 0x1ff] == 0) {
+		pagedir[(virt >> 39) & 0x1ff] = get_nextpage(vs, pd_flags);
+	}
 
-		/*
-		 * XXX We only look at the top level pagetable flags to determine whether
-		 *     the page should be mapped globally - the idea is that all ranges
-		 *     (KVA, kernel) where this should happen are pre-allocated in startup.c
-		 *     and thus thee is no need to look further...
-		 */
-		if (pagedir[(virt >> 39) & 0x1ff] & PE_C_G) {
-			pd_flags |= PE_C_G;
-			pt_flags |= PE_G;
-		}
+	/*
+	 * XXX We only look at the top level pagetable flags to determine whether
+	 *     the page should be mapped globally - the idea is that all ranges
+	 *     (KVA, kernel) where this should happen are pre-allocated in startup.c
+	 *     and thus thee is no need to look further...
+	 */
+	if (pagedir[(virt >> 39) & 0x1ff] & PE_C_G) {
+		pd_flags |= PE_C_G;
+		*pt_flags |= PE_G;
+	}
 
-		uint64_t* pdpe = pt_resolve_addr(pagedir[(virt >> 39) & 0x1ff]);
-		if (pdpe[(virt >> 30) & 0x1ff] == 0) {
-			pdpe[(virt >> 30) & 0x1ff] = get_nextpage(vs, pd_flags);
-		}
+	uint64_t* pdpe = pt_resolve_addr(pagedir[(virt >> 39) & 0x1ff]);
+	if (pdpe[(virt >> 30) & 0x1ff] == 0) {
+		pdpe[(virt >> 30) & 0x1ff] = get_nextpage(vs, pd_flags);
+	}
 
-		uint64_t* pde = pt_resolve_addr(pdpe[(virt >> 30) & 0x1ff]);
-		if (pde[(virt >> 21) & 0x1ff] == 0) {
-			pde[(virt >> 21) & 0x1ff] = get_nextpage(vs, pd_flags);
-		}
+	uint64_t* pde = pt_resolve_addr(pdpe[(virt >> 30) & 0x1ff]);
+	if (pde[(virt >> 21) & 0x1ff] == 0) {
+		pde[(virt >> 21) & 0x1ff] = get_nextpage(vs, pd_flags);
+	}
 
-		// Ensure we'll flush the mapping if it was already present - it may be in the TLB
-		uint64_t* pte = pt_resolve_addr(pde[(virt >> 21) & 0x1ff]);
-		bool need_invalidate = (pte[(virt >> 12) & 0x1ff] & PE_P) != 0;
-		pte[(virt >> 12) & 0x1ff] = (uint64_t)phys | pt_flags;
-		if (need_invalidate)
+	return pt_resolve_addr(pde[(virt >> 21) & 0x1ff]);
+}
+
+void
+md_tlb_invalidate(addr_t virt, size_t num_pages, int global)
+{
+	if (num_pages <= MD_TLB_INVLPG_MAX) {
+		for (/* nothing */; num_pages > 0; num_pages--, virt += PAGE_SIZE)
 			__asm __volatile("invlpg %0" : : "m" (*(char*)virt) : "memory");
+		return;
+	}
+
+	if (global) {
+		// Toggling PGE throws away everything, including global entries of all PCIDs
+		uint64_t cr4 = read_cr4();
+		write_cr4(cr4 & ~CR4_PGE);
+		write_cr4(cr4);
+	} else {
+		// Reloading %cr3 flushes the non-global entries of the current PCID
+		write_cr3(read_cr3() & ~CR3_NOFLUSH);
+	}
+}
+
+static inline void
+md_tlb_batch_add(struct MD_TLB_BATCH* tb, addr_t virt, uint64_t old_entry)
+{
+	// Entries that weren't present can't be in the TLB
+	if ((old_entry & PE_P) == 0)
+		return;
+
+	if (tb->tb_start == tb->tb_end) {
+		tb->tb_start = virt;
+		tb->tb_end = virt + PAGE_SIZE;
+	} else if (virt < tb->tb_start) {
+		tb->tb_start = virt;
+	} else if (virt + PAGE_SIZE > tb->tb_end) {
+		tb->tb_end = virt + PAGE_SIZE;
+	}
+	if (old_entry & PE_G)
+		tb->tb_global = true;
+}
+
+/*
+ * Ensures nothing in the batch lingers in any TLB. Kernel mappings are global,
+ * so every CPU must invalidate them. For user mappings, CPUs which have vs
+ * loaded are told to invalidate them now; all others are marked stale so
+ * they will not trust their PCID-tagged entries once they switch to vs.
+ */
+static void
+md_tlb_batch_flush(vmspace_t* vs, struct MD_TLB_BATCH* tb)
+{
+	if (tb->tb_start == tb->tb_end)
+		return;
+	size_t num_pages = (tb->tb_end - tb->tb_start) / PAGE_SIZE;
+
+	int state = md_interrupts_save_and_disable();
+	uint32_t cpu_bit = 1 << PCPU_GET(cpuid);
+	uint32_t other_cpus;
+	if (vs == NULL || tb->tb_global) {
+		md_tlb_invalidate(tb->tb_start, num_pages, tb->tb_global);
+		other_cpus = ~cpu_bit;
+	} else {
+		bool is_active = (vs->vs_md_cpu_active & cpu_bit) != 0;
+		__sync_fetch_and_or(&vs->vs_md_cpu_stale, is_active ? ~cpu_bit : ~0U);
+		if (is_active)
+			md_tlb_invalidate(tb->tb_start, num_pages, 0);
+		other_cpus = vs->vs_md_cpu_active & ~cpu_bit;
+	}
+	md_interrupts_restore(state);
+
+#ifdef OPTION_SMP
+	if (num_smp_launched > 1)
+		smp_tlb_shootdown(other_cpus, tb->tb_start, num_pages, vs == NULL || tb->tb_global);
+#else
+	(void)other_cpus;
+#endif
+}
+
+static inline void
+md_set_pte(uint64_t* pte, addr_t virt, uint64_t entry, struct MD_TLB_BATCH* tb)
+{
+	// Leave the entry alone if nothing but the accessed/dirty bits would change
+	uint64_t old_entry = pte[(virt >> 12) & 0x1ff];
+	if (((old_entry ^ entry) & ~(PE_A | PE_D)) == 0)
+		return;
+
+	// If the mapping was already present, it may be in the TLB
+	md_tlb_batch_add(tb, virt, old_entry);
+	pte[(virt >> 12) & 0x1ff] = entry;
+}
+
+void
+md_map_pages(vmspace_t* vs, addr_t virt, addr_t phys, size_t num_pages, int flags)
+{
+	/* Flags for the mapped pages themselves */
+	uint64_t pt_flags = md_pt_flags(flags);
+
+	/* Only walk the page directories if we cross into a new pagetable */
+	struct MD_TLB_BATCH tb = { 0 };
+	uint64_t* pte = NULL;
+	while(num_pages--) {
+		if (pte == NULL || (virt & ((1ULL << 21) - 1)) == 0)
+			pte = md_get_pagetable(vs, virt, &pt_flags);
+		md_set_pte(pte, virt, (uint64_t)phys | pt_flags, &tb);
 
 		virt += PAGE_SIZE; phys += PAGE_SIZE;
 	}
+	md_tlb_batch_flush(vs, &tb);
 }
 
 void
-md_unmap_pages(vmspace_t* vs, addr_t virt, size_t num_pages)
+md_map_pages_vector(vmspace_t* vs, addr_t virt, const addr_t* phys, size_t num_pages, int flags)
 {
-	thread_t* curthread = PCPU_GET(curthread);
-	int is_cur_vmspace = curthread->t_process != NULL && curthread->t_process->p_vmspace == vs;
+	uint64_t pt_flags = md_pt_flags(flags);
 
+	struct MD_TLB_BATCH tb = { 0 };
+	uint64_t* pte = NULL;
+	addr_t pte_virt = 0;
+	for (size_t n = 0; n < num_pages; n++, virt += PAGE_SIZE) {
+		if (phys[n] == 0)
+			continue; /* hole; leave whatever is there alone */
+		if (pte == NULL || (pte_virt >> 21) != (virt >> 21)) {
+			pte = md_get_pagetable(vs, virt, &pt_flags);
+			pte_virt = virt;
+		}
+		md_set_pte(pte, virt, (uint64_t)phys[n] | pt_flags, &tb);
+	}
+	md_tlb_batch_flush(vs, &tb);
+}
+
+void
+md_unmap_pages(vmspace_t* vs, addr_t virt, size_t num_pages)
+{
 	/* XXX we don't yet strip off bits 52-63 yet */
+	struct MD_TLB_BATCH tb = { 0 };
 	uint64_t* pagedir = (vs != NULL) ? vs->vs_md_pagedir : kernel_pagedir;
 	while(num_pages--) {
 		if (pagedir[(virt >> 39) & 0x1ff] == 0) {
@@ -123,17 +266,10 @@ md_unmap_pages(vmspace_t* vs, addr_t virt, size_t num_pages)
 
 		/* XXX perhaps we should check if this is actually mapped */
 		uint64_t* pte = pt_resolve_addr(pde[(virt >> 21) & 0x1ff]);
-		int global = (pte[(virt >> 12) & 0x1ff] & PE_G);
-		pte[(virt >> 12) & 0x1ff] = 0;
-		if (global || is_cur_vmspace) {
-			/*
-			 * We just unmapped a global virtual address or something that belongs to
-			 * the current thread; this means we'll have to * explicitely invalidate it.
-			 */
-			__asm __volatile("invlpg %0" : : "m" (*(char*)virt) : "memory");
-		}
+		md_set_pte(pte, virt, 0, &tb);
 		virt += PAGE_SIZE;
 	}
+	md_tlb_batch_flush(vs, &tb);
 }
 
 void
@@ -148,6 +284,38 @@ md_kunmap(addr_t virt, size_t num_pages)
 	md_unmap_pages(NULL, virt, num_pages);
 }
 
+uint64_t
+md_vmspace_get_cr3(vmspace_t* vs)
+{
+	if (vs == NULL)
+		return KVTOP((addr_t)kernel_pagedir);
+	return KVTOP((addr_t)vs->vs_md_pagedir) | vs->vs_md_pcid;
+}
+
+void
+md_vmspace_activate(vmspace_t* vs, uint64_t cr3)
+{
+	int state = md_interrupts_save_and_disable();
+	uint32_t cpu_bit = 1 << PCPU_GET(cpuid);
+	auto vs_old = static_cast<vmspace_t*>(PCPU_GET(vmspace));
+	if (vs_old != NULL)
+		__sync_fetch_and_and(&vs_old->vs_md_cpu_active, ~cpu_bit);
+	if (vs != NULL) {
+		__sync_fetch_and_or(&vs->vs_md_cpu_active, cpu_bit);
+
+		/*
+		 * With PCID, the TLB may still hold our entries from the last time we were
+		 * loaded on this CPU; we can keep them unless they were marked stale.
+		 */
+		uint32_t stale = __sync_fetch_and_and(&vs->vs_md_cpu_stale, ~cpu_bit);
+		if ((cr3 & CR3_PCID_MASK) != 0 && (stale & cpu_bit) == 0)
+			cr3 |= CR3_NOFLUSH;
+	}
+	PCPU_SET(vmspace, vs);
+	write_cr3(cr3);
+	md_interrupts_restore(state);
+}
+
 void
 vm_init()
 {
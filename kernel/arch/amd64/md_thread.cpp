@@ -12,9 +12,12 @@
 #include <ananas/mm.h>
 #include <ananas/pcpu.h>
 #include <ananas/syscall.h>
+#include <ananas/trace.h>
 #include <ananas/vm.h>
 #include <ananas/vmspace.h>
 
+TRACE_SETUP;
+
 extern void* kernel_pagedir;
 extern "C" {
 void thread_trampoline();
@@ -37,6 +40,8 @@ md_thread_init(thread_t* t, int flags)
 	 * and overflow.
 	 */
 	t->md_kstack_page = page_alloc_length(KERNEL_STACK_SIZE + PAGE_SIZE);
+	if (t->md_kstack_page == NULL)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
 	t->md_kstack = kmem_map(page_get_paddr(t->md_kstack_page) + PAGE_SIZE, KERNEL_STACK_SIZE, VM_FLAG_READ | VM_FLAG_WRITE);
 
 	/* Set up a stackframe so that we can return to the kernel code */
@@ -51,7 +56,7 @@ md_thread_init(thread_t* t, int flags)
 	sf->sf_rsp = ((addr_t)USERLAND_STACK_ADDR + THREAD_STACK_SIZE);
 
 	/* Fill out our MD fields */
-	t->md_cr3 = KVTOP((addr_t)proc->p_vmspace->vs_md_pagedir);
+	t->md_cr3 = md_vmspace_get_cr3(proc->p_vmspace);
   t->md_rsp = (addr_t)sf;
 	t->md_rsp0 = (addr_t)t->md_kstack + KERNEL_STACK_SIZE;
 	t->md_rip = (addr_t)&thread_trampoline;
@@ -73,6 +78,8 @@ md_kthread_init(thread_t* t, kthread_func_t kfunc, void* arg)
 	 * no kernelthread ever runs userland code.
 	 */
 	t->md_kstack_page = page_alloc_length(KERNEL_STACK_SIZE + PAGE_SIZE);
+	if (t->md_kstack_page == NULL)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
 	t->md_kstack = kmem_map(page_get_paddr(t->md_kstack_page) + PAGE_SIZE, KERNEL_STACK_SIZE, VM_FLAG_READ | VM_FLAG_WRITE);
 	t->t_md_flags = THREAD_MDFLAG_FULLRESTORE;
 
@@ -128,7 +135,7 @@ md_thread_switch(thread_t* new_thread, thread_t* old_thread)
 	PCPU_SET(rsp0, new_thread->md_rsp0);
 
 	/* Activate the new_thread thread's page tables */
-  __asm __volatile("movq %0, %%cr3" : : "r" (new_thread->md_cr3));
+	md_vmspace_activate(new_thread->t_process != NULL ? new_thread->t_process->p_vmspace : NULL, new_thread->md_cr3);
 
 	/*
 	 * This will only be called from kernel -> kernel transitions, and the
@@ -186,7 +193,7 @@ md_thread_clone(struct THREAD* t, struct THREAD* parent, register_t retval)
 	KASSERT(PCPU_GET(curthread) == parent, "must clone active thread");
 
 	/* Restore the thread's own page directory */
-	t->md_cr3 = KVTOP((addr_t)t->t_process->p_vmspace->vs_md_pagedir);
+	t->md_cr3 = md_vmspace_get_cr3(t->t_process->p_vmspace);
 
 	/*
 	 * We need to copy the the stack frame so we can return return safely to the
@@ -224,4 +231,21 @@ md_setup_post_exec(thread_t* t, addr_t exec_addr, register_t exec_arg)
 	t->md_rip = (addr_t)&thread_trampoline;
 }
 
+void
+md_thread_reload_vmspace(thread_t* t)
+{
+	KASSERT(PCPU_GET(curthread) == t, "must reload active thread");
+
+	/* Activate the page directory of the process' current vmspace */
+	t->md_cr3 = md_vmspace_get_cr3(t->t_process->p_vmspace);
+	md_vmspace_activate(t->t_process->p_vmspace, t->md_cr3);
+}
+
+void
+md_thread_restore_all(thread_t* t)
+{
+	/* Return to userland by restoring all registers, not just the callee-saved ones */
+	t->t_md_flags |= THREAD_MDFLAG_FULLRESTORE;
+}
+
 /* vim:set ts=2 sw=2: */
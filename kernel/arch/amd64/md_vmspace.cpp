@@ -3,11 +3,54 @@
 #include <machine/vm.h>
 #include <ananas/error.h>
 #include <ananas/lib.h>
+#include <ananas/lock.h>
 #include <ananas/vm.h>
 #include <ananas/trace.h>
 
 TRACE_SETUP;
 
+/*
+ * Process-Context Identifiers tag TLB entries with the address space they
+ * belong to, so we need not flush the TLB on every context switch. PCID 0 is
+ * never handed out: vmspaces using it are always flushed when they are loaded.
+ */
+#define MD_PCID_COUNT 4096
+#define MD_PCID_PER_WORD (sizeof(uint64_t) * 8)
+
+static spinlock_t md_pcid_lock = SPINLOCK_DEFAULT_INIT;
+static uint64_t md_pcid_used[MD_PCID_COUNT / MD_PCID_PER_WORD] = { 1 };
+
+static unsigned int
+md_pcid_alloc()
+{
+	if (!md_pcid_enabled)
+		return 0;
+
+	unsigned int pcid = 0;
+	spinlock_lock(&md_pcid_lock);
+	for (unsigned int n = 0; n < MD_PCID_COUNT / MD_PCID_PER_WORD; n++) {
+		if (md_pcid_used[n] == ~0ULL)
+			continue;
+		unsigned int bit = __builtin_ctzll(~md_pcid_used[n]);
+		md_pcid_used[n] |= 1ULL << bit;
+		pcid = n * MD_PCID_PER_WORD + bit;
+		break;
+	}
+	spinlock_unlock(&md_pcid_lock);
+	return pcid;
+}
+
+static void
+md_pcid_free(unsigned int pcid)
+{
+	if (pcid == 0)
+		return;
+
+	spinlock_lock(&md_pcid_lock);
+	md_pcid_used[pcid / MD_PCID_PER_WORD] &= ~(1ULL << (pcid % MD_PCID_PER_WORD));
+	spinlock_unlock(&md_pcid_lock);
+}
+
 errorcode_t
 md_vmspace_init(vmspace_t* vs)
 {
@@ -17,6 +60,14 @@ md_vmspace_init(vmspace_t* vs)
 		return ANANAS_ERROR(OUT_OF_MEMORY);
 	LIST_APPEND(&vs->vs_pages, pagedir_page);
 
+	/*
+	 * A recycled PCID may still have entries in the TLB of any CPU, so consider
+	 * them stale everywhere until we have been loaded once.
+	 */
+	vs->vs_md_pcid = md_pcid_alloc();
+	vs->vs_md_cpu_active = 0;
+	vs->vs_md_cpu_stale = ~0U;
+
 	/* Map the kernel pages in there */
 	memset(vs->vs_md_pagedir, 0, PAGE_SIZE);
 	md_map_kernel(vs);
@@ -27,4 +78,6 @@ md_vmspace_init(vmspace_t* vs)
 void
 md_vmspace_destroy(vmspace_t* vs)
 {
+	KASSERT(vs->vs_md_cpu_active == 0, "destroying vmspace %p which is still active (mask %x)", vs, vs->vs_md_cpu_active);
+	md_pcid_free(vs->vs_md_pcid);
 }
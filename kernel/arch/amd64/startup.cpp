@@ -53,6 +53,12 @@ extern "C" void *__entry, *__end, *__rodata_end;
 /* CPU clock speed, in MHz */
 int md_cpu_clock_mhz = 0;
 
+/* Set if we use Process-Context Identifiers */
+int md_pcid_enabled = 0;
+
+/* Set if the CPU supports Supervisor Mode Access Prevention */
+int md_smap_supported = 0;
+
 static void*
 bootstrap_get_pages(addr_t* avail, size_t num)
 {
@@ -312,7 +318,27 @@ extern void* syscall_handler;
 	wrmsr(MSR_SFMASK, 0x200 /* IF */);
 
 	/* Enable global pages */
-	write_cr4(read_cr4() | 0x80); /* PGE */
+	write_cr4(read_cr4() | CR4_PGE);
+
+	/* Tag TLB entries by address space if possible; %cr3 has PCID 0 here */
+	uint32_t eax, ebx, ecx, edx;
+	cpuid(1, &eax, &ebx, &ecx, &edx);
+	if (ecx & CPUID_1_ECX_PCID) {
+		write_cr4(read_cr4() | CR4_PCIDE);
+		md_pcid_enabled = 1;
+	}
+
+	/*
+	 * Note whether SMAP is available; user copies will open an access window
+	 * using stac/clac if so. We do not set CR4_SMAP yet as not every path
+	 * into user memory goes through copyin()/copyout().
+	 */
+	cpuid(0, &eax, &ebx, &ecx, &edx);
+	if (eax >= 7) {
+		cpuid(7, &eax, &ebx, &ecx, &edx);
+		if (ebx & CPUID_7_EBX_SMAP)
+			md_smap_supported = 1;
+	}
 
 	/* Enable FPU use; the kernel will save/restore it as needed */
 	write_cr4(read_cr4() | 0x600); /* OSFXSR | OSXMMEXCPT */
@@ -338,6 +364,7 @@ smp_init_ap_pagetable()
 	 * to get us to long mode.
 	 */
 	void* ptr = page_alloc_length_mapped(3 * PAGE_SIZE, &smp_ap_pages, VM_FLAG_READ | VM_FLAG_WRITE);
+	KASSERT(ptr != NULL, "out of memory");
 
 	addr_t pa = page_get_paddr(smp_ap_pages);
 	uint64_t* pml4 = static_cast<uint64_t*>(ptr);
@@ -5,21 +5,22 @@
 #include <ananas/pcpu.h>
 #include <ananas/irq.h>
 #include <ananas/lib.h>
+#include <ananas/timer.h>
 #include <machine/interrupts.h>
 #include "options.h"
 
 #define IRQ_PIT 0
 #define TIMER_FREQ 1193182
 
-#define HZ 100 /* XXX does not belong here */
-
 extern int md_cpu_clock_mhz;
 static uint64_t tsc_boot_time;
+static volatile uint64_t pit_ticks;
 
 static irqresult_t
 x86_pit_irq(Ananas::Device*, void*)
 {
 	PCPU_SET(tickcount, PCPU_GET(tickcount) + 1);
+	pit_ticks++;
 	if (!scheduler_activated())
 		return IRQ_RESULT_PROCESSED;
 
@@ -87,6 +88,12 @@ x86_pit_calc_cpuspeed_mhz()
 	return ((tsc_current - tsc_base) * HZ) / 1000000;
 }
 
+uint64_t
+timer_get_ticks()
+{
+	return pit_ticks;
+}
+
 void
 delay(int ms)
 {
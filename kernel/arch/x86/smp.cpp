@@ -42,6 +42,13 @@ static struct PAGE* ap_page;
 static int can_smp_launch = 0;
 extern "C" volatile int num_smp_launched = 1; /* BSP is always launched */
 
+/* Pending TLB shootdown; only one may be in flight at any time */
+static spinlock_t smp_tlb_lock = SPINLOCK_DEFAULT_INIT;
+static volatile uint32_t smp_tlb_pending;
+static addr_t smp_tlb_virt;
+static size_t smp_tlb_num_pages;
+static int smp_tlb_global;
+
 static struct IRQ_SOURCE ipi_source = {
 	.is_first = SMP_IPI_FIRST,
 	.is_count = SMP_IPI_COUNT,
@@ -73,6 +80,24 @@ smp_ipi_schedule(Ananas::Device*, void* context)
 	return IRQ_RESULT_PROCESSED;
 }
 
+/* Performs the pending shootdown, if it involves the current CPU */
+static void
+smp_tlb_serve()
+{
+	uint32_t cpu_bit = 1 << PCPU_GET(cpuid);
+	if (smp_tlb_pending & cpu_bit) {
+		md_tlb_invalidate(smp_tlb_virt, smp_tlb_num_pages, smp_tlb_global);
+		__sync_fetch_and_and(&smp_tlb_pending, ~cpu_bit);
+	}
+}
+
+static irqresult_t
+smp_ipi_tlb_shootdown(Ananas::Device*, void* context)
+{
+	smp_tlb_serve();
+	return IRQ_RESULT_PROCESSED;
+}
+
 static irqresult_t
 smp_ipi_panic(Ananas::Device*, void* context)
 {
@@ -149,6 +174,7 @@ void
 smp_prepare()
 {
 	ap_page = page_alloc_single();
+	KASSERT(ap_page != NULL, "out of memory");
 	KASSERT(page_get_paddr(ap_page) < 0x100000, "ap code must be below 1MB"); /* XXX crude */
 }
 
@@ -211,6 +237,8 @@ smp_init()
 		panic("can't register ipi");
 	if (ananas_is_failure(irq_register(SMP_IPI_SCHEDULE, NULL, smp_ipi_schedule, IRQ_TYPE_IPI, NULL)))
 		panic("can't register ipi");
+	if (ananas_is_failure(irq_register(SMP_IPI_TLB_SHOOTDOWN, NULL, smp_ipi_tlb_shootdown, IRQ_TYPE_IPI, NULL)))
+		panic("can't register ipi");
 
 	/*
 	 * Initialize the SMP launch variable; every AP will just spin and check this value. We don't
@@ -272,6 +300,47 @@ smp_broadcast_schedule()
 	*((volatile uint32_t*)(PTOKV(LAPIC_BASE) + LAPIC_ICR_LO)) = LAPIC_ICR_DEST_ALL_INC_SELF | LAPIC_ICR_LEVEL_ASSERT | LAPIC_ICR_DELIVERY_FIXED | SMP_IPI_SCHEDULE;
 }
 
+/*
+ * Asks every CPU in cpu_mask to invalidate the given range from its TLB, and
+ * waits until they all have. The caller must already have taken care of the
+ * current CPU.
+ */
+void
+smp_tlb_shootdown(uint32_t cpu_mask, addr_t virt, size_t num_pages, int global)
+{
+	cpu_mask &= (1 << num_smp_launched) - 1;
+	if (num_smp_launched <= 1 || cpu_mask == 0)
+		return;
+
+	/*
+	 * We may be called with interrupts disabled, so the IPI of another CPU
+	 * holding the lock may never reach us; serve its shootdown by hand while
+	 * waiting, or it would wait for us forever.
+	 */
+	register_t state = md_interrupts_save_and_disable();
+	while (!spinlock_trylock(&smp_tlb_lock))
+		smp_tlb_serve();
+	smp_tlb_virt = virt;
+	smp_tlb_num_pages = num_pages;
+	smp_tlb_global = global;
+	__sync_fetch_and_or(&smp_tlb_pending, cpu_mask);
+
+	/* Only interrupt the CPUs that are involved */
+	addr_t lapic_base = PTOKV(LAPIC_BASE);
+	for (int n = 0; n < num_smp_launched; n++) {
+		if ((cpu_mask & (1 << n)) == 0)
+			continue;
+		while (*((volatile uint32_t*)(lapic_base + LAPIC_ICR_LO)) & LAPIC_ICR_STATUS_PENDING)
+			/* wait for the previous IPI to be sent */ ;
+		*((volatile uint32_t*)(lapic_base + LAPIC_ICR_HI)) = smp_config.cfg_cpu[n].lapic_id << 24;
+		*((volatile uint32_t*)(lapic_base + LAPIC_ICR_LO)) = LAPIC_ICR_DEST_FIELD | LAPIC_ICR_LEVEL_ASSERT | LAPIC_ICR_DELIVERY_FIXED | SMP_IPI_TLB_SHOOTDOWN;
+	}
+	while (smp_tlb_pending != 0)
+		/* wait for it ... */ ;
+	spinlock_unlock(&smp_tlb_lock);
+	md_interrupts_restore(state);
+}
+
 /*
  * Called by mp_stub.S for every Application Processor. Should not return.
  */
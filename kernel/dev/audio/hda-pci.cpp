@@ -427,6 +427,8 @@ HDAPCIDevice::Attach()
 	 */
 	static_assert(PAGE_SIZE >= 4096, "tiny page size?");
 	hda_corb = static_cast<uint32_t*>(page_alloc_single_mapped(&hda_page, VM_FLAG_READ | VM_FLAG_WRITE | VM_FLAG_DEVICE));
+	if (hda_corb == NULL)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
 	hda_rirb = (uint64_t*)((char*)hda_corb + 1024);
 	addr_t corb_paddr = page_get_paddr(hda_page);
 	memset(hda_corb, 0, PAGE_SIZE);
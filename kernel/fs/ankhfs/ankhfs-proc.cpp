@@ -98,8 +98,8 @@ public:
 		strcpy(result, "???");
 		switch(inum_to_sub(inum)) {
 			case subName: {
-				if (p->p_info != nullptr)
-					strncpy(result, p->p_info->pi_args, sizeof(result));
+				if (p->p_name[0] != '\0')
+					strncpy(result, p->p_name, sizeof(result));
 				break;
 			}
 			case subVmSpace: {
@@ -35,6 +35,7 @@
 #include <ananas/vfs/mount.h>
 #include <ananas/init.h>
 #include <ananas/lib.h>
+#include <ananas/lock.h>
 #include <ananas/mm.h>
 #include <ananas/trace.h>
 #include <ananas/zlib.h>
@@ -49,82 +50,285 @@ TRACE_SETUP;
 #define CRAMFS_TO_LE16(x) (x)
 #define CRAMFS_TO_LE32(x) (x)
 
-static z_stream cramfs_zstream;
+/* Number of pages which can be decompressed simultaneously, per filesystem */
+#define CRAMFS_NUM_INFLATE 4
+
+/* Number of decompressed pages cached per filesystem */
+#define CRAMFS_CACHE_PAGES 32
+
+/* Maximum number of pages whose compressed data is read in one go */
+#define CRAMFS_READ_PAGES 16
 
 struct CRAMFS_INODE_PRIVDATA {
 	uint32_t offset;
 };
 
-struct CRAMFS_PRIVDATA {
-	unsigned char temp_buf[CRAMFS_PAGE_SIZE * 2];
+/* State needed to decompress a single page */
+struct CRAMFS_INFLATE {
+	z_stream zstream;
 	unsigned char decompress_buf[CRAMFS_PAGE_SIZE + 4];
 };
 
+struct CRAMFS_CACHED_PAGE {
+	ino_t cp_inum;			/* Inode, or 0 if unused */
+	uint32_t cp_index;		/* Page index within the inode */
+	uint32_t cp_length;		/* Number of valid bytes */
+	unsigned int cp_last_used;
+	unsigned char cp_data[CRAMFS_PAGE_SIZE];
+};
+
+struct CRAMFS_PRIVDATA {
+	/* Decompression states; inflate_sem counts the available ones */
+	semaphore_t inflate_sem;
+	spinlock_t inflate_lock;
+	unsigned int inflate_busy;	/* Bit n is set if inflate[n] is in use */
+	struct CRAMFS_INFLATE inflate[CRAMFS_NUM_INFLATE];
+
+	/* Recently used pages; the least recently used one is replaced first */
+	mutex_t cache_mtx;
+	unsigned int cache_clock;
+	struct CRAMFS_CACHED_PAGE cache[CRAMFS_CACHE_PAGES];
+};
+
+static struct CRAMFS_INFLATE*
+cramfs_get_inflate(struct CRAMFS_PRIVDATA* fs_privdata)
+{
+	sem_wait(&fs_privdata->inflate_sem);
+	spinlock_lock(&fs_privdata->inflate_lock);
+	unsigned int n = 0;
+	while (fs_privdata->inflate_busy & (1 << n))
+		n++;
+	KASSERT(n < CRAMFS_NUM_INFLATE, "semaphore allowed us in, but nothing available");
+	fs_privdata->inflate_busy |= 1 << n;
+	spinlock_unlock(&fs_privdata->inflate_lock);
+	return &fs_privdata->inflate[n];
+}
+
+static void
+cramfs_put_inflate(struct CRAMFS_PRIVDATA* fs_privdata, struct CRAMFS_INFLATE* ci)
+{
+	unsigned int n = ci - fs_privdata->inflate;
+	spinlock_lock(&fs_privdata->inflate_lock);
+	fs_privdata->inflate_busy &= ~(1 << n);
+	spinlock_unlock(&fs_privdata->inflate_lock);
+	sem_signal(&fs_privdata->inflate_sem);
+}
+
+/*
+ * Copies up to 'len' bytes of page 'page_index' of an inode, starting at
+ * 'offset' within the page, from the cache. Returns the number of bytes
+ * copied, or -1 if the page is not cached.
+ */
+static int
+cramfs_cache_lookup(struct CRAMFS_PRIVDATA* fs_privdata, ino_t inum, uint32_t page_index, uint32_t offset, void* buf, size_t len)
+{
+	int result = -1;
+	mutex_lock(&fs_privdata->cache_mtx);
+	for (unsigned int n = 0; n < CRAMFS_CACHE_PAGES; n++) {
+		struct CRAMFS_CACHED_PAGE* cp = &fs_privdata->cache[n];
+		if (cp->cp_inum != inum || cp->cp_index != page_index)
+			continue;
+
+		cp->cp_last_used = ++fs_privdata->cache_clock;
+		result = 0;
+		if (offset < cp->cp_length) {
+			result = (len > cp->cp_length - offset) ? cp->cp_length - offset : len;
+			memcpy(buf, &cp->cp_data[offset], result);
+		}
+		break;
+	}
+	mutex_unlock(&fs_privdata->cache_mtx);
+	return result;
+}
+
+static void
+cramfs_cache_insert(struct CRAMFS_PRIVDATA* fs_privdata, ino_t inum, uint32_t page_index, const void* data, uint32_t length)
+{
+	mutex_lock(&fs_privdata->cache_mtx);
+	struct CRAMFS_CACHED_PAGE* victim = &fs_privdata->cache[0];
+	for (unsigned int n = 0; n < CRAMFS_CACHE_PAGES; n++) {
+		struct CRAMFS_CACHED_PAGE* cp = &fs_privdata->cache[n];
+		if (cp->cp_inum == inum && cp->cp_index == page_index) {
+			/* Someone else beat us to it */
+			mutex_unlock(&fs_privdata->cache_mtx);
+			return;
+		}
+		if (cp->cp_last_used < victim->cp_last_used)
+			victim = cp;
+	}
+	victim->cp_inum = inum;
+	victim->cp_index = page_index;
+	victim->cp_length = length;
+	victim->cp_last_used = ++fs_privdata->cache_clock;
+	memcpy(victim->cp_data, data, length);
+	mutex_unlock(&fs_privdata->cache_mtx);
+}
+
+/*
+ * Fetches the compressed data offsets of pages [first_page .. first_page +
+ * num_pages) of an inode; offsets[n] will be the start of page first_page + n
+ * and offsets[num_pages] the end of the final page.
+ */
 static errorcode_t
-cramfs_read(struct VFS_FILE* file, void* buf, size_t* len)
+cramfs_get_chunk_offsets(struct VFS_INODE* inode, uint32_t first_page, unsigned int num_pages, uint32_t* offsets)
 {
-	struct VFS_INODE* inode = file->f_dentry->d_inode;
 	struct VFS_MOUNTED_FS* fs = inode->i_fs;
-	struct CRAMFS_PRIVDATA* fs_privdata = (struct CRAMFS_PRIVDATA*)fs->fs_privdata;
 	struct CRAMFS_INODE_PRIVDATA* i_privdata = (struct CRAMFS_INODE_PRIVDATA*)inode->i_privdata;
 
-	size_t total = 0, toread = *len;
-	while (toread > 0) {
-		uint32_t page_index = file->f_offset / CRAMFS_PAGE_SIZE;
-		int cur_block = -1;
+	/*
+	 * The block pointer table only contains the end of every page; the start of
+	 * a page is the end of the previous one. The first page has no previous
+	 * page, so its data starts directly after the table.
+	 */
+	unsigned int n = 0;
+	uint32_t index = first_page - 1;
+	if (first_page == 0) {
+		offsets[n++] = i_privdata->offset + (((inode->i_sb.st_size - 1) / CRAMFS_PAGE_SIZE) + 1) * sizeof(uint32_t);
+		index++;
+	}
+
+	/* Entries never straddle blocks, so we need only a single read per block */
+	struct BIO* bio = NULL;
+	blocknr_t cur_block = 0;
+	for (/* nothing */; n <= num_pages; n++, index++) {
+		uint32_t entry_offset = i_privdata->offset + index * sizeof(uint32_t);
+		blocknr_t block = entry_offset / fs->fs_block_size;
+		if (bio == NULL || block != cur_block) {
+			if (bio != NULL)
+				bio_free(bio);
+			errorcode_t err = vfs_bread(fs, block, &bio);
+			ANANAS_ERROR_RETURN(err);
+			cur_block = block;
+		}
+		offsets[n] = CRAMFS_TO_LE32(*(uint32_t*)(static_cast<char*>(BIO_DATA(bio)) + entry_offset % fs->fs_block_size));
+	}
+	if (bio != NULL)
+		bio_free(bio);
+	return ananas_success();
+}
+
+/*
+ * Schedules reads of all blocks spanning [offset .. offset + len) without
+ * waiting for any of them; this lets the device work on all of them while we
+ * are decompressing.
+ */
+static void
+cramfs_read_ahead(struct VFS_MOUNTED_FS* fs, uint32_t offset, uint32_t len)
+{
+	if (len == 0)
+		return;
+
+	blocknr_t first_block = offset / fs->fs_block_size;
+	blocknr_t last_block = (offset + len - 1) / fs->fs_block_size;
+	for (blocknr_t block = first_block; block <= last_block; block++) {
 		struct BIO* bio;
+		if (ananas_is_failure(vfs_bget(fs, block, &bio, BIO_READ_ASYNC)))
+			break;
+		bio_free(bio);
+	}
+}
 
-		/* Calculate the compressed data offset of this page */
-		cur_block = (i_privdata->offset + page_index * sizeof(uint32_t)) / fs->fs_block_size;
-		errorcode_t err = vfs_bread(fs, cur_block, &bio);
+/*
+ * Decompresses the chunk at [start_offset .. end_offset) into
+ * ci->decompress_buf; 'length' is set to the number of bytes it yielded. The
+ * compressed data is fed to zlib straight from the I/O buffers.
+ */
+static errorcode_t
+cramfs_inflate_chunk(struct VFS_MOUNTED_FS* fs, uint32_t start_offset, uint32_t end_offset, struct CRAMFS_INFLATE* ci, uint32_t* length)
+{
+	KASSERT(start_offset <= end_offset, "chunk ends before it begins (%u, %u)", start_offset, end_offset);
+
+	ci->zstream.next_out = ci->decompress_buf;
+	ci->zstream.avail_out = sizeof(ci->decompress_buf);
+
+	int zerr = inflateReset(&ci->zstream);
+	KASSERT(zerr == Z_OK, "inflateReset() error %d", zerr);
+
+	uint32_t cur_offset = start_offset;
+	while(cur_offset < end_offset) {
+		struct BIO* bio;
+		errorcode_t err = vfs_bread(fs, cur_offset / fs->fs_block_size, &bio);
 		ANANAS_ERROR_RETURN(err);
-		uint32_t next_offset = *(uint32_t*)(static_cast<char*>(BIO_DATA(bio)) + (i_privdata->offset + page_index * sizeof(uint32_t)) % fs->fs_block_size);
+		uint32_t piece_len = fs->fs_block_size - (cur_offset % fs->fs_block_size);
+		if (piece_len > end_offset - cur_offset)
+			piece_len = end_offset - cur_offset;
+
+		ci->zstream.next_in = reinterpret_cast<Bytef*>(static_cast<char*>(BIO_DATA(bio)) + (cur_offset % fs->fs_block_size));
+		ci->zstream.avail_in = piece_len;
+		zerr = inflate(&ci->zstream, Z_NO_FLUSH);
 		bio_free(bio);
+		cur_offset += piece_len;
 
-		uint32_t start_offset = 0;
-		if (page_index > 0) {
-			/* Now, fetch the offset of the previous page; this gives us the length of the compressed chunk */
-			int prev_block = (i_privdata->offset + (page_index - 1) * sizeof(uint32_t)) / fs->fs_block_size;
-			if (cur_block != prev_block) {
-				errorcode_t err = vfs_bread(fs, prev_block, &bio);
-				ANANAS_ERROR_RETURN(err);
-			}
-			start_offset = *(uint32_t*)(static_cast<char*>(BIO_DATA(bio)) + (i_privdata->offset + (page_index - 1) * sizeof(uint32_t)) % fs->fs_block_size);
-		} else {
-			/* In case of the first page, we have to set the offset ourselves as there is no index we can use */
-			start_offset  = i_privdata->offset;
-			start_offset += (((inode->i_sb.st_size - 1) / CRAMFS_PAGE_SIZE) + 1) * sizeof(uint32_t);
-		}
+		if (zerr == Z_STREAM_END)
+			break;
+		KASSERT(zerr == Z_OK, "inflate() error %d", zerr);
+	}
+	KASSERT(zerr == Z_STREAM_END, "inflate() did not finish (%d)", zerr);
+	KASSERT(ci->zstream.total_out <= CRAMFS_PAGE_SIZE, "inflate() gave more data than a page");
 
-		uint32_t left = next_offset - start_offset;
-		KASSERT(left < sizeof(fs_privdata->temp_buf), "chunk too large");
+	*length = ci->zstream.total_out;
+	return ananas_success();
+}
 
-		uint32_t buf_pos = 0;
-		while(buf_pos < left) {
-			cur_block = (start_offset + buf_pos) / fs->fs_block_size;
-			err = vfs_bread(fs, cur_block, &bio);
-			ANANAS_ERROR_RETURN(err);
-			int piece_len = fs->fs_block_size - ((start_offset + buf_pos) % fs->fs_block_size);
-			if (piece_len > left)
-				piece_len = left;
-			memcpy(fs_privdata->temp_buf + buf_pos, static_cast<void*>(static_cast<char*>(BIO_DATA(bio)) + ((start_offset + buf_pos) % fs->fs_block_size)), piece_len);
-			buf_pos += piece_len;
-		}
+static errorcode_t
+cramfs_read(struct VFS_FILE* file, void* buf, size_t* len)
+{
+	struct VFS_INODE* inode = file->f_dentry->d_inode;
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
+	struct CRAMFS_PRIVDATA* fs_privdata = (struct CRAMFS_PRIVDATA*)fs->fs_privdata;
 
-		cramfs_zstream.next_in = fs_privdata->temp_buf;
-		cramfs_zstream.avail_in = left;
+	/* Compressed data offsets of pages [chunk_first .. chunk_first + chunk_count) */
+	uint32_t chunk_offset[CRAMFS_READ_PAGES + 1];
+	uint32_t chunk_first = 0;
+	unsigned int chunk_count = 0;
 
-		cramfs_zstream.next_out = fs_privdata->decompress_buf;
-		cramfs_zstream.avail_out = sizeof(fs_privdata->decompress_buf);
+	size_t total = 0, toread = *len;
+	while (toread > 0 && file->f_offset < inode->i_sb.st_size) {
+		uint32_t page_index = file->f_offset / CRAMFS_PAGE_SIZE;
+		uint32_t page_offset = file->f_offset % CRAMFS_PAGE_SIZE;
+
+		/*
+		 * Reading a file in small pieces would otherwise decompress the same page
+		 * over and over again; see if we recently did the work already.
+		 */
+		int copy_chunk = cramfs_cache_lookup(fs_privdata, inode->i_inum, page_index, page_offset, buf, toread);
+		if (copy_chunk < 0) {
+			if (page_index < chunk_first || page_index >= chunk_first + chunk_count) {
+				/*
+				 * Look up where all pages we need live at once, and get the device
+				 * going on all of them; this beats handling them one by one.
+				 */
+				off_t end = file->f_offset + toread;
+				if (end > inode->i_sb.st_size)
+					end = inode->i_sb.st_size;
+				chunk_count = (end - 1) / CRAMFS_PAGE_SIZE - page_index + 1;
+				if (chunk_count > CRAMFS_READ_PAGES)
+					chunk_count = CRAMFS_READ_PAGES;
+				chunk_first = page_index;
+				errorcode_t err = cramfs_get_chunk_offsets(inode, chunk_first, chunk_count, chunk_offset);
+				ANANAS_ERROR_RETURN(err);
+				cramfs_read_ahead(fs, chunk_offset[0], chunk_offset[chunk_count] - chunk_offset[0]);
+			}
 
-		int zerr = inflateReset(&cramfs_zstream);
-		KASSERT(zerr == Z_OK, "inflateReset() error %d", zerr);
-		zerr = inflate(&cramfs_zstream, Z_FINISH);
-		KASSERT(zerr == Z_STREAM_END, "inflate() error %d", zerr);
-		KASSERT(cramfs_zstream.total_out <= CRAMFS_PAGE_SIZE, "inflate() gave more data than a page");
+			unsigned int n = page_index - chunk_first;
+			struct CRAMFS_INFLATE* ci = cramfs_get_inflate(fs_privdata);
+			uint32_t length;
+			errorcode_t err = cramfs_inflate_chunk(fs, chunk_offset[n], chunk_offset[n + 1], ci, &length);
+			if (ananas_is_failure(err)) {
+				cramfs_put_inflate(fs_privdata, ci);
+				return err;
+			}
 
-		int copy_chunk = (cramfs_zstream.total_out > toread) ? toread :  cramfs_zstream.total_out;
-		memcpy(buf, &fs_privdata->decompress_buf[file->f_offset % CRAMFS_PAGE_SIZE], copy_chunk);
+			copy_chunk = 0;
+			if (page_offset < length) {
+				copy_chunk = (length - page_offset > toread) ? toread : length - page_offset;
+				memcpy(buf, &ci->decompress_buf[page_offset], copy_chunk);
+			}
+			cramfs_cache_insert(fs_privdata, inode->i_inum, page_index, ci->decompress_buf, length);
+			cramfs_put_inflate(fs_privdata, ci);
+		}
+		if (copy_chunk == 0)
+			break; /* page is shorter than the inode claims */
 
 		file->f_offset += copy_chunk;
 		buf = static_cast<void*>(static_cast<char*>(buf) + copy_chunk);
@@ -285,7 +489,9 @@ cramfs_mount(struct VFS_MOUNTED_FS* fs, struct VFS_INODE** root_inode)
 		return ANANAS_ERROR(NO_DEVICE);
 	}
 
-	fs->fs_privdata = new CRAMFS_PRIVDATA;
+	auto fs_privdata = new CRAMFS_PRIVDATA;
+	memset(fs_privdata, 0, sizeof(struct CRAMFS_PRIVDATA));
+	fs->fs_privdata = fs_privdata;
 
 	/* Everything is ok; fill out the filesystem details */
 	err = vfs_get_inode(fs, __builtin_offsetof(struct CRAMFS_SUPERBLOCK, c_rootinode), root_inode);
@@ -295,10 +501,16 @@ cramfs_mount(struct VFS_MOUNTED_FS* fs, struct VFS_INODE** root_inode)
 		return ANANAS_ERROR(NO_DEVICE);
 	}
 
-	/* Initialize our deflater */
-	cramfs_zstream.next_in = NULL;
-	cramfs_zstream.avail_in = 0;
-	inflateInit(&cramfs_zstream);
+	/* Initialize our deflaters */
+	sem_init(&fs_privdata->inflate_sem, CRAMFS_NUM_INFLATE);
+	spinlock_init(&fs_privdata->inflate_lock);
+	for (unsigned int n = 0; n < CRAMFS_NUM_INFLATE; n++) {
+		z_stream* zs = &fs_privdata->inflate[n].zstream;
+		zs->next_in = NULL;
+		zs->avail_in = 0;
+		inflateInit(zs);
+	}
+	mutex_init(&fs_privdata->cache_mtx, "cramfscache");
 
 	return ananas_success();
 }
@@ -25,6 +25,7 @@
 #include <ananas/types.h>
 #include <ananas/bio.h>
 #include <ananas/error.h>
+#include <ananas/lock.h>
 #include <ananas/vfs.h>
 #include <ananas/vfs/generic.h>
 #include <ananas/vfs/mount.h>
@@ -44,10 +45,45 @@ struct EXT2_FS_PRIVDATA {
 
 	unsigned int num_blockgroups;
 	struct EXT2_BLOCKGROUP* blockgroup;
+
+	/*
+	 * Allocation state. The bitmaps are read on first use and kept in memory;
+	 * any change is written through to disk.
+	 */
+	mutex_t alloc_mtx;
+	uint8_t** block_bitmap;
+	uint8_t** inode_bitmap;
+};
+
+/*
+ * A run of logical blocks which are stored consecutively on disk; used to
+ * avoid walking the indirect blocks for every block that is mapped.
+ */
+struct EXT2_EXTENT {
+	blocknr_t e_logical;
+	blocknr_t e_physical;
+	blocknr_t e_length;	/* 0 if unused */
 };
 
+#define EXT2_EXTENT_CACHE_SIZE 8
+
+/* Number of blocks to reserve beyond the one we need when a file grows */
+#define EXT2_PREALLOC_BLOCKS 8
+
 struct EXT2_INODE_PRIVDATA {
 	blocknr_t block[EXT2_INODE_BLOCKS];
+	uint32_t flags;
+
+	spinlock_t extent_lock;
+	unsigned int extent_next;	/* next entry to replace */
+	struct EXT2_EXTENT extent[EXT2_EXTENT_CACHE_SIZE];
+
+	/*
+	 * Blocks reserved for the file to grow into; these are marked as used on
+	 * disk, so they must be released once the inode goes away.
+	 */
+	blocknr_t prealloc_block;
+	unsigned int prealloc_count;
 };
 
 static void
@@ -57,11 +93,286 @@ ext2_conv_superblock(struct EXT2_SUPERBLOCK* sb)
 	sb->s_magic = EXT2_TO_LE16(sb->s_magic);
 }
 
+/*
+ * Only write to filesystems whose on-disk format we fully understand.
+ */
+static bool
+ext2_is_writable(struct EXT2_FS_PRIVDATA* privdata)
+{
+	return (privdata->sb.s_feature_incompat & ~EXT2_FEATURE_INCOMPAT_FILETYPE) == 0 &&
+	       (privdata->sb.s_feature_ro_compat & ~(EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER | EXT2_FEATURE_RO_COMPAT_LARGE_FILE)) == 0;
+}
+
+/*
+ * Block and inode allocation.
+ *
+ * Both are tracked using a bitmap per blockgroup. We try to keep related
+ * things close together: blocks are allocated right after the block which
+ * precedes them in the file, and new inodes are placed in the blockgroup of
+ * their directory - this way, reading a file or directory needs little
+ * seeking.
+ */
+static inline bool
+ext2_test_bit(const uint8_t* bitmap, unsigned int n)
+{
+	return (bitmap[n / 8] & (1 << (n % 8))) != 0;
+}
+
+static inline void
+ext2_set_bit(uint8_t* bitmap, unsigned int n)
+{
+	bitmap[n / 8] |= 1 << (n % 8);
+}
+
+static inline void
+ext2_clear_bit(uint8_t* bitmap, unsigned int n)
+{
+	bitmap[n / 8] &= ~(1 << (n % 8));
+}
+
+/* Returns the first clear bit in [from, to), or -1 if there is none */
+static int
+ext2_find_clear_bit(const uint8_t* bitmap, unsigned int from, unsigned int to)
+{
+	unsigned int n = from;
+	while (n < to) {
+		/* Skip completely used bytes in one go */
+		if ((n % 8) == 0 && bitmap[n / 8] == 0xff) {
+			n += 8;
+			continue;
+		}
+		if (!ext2_test_bit(bitmap, n))
+			return n;
+		n++;
+	}
+	return -1;
+}
+
+static unsigned int
+ext2_blocks_in_group(struct EXT2_FS_PRIVDATA* privdata, unsigned int group)
+{
+	/* The final blockgroup may be cut short */
+	if (group == privdata->num_blockgroups - 1)
+		return privdata->sb.s_blocks_count - privdata->sb.s_first_data_block - group * privdata->sb.s_blocks_per_group;
+	return privdata->sb.s_blocks_per_group;
+}
+
+/*
+ * Fetches the block or inode bitmap of a given blockgroup. Must be called with
+ * alloc_mtx held.
+ */
+static errorcode_t
+ext2_get_bitmap(struct VFS_MOUNTED_FS* fs, unsigned int group, bool inode, uint8_t** bitmap)
+{
+	auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(fs->fs_privdata);
+	uint8_t** cache = inode ? privdata->inode_bitmap : privdata->block_bitmap;
+	if (cache[group] == NULL) {
+		struct EXT2_BLOCKGROUP* bg = &privdata->blockgroup[group];
+		struct BIO* bio;
+		errorcode_t err = vfs_bread(fs, inode ? bg->bg_inode_bitmap : bg->bg_block_bitmap, &bio);
+		ANANAS_ERROR_RETURN(err);
+		cache[group] = new uint8_t[fs->fs_block_size];
+		memcpy(cache[group], BIO_DATA(bio), fs->fs_block_size);
+		bio_free(bio);
+	}
+	*bitmap = cache[group];
+	return ananas_success();
+}
+
+/*
+ * Writes a bitmap back to disk, along with the blockgroup descriptor and the
+ * superblock free counts which go with it. Must be called with alloc_mtx held.
+ */
+static errorcode_t
+ext2_put_bitmap(struct VFS_MOUNTED_FS* fs, unsigned int group, bool inode)
+{
+	auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(fs->fs_privdata);
+	struct EXT2_BLOCKGROUP* bg = &privdata->blockgroup[group];
+
+	struct BIO* bio;
+	errorcode_t err = vfs_bget(fs, inode ? bg->bg_inode_bitmap : bg->bg_block_bitmap, &bio, BIO_READ_NODATA);
+	ANANAS_ERROR_RETURN(err);
+	memcpy(BIO_DATA(bio), inode ? privdata->inode_bitmap[group] : privdata->block_bitmap[group], fs->fs_block_size);
+	bio_set_dirty(bio);
+	bio_free(bio);
+
+	/* The descriptor lives where ext2_mount() got it from */
+	err = vfs_bread(fs, privdata->sb.s_first_data_block + 1 + (group * sizeof(struct EXT2_BLOCKGROUP)) / fs->fs_block_size, &bio);
+	ANANAS_ERROR_RETURN(err);
+	memcpy(static_cast<char*>(BIO_DATA(bio)) + (group * sizeof(struct EXT2_BLOCKGROUP)) % fs->fs_block_size, bg, sizeof(struct EXT2_BLOCKGROUP));
+	bio_set_dirty(bio);
+	bio_free(bio);
+
+	/* XXX we only update the primary superblock; e2fsck will fix the backups */
+	err = vfs_bread(fs, 1024 / fs->fs_block_size, &bio);
+	ANANAS_ERROR_RETURN(err);
+	auto sb = reinterpret_cast<struct EXT2_SUPERBLOCK*>(static_cast<char*>(BIO_DATA(bio)) + 1024 % fs->fs_block_size);
+	sb->s_free_blocks_count = EXT2_TO_LE32(privdata->sb.s_free_blocks_count);
+	sb->s_free_inodes_count = EXT2_TO_LE32(privdata->sb.s_free_inodes_count);
+	bio_set_dirty(bio);
+	bio_free(bio);
+	return ananas_success();
+}
+
+/*
+ * Allocates a block as close to 'goal' as possible. Up to 'max_count' - 1
+ * blocks directly following it will be allocated as well, if they are free;
+ * 'count' is set to the total number of blocks allocated.
+ */
+static errorcode_t
+ext2_alloc_blocks(struct VFS_MOUNTED_FS* fs, blocknr_t goal, unsigned int max_count, blocknr_t* block, unsigned int* count)
+{
+	auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(fs->fs_privdata);
+	struct EXT2_SUPERBLOCK* sb = &privdata->sb;
+	if (goal < sb->s_first_data_block || goal >= sb->s_blocks_count)
+		goal = sb->s_first_data_block;
+
+	mutex_lock(&privdata->alloc_mtx);
+	errorcode_t err = ANANAS_ERROR(NO_SPACE);
+	unsigned int group = (goal - sb->s_first_data_block) / sb->s_blocks_per_group;
+	for (unsigned int n = 0; n < privdata->num_blockgroups; n++, group = (group + 1) % privdata->num_blockgroups) {
+		struct EXT2_BLOCKGROUP* bg = &privdata->blockgroup[group];
+		if (bg->bg_free_blocks_count == 0)
+			continue;
+
+		uint8_t* bitmap;
+		err = ext2_get_bitmap(fs, group, false, &bitmap);
+		if (ananas_is_failure(err))
+			break;
+
+		/* In the goal's group, try the goal itself and anything after it first */
+		unsigned int group_blocks = ext2_blocks_in_group(privdata, group);
+		unsigned int start = (n == 0) ? (goal - sb->s_first_data_block) % sb->s_blocks_per_group : 0;
+		int bit = ext2_find_clear_bit(bitmap, start, group_blocks);
+		if (bit < 0 && start > 0)
+			bit = ext2_find_clear_bit(bitmap, 0, start);
+		if (bit < 0) {
+			err = ANANAS_ERROR(NO_SPACE);
+			continue; /* free count was off */
+		}
+
+		unsigned int num = 0;
+		while (num < max_count && bit + num < group_blocks && !ext2_test_bit(bitmap, bit + num)) {
+			ext2_set_bit(bitmap, bit + num);
+			num++;
+		}
+		bg->bg_free_blocks_count -= num;
+		sb->s_free_blocks_count -= num;
+		err = ext2_put_bitmap(fs, group, false);
+
+		*block = sb->s_first_data_block + group * sb->s_blocks_per_group + bit;
+		*count = num;
+		break;
+	}
+	mutex_unlock(&privdata->alloc_mtx);
+	return err;
+}
+
+/*
+ * Frees 'count' blocks starting at 'block'; these must be within a single
+ * blockgroup.
+ */
+static errorcode_t
+ext2_free_blocks(struct VFS_MOUNTED_FS* fs, blocknr_t block, unsigned int count)
+{
+	auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(fs->fs_privdata);
+	struct EXT2_SUPERBLOCK* sb = &privdata->sb;
+	unsigned int group = (block - sb->s_first_data_block) / sb->s_blocks_per_group;
+	unsigned int bit = (block - sb->s_first_data_block) % sb->s_blocks_per_group;
+	KASSERT(bit + count <= ext2_blocks_in_group(privdata, group), "freeing blocks across blockgroups");
+
+	mutex_lock(&privdata->alloc_mtx);
+	uint8_t* bitmap;
+	errorcode_t err = ext2_get_bitmap(fs, group, false, &bitmap);
+	if (ananas_is_success(err)) {
+		for (unsigned int n = 0; n < count; n++) {
+			KASSERT(ext2_test_bit(bitmap, bit + n), "freeing free block %u", (int)(block + n));
+			ext2_clear_bit(bitmap, bit + n);
+		}
+		privdata->blockgroup[group].bg_free_blocks_count += count;
+		sb->s_free_blocks_count += count;
+		err = ext2_put_bitmap(fs, group, false);
+	}
+	mutex_unlock(&privdata->alloc_mtx);
+	return err;
+}
+
+/*
+ * Allocates an inode, preferably within blockgroup 'group'.
+ */
+static errorcode_t
+ext2_alloc_inode(struct VFS_MOUNTED_FS* fs, unsigned int group, ino_t* inum)
+{
+	auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(fs->fs_privdata);
+	struct EXT2_SUPERBLOCK* sb = &privdata->sb;
+
+	mutex_lock(&privdata->alloc_mtx);
+	errorcode_t err = ANANAS_ERROR(NO_SPACE);
+	for (unsigned int n = 0; n < privdata->num_blockgroups; n++, group = (group + 1) % privdata->num_blockgroups) {
+		struct EXT2_BLOCKGROUP* bg = &privdata->blockgroup[group];
+		if (bg->bg_free_inodes_count == 0)
+			continue;
+
+		uint8_t* bitmap;
+		err = ext2_get_bitmap(fs, group, true, &bitmap);
+		if (ananas_is_failure(err))
+			break;
+
+		/* Reserved inodes are marked as used by mkfs, so we needn't skip them */
+		int bit = ext2_find_clear_bit(bitmap, 0, sb->s_inodes_per_group);
+		if (bit < 0) {
+			err = ANANAS_ERROR(NO_SPACE);
+			continue;
+		}
+		ext2_set_bit(bitmap, bit);
+		bg->bg_free_inodes_count--;
+		sb->s_free_inodes_count--;
+		err = ext2_put_bitmap(fs, group, true);
+		*inum = group * sb->s_inodes_per_group + bit + 1;
+		break;
+	}
+	mutex_unlock(&privdata->alloc_mtx);
+	return err;
+}
+
+static errorcode_t
+ext2_free_inode(struct VFS_MOUNTED_FS* fs, ino_t inum)
+{
+	auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(fs->fs_privdata);
+	unsigned int group = (inum - 1) / privdata->sb.s_inodes_per_group;
+	unsigned int bit = (inum - 1) % privdata->sb.s_inodes_per_group;
+
+	mutex_lock(&privdata->alloc_mtx);
+	uint8_t* bitmap;
+	errorcode_t err = ext2_get_bitmap(fs, group, true, &bitmap);
+	if (ananas_is_success(err)) {
+		KASSERT(ext2_test_bit(bitmap, bit), "freeing free inode %u", (int)inum);
+		ext2_clear_bit(bitmap, bit);
+		privdata->blockgroup[group].bg_free_inodes_count++;
+		privdata->sb.s_free_inodes_count++;
+		err = ext2_put_bitmap(fs, group, true);
+	}
+	mutex_unlock(&privdata->alloc_mtx);
+	return err;
+}
+
+/* Returns any blocks preallocated for the inode to the free pool */
+static void
+ext2_release_prealloc(struct VFS_INODE* inode)
+{
+	auto in_privdata = static_cast<struct EXT2_INODE_PRIVDATA*>(inode->i_privdata);
+	if (in_privdata->prealloc_count == 0)
+		return;
+	ext2_free_blocks(inode->i_fs, in_privdata->prealloc_block, in_privdata->prealloc_count);
+	in_privdata->prealloc_count = 0;
+}
+
 static errorcode_t
 ext2_prepare_inode(struct VFS_INODE* inode)
 {
 	auto privdata = new EXT2_INODE_PRIVDATA;
 	memset(privdata, 0, sizeof(struct EXT2_INODE_PRIVDATA));
+	spinlock_init(&privdata->extent_lock);
 	inode->i_privdata = privdata;
 	return ananas_success();
 }
@@ -69,6 +380,7 @@ ext2_prepare_inode(struct VFS_INODE* inode)
 static void
 ext2_discard_inode(struct VFS_INODE* inode)
 {
+	ext2_release_prealloc(inode);
 	kfree(inode->i_privdata);
 }
 
@@ -87,6 +399,60 @@ ext2_dump_inode(struct EXT2_INODE* inode)
 }
 #endif
 
+/* Looks up file block 'block_in' in the cache of recently resolved runs */
+static bool
+ext2_extent_lookup(struct EXT2_INODE_PRIVDATA* privdata, blocknr_t block_in, blocknr_t* block_out)
+{
+	bool found = false;
+	spinlock_lock(&privdata->extent_lock);
+	for (unsigned int n = 0; n < EXT2_EXTENT_CACHE_SIZE; n++) {
+		struct EXT2_EXTENT* e = &privdata->extent[n];
+		if (block_in < e->e_logical || block_in >= e->e_logical + e->e_length)
+			continue;
+		*block_out = e->e_physical + (block_in - e->e_logical);
+		found = true;
+		break;
+	}
+	spinlock_unlock(&privdata->extent_lock);
+	return found;
+}
+
+static void
+ext2_extent_add(struct EXT2_INODE_PRIVDATA* privdata, blocknr_t logical, blocknr_t physical, blocknr_t length)
+{
+	spinlock_lock(&privdata->extent_lock);
+	/* If this continues an existing run, just extend it */
+	for (unsigned int n = 0; n < EXT2_EXTENT_CACHE_SIZE; n++) {
+		struct EXT2_EXTENT* e = &privdata->extent[n];
+		if (e->e_length == 0 || e->e_logical + e->e_length != logical || e->e_physical + e->e_length != physical)
+			continue;
+		e->e_length += length;
+		spinlock_unlock(&privdata->extent_lock);
+		return;
+	}
+
+	struct EXT2_EXTENT* e = &privdata->extent[privdata->extent_next];
+	privdata->extent_next = (privdata->extent_next + 1) % EXT2_EXTENT_CACHE_SIZE;
+	e->e_logical = logical;
+	e->e_physical = physical;
+	e->e_length = length;
+	spinlock_unlock(&privdata->extent_lock);
+}
+
+/*
+ * Returns the length of the run of consecutive disk blocks starting at
+ * entry 'index' of the block pointer array 'ptr', which has 'num' entries.
+ */
+static blocknr_t
+ext2_run_length(const uint32_t* ptr, unsigned int index, unsigned int num)
+{
+	blocknr_t first = EXT2_TO_LE32(ptr[index]);
+	blocknr_t length = 1;
+	while (index + length < num && EXT2_TO_LE32(ptr[index + length]) == first + length)
+		length++;
+	return length;
+}
+
 /*
  * Retrieves the disk block for a given file block. In ext2, the first 12 blocks
  * are direct blocks. Block 13 is the first indirect block and contains pointers to
@@ -101,44 +467,277 @@ ext2_dump_inode(struct EXT2_INODE* inode)
  * Block 15 is the triply-indirect block, which contains a block-pointer to
  * an doubly-indirect block. With an 1KB blocksize, each doubly-indirect block
  * contains X * X blocks, so we can store X * X * X = 16777216 blocks.
+ *
+ * Besides the disk block, this yields the number of blocks following it that
+ * are stored consecutively - as far as we can tell from the pointer block we
+ * used. Holes yield a disk block of 0.
  */
 static errorcode_t
-ext2_block_map(struct VFS_INODE* inode, blocknr_t block_in, blocknr_t* block_out, int create)
+ext2_resolve_block(struct VFS_INODE* inode, blocknr_t block_in, blocknr_t* block_out, blocknr_t* run_length)
 {
 	struct VFS_MOUNTED_FS* fs = inode->i_fs;
 	auto in_privdata = static_cast<struct EXT2_INODE_PRIVDATA*>(inode->i_privdata);
+	blocknr_t ptrs_per_block = fs->fs_block_size / sizeof(uint32_t);
 
 	/*
 	 * We need to figure out whether we have to look up the block in the single,
 	 * double or triply-linked block. From the comments above, we know that:
 	 *
 	 * (a) The first 12 blocks (0 .. 11) can directly be accessed.
-	 * (a) The first indirect block contains blocks 12 .. 12 + block_size / 4.
-	 * (b) The double-indirect block contains blocks 12 + block_size / 4 to
+	 * (b) The first indirect block contains blocks 12 .. 12 + block_size / 4.
+	 * (c) The double-indirect block contains blocks 12 + block_size / 4 to
 	 *     13 + (block_size / 4)^2
-	 * (c) The triple-indirect block contains everything else.
+	 * (d) The triple-indirect block contains everything else.
 	 */
 
 	/* (a) Direct blocks are easy */
 	if (block_in < 12) {
 		*block_out = in_privdata->block[block_in];
+		*run_length = 1;
+		while (block_in + *run_length < 12 && in_privdata->block[block_in + *run_length] == *block_out + *run_length)
+			(*run_length)++;
 		return ananas_success();
 	}
+	block_in -= 12;
+
+	/* Figure out how many levels of indirection we need to go through */
+	int level = 1;
+	blocknr_t level_blocks = ptrs_per_block;
+	blocknr_t block = in_privdata->block[12];
+	if (block_in >= level_blocks) {
+		/* (c) Not in the single-indirect block */
+		block_in -= level_blocks;
+		level_blocks *= ptrs_per_block;
+		level = 2;
+		block = in_privdata->block[13];
+		if (block_in >= level_blocks) {
+			/* (d) Not in the double-indirect block either */
+			block_in -= level_blocks;
+			level_blocks *= ptrs_per_block;
+			level = 3;
+			block = in_privdata->block[14];
+			if (block_in >= level_blocks)
+				return ANANAS_ERROR(BAD_RANGE);
+		}
+	}
+
+	/* Walk down the indirect blocks until we end up at the block containing our pointer */
+	while (true) {
+		if (block == 0) {
+			/* Hole; nothing has been allocated here */
+			*block_out = 0;
+			*run_length = 1;
+			return ananas_success();
+		}
+
+		level_blocks /= ptrs_per_block;
+		unsigned int index = block_in / level_blocks;
+		block_in %= level_blocks;
 
-	if (block_in < 12 + fs->fs_block_size / 4) {
-		/*
-		 * (b) Need to look up the block the first indirect block, 13.
-		 */
 		struct BIO* bio;
-		errorcode_t err = vfs_bread(fs, in_privdata->block[12], &bio);
+		errorcode_t err = vfs_bread(fs, block, &bio);
 		ANANAS_ERROR_RETURN(err);
-		*block_out = EXT2_TO_LE32(*(uint32_t*)(static_cast<char*>(BIO_DATA(bio)) + (block_in - 12) * sizeof(uint32_t)));
+		auto ptr = static_cast<const uint32_t*>(BIO_DATA(bio));
+		if (level == 1) {
+			*block_out = EXT2_TO_LE32(ptr[index]);
+			*run_length = (*block_out != 0) ? ext2_run_length(ptr, index, ptrs_per_block) : 1;
+			bio_free(bio);
+			return ananas_success();
+		}
+		block = EXT2_TO_LE32(ptr[index]);
 		bio_free(bio);
+		level--;
+	}
+
+	/* NOTREACHED */
+}
+
+/*
+ * Determines the block and offset within it where inode 'inum' is stored.
+ *
+ * Inode number zero does not exists within ext2 (or Linux for that matter),
+ * but it is considered wasteful to ignore an inode, so inode 1 maps to the
+ * first inode entry on disk...
+ */
+static void
+ext2_locate_inode(struct VFS_MOUNTED_FS* fs, ino_t inum, blocknr_t* block, unsigned int* offset)
+{
+	auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(fs->fs_privdata);
+	inum--;
+	KASSERT(inum < privdata->sb.s_inodes_count, "inode out of range");
+
+	/*
+	 * Every block group has a fixed number of inodes, so we can find the
+	 * blockgroup number and corresponding inode index within this blockgroup by
+	 * simple divide and modulo operations. These two are combined to figure out
+	 * the block we have to read.
+	 */
+	uint32_t bgroup = inum / privdata->sb.s_inodes_per_group;
+	uint32_t iindex = inum % privdata->sb.s_inodes_per_group;
+	*block = privdata->blockgroup[bgroup].bg_inode_table + (iindex * privdata->sb.s_inode_size) / fs->fs_block_size;
+	*offset = (iindex * privdata->sb.s_inode_size) % fs->fs_block_size;
+}
+
+/*
+ * Picks the disk block we would like to use for logical block 'block_in': the
+ * one following the disk block of the previous logical block, so that the file
+ * ends up being stored sequentially.
+ */
+static blocknr_t
+ext2_find_goal(struct VFS_INODE* inode, blocknr_t block_in)
+{
+	auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(inode->i_fs->fs_privdata);
+	auto in_privdata = static_cast<struct EXT2_INODE_PRIVDATA*>(inode->i_privdata);
+
+	if (block_in > 0) {
+		blocknr_t prev, run_length;
+		if (ext2_extent_lookup(in_privdata, block_in - 1, &prev))
+			return prev + 1;
+		if (ananas_is_success(ext2_resolve_block(inode, block_in - 1, &prev, &run_length)) && prev != 0)
+			return prev + 1;
+	}
+
+	/* Nothing to go by; use the blockgroup containing the inode */
+	unsigned int group = (inode->i_inum - 1) / privdata->sb.s_inodes_per_group;
+	return privdata->sb.s_first_data_block + group * privdata->sb.s_blocks_per_group;
+}
+
+/*
+ * Allocates a single zero-filled block for the inode, close to 'goal'. We
+ * reserve a few blocks beyond it, so that a file which keeps growing is
+ * stored contiguously even if other files are written at the same time.
+ */
+static errorcode_t
+ext2_alloc_inode_block(struct VFS_INODE* inode, blocknr_t goal, blocknr_t* block)
+{
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
+	auto in_privdata = static_cast<struct EXT2_INODE_PRIVDATA*>(inode->i_privdata);
+
+	if (in_privdata->prealloc_count > 0 && in_privdata->prealloc_block == goal) {
+		*block = in_privdata->prealloc_block++;
+		in_privdata->prealloc_count--;
+	} else {
+		/* Not writing where we expected; no use holding on to the reservation */
+		ext2_release_prealloc(inode);
+
+		unsigned int count = 0;
+		errorcode_t err = ext2_alloc_blocks(fs, goal, 1 + EXT2_PREALLOC_BLOCKS, block, &count);
+		ANANAS_ERROR_RETURN(err);
+		in_privdata->prealloc_block = *block + 1;
+		in_privdata->prealloc_count = count - 1;
+	}
+	inode->i_sb.st_blocks += fs->fs_block_size / 512;
+
+	/* Never expose whatever the block contained before */
+	struct BIO* bio;
+	errorcode_t err = vfs_bget(fs, *block, &bio, BIO_READ_NODATA);
+	ANANAS_ERROR_RETURN(err);
+	memset(BIO_DATA(bio), 0, fs->fs_block_size);
+	bio_set_dirty(bio);
+	bio_free(bio);
+	return ananas_success();
+}
+
+/*
+ * Allocates a disk block for logical block 'block_in', which must not be
+ * mapped yet, along with any indirect blocks needed to reach it. The caller
+ * must mark the inode as dirty.
+ */
+static errorcode_t
+ext2_map_new_block(struct VFS_INODE* inode, blocknr_t block_in, blocknr_t* block_out)
+{
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
+	auto in_privdata = static_cast<struct EXT2_INODE_PRIVDATA*>(inode->i_privdata);
+	blocknr_t ptrs_per_block = fs->fs_block_size / sizeof(uint32_t);
+	blocknr_t goal = ext2_find_goal(inode, block_in);
+
+	/* Figure out the pointer in the inode which leads to our block, as in ext2_resolve_block() */
+	int level = 0;
+	blocknr_t level_blocks = 1;
+	blocknr_t* slot;
+	if (block_in < 12) {
+		slot = &in_privdata->block[block_in];
+	} else {
+		block_in -= 12;
+		level = 1;
+		level_blocks = ptrs_per_block;
+		slot = &in_privdata->block[12];
+		if (block_in >= level_blocks) {
+			block_in -= level_blocks;
+			level_blocks *= ptrs_per_block;
+			level = 2;
+			slot = &in_privdata->block[13];
+			if (block_in >= level_blocks) {
+				block_in -= level_blocks;
+				level_blocks *= ptrs_per_block;
+				level = 3;
+				slot = &in_privdata->block[14];
+				if (block_in >= level_blocks)
+					return ANANAS_ERROR(BAD_RANGE);
+			}
+		}
+	}
+
+	blocknr_t block = *slot;
+	if (block == 0) {
+		errorcode_t err = ext2_alloc_inode_block(inode, goal, &block);
+		ANANAS_ERROR_RETURN(err);
+		*slot = block;
+		goal = block + 1;
+	}
+
+	/* Walk down the indirect blocks, filling any gaps as we go */
+	for (/* nothing */; level > 0; level--) {
+		level_blocks /= ptrs_per_block;
+		unsigned int index = block_in / level_blocks;
+		block_in %= level_blocks;
+
+		struct BIO* bio;
+		errorcode_t err = vfs_bread(fs, block, &bio);
+		ANANAS_ERROR_RETURN(err);
+		auto ptr = static_cast<uint32_t*>(BIO_DATA(bio));
+		block = EXT2_TO_LE32(ptr[index]);
+		if (block == 0) {
+			err = ext2_alloc_inode_block(inode, goal, &block);
+			if (ananas_is_failure(err)) {
+				bio_free(bio);
+				return err;
+			}
+			ptr[index] = EXT2_TO_LE32(block);
+			bio_set_dirty(bio);
+			goal = block + 1;
+		}
+		bio_free(bio);
+	}
+
+	*block_out = block;
+	return ananas_success();
+}
+
+static errorcode_t
+ext2_block_map(struct VFS_INODE* inode, blocknr_t block_in, blocknr_t* block_out, int create)
+{
+	auto in_privdata = static_cast<struct EXT2_INODE_PRIVDATA*>(inode->i_privdata);
+
+	/* Sequential access will generally hit a run we have already resolved */
+	if (ext2_extent_lookup(in_privdata, block_in, block_out))
 		return ananas_success();
+
+	blocknr_t run_length;
+	errorcode_t err = ext2_resolve_block(inode, block_in, block_out, &run_length);
+	ANANAS_ERROR_RETURN(err);
+
+	if (*block_out == 0 && create) {
+		if (!ext2_is_writable(static_cast<struct EXT2_FS_PRIVDATA*>(inode->i_fs->fs_privdata)))
+			return ANANAS_ERROR(READ_ONLY);
+		err = ext2_map_new_block(inode, block_in, block_out);
+		ANANAS_ERROR_RETURN(err);
+		run_length = 1;
 	}
 
-	panic("ext2_block_map() needs support for doubly/triple indirect blocks!");
-	return ANANAS_ERROR(BAD_RANGE);
+	if (*block_out != 0)
+		ext2_extent_add(in_privdata, block_in, *block_out, run_length);
+	return ananas_success();
 }
 
 static errorcode_t
@@ -208,14 +807,450 @@ ext2_readdir(struct VFS_FILE* file, void* dirents, size_t* len)
 	return ananas_success();
 }
 
+/*
+ * Hashed directories (dir_index, also known as htree): the first block of an
+ * indexed directory contains a tree which maps hash ranges of the names to
+ * the directory blocks holding them. This means we only have to read the
+ * index and a single leaf block to find a name. The hash functions must
+ * match the ones Linux uses.
+ */
+#define EXT2_DX_TEA_DELTA 0x9e3779b9
+#define EXT2_DX_HASH_EOF 0x7fffffffU
+
+static inline uint32_t
+ext2_dx_rol32(uint32_t v, int s)
+{
+	return (v << s) | (v >> (32 - s));
+}
+
+static inline uint32_t
+ext2_dx_char(const char* s, int i, bool is_unsigned)
+{
+	return is_unsigned ? (uint32_t)(unsigned char)s[i] : (uint32_t)(int)(signed char)s[i];
+}
+
+static uint32_t
+ext2_dx_hash_legacy(const char* name, int len, bool is_unsigned)
+{
+	uint32_t hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+	for (int i = 0; i < len; i++) {
+		uint32_t hash = hash1 + (hash0 ^ (ext2_dx_char(name, i, is_unsigned) * 7152373));
+		if (hash & 0x80000000)
+			hash -= 0x7fffffff;
+		hash1 = hash0;
+		hash0 = hash;
+	}
+	return hash0 << 1;
+}
+
+static void
+ext2_dx_str2hashbuf(const char* msg, int len, uint32_t* buf, int num, bool is_unsigned)
+{
+	uint32_t pad = (uint32_t)len | ((uint32_t)len << 8);
+	pad |= pad << 16;
+
+	uint32_t val = pad;
+	if (len > num * 4)
+		len = num * 4;
+	for (int i = 0; i < len; i++) {
+		val = ext2_dx_char(msg, i, is_unsigned) + (val << 8);
+		if ((i % 4) == 3) {
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+	if (--num >= 0)
+		*buf++ = val;
+	while (--num >= 0)
+		*buf++ = pad;
+}
+
+static void
+ext2_dx_half_md4(uint32_t buf[4], const uint32_t in[8])
+{
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = ext2_dx_rol32(a, s))
+#define K2 013240474631U
+#define K3 015666365641U
+	uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	ROUND(F, a, b, c, d, in[0],  3);
+	ROUND(F, d, a, b, c, in[1],  7);
+	ROUND(F, c, d, a, b, in[2], 11);
+	ROUND(F, b, c, d, a, in[3], 19);
+	ROUND(F, a, b, c, d, in[4],  3);
+	ROUND(F, d, a, b, c, in[5],  7);
+	ROUND(F, c, d, a, b, in[6], 11);
+	ROUND(F, b, c, d, a, in[7], 19);
+
+	ROUND(G, a, b, c, d, in[1] + K2,  3);
+	ROUND(G, d, a, b, c, in[3] + K2,  5);
+	ROUND(G, c, d, a, b, in[5] + K2,  9);
+	ROUND(G, b, c, d, a, in[7] + K2, 13);
+	ROUND(G, a, b, c, d, in[0] + K2,  3);
+	ROUND(G, d, a, b, c, in[2] + K2,  5);
+	ROUND(G, c, d, a, b, in[4] + K2,  9);
+	ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+	ROUND(H, a, b, c, d, in[3] + K3,  3);
+	ROUND(H, d, a, b, c, in[7] + K3,  9);
+	ROUND(H, c, d, a, b, in[2] + K3, 11);
+	ROUND(H, b, c, d, a, in[6] + K3, 15);
+	ROUND(H, a, b, c, d, in[1] + K3,  3);
+	ROUND(H, d, a, b, c, in[5] + K3,  9);
+	ROUND(H, c, d, a, b, in[0] + K3, 11);
+	ROUND(H, b, c, d, a, in[4] + K3, 15);
+
+	buf[0] += a; buf[1] += b; buf[2] += c; buf[3] += d;
+#undef K3
+#undef K2
+#undef ROUND
+#undef H
+#undef G
+#undef F
+}
+
+static void
+ext2_dx_tea(uint32_t buf[4], const uint32_t in[4])
+{
+	uint32_t sum = 0;
+	uint32_t b0 = buf[0], b1 = buf[1];
+	for (int n = 0; n < 16; n++) {
+		sum += EXT2_DX_TEA_DELTA;
+		b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+		b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
+	}
+	buf[0] += b0;
+	buf[1] += b1;
+}
+
+static uint32_t
+ext2_dx_hash(struct EXT2_FS_PRIVDATA* privdata, int version, const char* name, int len)
+{
+	bool is_unsigned = (privdata->sb.s_flags & EXT2_FLAGS_UNSIGNED_HASH) != 0;
+
+	/* Use the filesystem's seed, unless it isn't set */
+	uint32_t buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	bool have_seed = false;
+	for (unsigned int n = 0; n < 4; n++)
+		if (privdata->sb.s_hash_seed[n] != 0)
+			have_seed = true;
+	if (have_seed) {
+		for (unsigned int n = 0; n < 4; n++)
+			buf[n] = EXT2_TO_LE32(privdata->sb.s_hash_seed[n]);
+	}
+
+	uint32_t hash, in[8];
+	switch(version) {
+		case EXT2_DX_HASH_LEGACY:
+			hash = ext2_dx_hash_legacy(name, len, is_unsigned);
+			break;
+		case EXT2_DX_HASH_HALF_MD4:
+			for (/* nothing */; len > 0; len -= 32, name += 32) {
+				ext2_dx_str2hashbuf(name, len, in, 8, is_unsigned);
+				ext2_dx_half_md4(buf, in);
+			}
+			hash = buf[1];
+			break;
+		default: /* EXT2_DX_HASH_TEA */
+			for (/* nothing */; len > 0; len -= 16, name += 16) {
+				ext2_dx_str2hashbuf(name, len, in, 4, is_unsigned);
+				ext2_dx_tea(buf, in);
+			}
+			hash = buf[0];
+			break;
+	}
+
+	/* The lowest bit is used to mark hash collisions in the index */
+	hash &= ~1;
+	if (hash == (EXT2_DX_HASH_EOF << 1))
+		hash = (EXT2_DX_HASH_EOF - 1) << 1;
+	return hash;
+}
+
+static errorcode_t
+ext2_read_dir_block(struct VFS_INODE* inode, blocknr_t logical, struct BIO** bio)
+{
+	blocknr_t block;
+	errorcode_t err = ext2_block_map(inode, logical, &block, 0);
+	ANANAS_ERROR_RETURN(err);
+	if (block == 0)
+		return ANANAS_ERROR(BAD_RANGE); /* directories have no holes */
+	return vfs_bread(inode->i_fs, block, bio);
+}
+
+/*
+ * Scans a single directory block for 'name'; sets inum to zero if it is not there.
+ */
+static errorcode_t
+ext2_search_dir_block(struct VFS_INODE* inode, blocknr_t logical, const char* name, size_t name_len, uint32_t* inum)
+{
+	struct BIO* bio;
+	errorcode_t err = ext2_read_dir_block(inode, logical, &bio);
+	ANANAS_ERROR_RETURN(err);
+
+	*inum = 0;
+	uint32_t block_size = inode->i_fs->fs_block_size;
+	for (uint32_t offset = 0; offset + sizeof(struct EXT2_DIRENTRY) <= block_size; /* nothing */) {
+		auto ext2de = reinterpret_cast<struct EXT2_DIRENTRY*>(static_cast<char*>(BIO_DATA(bio)) + offset);
+		uint16_t rec_len = EXT2_TO_LE16(ext2de->rec_len);
+		if (rec_len == 0)
+			break; /* corrupt; don't loop forever */
+		if (EXT2_TO_LE32(ext2de->inode) != 0 && ext2de->name_len == name_len && memcmp(ext2de->name, name, name_len) == 0) {
+			*inum = EXT2_TO_LE32(ext2de->inode);
+			break;
+		}
+		offset += rec_len;
+	}
+	bio_free(bio);
+	return ananas_success();
+}
+
+/*
+ * Walks the directory index to find 'name'; sets inum to zero if the name is
+ * not in the directory. Returns an error if the index cannot be used, in which
+ * case the caller should scan the directory instead.
+ */
+static errorcode_t
+ext2_dx_lookup(struct VFS_INODE* inode, const char* name, uint32_t* inum)
+{
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
+	auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(fs->fs_privdata);
+	size_t name_len = strlen(name);
+
+	struct BIO* bio;
+	errorcode_t err = ext2_read_dir_block(inode, 0, &bio);
+	ANANAS_ERROR_RETURN(err);
+
+	/* The root information lives after the '.' (12 bytes) and '..' (12 bytes) entries */
+	auto data = static_cast<char*>(BIO_DATA(bio));
+	auto info = reinterpret_cast<struct EXT2_DX_ROOT_INFO*>(data + 24);
+	if (info->reserved_zero != 0 || info->hash_version > EXT2_DX_HASH_TEA || info->indirect_levels > 1) {
+		bio_free(bio);
+		return ANANAS_ERROR(UNSUPPORTED);
+	}
+	uint32_t hash = ext2_dx_hash(privdata, info->hash_version, name, name_len);
+	unsigned int levels = info->indirect_levels;
+	auto entries = reinterpret_cast<struct EXT2_DX_ENTRY*>(data + 24 + info->info_length);
+
+	while (true) {
+		auto cl = reinterpret_cast<struct EXT2_DX_COUNTLIMIT*>(entries);
+		unsigned int count = EXT2_TO_LE16(cl->count);
+		unsigned int limit = EXT2_TO_LE16(cl->limit);
+		if (count == 0 || count > limit || reinterpret_cast<char*>(entries + limit) > data + fs->fs_block_size) {
+			bio_free(bio);
+			return ANANAS_ERROR(UNSUPPORTED);
+		}
+
+		/* Locate the last entry whose hash is not above ours; entry 0 covers everything below entry 1 */
+		unsigned int lo = 1, hi = count;
+		while (lo < hi) {
+			unsigned int mid = (lo + hi) / 2;
+			if (EXT2_TO_LE32(entries[mid].hash) > hash)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		unsigned int idx = lo - 1;
+		blocknr_t block = EXT2_TO_LE32(entries[idx].block) & 0x0fffffff;
+
+		if (levels == 0) {
+			/*
+			 * This is the block containing our name, if it exists. However, if the
+			 * next leaf starts with the same hash (the collision bit is set), the
+			 * name may live there instead.
+			 */
+			while (true) {
+				err = ext2_search_dir_block(inode, block, name, name_len, inum);
+				if (ananas_is_failure(err) || *inum != 0)
+					break;
+				if (++idx >= count)
+					break;
+				uint32_t next_hash = EXT2_TO_LE32(entries[idx].hash);
+				if ((next_hash & 1) == 0 || (next_hash & ~1) != hash)
+					break;
+				block = EXT2_TO_LE32(entries[idx].block) & 0x0fffffff;
+			}
+			bio_free(bio);
+			return err;
+		}
+
+		/* Descend into the next level; these nodes start with an empty 8-byte directory entry */
+		bio_free(bio);
+		err = ext2_read_dir_block(inode, block, &bio);
+		ANANAS_ERROR_RETURN(err);
+		data = static_cast<char*>(BIO_DATA(bio));
+		entries = reinterpret_cast<struct EXT2_DX_ENTRY*>(data + 8);
+		levels--;
+	}
+
+	/* NOTREACHED */
+}
+
+static errorcode_t
+ext2_lookup(struct DENTRY* parent, struct VFS_INODE** destinode, const char* dentry)
+{
+	struct VFS_INODE* inode = parent->d_inode;
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
+	auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(fs->fs_privdata);
+	auto in_privdata = static_cast<struct EXT2_INODE_PRIVDATA*>(inode->i_privdata);
+
+	if ((privdata->sb.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) && (in_privdata->flags & EXT2_INDEX_FL)) {
+		uint32_t inum = 0;
+		errorcode_t err = ext2_dx_lookup(inode, dentry, &inum);
+		if (ananas_is_success(err)) {
+			if (inum == 0)
+				return ANANAS_ERROR(NO_FILE);
+			return vfs_get_inode(fs, inum, destinode);
+		}
+		/* Index cannot be used; scan the entire directory instead */
+	}
+	return vfs_generic_lookup(parent, destinode, dentry);
+}
+
+/* Length of a directory entry holding a name of 'len' bytes */
+#define EXT2_DIRENT_LEN(len) ((sizeof(struct EXT2_DIRENTRY) + (len) + 3) & ~3)
+
+/*
+ * Adds a directory entry for inode 'inum' to directory 'dir'. We use the first
+ * entry with sufficient slack space; if there is none, the directory grows.
+ */
+static errorcode_t
+ext2_add_dirent(struct VFS_INODE* dir, const char* name, size_t name_len, ino_t inum, uint8_t file_type)
+{
+	struct VFS_MOUNTED_FS* fs = dir->i_fs;
+	auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(fs->fs_privdata);
+	auto in_privdata = static_cast<struct EXT2_INODE_PRIVDATA*>(dir->i_privdata);
+	unsigned int needed = EXT2_DIRENT_LEN(name_len);
+
+	/* Without the filetype feature, this byte is part of the name length */
+	if ((privdata->sb.s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE) == 0)
+		file_type = 0;
+
+	struct BIO* bio = NULL;
+	struct EXT2_DIRENTRY* ext2de = NULL;
+	blocknr_t num_blocks = dir->i_sb.st_size / fs->fs_block_size;
+	for (blocknr_t logical = 0; ext2de == NULL && logical < num_blocks; logical++) {
+		errorcode_t err = ext2_read_dir_block(dir, logical, &bio);
+		ANANAS_ERROR_RETURN(err);
+
+		auto data = static_cast<char*>(BIO_DATA(bio));
+		for (uint32_t offset = 0; offset + sizeof(struct EXT2_DIRENTRY) <= fs->fs_block_size; /* nothing */) {
+			auto cur = reinterpret_cast<struct EXT2_DIRENTRY*>(data + offset);
+			unsigned int rec_len = EXT2_TO_LE16(cur->rec_len);
+			if (rec_len == 0)
+				break; /* corrupt; don't loop forever */
+			unsigned int used = (EXT2_TO_LE32(cur->inode) != 0) ? EXT2_DIRENT_LEN(cur->name_len) : 0;
+			if (rec_len >= used + needed) {
+				if (used == 0) {
+					/* Unused entry; just take it over */
+					ext2de = cur;
+				} else {
+					/* Split the slack off into an entry of its own */
+					cur->rec_len = EXT2_TO_LE16(used);
+					ext2de = reinterpret_cast<struct EXT2_DIRENTRY*>(data + offset + used);
+					ext2de->rec_len = EXT2_TO_LE16(rec_len - used);
+				}
+				break;
+			}
+			offset += rec_len;
+		}
+		if (ext2de == NULL)
+			bio_free(bio);
+	}
+
+	if (ext2de == NULL) {
+		/* No room anywhere; add a block - ext2_block_map() will have zeroed it */
+		blocknr_t block;
+		errorcode_t err = ext2_block_map(dir, num_blocks, &block, 1);
+		ANANAS_ERROR_RETURN(err);
+		err = vfs_bread(fs, block, &bio);
+		ANANAS_ERROR_RETURN(err);
+		ext2de = static_cast<struct EXT2_DIRENTRY*>(BIO_DATA(bio));
+		ext2de->rec_len = EXT2_TO_LE16(fs->fs_block_size);
+		dir->i_sb.st_size += fs->fs_block_size;
+	}
+
+	ext2de->inode = EXT2_TO_LE32(inum);
+	ext2de->name_len = name_len;
+	ext2de->file_type = file_type;
+	memcpy(ext2de->name, name, name_len);
+	bio_set_dirty(bio);
+	bio_free(bio);
+
+	/*
+	 * We do not maintain the directory index, so it is stale now; like Linux'
+	 * ext2 does, drop the index flag so that nothing will use it anymore.
+	 */
+	in_privdata->flags &= ~EXT2_INDEX_FL;
+	vfs_set_inode_dirty(dir);
+	return ananas_success();
+}
+
+static errorcode_t
+ext2_create(struct VFS_INODE* dir, struct DENTRY* de, int mode)
+{
+	struct VFS_MOUNTED_FS* fs = dir->i_fs;
+	auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(fs->fs_privdata);
+	if (!ext2_is_writable(privdata))
+		return ANANAS_ERROR(READ_ONLY);
+
+	size_t name_len = strlen(de->d_entry);
+	if (name_len == 0 || name_len > 255)
+		return ANANAS_ERROR(BAD_LENGTH);
+
+	/* Keep the inode close to its directory */
+	ino_t inum = 0;
+	errorcode_t err = ext2_alloc_inode(fs, (dir->i_inum - 1) / privdata->sb.s_inodes_per_group, &inum);
+	ANANAS_ERROR_RETURN(err);
+
+	/* Initialize the on-disk inode; XXX we have no clock, so all timestamps are zero */
+	blocknr_t block;
+	unsigned int idx;
+	ext2_locate_inode(fs, inum, &block, &idx);
+	struct BIO* bio;
+	err = vfs_bread(fs, block, &bio);
+	if (ananas_is_failure(err)) {
+		ext2_free_inode(fs, inum);
+		return err;
+	}
+	auto ext2inode = reinterpret_cast<struct EXT2_INODE*>(static_cast<char*>(BIO_DATA(bio)) + idx);
+	memset(ext2inode, 0, privdata->sb.s_inode_size);
+	ext2inode->i_mode = EXT2_TO_LE16(EXT2_S_IFREG | (mode & 0777));
+	ext2inode->i_links_count = EXT2_TO_LE16(1);
+	bio_set_dirty(bio);
+	bio_free(bio);
+
+	/* Hook the new file to the directory */
+	err = ext2_add_dirent(dir, de->d_entry, name_len, inum, EXT2_FT_REG_FILE);
+	if (ananas_is_failure(err)) {
+		ext2_free_inode(fs, inum);
+		return err;
+	}
+
+	/* And obtain it */
+	struct VFS_INODE* inode;
+	err = vfs_get_inode(fs, inum, &inode);
+	ANANAS_ERROR_RETURN(err);
+
+	/* Almost done - hook it to the dentry */
+	dcache_set_inode(de, inode);
+	return ananas_success();
+}
+
 static struct VFS_INODE_OPS ext2_file_ops = {
+	.block_map = ext2_block_map,
 	.read = vfs_generic_read,
-	.block_map = ext2_block_map
+	.write = vfs_generic_write
 };
 
 static struct VFS_INODE_OPS ext2_dir_ops = {
 	.readdir = ext2_readdir,
-	.lookup = vfs_generic_lookup
+	.lookup = ext2_lookup,
+	.create = ext2_create
 };
 
 /*
@@ -225,35 +1260,18 @@ static errorcode_t
 ext2_read_inode(struct VFS_INODE* inode, ino_t inum)
 {
 	struct VFS_MOUNTED_FS* fs = inode->i_fs;
-	struct EXT2_FS_PRIVDATA* privdata = (struct EXT2_FS_PRIVDATA*)inode->i_fs->fs_privdata;
-
-	/*
-	 * Inode number zero does not exists within ext2 (or Linux for that matter),
-	 * but it is considered wasteful to ignore an inode, so inode 1 maps to the
-	 * first inode entry on disk...
-	 */
-	inum--;
-	KASSERT(inum < privdata->sb.s_inodes_count, "inode out of range");
-
-	/*
-	 * Every block group has a fixed number of inodes, so we can find the
-	 * blockgroup number and corresponding inode index within this blockgroup by
-	 * simple divide and modulo operations. These two are combined to figure out
-	 * the block we have to read.
-	 */
-	uint32_t bgroup = inum / privdata->sb.s_inodes_per_group;
-	uint32_t iindex = inum % privdata->sb.s_inodes_per_group;
-	blocknr_t block = privdata->blockgroup[bgroup].bg_inode_table + (iindex * privdata->sb.s_inode_size) / fs->fs_block_size;
 
 	/* Fetch the block and make a pointer to the inode */
+	blocknr_t block;
+	unsigned int idx;
+	ext2_locate_inode(fs, inum, &block, &idx);
 	struct BIO* bio;
 	errorcode_t err = vfs_bread(fs, block, &bio);
 	ANANAS_ERROR_RETURN(err);
-	unsigned int idx = (iindex * privdata->sb.s_inode_size) % fs->fs_block_size;
 	auto ext2inode = reinterpret_cast<struct EXT2_INODE*>(static_cast<char*>(BIO_DATA(bio)) + idx);
 
 	/* Fill the stat buffer with date */
-	inode->i_sb.st_ino    = inum;
+	inode->i_sb.st_ino    = inum - 1;
 	inode->i_sb.st_mode   = EXT2_TO_LE16(ext2inode->i_mode);
 	inode->i_sb.st_nlink  = EXT2_TO_LE16(ext2inode->i_links_count);
 	inode->i_sb.st_uid    = EXT2_TO_LE16(ext2inode->i_uid);
@@ -271,6 +1289,7 @@ ext2_read_inode(struct VFS_INODE* inode, ino_t inum)
 	auto iprivdata = static_cast<struct EXT2_INODE_PRIVDATA*>(inode->i_privdata);
 	for (unsigned int i = 0; i < EXT2_INODE_BLOCKS; i++)
 		iprivdata->block[i] = EXT2_TO_LE32(ext2inode->i_block[i]);
+	iprivdata->flags = EXT2_TO_LE32(ext2inode->i_flags);
 
 	/* Fill out the inode operations - this depends on the inode type */
 	uint16_t imode = EXT2_TO_LE16(ext2inode->i_mode);
@@ -287,6 +1306,41 @@ ext2_read_inode(struct VFS_INODE* inode, ino_t inum)
 	return ananas_success();
 }
 
+/*
+ * Writes an inode back to disk.
+ */
+static errorcode_t
+ext2_write_inode(struct VFS_INODE* inode)
+{
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
+	auto iprivdata = static_cast<struct EXT2_INODE_PRIVDATA*>(inode->i_privdata);
+
+	blocknr_t block;
+	unsigned int idx;
+	ext2_locate_inode(fs, inode->i_inum, &block, &idx);
+	struct BIO* bio;
+	errorcode_t err = vfs_bread(fs, block, &bio);
+	ANANAS_ERROR_RETURN(err);
+	auto ext2inode = reinterpret_cast<struct EXT2_INODE*>(static_cast<char*>(BIO_DATA(bio)) + idx);
+
+	ext2inode->i_mode        = EXT2_TO_LE16(inode->i_sb.st_mode);
+	ext2inode->i_links_count = EXT2_TO_LE16(inode->i_sb.st_nlink);
+	ext2inode->i_uid         = EXT2_TO_LE16(inode->i_sb.st_uid);
+	ext2inode->i_gid         = EXT2_TO_LE16(inode->i_sb.st_gid);
+	ext2inode->i_atime       = EXT2_TO_LE32(inode->i_sb.st_atime);
+	ext2inode->i_mtime       = EXT2_TO_LE32(inode->i_sb.st_mtime);
+	ext2inode->i_ctime       = EXT2_TO_LE32(inode->i_sb.st_ctime);
+	ext2inode->i_blocks      = EXT2_TO_LE32(inode->i_sb.st_blocks);
+	ext2inode->i_size        = EXT2_TO_LE32(inode->i_sb.st_size); /* XXX no large file support */
+	for (unsigned int i = 0; i < EXT2_INODE_BLOCKS; i++)
+		ext2inode->i_block[i] = EXT2_TO_LE32(iprivdata->block[i]);
+	ext2inode->i_flags       = EXT2_TO_LE32(iprivdata->flags);
+
+	bio_set_dirty(bio);
+	bio_free(bio);
+	return ananas_success();
+}
+
 static errorcode_t
 ext2_mount(struct VFS_MOUNTED_FS* fs, struct VFS_INODE** root_inode)
 {
@@ -316,6 +1370,11 @@ ext2_mount(struct VFS_MOUNTED_FS* fs, struct VFS_INODE** root_inode)
 
 	privdata->num_blockgroups = (sb->s_blocks_count - sb->s_first_data_block - 1) / sb->s_blocks_per_group + 1;
 	privdata->blockgroup = new EXT2_BLOCKGROUP[privdata->num_blockgroups];
+	mutex_init(&privdata->alloc_mtx, "ext2alloc");
+	privdata->block_bitmap = new uint8_t*[privdata->num_blockgroups];
+	privdata->inode_bitmap = new uint8_t*[privdata->num_blockgroups];
+	memset(privdata->block_bitmap, 0, privdata->num_blockgroups * sizeof(uint8_t*));
+	memset(privdata->inode_bitmap, 0, privdata->num_blockgroups * sizeof(uint8_t*));
 
 	/* Fill out filesystem fields */
 	fs->fs_block_size = 1024L << sb->s_log_block_size;
@@ -369,7 +1428,8 @@ static struct VFS_FILESYSTEM_OPS fsops_ext2 = {
 	.mount = ext2_mount,
 	.prepare_inode = ext2_prepare_inode,
 	.discard_inode = ext2_discard_inode,
-	.read_inode = ext2_read_inode
+	.read_inode = ext2_read_inode,
+	.write_inode = ext2_write_inode
 };
 
 static struct VFS_FILESYSTEM fs_ext2 = {
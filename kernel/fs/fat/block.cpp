@@ -9,6 +9,7 @@
 #include <ananas/schedule.h>
 #include <ananas/trace.h>
 #include <ananas/lib.h>
+#include <ananas/mm.h>
 #include "fatfs.h"
 #include "block.h"
 
@@ -47,199 +48,283 @@ fat_make_cluster_block_offset(struct VFS_MOUNTED_FS* fs, uint32_t cluster, block
 }
 
 /*
- * Used to obtain the clusternum'th cluster of a file starting at
- * first_cluster. Returns BAD_RANGE error if end-of-file was found (but
- * cluster_out will be set to the final cluster found_
+ * Every inode keeps the part of its cluster chain we have seen so far as a
+ * list of extents, i.e. runs of consecutive clusters, sorted by their index
+ * within the file. FAT filesystems are usually not too fragmented, so this
+ * list stays short. It is filled lazily by walking the chain on disk up to
+ * the cluster that is needed; all functions below must be called with the
+ * inode's extent_mtx held.
  */
-static errorcode_t
-fat_get_cluster(struct VFS_MOUNTED_FS* fs, uint32_t first_cluster, uint32_t clusternum, uint32_t* cluster_out)
+static void
+fat_extent_append(struct FAT_INODE_PRIVDATA* privdata, uint32_t cluster)
 {
-	auto fs_privdata = static_cast<struct FAT_FS_PRIVDATA*>(fs->fs_privdata);
-	uint32_t cur_cluster = first_cluster;
-
-	/*
-	 * First of all, look through our cache. XXX linear search.
-	 *
-	 * We assume the cache items will never be removed while we are working with
-	 * the file because it will remain referenced - we throw away the cache items
-	 * when the inode is freed.
-	 *
-	 * Note that we explicitely _do not_ cache cluster -1; it is used to find the
-	 * final cluster of the FAT chain.
-	 */
-try_cache: ; /* dummy ; to keep gcc happy */
-	int create = 0, found = 0;
-	struct FAT_CLUSTER_CACHEITEM* ci = NULL;
-	struct FAT_CLUSTER_CACHEITEM* ci_closest = NULL;
-	if (clusternum != -1) {
-		spinlock_lock(&fs_privdata->spl_cache);
-		for(int cache_item = 0; cache_item < FAT_NUM_CACHEITEMS; cache_item++) {
-			ci = &fs_privdata->cluster_cache[cache_item];
-			if (ci->f_clusterno == 0) {
-				/* Found empty item - use it (we assume this always occurs at the end of the items) */
-				create++;
-				ci->f_clusterno = first_cluster;
-				ci->f_index = clusternum;
-				ci->f_nextcluster = 0;
-				break;
-			}
-			if (ci->f_clusterno == first_cluster) {
-				if (ci->f_index == clusternum) {
-					/* Got it */
-					found++;
-					break;
-				}
-
-				/*
-				 * Cluster is fine, but index isn't. Attempt to use this item as a base;
-				 * the less items we'll have to walk through, the better.
-				 */
-				if (ci->f_index < clusternum && (ci_closest == NULL || ci->f_index > ci_closest->f_index))
-					ci_closest = ci;
-			}
-		}
-		/*
-		 * If we need to do a lookup, use the closest item as base; we do this
-		 * while holding the lock to ensure the item won't vanish.
-		 */
-		if (create && !found && ci_closest != NULL) {
-			cur_cluster = ci_closest->f_nextcluster;
-			clusternum -= ci_closest->f_index;
-		}
-		spinlock_unlock(&fs_privdata->spl_cache);
-
-		if (create == 0 && found == 0) {
-			/*
-			 * Out of cache items; we'll just throw away all cached clusters of this
-			 * item. If this doesn't work, we'll just overwrite the first item XXX
-			 */
-			if (fat_clear_cache(fs, first_cluster))
-				goto try_cache;
-			ci = &fs_privdata->cluster_cache[0];
-			ci->f_clusterno = first_cluster;
-			ci->f_index = clusternum;
-			ci->f_nextcluster = 0;
-			create++;
-			kprintf("fat_get_cluster(): sacrificed first cache block\n");
+	if (privdata->num_extents > 0) {
+		struct FAT_EXTENT* e = &privdata->extent[privdata->num_extents - 1];
+		if (e->e_cluster + e->e_length == cluster) {
+			/* Continues the final run */
+			e->e_length++;
+			return;
 		}
 	}
 
-	/*
-	 * If we are not creating, yet the next cluster value is zero, someone else is
-	 * looking up the item, we need to spin.
-	 */
-	if (ci != NULL && create == 0) {
-		while (ci->f_nextcluster == 0) {
-			kprintf("fat_get_cluster(): pending cluster found, waiting...\n");
-			reschedule();
+	if (privdata->num_extents == privdata->max_extents) {
+		unsigned int max_extents = (privdata->max_extents > 0) ? privdata->max_extents * 2 : 4;
+		auto extent = new FAT_EXTENT[max_extents];
+		if (privdata->extent != NULL) {
+			memcpy(extent, privdata->extent, privdata->num_extents * sizeof(struct FAT_EXTENT));
+			kfree(privdata->extent);
 		}
-		if (ci->f_nextcluster == -1)
-			return ANANAS_ERROR(BAD_RANGE);
-		*cluster_out = ci->f_nextcluster;
-		return ananas_success();
+		privdata->extent = extent;
+		privdata->max_extents = max_extents;
 	}
 
-	/* Not in the cache; we'll need to traverse the disk */
-	*cluster_out = first_cluster;
-	while (cur_cluster != 0 && clusternum-- > 0) {
-		blocknr_t sector_num;
+	struct FAT_EXTENT* e = &privdata->extent[privdata->num_extents];
+	e->e_index = (privdata->num_extents > 0) ? privdata->extent[privdata->num_extents - 1].e_index + privdata->extent[privdata->num_extents - 1].e_length : 0;
+	e->e_cluster = cluster;
+	e->e_length = 1;
+	privdata->num_extents++;
+}
+
+/* Returns the number of clusters of the file we know about */
+static inline uint32_t
+fat_extent_num_clusters(struct FAT_INODE_PRIVDATA* privdata)
+{
+	if (privdata->num_extents == 0)
+		return 0;
+	struct FAT_EXTENT* e = &privdata->extent[privdata->num_extents - 1];
+	return e->e_index + e->e_length;
+}
+
+/* Returns the final cluster of the file we know about, or 0 if there is none */
+static inline uint32_t
+fat_extent_last_cluster(struct FAT_INODE_PRIVDATA* privdata)
+{
+	if (privdata->num_extents == 0)
+		return 0;
+	struct FAT_EXTENT* e = &privdata->extent[privdata->num_extents - 1];
+	return e->e_cluster + e->e_length - 1;
+}
+
+static void
+fat_extent_clear(struct FAT_INODE_PRIVDATA* privdata)
+{
+	privdata->num_extents = 0;
+	privdata->extent_complete = 0;
+	privdata->extent_hint = 0;
+}
+
+/*
+ * Walks the cluster chain on disk until we know cluster 'clusternum' of the
+ * file (use -1 to walk the entire chain).
+ */
+static errorcode_t
+fat_extent_fill(struct VFS_INODE* inode, uint32_t clusternum)
+{
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
+	auto privdata = static_cast<struct FAT_INODE_PRIVDATA*>(inode->i_privdata);
+	auto fs_privdata = static_cast<struct FAT_FS_PRIVDATA*>(fs->fs_privdata);
+
+	if (privdata->num_extents == 0 && !privdata->extent_complete) {
+		if (privdata->first_cluster == 0)
+			privdata->extent_complete++;
+		else
+			fat_extent_append(privdata, privdata->first_cluster);
+	}
+
+	blocknr_t cur_block = (blocknr_t)-1;
+	struct BIO* bio = NULL;
+	while (!privdata->extent_complete && (clusternum == (uint32_t)-1 || fat_extent_num_clusters(privdata) <= clusternum)) {
+		/* Obtain the FAT block, if necessary; chains tend to stay within a single one */
+		uint32_t cur_cluster = fat_extent_last_cluster(privdata);
 		uint32_t offset;
-		fat_make_cluster_block_offset(fs, cur_cluster, &sector_num, &offset);
-		struct BIO* bio;
-		errorcode_t err = vfs_bread(fs, sector_num, &bio);
-		ANANAS_ERROR_RETURN(err);
+		blocknr_t want_block;
+		fat_make_cluster_block_offset(fs, cur_cluster, &want_block, &offset);
+		if (want_block != cur_block || bio == NULL) {
+			if (bio != NULL) bio_free(bio);
+			errorcode_t err = vfs_bread(fs, want_block, &bio);
+			ANANAS_ERROR_RETURN(err);
+			cur_block = want_block;
+		}
 
 		/* Grab the value from the FAT */
+		uint32_t next_cluster = 0;
 		switch (fs_privdata->fat_type) {
 			case 16:
-				cur_cluster = FAT_FROM_LE16((char*)(static_cast<char*>(BIO_DATA(bio)) + offset));
-				if (cur_cluster >= 0xfff8)
-					cur_cluster = 0;
+				next_cluster = FAT_FROM_LE16((char*)(static_cast<char*>(BIO_DATA(bio)) + offset));
+				if (next_cluster >= 0xfff8)
+					next_cluster = 0;
 				break;
 			case 32: /* actually FAT-28... */
-				cur_cluster = FAT_FROM_LE32((char*)(static_cast<char*>(BIO_DATA(bio)) + offset)) & 0xfffffff;
-				if (cur_cluster >= 0xffffff8)
-					cur_cluster = 0;
+				next_cluster = FAT_FROM_LE32((char*)(static_cast<char*>(BIO_DATA(bio)) + offset)) & 0xfffffff;
+				if (next_cluster >= 0xffffff8)
+					next_cluster = 0;
 				break;
 		}
-		bio_free(bio);
-		if (cur_cluster != 0)
-			*cluster_out = cur_cluster;
+		if (next_cluster < 2)
+			privdata->extent_complete++; /* end of the chain (or a corrupt one) */
+		else
+			fat_extent_append(privdata, next_cluster);
 	}
-	if (cur_cluster != 0) {
-		if (ci != NULL)
-			ci->f_nextcluster = *cluster_out;
-		return ananas_success();
-	} else {
-		if (ci != NULL)
-			ci->f_nextcluster = -1;
+	if (bio != NULL)
+		bio_free(bio);
+	return ananas_success();
+}
+
+/*
+ * Used to obtain the clusternum'th cluster of a file. Returns BAD_RANGE error
+ * if end-of-file was found (but cluster_out will be set to the final cluster
+ * found, or zero if the file has no clusters)
+ */
+static errorcode_t
+fat_get_cluster_locked(struct VFS_INODE* inode, uint32_t clusternum, uint32_t* cluster_out)
+{
+	auto privdata = static_cast<struct FAT_INODE_PRIVDATA*>(inode->i_privdata);
+
+	errorcode_t err = fat_extent_fill(inode, clusternum);
+	ANANAS_ERROR_RETURN(err);
+
+	if (clusternum == (uint32_t)-1 || clusternum >= fat_extent_num_clusters(privdata)) {
+		*cluster_out = fat_extent_last_cluster(privdata);
 		return ANANAS_ERROR(BAD_RANGE);
 	}
+
+	/* Sequential access will hit the same extent as last time */
+	struct FAT_EXTENT* e = &privdata->extent[privdata->extent_hint];
+	if (clusternum < e->e_index || clusternum >= e->e_index + e->e_length) {
+		unsigned int lo = 0, hi = privdata->num_extents;
+		while (hi - lo > 1) {
+			unsigned int mid = (lo + hi) / 2;
+			if (privdata->extent[mid].e_index > clusternum)
+				hi = mid;
+			else
+				lo = mid;
+		}
+		privdata->extent_hint = lo;
+		e = &privdata->extent[lo];
+	}
+	*cluster_out = e->e_cluster + (clusternum - e->e_index);
+	return ananas_success();
+}
+
+static errorcode_t
+fat_get_cluster(struct VFS_INODE* inode, uint32_t clusternum, uint32_t* cluster_out)
+{
+	auto privdata = static_cast<struct FAT_INODE_PRIVDATA*>(inode->i_privdata);
+
+	mutex_lock(&privdata->extent_mtx);
+	errorcode_t err = fat_get_cluster_locked(inode, clusternum, cluster_out);
+	mutex_unlock(&privdata->extent_mtx);
+	return err;
+}
+
+void
+fat_discard_extents(struct VFS_INODE* inode)
+{
+	auto privdata = static_cast<struct FAT_INODE_PRIVDATA*>(inode->i_privdata);
+
+	mutex_lock(&privdata->extent_mtx);
+	fat_extent_clear(privdata);
+	if (privdata->extent != NULL)
+		kfree(privdata->extent);
+	privdata->extent = NULL;
+	privdata->max_extents = 0;
+	mutex_unlock(&privdata->extent_mtx);
 }
 
+/* Maximum number of FAT entries which can be updated in a single batch */
+#define FAT_MAX_BATCH 32
+
 /*
- * Sets a cluster value to a given value.
+ * Sets FAT entries 'cluster[n]' to 'value[n]', for all n < num. Entries which
+ * share a FAT sector are updated together, so that every modified sector is
+ * written - and copied to the other FATs - just once.
  */
 static errorcode_t
-fat_set_cluster(struct VFS_MOUNTED_FS* fs, uint32_t cluster_num, uint32_t cluster_val)
+fat_set_clusters(struct VFS_MOUNTED_FS* fs, const uint32_t* cluster, const uint32_t* value, unsigned int num)
 {
 	auto fs_privdata = static_cast<struct FAT_FS_PRIVDATA*>(fs->fs_privdata);
+	KASSERT(num <= FAT_MAX_BATCH, "batch of %u entries too large", num);
 
-	/* Calculate the block and offset within that block of the cluster */
-	blocknr_t sector_num;
-	uint32_t offset;
-	fat_make_cluster_block_offset(fs, cluster_num, &sector_num, &offset);
+	bool done[FAT_MAX_BATCH];
+	memset(done, 0, sizeof(done));
+	for (unsigned int n = 0; n < num; n++) {
+		if (done[n])
+			continue;
 
-	/* Fetch the FAT data */
-	struct BIO* bio;
-	errorcode_t err = vfs_bread(fs, sector_num, &bio);
-	ANANAS_ERROR_RETURN(err);
+		/* Calculate the block and offset within that block of the cluster */
+		blocknr_t sector_num;
+		uint32_t offset;
+		fat_make_cluster_block_offset(fs, cluster[n], &sector_num, &offset);
 
-	switch (fs_privdata->fat_type) {
-		case 16:
-			FAT_TO_LE16((char*)(static_cast<char*>(BIO_DATA(bio)) + offset), cluster_val);
-			break;
-		case 32: /* actually FAT-28... */
-			FAT_TO_LE32((char*)(static_cast<char*>(BIO_DATA(bio)) + offset), cluster_val);
-			break;
-		default:
-			panic("unsuported fat type");
-	}
+		/* Fetch the FAT data */
+		struct BIO* bio;
+		errorcode_t err = vfs_bread(fs, sector_num, &bio);
+		ANANAS_ERROR_RETURN(err);
+
+		/* Update every entry which lives in this sector */
+		for (unsigned int m = n; m < num; m++) {
+			blocknr_t cur_sector;
+			fat_make_cluster_block_offset(fs, cluster[m], &cur_sector, &offset);
+			if (done[m] || cur_sector != sector_num)
+				continue;
+			switch (fs_privdata->fat_type) {
+				case 16:
+					FAT_TO_LE16((char*)(static_cast<char*>(BIO_DATA(bio)) + offset), value[m]);
+					break;
+				case 32: /* actually FAT-28... */
+					FAT_TO_LE32((char*)(static_cast<char*>(BIO_DATA(bio)) + offset), value[m]);
+					break;
+				default:
+					panic("unsuported fat type");
+			}
+			done[m] = true;
+		}
 
-	bio_set_dirty(bio);
+		bio_set_dirty(bio);
 
-	/* Sync all other FAT tables as well */
-	for (int i = 1; i < fs_privdata->num_fats; i++) {
-		sector_num += fs_privdata->num_fat_sectors;
-		struct BIO* bio2;
-		err = vfs_bread(fs, sector_num, &bio2);
-		if (ananas_is_failure(err)) {
-			/* XXX we should free the cluster */
-			bio_free(bio);
-			kprintf("fat_set_cluster(): XXX leaking cluster %u\n", sector_num);
-			return err;
+		/* Sync all other FAT tables as well; we overwrite the sector completely */
+		for (int i = 1; i < fs_privdata->num_fats; i++) {
+			sector_num += fs_privdata->num_fat_sectors;
+			struct BIO* bio2;
+			err = vfs_bget(fs, sector_num, &bio2, BIO_READ_NODATA);
+			if (ananas_is_failure(err)) {
+				bio_free(bio);
+				return err;
+			}
+			memcpy(BIO_DATA(bio2), static_cast<char*>(BIO_DATA(bio)), fs_privdata->sector_size);
+			bio_set_dirty(bio2);
+			bio_free(bio2);
 		}
-		memcpy(BIO_DATA(bio2), static_cast<char*>(BIO_DATA(bio)), fs_privdata->sector_size);
-		bio_set_dirty(bio2);
-		bio_free(bio2);
+		bio_free(bio);
 	}
-	bio_free(bio);
 
 	return ananas_success();
 }
 
+static inline bool
+fat_cluster_in_use(const uint32_t* bitmap, uint32_t cluster)
+{
+	return (bitmap[cluster / 32] & (1 << (cluster % 32))) != 0;
+}
+
 /*
- * Obtains the first available cluster and marks it as being used.
+ * Builds the bitmap of clusters in use by scanning the first FAT; this is done
+ * once, upon the first allocation. Must be called with mtx_alloc held.
  */
 static errorcode_t
-fat_claim_avail_cluster(struct VFS_MOUNTED_FS* fs, uint32_t* cluster_out)
+fat_build_avail_bitmap(struct VFS_MOUNTED_FS* fs)
 {
 	auto fs_privdata = static_cast<struct FAT_FS_PRIVDATA*>(fs->fs_privdata);
+	uint32_t end_cluster = fs_privdata->total_clusters + 2; /* first 2 are reserved */
+	unsigned int num_words = (end_cluster + 31) / 32;
+	uint32_t* bitmap = new uint32_t[num_words];
+	memset(bitmap, 0, num_words * sizeof(uint32_t));
+	bitmap[0] |= 3; /* reserved clusters */
 
-	/* XXX We do a dumb find-first on the filesystem for now */
+	uint32_t num_avail = 0;
 	blocknr_t cur_block = (blocknr_t)-1;
 	struct BIO* bio = NULL;
-	for (uint32_t clusterno = fs_privdata->next_avail_cluster; clusterno < fs_privdata->total_clusters; clusterno++) {
+	for (uint32_t clusterno = 2; clusterno < end_cluster; clusterno++) {
 		/* Obtain the FAT block, if necessary */
 		uint32_t offset;
 		blocknr_t want_block;
@@ -247,42 +332,130 @@ fat_claim_avail_cluster(struct VFS_MOUNTED_FS* fs, uint32_t* cluster_out)
 		if (want_block != cur_block || bio == NULL) {
 			if (bio != NULL) bio_free(bio);
 			errorcode_t err = vfs_bread(fs, want_block, &bio);
-			ANANAS_ERROR_RETURN(err);
+			if (ananas_is_failure(err)) {
+				kfree(bitmap);
+				return err;
+			}
 			cur_block = want_block;
 		}
 
-		/* Obtain the cluster value */
-		uint32_t val = -1;
+		uint32_t val = 0;
 		switch (fs_privdata->fat_type) {
 			case 16:
 				val = FAT_FROM_LE16((char*)(static_cast<char*>(BIO_DATA(bio)) + offset));
-				if (val == 0) { /* available cluster? */
-					/* Yes; claim it */
-					FAT_TO_LE16((char*)(static_cast<char*>(BIO_DATA(bio)) + offset), 0xfff8);
-				}
 				break;
 			case 32: /* actually FAT-28... */
 				val = FAT_FROM_LE32((char*)(static_cast<char*>(BIO_DATA(bio)) + offset)) & 0xfffffff;
-				if (val == 0) { /* available cluster? */
-					/* Yes; claim it */
-					FAT_TO_LE32((char*)(static_cast<char*>(BIO_DATA(bio)) + offset), 0xffffff8);
-				}
 				break;
 		}
 		if (val != 0)
+			bitmap[clusterno / 32] |= 1 << (clusterno % 32);
+		else
+			num_avail++;
+	}
+	if (bio != NULL)
+		bio_free(bio);
+
+	fs_privdata->avail_bitmap = bitmap;
+	fs_privdata->num_avail_clusters = num_avail;
+	if (fs_privdata->next_avail_cluster < 2 || fs_privdata->next_avail_cluster >= end_cluster)
+		fs_privdata->next_avail_cluster = 2;
+	return ananas_success();
+}
+
+/* Returns the first available cluster in [from, to), or 0 if there is none */
+static uint32_t
+fat_find_avail_cluster(const uint32_t* bitmap, uint32_t from, uint32_t to)
+{
+	uint32_t cluster = from;
+	while (cluster < to) {
+		/* Skip completely used words in one go */
+		if ((cluster % 32) == 0 && bitmap[cluster / 32] == 0xffffffff) {
+			cluster += 32;
 			continue;
+		}
+		if (!fat_cluster_in_use(bitmap, cluster))
+			return cluster;
+		cluster++;
+	}
+	return 0;
+}
 
-		/* OK; this one is available (and we just claimed it) - flush the FAT entry */
-		bio_set_dirty(bio);
-		bio_free(bio);
+/*
+ * Claims an available cluster, as close to 'goal' as possible, along with up
+ * to 'max_count' - 1 available clusters directly following it. These are only
+ * marked as used in memory; it is up to the caller to hook them into the FAT.
+ */
+static errorcode_t
+fat_claim_avail_clusters(struct VFS_MOUNTED_FS* fs, uint32_t goal, unsigned int max_count, uint32_t* cluster_out, unsigned int* count_out)
+{
+	auto fs_privdata = static_cast<struct FAT_FS_PRIVDATA*>(fs->fs_privdata);
+	uint32_t end_cluster = fs_privdata->total_clusters + 2;
 
-		/* XXX should update second fat */
-		*cluster_out = clusterno;
-		return ananas_success();
+	mutex_lock(&fs_privdata->mtx_alloc);
+	if (fs_privdata->avail_bitmap == NULL) {
+		errorcode_t err = fat_build_avail_bitmap(fs);
+		if (ananas_is_failure(err)) {
+			mutex_unlock(&fs_privdata->mtx_alloc);
+			return err;
+		}
 	}
+	uint32_t* bitmap = fs_privdata->avail_bitmap;
+
+	if (goal < 2 || goal >= end_cluster)
+		goal = fs_privdata->next_avail_cluster;
+	uint32_t cluster = fat_find_avail_cluster(bitmap, goal, end_cluster);
+	if (cluster == 0)
+		cluster = fat_find_avail_cluster(bitmap, 2, goal);
+	if (cluster == 0) {
+		/* Out of available clusters */
+		mutex_unlock(&fs_privdata->mtx_alloc);
+		return ANANAS_ERROR(NO_SPACE);
+	}
+
+	unsigned int count = 0;
+	while (count < max_count && cluster + count < end_cluster && !fat_cluster_in_use(bitmap, cluster + count)) {
+		bitmap[(cluster + count) / 32] |= 1 << ((cluster + count) % 32);
+		count++;
+	}
+	fs_privdata->num_avail_clusters -= count;
+	fs_privdata->next_avail_cluster = (cluster + count < end_cluster) ? cluster + count : 2;
+	mutex_unlock(&fs_privdata->mtx_alloc);
 
-	/* Out of available clusters */
-	return ANANAS_ERROR(NO_SPACE);
+	*cluster_out = cluster;
+	*count_out = count;
+	return ananas_success();
+}
+
+/*
+ * Marks 'count' clusters starting at 'cluster' as available again; the caller
+ * must have cleared their FAT entries, if needed.
+ */
+static void
+fat_release_clusters(struct VFS_MOUNTED_FS* fs, uint32_t cluster, unsigned int count)
+{
+	auto fs_privdata = static_cast<struct FAT_FS_PRIVDATA*>(fs->fs_privdata);
+
+	mutex_lock(&fs_privdata->mtx_alloc);
+	if (fs_privdata->avail_bitmap != NULL) {
+		for (unsigned int n = 0; n < count; n++) {
+			KASSERT(fat_cluster_in_use(fs_privdata->avail_bitmap, cluster + n), "releasing available cluster %u", cluster + n);
+			fs_privdata->avail_bitmap[(cluster + n) / 32] &= ~(1 << ((cluster + n) % 32));
+		}
+	}
+	if (fs_privdata->num_avail_clusters != (uint32_t)-1)
+		fs_privdata->num_avail_clusters += count;
+	mutex_unlock(&fs_privdata->mtx_alloc);
+}
+
+void
+fat_release_prealloc(struct VFS_INODE* inode)
+{
+	auto privdata = static_cast<struct FAT_INODE_PRIVDATA*>(inode->i_privdata);
+	if (privdata->prealloc_count == 0)
+		return;
+	fat_release_clusters(inode->i_fs, privdata->prealloc_cluster, privdata->prealloc_count);
+	privdata->prealloc_count = 0;
 }
 
 /*
@@ -295,55 +468,65 @@ fat_append_cluster(struct VFS_INODE* inode, uint32_t* cluster_out)
 	struct VFS_MOUNTED_FS* fs = inode->i_fs;
 	auto fs_privdata = static_cast<struct FAT_FS_PRIVDATA*>(fs->fs_privdata);
 
+	/* Figure out the last cluster of the file; this walks whatever is left of the chain */
+	mutex_lock(&privdata->extent_mtx);
+	uint32_t last_cluster = 0;
+	errorcode_t err = fat_get_cluster_locked(inode, (uint32_t)-1, &last_cluster);
+	if (ANANAS_ERROR_CODE(err) != ANANAS_ERROR_BAD_RANGE) {
+		KASSERT(ananas_is_failure(err), "able to obtain impossible cluster");
+		mutex_unlock(&privdata->extent_mtx);
+		return err;
+	}
+
 	/*
-	 * Figure out the last cluster of the file; we cache this per inode as we don't
-	 * want to clutter the cluster-cache with it (these entries need to be updated
-	 * if we append a cluster)
+	 * Obtain the next cluster; we want it directly after the last one so that
+	 * the file is stored contiguously. To keep it that way while other files are
+	 * growing as well, we reserve some clusters beyond it.
 	 */
-	uint32_t last_cluster = privdata->last_cluster;
-	if (last_cluster == 0) {
-		errorcode_t err = fat_get_cluster(fs, privdata->first_cluster, (uint32_t)-1, &last_cluster);
-		if (ANANAS_ERROR_CODE(err) != ANANAS_ERROR_BAD_RANGE) {
-			KASSERT(ananas_is_failure(err), "able to obtain impossible cluster");
+	uint32_t new_cluster = 0;
+	uint32_t goal = (last_cluster != 0) ? last_cluster + 1 : 0;
+	if (privdata->prealloc_count > 0 && privdata->prealloc_cluster == goal) {
+		new_cluster = privdata->prealloc_cluster++;
+		privdata->prealloc_count--;
+	} else {
+		fat_release_prealloc(inode);
+
+		unsigned int count;
+		err = fat_claim_avail_clusters(fs, goal, 1 + FAT_PREALLOC_CLUSTERS, &new_cluster, &count);
+		if (ananas_is_failure(err)) {
+			mutex_unlock(&privdata->extent_mtx);
 			return err;
 		}
-		privdata->last_cluster = last_cluster;
+		privdata->prealloc_cluster = new_cluster + 1;
+		privdata->prealloc_count = count - 1;
 	}
 
-	/* Obtain the next cluster - this will also mark it as being in use */
-	uint32_t new_cluster = 0;
-	errorcode_t err = fat_claim_avail_cluster(fs, &new_cluster);
-	ANANAS_ERROR_RETURN(err);
+	/*
+	 * Mark the new cluster as end-of-chain and hook it to the previous one, if
+	 * any; these will often share a FAT sector, so do it in one go.
+	 */
+	uint32_t cluster[2] = { new_cluster, last_cluster };
+	uint32_t value[2] = { (fs_privdata->fat_type == 16) ? 0xfff8U : 0xffffff8U, new_cluster };
+	err = fat_set_clusters(fs, cluster, value, (last_cluster != 0) ? 2 : 1);
+	if (ananas_is_failure(err)) {
+		mutex_unlock(&privdata->extent_mtx);
+		fat_release_clusters(fs, new_cluster, 1);
+		return err;
+	}
+
+	/* The chain was complete, so the new cluster simply goes at the end */
+	fat_extent_append(privdata, new_cluster);
 
 	/* If the file didn't have any clusters before, it sure does now */
-	if (privdata->first_cluster == 0) {
+	bool first = privdata->first_cluster == 0;
+	if (first)
 		privdata->first_cluster = new_cluster;
+	mutex_unlock(&privdata->extent_mtx);
+	if (first)
 		vfs_set_inode_dirty(inode);
-	} else {
-		/* Append this cluster to the file chain */
-		err = fat_set_cluster(fs, last_cluster, new_cluster);
-		ANANAS_ERROR_RETURN(err); /* XXX leaks clusterno */
-	}
 	*cluster_out = new_cluster;
 
-	/*
-	 * Update the cache; if there is an entry for our inode which is marked as
-	 * nonexistent, we expect it to be the last one and overwrite it.
-	 */
-	spinlock_lock(&fs_privdata->spl_cache);
-	for(int cache_item = 0; cache_item < FAT_NUM_CACHEITEMS; cache_item++) {
-		struct FAT_CLUSTER_CACHEITEM* ci = &fs_privdata->cluster_cache[cache_item];
-		if (ci->f_clusterno == privdata->first_cluster && ci->f_nextcluster == -1) {
-			/* Found empty item - use it (we assume this always occurs at the end of the items) */
-			KASSERT(ci->f_index == (inode->i_sb.st_size + ((fs_privdata->sector_size * fs_privdata->sectors_per_cluster) - 1)) / (fs_privdata->sector_size * fs_privdata->sectors_per_cluster), "empty cache item isn't final item?");
-			ci->f_nextcluster = new_cluster;
-			break;
-		}
-	}
-	spinlock_unlock(&fs_privdata->spl_cache);
-
 	/* Update the block count of the inode */
-	privdata->last_cluster = new_cluster;
 	inode->i_sb.st_blocks += fs_privdata->sectors_per_cluster;
 	return ananas_success();
 }
@@ -353,38 +536,41 @@ fat_truncate_clusterchain(struct VFS_INODE* inode)
 {
 	auto privdata = static_cast<struct FAT_INODE_PRIVDATA*>(inode->i_privdata);
 	struct VFS_MOUNTED_FS* fs = inode->i_fs;
-	auto fs_privdata = static_cast<struct FAT_FS_PRIVDATA*>(fs->fs_privdata);
 
 	/*
-	 * We need to free the clusters in reverse order: if we do it sequentially,
-	 * we won't be able to find the next one as we broke the chain...
+	 * Walk the entire chain first, so that we needn't worry about breaking it
+	 * while freeing the clusters.
 	 */
-	unsigned int bytes_per_cluster = fs_privdata->sector_size * fs_privdata->sectors_per_cluster;
-	int num_clusters = (inode->i_sb.st_size + bytes_per_cluster - 1) / bytes_per_cluster;
-
-	errorcode_t err = ananas_success();
-	uint32_t cluster = 0;
-	for (int num = num_clusters - 1; num >= 0; num--) {
-		errorcode_t err = fat_get_cluster(fs, privdata->first_cluster, num, &cluster);
-		if (ANANAS_ERROR_CODE(err) == ANANAS_ERROR_BAD_RANGE)
-			break; /* end of the run */
-		ANANAS_ERROR_RETURN(err); /* anything else is bad */
-
-		/*
-		 * Throw away this cluster; note that fat_set_cluster() will not update the
-		 * cluster map, which is fine as we'll just flush the cache soon.
-		 */
-		err = fat_set_cluster(fs, cluster, 0);
-		if (ananas_is_failure(err))
-			break;
+	mutex_lock(&privdata->extent_mtx);
+	errorcode_t err = fat_extent_fill(inode, (uint32_t)-1);
+
+	uint32_t cluster[FAT_MAX_BATCH];
+	uint32_t value[FAT_MAX_BATCH];
+	memset(value, 0, sizeof(value));
+	unsigned int num_batch = 0;
+	for (unsigned int n = 0; ananas_is_success(err) && n < privdata->num_extents; n++) {
+		struct FAT_EXTENT* e = &privdata->extent[n];
+		for (uint32_t i = 0; i < e->e_length; i++) {
+			cluster[num_batch++] = e->e_cluster + i;
+			if (num_batch < FAT_MAX_BATCH && (n < privdata->num_extents - 1 || i < e->e_length - 1))
+				continue;
+
+			err = fat_set_clusters(fs, cluster, value, num_batch);
+			if (ananas_is_failure(err))
+				break;
+			for (unsigned int m = 0; m < num_batch; m++)
+				fat_release_clusters(fs, cluster[m], 1);
+			num_batch = 0;
+		}
 	}
+	fat_release_prealloc(inode);
 
 	/*
 	 * Throw away the cluster map of this inode - we clean up everything even in
 	 * case of an error as it won't hurt to do so (and we expect little failure)
 	 */
-	if (privdata->first_cluster > 0)
-		fat_clear_cache(fs, privdata->first_cluster);
+	fat_extent_clear(privdata);
+	mutex_unlock(&privdata->extent_mtx);
 	return err;
 }
 
@@ -413,7 +599,7 @@ fat_block_map(struct VFS_INODE* inode, blocknr_t block_in, blocknr_t* block_out,
 			return ANANAS_ERROR(BAD_RANGE);
 	} else {
 		uint32_t cluster;
-		errorcode_t err = fat_get_cluster(fs, privdata->first_cluster, block_in / fs_privdata->sectors_per_cluster, &cluster);
+		errorcode_t err = fat_get_cluster(inode, block_in / fs_privdata->sectors_per_cluster, &cluster);
 		if (ANANAS_ERROR_CODE(err) == ANANAS_ERROR_BAD_RANGE) {
 			/* end of the chain */
 			if (!create) {
@@ -435,60 +621,6 @@ fat_block_map(struct VFS_INODE* inode, blocknr_t block_in, blocknr_t* block_out,
 	return ananas_success();
 }
 
-int
-fat_clear_cache(struct VFS_MOUNTED_FS* fs, uint32_t first_cluster)
-{
-	auto fs_privdata = static_cast<struct FAT_FS_PRIVDATA*>(fs->fs_privdata);
-
-	/*
-	 * Throw away al inode's cluster items; this works by searching for the last
-	 * item in the cluster cache and copying it over our removed blocks - this
-	 * works because the cache isn't sorted.
-	 */
-	spinlock_lock(&fs_privdata->spl_cache);
-	unsigned int last_index = 0;
-	while (last_index < FAT_NUM_CACHEITEMS && fs_privdata->cluster_cache[last_index].f_clusterno != 0)
-		last_index++;
-	/* Cacheitems 0 ... i, for all i < last_index are in use */
-
-	/* Throw away all inode's cluster items in the cache */
-	int num_removed = 0;
-	struct FAT_CLUSTER_CACHEITEM* ci = fs_privdata->cluster_cache;
-	for(unsigned int n = 0; n < FAT_NUM_CACHEITEMS; n++, ci++) {
-		if (ci->f_clusterno != first_cluster)
-			continue;
-
-		/*
-		 * OK, this is an item we'll have to destroy - copy the last entry over it and remove that one.
-		 * If this is the final entry, we skip the copying.
-			*/
-		KASSERT(last_index >= 0 && last_index <= FAT_NUM_CACHEITEMS, "last index %u invalid", last_index);
-		KASSERT(n <= last_index, "item to remove %u is beyond last index %i", n, last_index);
-		if (n != (last_index - 1)) {
-			/* Need to overwrite this item with the final cache item */
-			memcpy(ci, &fs_privdata->cluster_cache[last_index - 1], sizeof(*ci));
-			memset(&fs_privdata->cluster_cache[last_index - 1], 0, sizeof(*ci));
-			last_index--;
-		} else {
-			memset(ci, 0, sizeof(*ci));
-		}
-		num_removed++;
-	}
-	spinlock_unlock(&fs_privdata->spl_cache);
-	return num_removed;
-}
-
-void
-fat_dump_cache(struct VFS_MOUNTED_FS* fs)
-{
-	auto fs_privdata = static_cast<struct FAT_FS_PRIVDATA*>(fs->fs_privdata);
-	struct FAT_CLUSTER_CACHEITEM* ci = fs_privdata->cluster_cache;
-	for(unsigned int n = 0; n < FAT_NUM_CACHEITEMS; n++, ci++) {
-		kprintf("ci[%i]: clusterno=%i, index=%i, nextcl=%u\n",
-		 n, ci->f_clusterno, ci->f_index, ci->f_nextcluster);
-	}
-}
-
 errorcode_t
 fat_update_infosector(struct VFS_MOUNTED_FS* fs)
 {
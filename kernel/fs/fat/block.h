@@ -6,9 +6,9 @@
 struct VFS_INODE;
 
 errorcode_t fat_block_map(struct VFS_INODE* inode, blocknr_t block_in, blocknr_t* block_out, int create);
-void fat_dump_cache(struct VFS_MOUNTED_FS* fs);
-int fat_clear_cache(struct VFS_MOUNTED_FS* fs, uint32_t first_cluster);
+void fat_discard_extents(struct VFS_INODE* inode);
 errorcode_t fat_truncate_clusterchain(struct VFS_INODE* inode);
+void fat_release_prealloc(struct VFS_INODE* inode);
 errorcode_t fat_update_infosector(struct VFS_MOUNTED_FS* fs);
 
 extern struct VFS_INODE_OPS fat_inode_ops;
@@ -4,6 +4,7 @@
 #include <ananas/lock.h>
 #include <ananas/trace.h>
 #include <ananas/lib.h>
+#include <ananas/mm.h>
 #include <ananas/vfs/types.h>
 #include <ananas/vfs/core.h>
 #include <ananas/vfs/generic.h>
@@ -180,6 +181,158 @@ fat_readdir(struct VFS_FILE* file, void* dirents, size_t* len)
 	return err;
 }
 
+/*
+ * Name index.
+ *
+ * Finding a name in a FAT directory means assembling every (long) filename
+ * in it until we hit a match, which is costly for large directories. Instead,
+ * the first lookup reads all names in the directory into a hash table, which
+ * is kept with the directory inode and updated as entries are added and
+ * removed.
+ */
+static unsigned int
+fat_name_hash(const char* name)
+{
+	uint32_t hash = 2166136261U; /* FNV-1a */
+	for (/* nothing */; *name != '\0'; name++)
+		hash = (hash ^ (uint8_t)*name) * 16777619U;
+	return hash % FAT_NAME_HASH_SIZE;
+}
+
+/* Must be called with name_mtx held */
+static void
+fat_name_index_insert(struct FAT_INODE_PRIVDATA* privdata, const char* name, ino_t inum)
+{
+	size_t len = strlen(name);
+	auto ne = static_cast<struct FAT_NAME_ENTRY*>(kmalloc(sizeof(struct FAT_NAME_ENTRY) + len));
+	ne->ne_inum = inum;
+	memcpy(ne->ne_name, name, len + 1);
+
+	unsigned int bucket = fat_name_hash(name);
+	ne->ne_next = privdata->name_hash[bucket];
+	privdata->name_hash[bucket] = ne;
+}
+
+/* Must be called with name_mtx held */
+static void
+fat_name_index_clear(struct FAT_INODE_PRIVDATA* privdata)
+{
+	if (privdata->name_hash == NULL)
+		return;
+	for (unsigned int n = 0; n < FAT_NAME_HASH_SIZE; n++) {
+		struct FAT_NAME_ENTRY* ne = privdata->name_hash[n];
+		while (ne != NULL) {
+			struct FAT_NAME_ENTRY* next = ne->ne_next;
+			kfree(ne);
+			ne = next;
+		}
+	}
+	kfree(privdata->name_hash);
+	privdata->name_hash = NULL;
+}
+
+/* Must be called with name_mtx held */
+static errorcode_t
+fat_name_index_build(struct DENTRY* parent)
+{
+	auto privdata = static_cast<struct FAT_INODE_PRIVDATA*>(parent->d_inode->i_privdata);
+	privdata->name_hash = static_cast<struct FAT_NAME_ENTRY**>(kmalloc(sizeof(struct FAT_NAME_ENTRY*) * FAT_NAME_HASH_SIZE));
+	memset(privdata->name_hash, 0, sizeof(struct FAT_NAME_ENTRY*) * FAT_NAME_HASH_SIZE);
+
+	struct VFS_FILE dirf;
+	memset(&dirf, 0, sizeof(dirf));
+	dirf.f_dentry = parent;
+	while (1) {
+		char buf[1024];
+		size_t buf_len = sizeof(buf);
+		errorcode_t err = fat_readdir(&dirf, buf, &buf_len);
+		if (ananas_is_failure(err)) {
+			fat_name_index_clear(privdata);
+			return err;
+		}
+		if (buf_len == 0)
+			break;
+
+		char* cur_ptr = buf;
+		while (buf_len > 0) {
+			struct VFS_DIRENT* de = (struct VFS_DIRENT*)cur_ptr;
+			buf_len -= DE_LENGTH(de); cur_ptr += DE_LENGTH(de);
+			fat_name_index_insert(privdata, de->de_name, de->de_inum);
+		}
+	}
+	return ananas_success();
+}
+
+static void
+fat_name_index_add(struct VFS_INODE* dir, const char* name, ino_t inum)
+{
+	auto privdata = static_cast<struct FAT_INODE_PRIVDATA*>(dir->i_privdata);
+	mutex_lock(&privdata->name_mtx);
+	if (privdata->name_hash != NULL)
+		fat_name_index_insert(privdata, name, inum);
+	mutex_unlock(&privdata->name_mtx);
+}
+
+static void
+fat_name_index_remove(struct VFS_INODE* dir, const char* name)
+{
+	auto privdata = static_cast<struct FAT_INODE_PRIVDATA*>(dir->i_privdata);
+	mutex_lock(&privdata->name_mtx);
+	if (privdata->name_hash != NULL) {
+		struct FAT_NAME_ENTRY** prev = &privdata->name_hash[fat_name_hash(name)];
+		while (*prev != NULL) {
+			struct FAT_NAME_ENTRY* ne = *prev;
+			if (strcmp(ne->ne_name, name) != 0) {
+				prev = &ne->ne_next;
+				continue;
+			}
+			*prev = ne->ne_next;
+			kfree(ne);
+		}
+	}
+	mutex_unlock(&privdata->name_mtx);
+}
+
+void
+fat_discard_name_index(struct VFS_INODE* inode)
+{
+	auto privdata = static_cast<struct FAT_INODE_PRIVDATA*>(inode->i_privdata);
+	mutex_lock(&privdata->name_mtx);
+	fat_name_index_clear(privdata);
+	mutex_unlock(&privdata->name_mtx);
+}
+
+static errorcode_t
+fat_lookup(struct DENTRY* parent, struct VFS_INODE** destinode, const char* dentry)
+{
+	struct VFS_INODE* dir = parent->d_inode;
+	auto privdata = static_cast<struct FAT_INODE_PRIVDATA*>(dir->i_privdata);
+
+	mutex_lock(&privdata->name_mtx);
+	if (privdata->name_hash == NULL) {
+		errorcode_t err = fat_name_index_build(parent);
+		if (ananas_is_failure(err)) {
+			mutex_unlock(&privdata->name_mtx);
+			return err;
+		}
+	}
+
+	ino_t inum = 0;
+	bool found = false;
+	for (struct FAT_NAME_ENTRY* ne = privdata->name_hash[fat_name_hash(dentry)]; ne != NULL; ne = ne->ne_next) {
+		if (strcmp(ne->ne_name, dentry) != 0)
+			continue;
+		inum = ne->ne_inum;
+		found = true;
+		break;
+	}
+	mutex_unlock(&privdata->name_mtx);
+
+	if (!found)
+		return ANANAS_ERROR(NO_FILE);
+	return vfs_get_inode(dir->i_fs, inum, destinode);
+}
+
 /*
  * Construct the 8.3-FAT notation for a given shortname and calculates the
  * checksum while doing so.
@@ -355,9 +508,9 @@ fat_add_directory_entry(struct VFS_INODE* dir, const char* dentry, struct FAT_EN
 
 			/* Mangle the LFN entry in place */
 			for (int i = 0; i < 5 && (13 * cur_entry_idx + i) < filename_len; i++)
-				lfn->lfn_name_1[i * 2] = dentry[11 * cur_entry_idx + i];
+				lfn->lfn_name_1[i * 2] = dentry[13 * cur_entry_idx + i];
 			for (int i = 0; i < 6 && (13 * cur_entry_idx + 5 + i) < filename_len; i++)
-				lfn->lfn_name_2[i * 2] = dentry[11 * cur_entry_idx + 5 + i];
+				lfn->lfn_name_2[i * 2] = dentry[13 * cur_entry_idx + 5 + i];
 			for (int i = 0; i < 2 && (13 * cur_entry_idx + 11 + i) < filename_len; i++)
 				lfn->lfn_name_3[i * 2] = dentry[13 * cur_entry_idx + 11 + i];
 		}
@@ -367,6 +520,8 @@ fat_add_directory_entry(struct VFS_INODE* dir, const char* dentry, struct FAT_EN
 	}
 
 	bio_free(bio);
+	if (dentry != NULL)
+		fat_name_index_add(dir, dentry, *inum);
 	return ananas_success();
 }
 
@@ -466,6 +621,8 @@ fat_remove_directory_entry(struct VFS_INODE* dir, const char* dentry)
 
 	if (bio != NULL)
 		bio_free(bio);
+	if (ananas_is_success(errorcode))
+		fat_name_index_remove(dir, dentry);
 	return errorcode;
 }
 
@@ -556,8 +713,12 @@ fat_rename(struct VFS_INODE* old_dir, struct DENTRY* old_dentry, struct VFS_INOD
 	 * Copy the inode information over; the old inode will soon go XXX we should copy more
 	 */
 	struct VFS_INODE* old_inode = old_dentry->d_inode;
+	auto privdata = static_cast<struct FAT_INODE_PRIVDATA*>(inode->i_privdata);
+	auto old_privdata = static_cast<struct FAT_INODE_PRIVDATA*>(old_inode->i_privdata);
 	inode->i_sb.st_size = old_inode->i_sb.st_size;
-	memcpy(inode->i_privdata, old_inode->i_privdata, sizeof(struct FAT_INODE_PRIVDATA));
+	privdata->first_cluster = old_privdata->first_cluster;
+	fat_discard_extents(inode);
+	fat_release_prealloc(old_inode);
 	vfs_set_inode_dirty(inode);
 
 	/*
@@ -571,7 +732,7 @@ fat_rename(struct VFS_INODE* old_dir, struct DENTRY* old_dentry, struct VFS_INOD
 
 struct VFS_INODE_OPS fat_dir_ops = {
 	.readdir = fat_readdir,
-	.lookup = vfs_generic_lookup,
+	.lookup = fat_lookup,
 	.create = fat_create,
 	.unlink = fat_unlink,
 	.rename = fat_rename,
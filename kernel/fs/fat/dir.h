@@ -4,8 +4,10 @@
 #include <ananas/types.h>
 
 struct VFS_FILE;
+struct VFS_INODE;
 
 errorcode_t fat_readdir(struct VFS_FILE* file, void* dirents, size_t* len);
+void fat_discard_name_index(struct VFS_INODE* inode);
 extern struct VFS_INODE_OPS fat_dir_ops;
 
 #endif /* __FATFS_DIR_H__ */
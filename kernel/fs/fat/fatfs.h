@@ -29,14 +29,8 @@
 		((uint8_t*)(x))[3] = ((y) >> 24) & 0xff; \
 	} while(0)
 
-/* Number of cache items per filesystem */
-#define FAT_NUM_CACHEITEMS	1000
-
-struct FAT_CLUSTER_CACHEITEM {
-	uint32_t	f_clusterno;
-	uint32_t	f_index;
-	uint32_t	f_nextcluster;
-};
+/* Number of clusters to reserve beyond the one we need when a file grows */
+#define FAT_PREALLOC_CLUSTERS	16
 
 struct FAT_FS_PRIVDATA {
 	int      fat_type;			/* FAT type: 16 or 32 */
@@ -52,14 +46,44 @@ struct FAT_FS_PRIVDATA {
 	uint32_t next_avail_cluster;		/* Next available cluster */
 	uint32_t num_avail_clusters;		/* Number of available clusters */
 	uint32_t infosector_num;		/* Info sector, or 0 if not present */
-	spinlock_t spl_cache;
-	struct FAT_CLUSTER_CACHEITEM cluster_cache[FAT_NUM_CACHEITEMS];
+	mutex_t  mtx_alloc;			/* Protects cluster allocation */
+	uint32_t* avail_bitmap;			/* Bit set per used cluster; built on first allocation */
+};
+
+/* A run of consecutive clusters within a file */
+struct FAT_EXTENT {
+	uint32_t e_index;			/* Index of the first cluster within the file */
+	uint32_t e_cluster;			/* First cluster on disk */
+	uint32_t e_length;			/* Number of clusters */
+};
+
+/* Number of hash buckets in a directory's name index */
+#define FAT_NAME_HASH_SIZE	256
+
+/* A name in a directory's name index */
+struct FAT_NAME_ENTRY {
+	struct FAT_NAME_ENTRY* ne_next;		/* Next entry in the bucket */
+	ino_t    ne_inum;
+	char     ne_name[1];			/* Name; allocated along with the entry */
 };
 
 struct FAT_INODE_PRIVDATA {
 	int      root_inode;
 	uint32_t first_cluster;
-	uint32_t last_cluster;
+	uint32_t prealloc_cluster;		/* First cluster reserved for growth */
+	uint32_t prealloc_count;		/* Number of reserved clusters */
+
+	/* Cluster chain as far as we know it; see fat_get_cluster() */
+	mutex_t  extent_mtx;
+	struct FAT_EXTENT* extent;
+	unsigned int num_extents;
+	unsigned int max_extents;
+	unsigned int extent_hint;		/* Extent used by the previous lookup */
+	int      extent_complete;		/* Set if we know the entire chain */
+
+	/* Names in the directory; built on the first lookup, see fat_lookup() */
+	mutex_t  name_mtx;
+	struct FAT_NAME_ENTRY** name_hash;	/* Buckets, or NULL if not built yet */
 };
 
 #endif /* __FATFS_H__ */
@@ -16,22 +16,23 @@
 errorcode_t
 fat_prepare_inode(struct VFS_INODE* inode)
 {
-	inode->i_privdata = new FAT_INODE_PRIVDATA;
-	memset(inode->i_privdata, 0, sizeof(struct FAT_INODE_PRIVDATA));
+	auto privdata = new FAT_INODE_PRIVDATA;
+	memset(privdata, 0, sizeof(struct FAT_INODE_PRIVDATA));
+	mutex_init(&privdata->extent_mtx, "fatextent");
+	mutex_init(&privdata->name_mtx, "fatname");
+	inode->i_privdata = privdata;
 	return ananas_success();
 }
 
 void
 fat_discard_inode(struct VFS_INODE* inode)
 {
-	auto privdata = static_cast<struct FAT_INODE_PRIVDATA*>(inode->i_privdata);
+	/* Throw away the cluster chain and names we know of */
+	fat_discard_extents(inode);
+	fat_discard_name_index(inode);
 
-	/*
-	 * If the file has backing storage, we need to throw away all inode's cluster
-	 * items in the cache.
-	 */
-	if (privdata->first_cluster != 0)
-		fat_clear_cache(inode->i_fs, privdata->first_cluster);
+	/* Any clusters we reserved for the file to grow into can be used by others */
+	fat_release_prealloc(inode);
 
 	kfree(inode->i_privdata);
 }
@@ -15,6 +15,7 @@
 #include <ananas/vfs/mount.h>
 #include <ananas/init.h>
 #include <ananas/lib.h>
+#include <ananas/lock.h>
 #include <ananas/trace.h>
 #include <ananas/mm.h>
 #include <iso9660.h>
@@ -24,8 +25,26 @@ TRACE_SETUP;
 #define ISO9660_GET_WORD(x) (((uint16_t)(x)[0]) | ((uint16_t)(x)[1] << 8))
 #define ISO9660_GET_DWORD(x) (((uint32_t)(x)[0]) | ((uint32_t)(x)[1] << 8) | ((uint32_t)(x)[2] << 16) | ((uint32_t)(x)[3] << 24))
 
+/* Number of blocks we try to have scheduled ahead of a sequential reader */
+#define ISO9660_READ_AHEAD 32
+
+/* Number of hash buckets in a directory's name index */
+#define ISO9660_NAME_HASH_SIZE 64
+
+/* A name in a directory's name index */
+struct ISO9660_NAME_ENTRY {
+	struct ISO9660_NAME_ENTRY* ne_next;	/* Next entry in the bucket */
+	ino_t ne_inum;
+	char  ne_name[1];			/* Name; allocated along with the entry */
+};
+
 struct ISO9660_INODE_PRIVDATA {
 	uint32_t lba;
+	blocknr_t ra_next;			/* First block not yet read ahead */
+
+	/* Names in the directory; built on the first lookup, see iso9660_lookup() */
+	mutex_t name_mtx;
+	struct ISO9660_NAME_ENTRY** name_hash;	/* Buckets, or NULL if not built yet */
 };
 
 namespace {	
@@ -152,14 +171,35 @@ iso9660_prepare_inode(struct VFS_INODE* inode)
 {
 	auto privdata = new ISO9660_INODE_PRIVDATA;
 	memset(privdata, 0, sizeof(struct ISO9660_INODE_PRIVDATA));
+	mutex_init(&privdata->name_mtx, "iso9660name");
 	inode->i_privdata = privdata;
 	return ananas_success();
 }
 
+/* Must be called with name_mtx held */
+static void
+iso9660_name_index_clear(struct ISO9660_INODE_PRIVDATA* privdata)
+{
+	if (privdata->name_hash == NULL)
+		return;
+	for (unsigned int n = 0; n < ISO9660_NAME_HASH_SIZE; n++) {
+		struct ISO9660_NAME_ENTRY* ne = privdata->name_hash[n];
+		while (ne != NULL) {
+			struct ISO9660_NAME_ENTRY* next = ne->ne_next;
+			kfree(ne);
+			ne = next;
+		}
+	}
+	kfree(privdata->name_hash);
+	privdata->name_hash = NULL;
+}
+
 static void
 iso9660_discard_inode(struct VFS_INODE* inode)
 {
-	kfree(inode->i_privdata);
+	auto privdata = static_cast<struct ISO9660_INODE_PRIVDATA*>(inode->i_privdata);
+	iso9660_name_index_clear(privdata);
+	kfree(privdata);
 }
 
 static errorcode_t
@@ -241,6 +281,121 @@ iso9660_readdir(struct VFS_FILE* file, void* dirents, size_t* len)
 	return ananas_success();
 }
 
+static unsigned int
+iso9660_name_hash(const char* name)
+{
+	uint32_t hash = 2166136261U; /* FNV-1a */
+	for (/* nothing */; *name != '\0'; name++)
+		hash = (hash ^ (uint8_t)*name) * 16777619U;
+	return hash % ISO9660_NAME_HASH_SIZE;
+}
+
+/* Must be called with name_mtx held */
+static errorcode_t
+iso9660_name_index_build(struct DENTRY* parent)
+{
+	auto privdata = static_cast<struct ISO9660_INODE_PRIVDATA*>(parent->d_inode->i_privdata);
+	privdata->name_hash = static_cast<struct ISO9660_NAME_ENTRY**>(kmalloc(sizeof(struct ISO9660_NAME_ENTRY*) * ISO9660_NAME_HASH_SIZE));
+	memset(privdata->name_hash, 0, sizeof(struct ISO9660_NAME_ENTRY*) * ISO9660_NAME_HASH_SIZE);
+
+	/*
+	 * Use readdir to walk the records; this ensures the names we store are
+	 * exactly the ones which are reported to userland.
+	 */
+	struct VFS_FILE dirf;
+	memset(&dirf, 0, sizeof(dirf));
+	dirf.f_dentry = parent;
+	while (1) {
+		char buf[1024];
+		size_t buf_len = sizeof(buf);
+		errorcode_t err = iso9660_readdir(&dirf, buf, &buf_len);
+		if (ananas_is_failure(err)) {
+			iso9660_name_index_clear(privdata);
+			return err;
+		}
+		if (buf_len == 0)
+			break;
+
+		char* cur_ptr = buf;
+		while (buf_len > 0) {
+			struct VFS_DIRENT* de = (struct VFS_DIRENT*)cur_ptr;
+			buf_len -= DE_LENGTH(de); cur_ptr += DE_LENGTH(de);
+
+			size_t len = strlen(de->de_name);
+			auto ne = static_cast<struct ISO9660_NAME_ENTRY*>(kmalloc(sizeof(struct ISO9660_NAME_ENTRY) + len));
+			ne->ne_inum = de->de_inum;
+			memcpy(ne->ne_name, de->de_name, len + 1);
+
+			unsigned int bucket = iso9660_name_hash(de->de_name);
+			ne->ne_next = privdata->name_hash[bucket];
+			privdata->name_hash[bucket] = ne;
+		}
+	}
+	return ananas_success();
+}
+
+static errorcode_t
+iso9660_lookup(struct DENTRY* parent, struct VFS_INODE** destinode, const char* dentry)
+{
+	struct VFS_INODE* dir = parent->d_inode;
+	auto privdata = static_cast<struct ISO9660_INODE_PRIVDATA*>(dir->i_privdata);
+
+	/*
+	 * The filesystem is read-only, so once we've walked a directory we know
+	 * everything in it for as long as the inode lives.
+	 */
+	mutex_lock(&privdata->name_mtx);
+	if (privdata->name_hash == NULL) {
+		errorcode_t err = iso9660_name_index_build(parent);
+		if (ananas_is_failure(err)) {
+			mutex_unlock(&privdata->name_mtx);
+			return err;
+		}
+	}
+
+	ino_t inum = 0;
+	bool found = false;
+	for (struct ISO9660_NAME_ENTRY* ne = privdata->name_hash[iso9660_name_hash(dentry)]; ne != NULL; ne = ne->ne_next) {
+		if (strcmp(ne->ne_name, dentry) != 0)
+			continue;
+		inum = ne->ne_inum;
+		found = true;
+		break;
+	}
+	mutex_unlock(&privdata->name_mtx);
+
+	if (!found)
+		return ANANAS_ERROR(NO_FILE);
+	return vfs_get_inode(dir->i_fs, inum, destinode);
+}
+
+/*
+ * Ensures reads of the ISO9660_READ_AHEAD blocks starting at 'blocknum' are
+ * scheduled; this is cheap as files are a single contiguous extent.
+ */
+static void
+iso9660_read_ahead(struct VFS_INODE* inode, blocknr_t blocknum)
+{
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
+	auto privdata = static_cast<struct ISO9660_INODE_PRIVDATA*>(inode->i_privdata);
+	blocknr_t num_blocks = (inode->i_sb.st_size + fs->fs_block_size - 1) / fs->fs_block_size;
+
+	blocknr_t first = blocknum;
+	if (privdata->ra_next > first && privdata->ra_next <= first + ISO9660_READ_AHEAD)
+		first = privdata->ra_next; /* sequential read; skip what we already did */
+	blocknr_t last = blocknum + ISO9660_READ_AHEAD;
+	if (last > num_blocks)
+		last = num_blocks;
+
+	for (blocknr_t block = first; block < last; block++) {
+		struct BIO* bio;
+		if (ananas_is_failure(vfs_bget(fs, privdata->lba + block, &bio, BIO_READ_ASYNC)))
+			break;
+		bio_free(bio);
+	}
+	privdata->ra_next = last;
+}
+
 static errorcode_t
 iso9660_read(struct VFS_FILE* file, void* buf, size_t* len)
 {
@@ -256,6 +411,13 @@ iso9660_read(struct VFS_FILE* file, void* buf, size_t* len)
 		left = inode->i_sb.st_size - file->f_offset;
 
 	while(left > 0) {
+		/*
+		 * Keep the device busy with the blocks following this one; refill the
+		 * window once we've used up half of it, or if we have moved before it.
+		 */
+		if (blocknum + ISO9660_READ_AHEAD / 2 >= privdata->ra_next || blocknum + ISO9660_READ_AHEAD < privdata->ra_next)
+			iso9660_read_ahead(inode, blocknum);
+
 		/* Fetch the block */
 		struct BIO* bio;
 		errorcode_t err = vfs_bread(fs, privdata->lba + blocknum, &bio);
@@ -283,7 +445,7 @@ iso9660_read(struct VFS_FILE* file, void* buf, size_t* len)
 namespace {
 struct VFS_INODE_OPS iso9660_dir_ops = {
 	.readdir = iso9660_readdir,
-	.lookup = vfs_generic_lookup 
+	.lookup = iso9660_lookup
 };
 
 struct VFS_INODE_OPS iso9660_file_ops = {
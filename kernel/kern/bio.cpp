@@ -333,6 +333,13 @@ bio_get(Ananas::Device* device, blocknr_t block, size_t len, int flags)
 		return bio;
 	}
 
+	/*
+	 * If the caller only wants to get the read going, we're done; anyone
+	 * obtaining this block later on will wait until it has been read.
+	 */
+	if (flags & BIO_READ_ASYNC)
+		return bio;
+
 	/* ... and wait until we have something to report... */
 	bio_waitcomplete(bio);
 	TRACE(BIO, INFO, "dev=%p, block=%u, len=%u ==> new block %p", device, (int)block, len, bio);
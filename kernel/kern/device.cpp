@@ -16,6 +16,7 @@ Device::Device()
 	all_next = NULL; all_prev = NULL;
 	children_next = NULL; children_prev = NULL;
 	sem_init(&d_Waiters, 1);
+	poll_queue_init(&d_PollQueue);
 	LIST_INIT(&d_Children);
 }
 
@@ -26,6 +27,7 @@ Device::Device(const CreateDeviceProperties& cdp)
 	all_next = NULL; all_prev = NULL;
 	children_next = NULL; children_prev = NULL;
 	sem_init(&d_Waiters, 1);
+	poll_queue_init(&d_PollQueue);
 	LIST_INIT(&d_Children);
 }
 
@@ -17,6 +17,7 @@ TRACE_SETUP;
 // XXX The next constants are a kludge - we need to have a nicer mechanism to allocate
 //     virtual address space (vmspace should be extended for dynamic mappings)
 #define INTERPRETER_BASE 0xf000000
+#define DYNAMIC_BASE 0x1000000
 #define PHDR_BASE 0xd0000000
 #define ELFINFO_BASE 0xe000000
 
@@ -40,8 +41,43 @@ read_data(struct DENTRY* dentry, void* buf, off_t offset, size_t len)
 }
 
 #ifdef __amd64__
-static errorcode_t
-elf64_load_ph(vmspace_t* vs, struct DENTRY* dentry, const Elf64_Phdr& phdr, addr_t rbase)
+/*
+ * Everything needed to map a PT_LOAD segment, as relative to the load base;
+ * this is computed once per file and re-used every time it is executed.
+ */
+struct ELF64_SEGMENT {
+	addr_t		es_virt;	/* Page-aligned start address */
+	off_t		es_vskip;	/* Bytes to skip in the first page */
+	size_t		es_vlength;	/* Length of the mapping */
+	off_t		es_doffset;	/* Page-aligned file offset */
+	size_t		es_dlength;	/* Bytes backed by the file */
+	unsigned int	es_flags;	/* VM_FLAG_... */
+};
+
+struct ELF64_CACHE {
+	struct EXEC_CACHE ec;		/* Must be first */
+	Elf64_Half	ec_type;
+	Elf64_Addr	ec_entry;
+	Elf64_Off	ec_phoff;
+	Elf64_Half	ec_phnum;
+	Elf64_Half	ec_phentsize;
+	Elf64_Addr	ec_phdr_vaddr;	/* PT_PHDR address, if any */
+	char*		ec_interp;	/* PT_INTERP contents, if any */
+	unsigned int	ec_num_segments;
+	struct ELF64_SEGMENT* ec_segments;
+};
+
+static void
+elf64_cache_free(struct EXEC_CACHE* ec)
+{
+	auto cache = reinterpret_cast<struct ELF64_CACHE*>(ec);
+	kfree(cache->ec_interp);
+	kfree(cache->ec_segments);
+	kfree(cache);
+}
+
+static void
+elf64_make_segment(const Elf64_Phdr& phdr, struct ELF64_SEGMENT& es)
 {
 	/* Construct the flags for the actual mapping */
 	unsigned int flags = VM_FLAG_FAULT | VM_FLAG_USER;
@@ -60,18 +96,20 @@ elf64_load_ph(vmspace_t* vs, struct DENTRY* dentry, const Elf64_Phdr& phdr, addr
 	 * The program need not begin at a page-size, so we may need to adjust. XXX we need more checks here,
 	 * for example to see if we can even map this and if we aren't going out of bounds somewhere.
 	 */
-	vmarea_t* va;
 	addr_t virt_begin = ROUND_DOWN(phdr.p_vaddr, PAGE_SIZE);
 	addr_t virt_end   = ROUND_UP((phdr.p_vaddr + phdr.p_memsz), PAGE_SIZE);
-	off_t vskip = phdr.p_vaddr - virt_begin;
-	TRACE(EXEC, INFO, "elf map: vbegin=%p vend=%p vskip=%d offset=%d filesz=%d\n", virt_begin, virt_end, vskip, phdr.p_offset, phdr.p_filesz);
-	return vmspace_mapto_dentry(vs, rbase + virt_begin, vskip, virt_end - virt_begin, dentry, phdr.p_offset - vskip, phdr.p_filesz, flags, &va);
+	es.es_virt = virt_begin;
+	es.es_vskip = phdr.p_vaddr - virt_begin;
+	es.es_vlength = virt_end - virt_begin;
+	es.es_doffset = phdr.p_offset - es.es_vskip;
+	es.es_dlength = phdr.p_filesz;
+	es.es_flags = flags;
 }
 
 static errorcode_t
 elf64_check_header(const Elf64_Ehdr& ehdr)
 {
-	/* Perform basic ELF checks; must be statically-linked executable */
+	/* Perform basic ELF checks; must be an executable or shared object */
 	if (ehdr.e_ident[EI_MAG0] != ELFMAG0 || ehdr.e_ident[EI_MAG1] != ELFMAG1 ||
 	    ehdr.e_ident[EI_MAG2] != ELFMAG2 || ehdr.e_ident[EI_MAG3] != ELFMAG3)
 		return ANANAS_ERROR(BAD_EXEC);
@@ -86,17 +124,27 @@ elf64_check_header(const Elf64_Ehdr& ehdr)
 	if (ehdr.e_machine != EM_X86_64)
 		return ANANAS_ERROR(BAD_EXEC);
 
-	/* We only support static binaries here, so reject anything without a program table */
+	if (ehdr.e_type != ET_EXEC && ehdr.e_type != ET_DYN)
+		return ANANAS_ERROR(BAD_EXEC);
+
+	/* We need the program table to load anything */
 	if (ehdr.e_phnum == 0)
 		return ANANAS_ERROR(BAD_EXEC);
 	if (ehdr.e_phentsize < sizeof(Elf64_Phdr))
 		return ANANAS_ERROR(BAD_EXEC);
+	/* The entire program table is read at once; refuse anything silly */
+	if (ehdr.e_phnum * ehdr.e_phentsize > PAGE_SIZE)
+		return ANANAS_ERROR(BAD_EXEC);
 
 	return ananas_success();
 }
 
+/*
+ * Reads and validates the headers of the file, and turns them into a mapping
+ * template. This reads the ELF header and the program table once each.
+ */
 static errorcode_t
-elf64_load_file(vmspace_t* vs, struct DENTRY* dentry, addr_t rbase, addr_t* exec_addr)
+elf64_parse(struct DENTRY* dentry, struct ELF64_CACHE** out)
 {
 	errorcode_t err;
 	Elf64_Ehdr ehdr;
@@ -107,69 +155,177 @@ elf64_load_file(vmspace_t* vs, struct DENTRY* dentry, addr_t rbase, addr_t* exec
 	err = elf64_check_header(ehdr);
 	ANANAS_ERROR_RETURN(err);
 
-	/* Process all program headers one by one */
+	size_t ph_len = ehdr.e_phnum * ehdr.e_phentsize;
+	auto ph = static_cast<char*>(kmalloc(ph_len));
+	err = read_data(dentry, ph, ehdr.e_phoff, ph_len);
+	if (ananas_is_failure(err)) {
+		kfree(ph);
+		return err;
+	}
+
+	auto cache = new ELF64_CACHE;
+	memset(cache, 0, sizeof(*cache));
+	cache->ec.ec_free = elf64_cache_free;
+	cache->ec_type = ehdr.e_type;
+	cache->ec_entry = ehdr.e_entry;
+	cache->ec_phoff = ehdr.e_phoff;
+	cache->ec_phnum = ehdr.e_phnum;
+	cache->ec_phentsize = ehdr.e_phentsize;
+	cache->ec_segments = new ELF64_SEGMENT[ehdr.e_phnum];
+
 	for (unsigned int i = 0; i < ehdr.e_phnum; i++) {
-		Elf64_Phdr phdr;
-		err = read_data(dentry, &phdr, ehdr.e_phoff + i * ehdr.e_phentsize, sizeof(phdr));
-		ANANAS_ERROR_RETURN(err);
-		if(phdr.p_type != PT_LOAD)
-			continue;
+		const Elf64_Phdr& phdr = *reinterpret_cast<const Elf64_Phdr*>(ph + i * ehdr.e_phentsize);
+		switch(phdr.p_type) {
+			case PT_LOAD:
+				elf64_make_segment(phdr, cache->ec_segments[cache->ec_num_segments++]);
+				break;
+			case PT_PHDR:
+				cache->ec_phdr_vaddr = phdr.p_vaddr;
+				break;
+			case PT_INTERP: {
+				if (cache->ec_interp != nullptr) {
+					kprintf("elf64_load: multiple interp headers\n");
+					err = ANANAS_ERROR(BAD_EXEC);
+					break;
+				}
+
+				if (phdr.p_filesz >= PAGE_SIZE) {
+					kprintf("elf64_load: interp too large\n");
+					err = ANANAS_ERROR(BAD_EXEC);
+					break;
+				}
+
+				// Read the interpreter from disk
+				cache->ec_interp = static_cast<char*>(kmalloc(phdr.p_filesz + 1));
+				cache->ec_interp[phdr.p_filesz] = '\0';
+				err = read_data(dentry, cache->ec_interp, phdr.p_offset, phdr.p_filesz);
+				break;
+			}
+		}
+		if (ananas_is_failure(err))
+			break;
+	}
+	kfree(ph);
+
+	if (ananas_is_failure(err)) {
+		elf64_cache_free(&cache->ec);
+		return err;
+	}
+
+	*out = cache;
+	return ananas_success();
+}
+
+/*
+ * Obtains the template of the file, parsing it only if the inode does not have
+ * one yet. The result is referenced and must be freed using exec_cache_deref().
+ */
+static errorcode_t
+elf64_get_cache(struct DENTRY* dentry, struct ELF64_CACHE** out)
+{
+	struct VFS_INODE* inode = dentry->d_inode;
+	struct EXEC_CACHE* ec = exec_cache_get(inode);
+	if (ec != NULL && ec->ec_free != elf64_cache_free) {
+		/* Parsed by some other format, so it is not ours */
+		exec_cache_deref(ec);
+		return ANANAS_ERROR(BAD_EXEC);
+	}
 
-		err = elf64_load_ph(vs, dentry, phdr, rbase);
+	if (ec == NULL) {
+		/*
+		 * XXX If the file is written to while we are parsing it, we may attach a
+		 *     stale template; executables being modified while they are started
+		 *     are unlikely to work anyway.
+		 */
+		struct ELF64_CACHE* cache;
+		errorcode_t err = elf64_parse(dentry, &cache);
 		ANANAS_ERROR_RETURN(err);
+		ec = exec_cache_set(inode, &cache->ec);
 	}
 
-	*exec_addr = ehdr.e_entry;
+	*out = reinterpret_cast<struct ELF64_CACHE*>(ec);
 	return ananas_success();
 }
 
 static errorcode_t
-elf64_load(vmspace_t* vs, struct DENTRY* dentry, addr_t* exec_addr, register_t* exec_arg)
+elf64_map_segments(vmspace_t* vs, struct DENTRY* dentry, const struct ELF64_CACHE& cache, addr_t rbase)
 {
-	*exec_arg = 0;
+	for (unsigned int i = 0; i < cache.ec_num_segments; i++) {
+		const struct ELF64_SEGMENT& es = cache.ec_segments[i];
+		TRACE(EXEC, INFO, "elf map: vbegin=%p vlen=%d vskip=%d offset=%d filesz=%d\n", rbase + es.es_virt, es.es_vlength, es.es_vskip, es.es_doffset, es.es_dlength);
 
-	// Load the file - this checks the ELF header as well
-	errorcode_t err = elf64_load_file(vs, dentry, 0, exec_addr);
-	ANANAS_ERROR_RETURN(err);
+		vmarea_t* va;
+		errorcode_t err = vmspace_mapto_dentry(vs, rbase + es.es_virt, es.es_vskip, es.es_vlength, dentry, es.es_doffset, es.es_dlength, es.es_flags, &va);
+		ANANAS_ERROR_RETURN(err);
+	}
+	return ananas_success();
+}
 
-	// Fetch the ELF header (again - this could be nicer...)
-	Elf64_Ehdr ehdr;
-	err = read_data(dentry, &ehdr, 0, sizeof(ehdr));
+static errorcode_t
+elf64_load_interpreter(vmspace_t* vs, struct DENTRY* dentry, addr_t rbase, addr_t* exec_addr)
+{
+	struct ELF64_CACHE* cache;
+	errorcode_t err = elf64_get_cache(dentry, &cache);
 	ANANAS_ERROR_RETURN(err);
 
-	// Only accept executables here
-	if (ehdr.e_type != ET_EXEC)
+	// We load the interpreter at a base of our choosing, so it must be relocatable
+	if (cache->ec_type != ET_DYN || cache->ec_interp != nullptr) {
+		exec_cache_deref(&cache->ec);
 		return ANANAS_ERROR(BAD_EXEC);
+	}
 
-	// This went okay - see if there any other interesting headers here
-	char* interp = nullptr;
-	for (unsigned int i = 0; i < ehdr.e_phnum; i++) {
-		Elf64_Phdr phdr;
-		err = read_data(dentry, &phdr, ehdr.e_phoff + i * ehdr.e_phentsize, sizeof(phdr));
-		ANANAS_ERROR_RETURN(err);
-		switch(phdr.p_type) {
-			case PT_INTERP: {
-				if (interp != nullptr) {
-					kfree(interp);
-					kprintf("elf64_load: multiple interp headers\n");
-					return ANANAS_ERROR(BAD_EXEC);
-				}
+	err = elf64_map_segments(vs, dentry, *cache, rbase);
+	if (ananas_is_success(err))
+		*exec_addr = rbase + cache->ec_entry;
+	exec_cache_deref(&cache->ec);
+	return err;
+}
 
-				if (phdr.p_filesz >= PAGE_SIZE) {
-					kprintf("elf64_load: interp too large\n");
-					return ANANAS_ERROR(BAD_EXEC);
-				}
+static errorcode_t
+elf64_load(vmspace_t* vs, struct DENTRY* dentry, addr_t* exec_addr, register_t* exec_arg)
+{
+	*exec_arg = 0;
 
-				// Read the interpreter from disk
-				interp = static_cast<char*>(kmalloc(phdr.p_filesz + 1));
-				interp[phdr.p_filesz] = '\0';
+	// Fetch the file layout - this checks the ELF header as well
+	struct ELF64_CACHE* cache;
+	errorcode_t err = elf64_get_cache(dentry, &cache);
+	ANANAS_ERROR_RETURN(err);
 
-				err = read_data(dentry, interp, phdr.p_offset, phdr.p_filesz);
-				ANANAS_ERROR_RETURN(err); // XXX leaks interp
+	/*
+	 * Accept executables and position-independent executables; the latter
+	 * require an interpreter to relocate them, which also rejects shared
+	 * libraries.
+	 */
+	addr_t rbase = 0;
+	switch(cache->ec_type) {
+		case ET_EXEC:
+			break;
+		case ET_DYN:
+			if (cache->ec_interp != nullptr) {
+				rbase = DYNAMIC_BASE;
 				break;
 			}
-		}
-	 }
+			/* FALLTHROUGH */
+		default:
+			exec_cache_deref(&cache->ec);
+			return ANANAS_ERROR(BAD_EXEC);
+	}
+
+	err = elf64_map_segments(vs, dentry, *cache, rbase);
+	*exec_addr = rbase + cache->ec_entry;
+
+	// Copy what we need; the cache may go away once we release it
+	char* interp = nullptr;
+	if (ananas_is_success(err) && cache->ec_interp != nullptr) {
+		interp = static_cast<char*>(kmalloc(strlen(cache->ec_interp) + 1));
+		strcpy(interp, cache->ec_interp);
+	}
+	Elf64_Off phoff = cache->ec_phoff;
+	Elf64_Half phnum = cache->ec_phnum;
+	Elf64_Half phentsize = cache->ec_phentsize;
+	Elf64_Addr phdr_vaddr = cache->ec_phdr_vaddr;
+	exec_cache_deref(&cache->ec);
+	ANANAS_ERROR_RETURN(err);
 
 	if (interp != nullptr) {
 		// We need to use an interpreter to load this
@@ -186,23 +342,28 @@ elf64_load(vmspace_t* vs, struct DENTRY* dentry, addr_t* exec_addr, register_t*
 		// Load the interpreter ELF file
 		addr_t interp_rbase = INTERPRETER_BASE;
 		addr_t interp_entry;
-		err = elf64_load_file(vs, interp_file.f_dentry, interp_rbase, &interp_entry);
+		err = elf64_load_interpreter(vs, interp_file.f_dentry, interp_rbase, &interp_entry);
 		vfs_close(&interp_file); // we don't need it anymore
 		ANANAS_ERROR_RETURN(err);
 
 		/*
-		* Map the program headers in memory - we need to process them anyway, and we
-		* want to hand them over the the executable itself, as the dynamic loader
-		* will likely need them.
-		*
-		* XXX Note that _we_ can't use the mappings here because vs is likely not
-		*     our current vmspace...
-		*/
-		vmarea_t* va_phdr;
-		{
-			size_t phdr_len = ehdr.e_phnum * ehdr.e_phentsize;
-			err = vmspace_mapto_dentry(vs, PHDR_BASE, ehdr.e_phoff & (PAGE_SIZE - 1), phdr_len, dentry, ehdr.e_phoff & ~(PAGE_SIZE - 1), phdr_len, VM_FLAG_READ | VM_FLAG_USER, &va_phdr);
+		 * The dynamic loader needs the program headers to locate the dynamic
+		 * section. Usually, PT_PHDR tells us they are part of a loaded segment
+		 * already; if not, map them from the file.
+		 *
+		 * XXX Note that _we_ can't use the mappings here because vs is likely not
+		 *     our current vmspace...
+		 */
+		addr_t phdr_addr;
+		if (phdr_vaddr != 0) {
+			phdr_addr = rbase + phdr_vaddr;
+		} else {
+			vmarea_t* va_phdr;
+			off_t phdr_skip = phoff & (PAGE_SIZE - 1);
+			size_t phdr_len = phnum * phentsize;
+			err = vmspace_mapto_dentry(vs, PHDR_BASE, phdr_skip, phdr_skip + phdr_len, dentry, phoff - phdr_skip, phdr_len, VM_FLAG_READ | VM_FLAG_USER, &va_phdr);
 			ANANAS_ERROR_RETURN(err);
+			phdr_addr = va_phdr->va_virt + phdr_skip;
 		}
 
 		/*
@@ -219,7 +380,10 @@ elf64_load(vmspace_t* vs, struct DENTRY* dentry, addr_t* exec_addr, register_t*
 
 		// Now assign a page to there
 		struct VM_PAGE* vp = vmpage_create_private(va, VM_PAGE_FLAG_PRIVATE | VM_PAGE_FLAG_READONLY);
+		if (vp == nullptr)
+			return ANANAS_ERROR(OUT_OF_MEMORY);
 		vp->vp_vaddr = ELFINFO_BASE;
+		vmpage_map(vs, va, vp); // the area is not faultable, so it must be mapped now
 		auto elf_info = static_cast<struct ANANAS_ELF_INFO*>(kmem_map(page_get_paddr(vmpage_get_page(vp)), sizeof(struct ANANAS_ELF_INFO), VM_FLAG_READ | VM_FLAG_WRITE));
 		vmpage_unlock(vp);
 
@@ -227,14 +391,15 @@ elf64_load(vmspace_t* vs, struct DENTRY* dentry, addr_t* exec_addr, register_t*
 		memset(elf_info, 0, PAGE_SIZE);
 		elf_info->ei_size = sizeof(*elf_info);
 		elf_info->ei_interpreter_base = interp_rbase;
+		elf_info->ei_base = rbase;
 		elf_info->ei_entry = *exec_addr;
-		elf_info->ei_phdr = va_phdr->va_virt;
-		elf_info->ei_phdr_entries = ehdr.e_phnum;
+		elf_info->ei_phdr = phdr_addr;
+		elf_info->ei_phdr_entries = phnum;
 		kmem_unmap(elf_info, sizeof(struct ANANAS_ELF_INFO));
 
 		// Override the load address
-		*exec_addr = interp_entry + interp_rbase;
-		kprintf(">> exec addr %p virt %p\n", *exec_addr, *exec_arg);
+		*exec_addr = interp_entry;
+		TRACE(EXEC, INFO, "elf: interpreter entry %p, info at %p", *exec_addr, *exec_arg);
 	}
 
 	return ananas_success();
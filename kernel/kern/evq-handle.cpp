@@ -0,0 +1,396 @@
+/*
+ * Event queues keep a persistent set of handles to watch, so that a single
+ * thread can wait for any of them without having to pass the entire set on
+ * every call as poll() must.
+ *
+ * Every watched handle has an interest, which is registered with the poll
+ * queue of whatever the handle waits on. Once that queue is woken up, the
+ * interest is placed on the pending list; evq_wait() takes interests off the
+ * pending list and reports the handle if it is actually ready. Interests are
+ * only made pending by wakeups, which makes the queue edge-triggered.
+ *
+ * Interests do not hold a reference to the watched handle, as that would keep
+ * it alive after it is closed. Instead, every handle lists the interests
+ * watching it; once the handle is closed, these are detached from it and
+ * thrown away by the queue the next time it comes across them.
+ */
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/handle.h>
+#include <ananas/lib.h>
+#include <ananas/lock.h>
+#include <ananas/mm.h>
+#include <ananas/poll.h>
+#include <ananas/process.h>
+#include <ananas/trace.h>
+#include <ananas/thread.h>
+
+TRACE_SETUP;
+
+struct EVQ_INTEREST {
+	struct POLL_ENTRY ei_entry;
+	struct EVENT_QUEUE* ei_queue;
+	struct HANDLE* ei_handle;	/* Watched handle, NULL once closed */
+	handleindex_t ei_index;		/* Index the handle was added by */
+	void* ei_data;
+	bool ei_pending;
+	LIST_FIELDS_IT(struct EVQ_INTEREST, all);
+	LIST_FIELDS_IT(struct EVQ_INTEREST, pending);
+	LIST_FIELDS_IT(struct EVQ_INTEREST, handle);
+};
+
+/* Protects the interest lists of all handles, and ei_handle */
+static spinlock_t spl_evq_handles = SPINLOCK_DEFAULT_INIT;
+
+struct EVENT_QUEUE {
+	mutex_t evq_mutex;		/* Protects the interests */
+	refcount_t evq_refcount;	/* Number of handles */
+	struct EVQ_INTEREST_LIST evq_interests;
+	spinlock_t evq_lock;		/* Protects the pending list */
+	struct EVQ_INTEREST_LIST evq_pending;
+	semaphore_t evq_sem;		/* Signalled when something becomes pending */
+	struct POLL_QUEUE evq_poll;	/* Pollers of the queue itself */
+};
+
+/* Returns true if the interest was not pending yet */
+static bool
+evq_make_pending(struct EVENT_QUEUE* evq, struct EVQ_INTEREST* ei)
+{
+	register_t state = spinlock_lock_unpremptible(&evq->evq_lock);
+	bool was_pending = ei->ei_pending;
+	if (!was_pending) {
+		LIST_APPEND_IP(&evq->evq_pending, pending, ei);
+		ei->ei_pending = true;
+	}
+	spinlock_unlock_unpremptible(&evq->evq_lock, state);
+	return !was_pending;
+}
+
+/* Called with the lock of the watched object's poll queue held */
+static void
+evq_notify(struct POLL_ENTRY* pe, unsigned int events)
+{
+	auto ei = static_cast<struct EVQ_INTEREST*>(pe->pe_context);
+	struct EVENT_QUEUE* evq = ei->ei_queue;
+
+	if (evq_make_pending(evq, ei)) {
+		sem_signal(&evq->evq_sem);
+		poll_wakeup(&evq->evq_poll, POLLIN);
+	}
+}
+
+/* Must be called with spl_evq_handles held */
+static void
+evq_detach(struct EVQ_INTEREST* ei)
+{
+	if (ei->ei_handle != NULL) {
+		LIST_REMOVE_IP(&ei->ei_handle->h_evq_interests, handle, ei);
+		ei->ei_handle = NULL;
+	}
+
+	/* Once unregistered, no one can make the interest pending anymore */
+	poll_unregister(&ei->ei_entry);
+}
+
+/* Returns a reference to the watched handle, or NULL if it was closed */
+static struct HANDLE*
+evq_ref_handle(struct EVQ_INTEREST* ei)
+{
+	register_t state = spinlock_lock_unpremptible(&spl_evq_handles);
+	struct HANDLE* handle = ei->ei_handle;
+	if (handle != NULL)
+		handle_ref(handle); /* cannot be the final reference; closing detaches us first */
+	spinlock_unlock_unpremptible(&spl_evq_handles, state);
+	return handle;
+}
+
+/* Must be called with the queue mutex held */
+static void
+evq_remove(struct EVENT_QUEUE* evq, struct EVQ_INTEREST* ei)
+{
+	register_t state = spinlock_lock_unpremptible(&spl_evq_handles);
+	evq_detach(ei);
+	spinlock_unlock_unpremptible(&spl_evq_handles, state);
+
+	state = spinlock_lock_unpremptible(&evq->evq_lock);
+	if (ei->ei_pending)
+		LIST_REMOVE_IP(&evq->evq_pending, pending, ei);
+	spinlock_unlock_unpremptible(&evq->evq_lock, state);
+
+	LIST_REMOVE_IP(&evq->evq_interests, all, ei);
+	kfree(ei);
+}
+
+/* Must be called with the queue mutex held */
+static struct EVQ_INTEREST*
+evq_find(struct EVENT_QUEUE* evq, handleindex_t index)
+{
+	LIST_FOREACH_SAFE_IP(&evq->evq_interests, all, ei, struct EVQ_INTEREST) {
+		if (ei->ei_index != index)
+			continue;
+		if (ei->ei_handle != NULL)
+			return ei;
+
+		/* Left behind by a closed handle; the index may be reused by now */
+		evq_remove(evq, ei);
+	}
+	return NULL;
+}
+
+static errorcode_t
+evq_get(struct HANDLE* handle, struct EVENT_QUEUE** evq)
+{
+	if (handle->h_type != HANDLE_TYPE_EVQ || handle->h_data.d_evq == NULL)
+		return ANANAS_ERROR(BAD_HANDLE);
+	*evq = handle->h_data.d_evq;
+	return ananas_success();
+}
+
+errorcode_t
+evq_connect(struct HANDLE* handle)
+{
+	KASSERT(handle->h_type == HANDLE_TYPE_EVQ, "handle is not an event queue");
+
+	auto evq = new EVENT_QUEUE;
+	memset(evq, 0, sizeof(*evq));
+	mutex_init(&evq->evq_mutex, "evq");
+	evq->evq_refcount = 1;
+	LIST_INIT(&evq->evq_interests);
+	spinlock_init(&evq->evq_lock);
+	LIST_INIT(&evq->evq_pending);
+	sem_init(&evq->evq_sem, 0);
+	poll_queue_init(&evq->evq_poll);
+
+	handle->h_data.d_evq = evq;
+	return ananas_success();
+}
+
+errorcode_t
+evq_control(thread_t* t, struct HANDLE* handle, int op, const struct EVQ_EVENT* ev)
+{
+	struct EVENT_QUEUE* evq;
+	errorcode_t err = evq_get(handle, &evq);
+	ANANAS_ERROR_RETURN(err);
+
+	mutex_lock(&evq->evq_mutex);
+	struct EVQ_INTEREST* ei = evq_find(evq, ev->ev_handle);
+	switch(op) {
+		case EVQ_CTL_ADD: {
+			if (ei != NULL) {
+				err = ANANAS_ERROR(FILE_EXISTS);
+				break;
+			}
+
+			struct HANDLE* target;
+			err = handle_lookup(t->t_process, ev->ev_handle, HANDLE_TYPE_ANY, &target);
+			if (ananas_is_failure(err))
+				break;
+			if (target->h_type == HANDLE_TYPE_EVQ) {
+				/* Watching event queues could create reference loops */
+				handle_deref(target);
+				err = ANANAS_ERROR(BAD_TYPE);
+				break;
+			}
+
+			ei = new EVQ_INTEREST;
+			memset(ei, 0, sizeof(*ei));
+			ei->ei_queue = evq;
+			ei->ei_index = ev->ev_handle;
+			ei->ei_data = ev->ev_data;
+			ei->ei_entry.pe_events = ev->ev_events;
+			ei->ei_entry.pe_notify = evq_notify;
+			ei->ei_entry.pe_context = ei;
+			LIST_APPEND_IP(&evq->evq_interests, all, ei);
+
+			register_t state = spinlock_lock_unpremptible(&spl_evq_handles);
+			ei->ei_handle = target;
+			LIST_APPEND_IP(&target->h_evq_interests, handle, ei);
+			spinlock_unlock_unpremptible(&spl_evq_handles, state);
+
+			/* If the handle is ready already, it will not be woken up for it */
+			unsigned int events;
+			err = handle_poll(t, ev->ev_handle, target, &ei->ei_entry, &events);
+			if (ananas_is_failure(err)) {
+				evq_remove(evq, ei);
+				handle_deref(target);
+				break;
+			}
+
+			/*
+			 * If the handle was closed in the meantime, it may have detached us
+			 * before we registered with its poll queue; verify it is still there.
+			 */
+			struct HANDLE* current;
+			if (ananas_is_failure(handle_lookup(t->t_process, ev->ev_handle, HANDLE_TYPE_ANY, &current)))
+				current = NULL;
+			else
+				handle_deref(current);
+			handle_deref(target);
+			if (current != target) {
+				evq_remove(evq, ei);
+				err = ANANAS_ERROR(BAD_HANDLE);
+				break;
+			}
+
+			if ((events & (ev->ev_events | POLLERR | POLLHUP)) && evq_make_pending(evq, ei)) {
+				sem_signal(&evq->evq_sem);
+				poll_wakeup(&evq->evq_poll, POLLIN);
+			}
+			break;
+		}
+		case EVQ_CTL_MOD:
+			if (ei == NULL) {
+				err = ANANAS_ERROR(BAD_HANDLE);
+				break;
+			}
+			ei->ei_entry.pe_events = ev->ev_events;
+			ei->ei_data = ev->ev_data;
+
+			/* Re-evaluate the new mask on the next wait */
+			if (evq_make_pending(evq, ei))
+				sem_signal(&evq->evq_sem);
+			break;
+		case EVQ_CTL_DEL:
+			if (ei == NULL) {
+				err = ANANAS_ERROR(BAD_HANDLE);
+				break;
+			}
+			evq_remove(evq, ei);
+			break;
+		default:
+			err = ANANAS_ERROR(BAD_OPERATION);
+			break;
+	}
+	mutex_unlock(&evq->evq_mutex);
+	return err;
+}
+
+errorcode_t
+evq_collect(thread_t* t, struct HANDLE* handle, struct EVQ_EVENT* events, size_t* num, int timeout)
+{
+	struct EVENT_QUEUE* evq;
+	errorcode_t err = evq_get(handle, &evq);
+	ANANAS_ERROR_RETURN(err);
+
+	uint64_t deadline = poll_deadline(timeout);
+	size_t max = *num, n = 0;
+	for (;;) {
+		mutex_lock(&evq->evq_mutex);
+		while (n < max) {
+			register_t state = spinlock_lock_unpremptible(&evq->evq_lock);
+			struct EVQ_INTEREST* ei = LIST_HEAD(&evq->evq_pending);
+			if (ei != NULL) {
+				LIST_POP_HEAD_IP(&evq->evq_pending, pending);
+				ei->ei_pending = false;
+			}
+			spinlock_unlock_unpremptible(&evq->evq_lock, state);
+			if (ei == NULL)
+				break;
+
+			struct HANDLE* watched = evq_ref_handle(ei);
+			if (watched == NULL) {
+				/* Closed; it was made pending just so we would clean it up */
+				evq_remove(evq, ei);
+				continue;
+			}
+
+			/* Wakeups may be spurious; only report what is actually there */
+			unsigned int ready;
+			if (ananas_is_failure(handle_poll(t, ei->ei_index, watched, NULL, &ready)))
+				ready = POLLERR;
+			handle_deref(watched);
+			ready &= ei->ei_entry.pe_events | POLLERR | POLLHUP;
+			if (ready == 0)
+				continue;
+
+			struct EVQ_EVENT* ev = &events[n++];
+			ev->ev_handle = ei->ei_index;
+			ev->ev_events = ready;
+			ev->ev_data = ei->ei_data;
+		}
+		mutex_unlock(&evq->evq_mutex);
+
+		if (n > 0 || !poll_sleep(&evq->evq_sem, timeout, deadline))
+			break;
+	}
+
+	*num = n;
+	return ananas_success();
+}
+
+void
+evq_handle_closed(struct HANDLE* handle)
+{
+	register_t state = spinlock_lock_unpremptible(&spl_evq_handles);
+	while (!LIST_EMPTY(&handle->h_evq_interests)) {
+		struct EVQ_INTEREST* ei = LIST_HEAD(&handle->h_evq_interests);
+		evq_detach(ei);
+
+		/*
+		 * The queue still owns the interest; have it thrown away on the next
+		 * wait. Its queue cannot be gone yet, as that would have detached us.
+		 */
+		struct EVENT_QUEUE* evq = ei->ei_queue;
+		if (evq_make_pending(evq, ei))
+			sem_signal(&evq->evq_sem);
+	}
+	spinlock_unlock_unpremptible(&spl_evq_handles, state);
+}
+
+static errorcode_t
+evqhandle_poll(thread_t* t, handleindex_t index, struct HANDLE* handle, struct POLL_ENTRY* pe, unsigned int* events)
+{
+	struct EVENT_QUEUE* evq;
+	errorcode_t err = evq_get(handle, &evq);
+	ANANAS_ERROR_RETURN(err);
+
+	if (pe != NULL)
+		poll_register(&evq->evq_poll, pe);
+
+	register_t state = spinlock_lock_unpremptible(&evq->evq_lock);
+	*events = LIST_EMPTY(&evq->evq_pending) ? 0 : POLLIN;
+	spinlock_unlock_unpremptible(&evq->evq_lock, state);
+	return ananas_success();
+}
+
+static errorcode_t
+evqhandle_free(process_t* proc, struct HANDLE* handle)
+{
+	struct EVENT_QUEUE* evq = handle->h_data.d_evq;
+	if (evq == NULL)
+		return ananas_success(); /* never connected */
+	handle->h_data.d_evq = NULL;
+	if (__sync_sub_and_fetch(&evq->evq_refcount, 1) > 0)
+		return ananas_success();
+
+	/* Final handle is gone; stop watching everything */
+	mutex_lock(&evq->evq_mutex);
+	while (!LIST_EMPTY(&evq->evq_interests))
+		evq_remove(evq, LIST_HEAD(&evq->evq_interests));
+	mutex_unlock(&evq->evq_mutex);
+	kfree(evq);
+	return ananas_success();
+}
+
+static errorcode_t
+evqhandle_clone(process_t* proc_in, handleindex_t index, struct HANDLE* handle, struct CLONE_OPTIONS* opts, process_t* proc_out, struct HANDLE** handle_out, handleindex_t index_out_min, handleindex_t* index_out)
+{
+	struct EVENT_QUEUE* evq;
+	errorcode_t err = evq_get(handle, &evq);
+	ANANAS_ERROR_RETURN(err);
+
+	/* Both handles share the same queue, including what it watches */
+	err = handle_clone_generic(handle, proc_out, handle_out, index_out_min, index_out);
+	ANANAS_ERROR_RETURN(err);
+	__sync_fetch_and_add(&evq->evq_refcount, 1);
+	return ananas_success();
+}
+
+static struct HANDLE_OPS evq_hops = {
+	.hop_free = evqhandle_free,
+	.hop_clone = evqhandle_clone,
+	.hop_poll = evqhandle_poll,
+};
+HANDLE_TYPE(HANDLE_TYPE_EVQ, "evq", evq_hops);
+
+/* vim:set ts=2 sw=2: */
@@ -1,9 +1,18 @@
 #include <ananas/exec.h>
 #include <ananas/lib.h>
 #include <ananas/init.h>
+#include <ananas/kmem.h>
+#include <ananas/limits.h>
+#include <ananas/page.h>
 #include <ananas/process.h>
+#include <ananas/syscall.h>
 #include <ananas/thread.h>
 #include <ananas/trace.h>
+#include <ananas/vfs/types.h>
+#include <ananas/vm.h>
+#include <ananas/vmpage.h>
+#include <ananas/vmspace.h>
+#include <machine/param.h>
 
 TRACE_SETUP;
 
@@ -41,6 +50,214 @@ exec_load(vmspace_t* vs, struct DENTRY* dentry, addr_t* exec_addr, register_t* e
 
 INIT_FUNCTION(exec_init, SUBSYSTEM_THREAD, ORDER_FIRST);
 
+namespace {
+
+/*
+ * Fills an area of a vmspace which need not be active, front to back; only
+ * the page currently being written is mapped in the kernel.
+ */
+struct ARG_WRITER {
+	vmspace_t* aw_vs;
+	vmarea_t* aw_va;
+	addr_t aw_page;		/* Page mapped at aw_kva, if any */
+	char* aw_kva;
+};
+
+void
+arg_writer_unmap(ARG_WRITER& aw)
+{
+	if (aw.aw_kva != nullptr)
+		kmem_unmap(aw.aw_kva, PAGE_SIZE);
+	aw.aw_kva = nullptr;
+	aw.aw_page = 0;
+}
+
+/* Returns a kernel pointer to 'virt', backing its page if needed; nullptr if out of memory */
+char*
+arg_writer_get(ARG_WRITER& aw, addr_t virt)
+{
+	addr_t page = virt & ~(PAGE_SIZE - 1);
+	if (aw.aw_kva != nullptr && aw.aw_page == page)
+		return aw.aw_kva + (virt - page);
+	arg_writer_unmap(aw);
+
+	// The page may have been backed by the other writer already
+	struct VM_PAGE* vp = vmpage_lookup_vaddr_locked(aw.aw_va, page);
+	bool fresh = vp == nullptr;
+	if (fresh) {
+		vp = vmpage_create_private(aw.aw_va, VM_PAGE_FLAG_PRIVATE);
+		if (vp == nullptr)
+			return nullptr;
+		vp->vp_vaddr = page;
+		vmpage_map(aw.aw_vs, aw.aw_va, vp);
+	}
+	aw.aw_kva = static_cast<char*>(kmem_map(page_get_paddr(vmpage_get_page(vp)), PAGE_SIZE, VM_FLAG_READ | VM_FLAG_WRITE));
+	aw.aw_page = page;
+	vmpage_unlock(vp);
+
+	if (fresh)
+		memset(aw.aw_kva, 0, PAGE_SIZE);
+	return aw.aw_kva + (virt - page);
+}
+
+errorcode_t
+fetch_pointer(const char* const* vec, size_t n, bool from_user, const char** out)
+{
+	if (!from_user) {
+		*out = vec[n];
+		return ananas_success();
+	}
+	return copyin(out, &vec[n], sizeof(*out));
+}
+
+/* Copies a string of at most 'max' bytes; yields BAD_LENGTH if it does not fit */
+errorcode_t
+copy_string(char* dst, const char* src, size_t max, bool from_user, size_t* len)
+{
+	if (from_user)
+		return copyinstr(dst, src, max, len);
+
+	for (size_t n = 0; n < max; n++) {
+		dst[n] = src[n];
+		if (src[n] == '\0') {
+			*len = n + 1;
+			return ananas_success();
+		}
+	}
+	return ANANAS_ERROR(BAD_LENGTH);
+}
+
+errorcode_t
+count_vector(const char* const* vec, bool from_user, size_t* count)
+{
+	*count = 0;
+	if (vec == nullptr)
+		return ananas_success();
+
+	for (;;) {
+		const char* p;
+		errorcode_t err = fetch_pointer(vec, *count, from_user, &p);
+		ANANAS_ERROR_RETURN(err);
+		if (p == nullptr)
+			return ananas_success();
+		if (++*count >= ARG_MAX / sizeof(char*))
+			return ANANAS_ERROR(BAD_LENGTH);
+	}
+}
+
+/*
+ * Writes the pointers of 'vec' at 'ptrs' and the strings they refer to at
+ * 'strings', which is advanced past them; 'end' is the end of the area.
+ */
+errorcode_t
+write_vector(ARG_WRITER& aw_ptrs, addr_t& ptrs, ARG_WRITER& aw_strings, addr_t& strings, addr_t end, const char* const* vec, size_t count, bool from_user)
+{
+	for (size_t n = 0; n < count; n++) {
+		const char* src;
+		errorcode_t err = fetch_pointer(vec, n, from_user, &src);
+		ANANAS_ERROR_RETURN(err);
+		if (src == nullptr)
+			return ANANAS_ERROR(BAD_ADDRESS); // changed underneath us
+
+		char* ptr = arg_writer_get(aw_ptrs, ptrs);
+		if (ptr == nullptr)
+			return ANANAS_ERROR(OUT_OF_MEMORY);
+		*reinterpret_cast<addr_t*>(ptr) = strings;
+		ptrs += sizeof(addr_t);
+
+		// Copy the string page by page, until we have seen the terminator
+		for (;;) {
+			size_t room = PAGE_SIZE - (strings & (PAGE_SIZE - 1));
+			if (room > end - strings)
+				room = end - strings;
+			if (room == 0)
+				return ANANAS_ERROR(BAD_LENGTH);
+
+			char* dst = arg_writer_get(aw_strings, strings);
+			if (dst == nullptr)
+				return ANANAS_ERROR(OUT_OF_MEMORY);
+
+			size_t len;
+			err = copy_string(dst, src, room, from_user, &len);
+			if (ananas_is_success(err)) {
+				strings += len;
+				break;
+			}
+			if (ANANAS_ERROR_CODE(err) != ANANAS_ERROR_BAD_LENGTH)
+				return err;
+			strings += room;
+			src += room;
+		}
+	}
+
+	// Terminate the vector; the page is zero-filled, but it may not exist yet
+	char* ptr = arg_writer_get(aw_ptrs, ptrs);
+	if (ptr == nullptr)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+	*reinterpret_cast<addr_t*>(ptr) = 0;
+	ptrs += sizeof(addr_t);
+	return ananas_success();
+}
+
+} // unnamed namespace
+
+/*
+ * The area looks as follows:
+ *
+ *   argv[0] ... argv[argc - 1] NULL envp[0] ... envp[envc - 1] NULL strings
+ *
+ * Only pages we actually write are backed; the remainder of the ARG_MAX bytes
+ * reserved for the area is zero-filled on demand should anyone touch it.
+ */
+errorcode_t
+exec_prepare_args(vmspace_t* vs, const char* const* argv, const char* const* envp, bool from_user, struct EXEC_ARGS* ea)
+{
+	size_t argc, envc;
+	errorcode_t err = count_vector(argv, from_user, &argc);
+	ANANAS_ERROR_RETURN(err);
+	err = count_vector(envp, from_user, &envc);
+	ANANAS_ERROR_RETURN(err);
+
+	// Keep a copy of argv[0], so the process can be named without looking at its memory
+	ea->ea_name[0] = '\0';
+	if (argc > 0) {
+		const char* arg0;
+		err = fetch_pointer(argv, 0, from_user, &arg0);
+		ANANAS_ERROR_RETURN(err);
+		size_t len;
+		err = copy_string(ea->ea_name, arg0, sizeof(ea->ea_name) - 1, from_user, &len);
+		if (ananas_is_failure(err) && ANANAS_ERROR_CODE(err) != ANANAS_ERROR_BAD_LENGTH)
+			return err;
+		ea->ea_name[sizeof(ea->ea_name) - 1] = '\0';
+	}
+
+	size_t ptrs_len = (argc + 1 + envc + 1) * sizeof(addr_t);
+	if (ptrs_len > ARG_MAX)
+		return ANANAS_ERROR(BAD_LENGTH);
+
+	vmarea_t* va;
+	err = vmspace_map(vs, ARG_MAX, VM_FLAG_USER | VM_FLAG_READ | VM_FLAG_WRITE | VM_FLAG_PRIVATE | VM_FLAG_FAULT, &va);
+	ANANAS_ERROR_RETURN(err);
+
+	ARG_WRITER aw_ptrs = { vs, va, 0, nullptr };
+	ARG_WRITER aw_strings = { vs, va, 0, nullptr };
+	addr_t ptrs = va->va_virt;
+	addr_t strings = va->va_virt + ptrs_len;
+	addr_t end = va->va_virt + ARG_MAX;
+
+	ea->ea_argc = argc;
+	ea->ea_argv = ptrs;
+	err = write_vector(aw_ptrs, ptrs, aw_strings, strings, end, argv, argc, from_user);
+	ea->ea_envp = ptrs;
+	if (ananas_is_success(err))
+		err = write_vector(aw_ptrs, ptrs, aw_strings, strings, end, envp, envc, from_user);
+
+	arg_writer_unmap(aw_ptrs);
+	arg_writer_unmap(aw_strings);
+	// On failure, the area is freed along with the vmspace by our caller
+	return err;
+}
+
 errorcode_t
 exec_register_format(struct EXEC_FORMAT* ef)
 {
@@ -55,4 +272,58 @@ exec_unregister_format(struct EXEC_FORMAT* ef)
 	return ananas_success();
 }
 
+struct EXEC_CACHE*
+exec_cache_get(struct VFS_INODE* inode)
+{
+	INODE_LOCK(inode);
+	struct EXEC_CACHE* ec = inode->i_exec_cache;
+	if (ec != NULL)
+		__sync_fetch_and_add(&ec->ec_refcount, 1);
+	INODE_UNLOCK(inode);
+	return ec;
+}
+
+struct EXEC_CACHE*
+exec_cache_set(struct VFS_INODE* inode, struct EXEC_CACHE* ec)
+{
+	/* One reference belongs to the inode, the other to the caller */
+	ec->ec_refcount = 2;
+
+	INODE_LOCK(inode);
+	struct EXEC_CACHE* cur = inode->i_exec_cache;
+	if (cur == NULL) {
+		inode->i_exec_cache = ec;
+		INODE_UNLOCK(inode);
+		return ec;
+	}
+
+	/* Someone beat us to it; use theirs instead */
+	__sync_fetch_and_add(&cur->ec_refcount, 1);
+	INODE_UNLOCK(inode);
+	ec->ec_free(ec);
+	return cur;
+}
+
+void
+exec_cache_deref(struct EXEC_CACHE* ec)
+{
+	if (__sync_sub_and_fetch(&ec->ec_refcount, 1) == 0)
+		ec->ec_free(ec);
+}
+
+void
+exec_cache_invalidate(struct VFS_INODE* inode)
+{
+	if (inode->i_exec_cache == NULL)
+		return; /* nothing to do; avoids locking on every write */
+
+	INODE_LOCK(inode);
+	struct EXEC_CACHE* ec = inode->i_exec_cache;
+	inode->i_exec_cache = NULL;
+	INODE_UNLOCK(inode);
+
+	if (ec != NULL)
+		exec_cache_deref(ec);
+}
+
 /* vim:set ts=2 sw=2: */
@@ -5,6 +5,7 @@
 #include <ananas/lib.h>
 #include <ananas/lock.h>
 #include <ananas/mm.h>
+#include <ananas/poll.h>
 #include <ananas/process.h>
 #include <ananas/schedule.h>
 #include <ananas/trace.h>
@@ -13,11 +14,13 @@
 
 TRACE_SETUP;
 
-#define NUM_HANDLES 500 /* XXX shouldn't be static */
+#define HANDLE_POOL_CHUNK 64 /* Handles to add to the pool at once */
+#define HANDLE_CACHE_MAX 16 /* Freed handles a process keeps for itself */
+#define HANDLE_TABLE_MIN 32 /* Initial number of slots per process */
 
 static struct HANDLE_QUEUE handle_freelist;
 static spinlock_t spl_handlequeue;
-static struct HANDLE_TYPES handle_types;
+static struct HANDLE_TYPE* handle_types[HANDLE_NUM_TYPES];
 static spinlock_t spl_handletypes;
 
 void
@@ -25,49 +28,138 @@ handle_init()
 {
 	spinlock_init(&spl_handlequeue);
 	spinlock_init(&spl_handletypes);
-	LIST_INIT(&handle_types);
+	LIST_INIT(&handle_freelist);
+}
 
-	auto pool = new HANDLE[NUM_HANDLES];
-	memset(pool, 0, sizeof(struct HANDLE) * NUM_HANDLES);
+/*
+ * Handles are never returned to the allocator once created; this means a
+ * handle pointer found by handle_lookup() always refers to a struct HANDLE,
+ * even if it was freed and reused in the meantime.
+ */
+static struct HANDLE*
+handle_pool_get()
+{
+	spinlock_lock(&spl_handlequeue);
+	if (LIST_EMPTY(&handle_freelist)) {
+		spinlock_unlock(&spl_handlequeue);
+		auto pool = new HANDLE[HANDLE_POOL_CHUNK];
+		memset(pool, 0, sizeof(struct HANDLE) * HANDLE_POOL_CHUNK);
+
+		spinlock_lock(&spl_handlequeue);
+		for (unsigned int i = 0; i < HANDLE_POOL_CHUNK; i++) {
+			struct HANDLE* h = &pool[i];
+			LIST_APPEND(&handle_freelist, h);
+		}
+	}
+	struct HANDLE* handle = LIST_HEAD(&handle_freelist);
+	LIST_POP_HEAD(&handle_freelist);
+	spinlock_unlock(&spl_handlequeue);
+	return handle;
+}
 
-	/* Add all handles to the queue one by one */
-	LIST_INIT(&handle_freelist);
-	for (unsigned int i = 0; i < NUM_HANDLES; i++) {
-		struct HANDLE* h = &pool[i];
-		LIST_APPEND(&handle_freelist, h);
+static void
+handle_pool_put(struct HANDLE* handle)
+{
+	spinlock_lock(&spl_handlequeue);
+	LIST_APPEND(&handle_freelist, handle);
+	spinlock_unlock(&spl_handlequeue);
+}
+
+/* Must be called with the process lock held */
+static errorcode_t
+handle_table_grow(process_t* proc, unsigned int min_size)
+{
+	struct HANDLE_TABLE* old_tab = proc->p_handle_table;
+	unsigned int old_size = old_tab != NULL ? old_tab->htab_size : 0;
+	unsigned int new_size = old_size > 0 ? old_size * 2 : HANDLE_TABLE_MIN;
+	while (new_size < min_size)
+		new_size *= 2;
+	if (new_size > PROCESS_MAX_HANDLES)
+		new_size = PROCESS_MAX_HANDLES;
+	if (new_size <= old_size || new_size < min_size)
+		return ANANAS_ERROR(OUT_OF_HANDLES);
+
+	auto tab = static_cast<struct HANDLE_TABLE*>(kmalloc(sizeof(struct HANDLE_TABLE) + (new_size - 1) * sizeof(struct HANDLE*)));
+	auto bitmap = new uint32_t[new_size / 32];
+	if (tab == NULL || bitmap == NULL) {
+		kfree(tab);
+		kfree(bitmap);
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+	}
+	tab->htab_size = new_size;
+	tab->htab_prev = old_tab;
+	for (unsigned int n = 0; n < new_size; n++)
+		tab->htab_handle[n] = n < old_size ? old_tab->htab_handle[n] : NULL;
+	memset(bitmap, 0, new_size / 8);
+	if (old_size > 0)
+		memcpy(bitmap, proc->p_handle_bitmap, old_size / 8);
+
+	/* Ensure the table contents are visible before the table itself is */
+	__sync_synchronize();
+	proc->p_handle_table = tab;
+	kfree(proc->p_handle_bitmap);
+	proc->p_handle_bitmap = bitmap;
+	return ananas_success();
+}
+
+/* Returns the first free slot >= index_from, or -1; process lock must be held */
+static handleindex_t
+handle_table_find_free(process_t* proc, handleindex_t index_from)
+{
+	struct HANDLE_TABLE* tab = proc->p_handle_table;
+	if (tab == NULL)
+		return -1;
+	unsigned int num_words = tab->htab_size / 32;
+	for (unsigned int w = index_from / 32; w < num_words; w++) {
+		uint32_t used = proc->p_handle_bitmap[w];
+		if (w == (unsigned int)index_from / 32)
+			used |= (1U << (index_from % 32)) - 1; /* skip anything before index_from */
+		if (used == 0xffffffff)
+			continue;
+		return w * 32 + __builtin_ctz(~used);
 	}
+	return -1;
 }
 
 errorcode_t
 handle_alloc(int type, process_t* proc, handleindex_t index_from, struct HANDLE** handle_out, handleindex_t* index_out)
 {
 	KASSERT(proc != NULL, "handle_alloc() without process");
+	if (index_from < 0 || index_from >= PROCESS_MAX_HANDLES)
+		return ANANAS_ERROR(BAD_RANGE);
 
-	/* Look up the handle type XXX O(n) */
+	/* Look up the handle type */
 	struct HANDLE_TYPE* htype = NULL;
-	spinlock_lock(&spl_handletypes);
-	LIST_FOREACH(&handle_types, ht, struct HANDLE_TYPE) {
-		if (ht->ht_id != type)
-			continue;
-		htype = ht;
-		break;
-	}
-	spinlock_unlock(&spl_handletypes);
+	if (type > HANDLE_TYPE_UNUSED && type < HANDLE_NUM_TYPES)
+		htype = handle_types[type];
 	if (htype == NULL)
 		return ANANAS_ERROR(BAD_TYPE);
 
-	/* Grab a handle from the pool */
-	spinlock_lock(&spl_handlequeue);
-	if (LIST_EMPTY(&handle_freelist)) {
-		/* XXX should we wait for a new handle, or just give an error? */
-		panic("out of handles");
+	/* Find a slot, growing the table as needed */
+	process_lock(proc);
+	handleindex_t n;
+	while ((n = handle_table_find_free(proc, index_from)) < 0) {
+		errorcode_t err = handle_table_grow(proc, index_from + 1);
+		if (ananas_is_failure(err)) {
+			process_unlock(proc);
+			return err;
+		}
 	}
-	struct HANDLE* handle = LIST_HEAD(&handle_freelist);
-	LIST_POP_HEAD(&handle_freelist);
-	spinlock_unlock(&spl_handlequeue);
+	proc->p_handle_bitmap[n / 32] |= 1U << (n % 32);
+
+	/* Grab a handle; prefer one this process freed before */
+	struct HANDLE* handle = proc->p_handle_cache;
+	if (handle != NULL) {
+		proc->p_handle_cache = handle->li_next;
+		proc->p_handle_cache_count--;
+	}
+	process_unlock(proc);
+	if (handle == NULL)
+		handle = handle_pool_get();
 
 	/* Sanity checks */
 	KASSERT(handle->h_type == HANDLE_TYPE_UNUSED, "handle from pool must be unused");
+	KASSERT(handle->h_refcount == 0, "handle from pool must not be referenced");
 
 	/* Initialize the handle */
 	mutex_init(&handle->h_mutex, "handle");
@@ -75,25 +167,41 @@ handle_alloc(int type, process_t* proc, handleindex_t index_from, struct HANDLE*
 	handle->h_process = proc;
 	handle->h_hops = htype->ht_hops;
 	handle->h_flags = 0;
+	handle->h_refcount = 1; /* the handle table's reference */
+	LIST_INIT(&handle->h_evq_interests);
 
-	/* Hook the handle to the process */
+	/* Hook the handle to the process; the slot was reserved above */
 	process_lock(proc);
-	handleindex_t n = index_from;
-	while(n < PROCESS_MAX_HANDLES && proc->p_handle[n] != NULL)
-		n++;
-	if (n < PROCESS_MAX_HANDLES)
-		proc->p_handle[n] = handle;
+	proc->p_handle_table->htab_handle[n] = handle;
 	process_unlock(proc);
 
-	if (n == PROCESS_MAX_HANDLES)
-		panic("out of handles"); // XXX FIX ME
-
 	*handle_out = handle;
 	*index_out = n;
 	TRACE(HANDLE, INFO, "process=%p, type=%u => handle=%p, index=%u", proc, type, handle, n);
 	return ananas_success();
 }
 
+void
+handle_ref(struct HANDLE* handle)
+{
+	KASSERT(handle->h_refcount > 0, "reffing handle with invalid refcount %d", handle->h_refcount);
+	__sync_fetch_and_add(&handle->h_refcount, 1);
+}
+
+/* Obtains a reference unless the handle is already on its way out */
+static bool
+handle_tryref(struct HANDLE* handle)
+{
+	refcount_t refs = handle->h_refcount;
+	while (refs > 0) {
+		refcount_t prev = __sync_val_compare_and_swap(&handle->h_refcount, refs, refs + 1);
+		if (prev == refs)
+			return true;
+		refs = prev;
+	}
+	return false;
+}
+
 errorcode_t
 handle_lookup(process_t* proc, handleindex_t index, int type, struct HANDLE** handle_out)
 {
@@ -101,72 +209,171 @@ handle_lookup(process_t* proc, handleindex_t index, int type, struct HANDLE** ha
 	if(index < 0 || index >= PROCESS_MAX_HANDLES)
 		return ANANAS_ERROR(BAD_HANDLE);
 
-	/* Obtain the handle XXX How do we ensure it won't get freed after this? Should we ref it? */
-	process_lock(proc);
-	struct HANDLE* handle = proc->p_handle[index];
-	process_unlock(proc);
+	/*
+	 * Obtain the handle without the process lock: we reference it and then
+	 * verify it is still in the table; if not, it was freed (and maybe reused)
+	 * under our feet and we try again.
+	 */
+	struct HANDLE* handle;
+	for (;;) {
+		struct HANDLE_TABLE* tab = proc->p_handle_table;
+		if (tab == NULL || (unsigned int)index >= tab->htab_size)
+			return ANANAS_ERROR(BAD_HANDLE);
+		handle = tab->htab_handle[index];
+		if (handle == NULL)
+			return ANANAS_ERROR(BAD_HANDLE);
+		if (!handle_tryref(handle))
+			continue;
+
+		tab = proc->p_handle_table;
+		if (tab->htab_handle[index] == handle)
+			break;
+		handle_deref(handle);
+	}
 
-	/* ensure handle exists - we don't verify ownership: it _is_ in the thread's handle table... */
-	if (handle == NULL)
-		return ANANAS_ERROR(BAD_HANDLE);
 	/* if this is a handle reference, check the type of the handle we are refering to */
-	if (type != HANDLE_TYPE_ANY && handle->h_type != type)
-		return ANANAS_ERROR(BAD_HANDLE);
-	/* ... yet unused handles are never valid */
-	if (handle->h_type == HANDLE_TYPE_UNUSED)
+	if ((type != HANDLE_TYPE_ANY && handle->h_type != type) || handle->h_type == HANDLE_TYPE_UNUSED) {
+		/* ... yet unused handles are never valid */
+		handle_deref(handle);
 		return ANANAS_ERROR(BAD_HANDLE);
+	}
 	*handle_out = handle;
 	return ananas_success();
 }
 
-errorcode_t
-handle_free(struct HANDLE* handle)
+static errorcode_t
+handle_destroy(struct HANDLE* handle)
 {
 	/*
-	 * Lock the handle so that no-one else can touch it, mark the handle as being
-	 * torn-down and see if we actually have to destroy it at this point.
+	 * If the handle has a specific free function, call it - otherwise assume
+	 * no special action is needed.
 	 */
+	errorcode_t err = ananas_success();
+	process_t* proc = handle->h_process;
 	mutex_lock(&handle->h_mutex);
+	if (handle->h_hops->hop_free != NULL)
+		err = handle->h_hops->hop_free(proc, handle);
 
-	/* Remove us from the thread handle queue, if necessary */
-	process_t* proc = handle->h_process;
+	/* Clear the handle */
+	memset(&handle->h_data, 0, sizeof(handle->h_data));
+	handle->h_type = HANDLE_TYPE_UNUSED; /* just to ensure the value matches */
+	handle->h_process = NULL;
+	mutex_unlock(&handle->h_mutex);
+
+	/* Keep it for the process if it's still around, otherwise back to the pool */
 	if (proc != NULL) {
 		process_lock(proc);
-		for (handleindex_t n = 0; n < PROCESS_MAX_HANDLES; n++) {
-			if (proc->p_handle[n] == handle)
-				proc->p_handle[n] = NULL;
+		if (proc->p_handle_table != NULL && proc->p_handle_cache_count < HANDLE_CACHE_MAX) {
+			handle->li_next = proc->p_handle_cache;
+			proc->p_handle_cache = handle;
+			proc->p_handle_cache_count++;
+			handle = NULL;
 		}
 		process_unlock(proc);
 	}
+	if (handle != NULL)
+		handle_pool_put(handle);
+	return err;
+}
 
-	/*
-	 * If the handle has a specific free function, call it - otherwise assume
-	 * no special action is needed.
-	 */
-	if (handle->h_hops->hop_free != NULL) {
-		errorcode_t err = handle->h_hops->hop_free(proc, handle);
-		ANANAS_ERROR_RETURN(err);
-	}
+void
+handle_deref(struct HANDLE* handle)
+{
+	KASSERT(handle->h_refcount > 0, "dereffing handle with invalid refcount %d", handle->h_refcount);
+	if (__sync_sub_and_fetch(&handle->h_refcount, 1) == 0)
+		handle_destroy(handle);
+}
 
-	/* Clear the handle */
-	memset(&handle->h_data, 0, sizeof(handle->h_data));
-	handle->h_type = HANDLE_TYPE_UNUSED; /* just to ensure the value matches */
-	handle->h_process = NULL;
+/*
+ * Removes the handle from its table; returns true if it was there. If 'index'
+ * is non-negative, it is the slot the caller found the handle in; otherwise,
+ * the table is searched.
+ */
+static bool
+handle_unhook(struct HANDLE* handle, handleindex_t index)
+{
+	process_t* proc = handle->h_process;
+	if (proc == NULL)
+		return false;
+
+	bool found = false;
+	process_lock(proc);
+	struct HANDLE_TABLE* tab = proc->p_handle_table;
+	if (tab != NULL && index < 0) {
+		for (unsigned int n = 0; n < tab->htab_size; n++) {
+			if (tab->htab_handle[n] != handle)
+				continue;
+			index = n;
+			break;
+		}
+	}
+	if (tab != NULL && index >= 0 && (unsigned int)index < tab->htab_size && tab->htab_handle[index] == handle) {
+		tab->htab_handle[index] = NULL;
+		proc->p_handle_bitmap[index / 32] &= ~(1U << (index % 32));
+		found = true;
+	}
+	process_unlock(proc);
+	return found;
+}
 
-	/*	
-	 * Let go of the handle lock - if someone tries to use it, they'll lock it
-	 * before looking at the flags field and this will cause a deadlock.  Better
-	 * safe than sorry.
+static errorcode_t
+handle_free_at(struct HANDLE* handle, handleindex_t index)
+{
+	/*
+	 * Remove the handle from the process so that no new references can be
+	 * obtained, make event queues forget about it and drop the table's
+	 * reference. The handle is destroyed once the final reference is gone,
+	 * which may be right now.
 	 */
-	mutex_unlock(&handle->h_mutex);
+	if (!handle_unhook(handle, index))
+		return ANANAS_ERROR(BAD_HANDLE);
+	evq_handle_closed(handle);
 
-	/* Hand it back to the the pool */
-	spinlock_lock(&spl_handlequeue);
-	LIST_APPEND(&handle_freelist, handle);
-	spinlock_unlock(&spl_handlequeue);
+	KASSERT(handle->h_refcount > 0, "freeing handle with invalid refcount %d", handle->h_refcount);
+	if (__sync_sub_and_fetch(&handle->h_refcount, 1) == 0)
+		return handle_destroy(handle);
 	return ananas_success();
 }
 
+errorcode_t
+handle_free(struct HANDLE* handle)
+{
+	return handle_free_at(handle, -1);
+}
+
+void
+handle_table_destroy(process_t* proc)
+{
+	/* Throw away all handles */
+	struct HANDLE_TABLE* tab = proc->p_handle_table;
+	for (unsigned int n = 0; tab != NULL && n < tab->htab_size; n++) {
+		struct HANDLE* handle = tab->htab_handle[n];
+		if (handle != NULL)
+			handle_free_at(handle, n);
+	}
+
+	/* Get rid of the tables; from now on, freed handles go straight to the pool */
+	process_lock(proc);
+	proc->p_handle_table = NULL;
+	kfree(proc->p_handle_bitmap);
+	proc->p_handle_bitmap = NULL;
+	struct HANDLE* cache = proc->p_handle_cache;
+	proc->p_handle_cache = NULL;
+	proc->p_handle_cache_count = 0;
+	process_unlock(proc);
+
+	while (tab != NULL) {
+		struct HANDLE_TABLE* prev = tab->htab_prev;
+		kfree(tab);
+		tab = prev;
+	}
+	while (cache != NULL) {
+		struct HANDLE* next = cache->li_next;
+		handle_pool_put(cache);
+		cache = next;
+	}
+}
+
 errorcode_t
 handle_free_byindex(process_t* proc, handleindex_t index)
 {
@@ -175,7 +382,9 @@ handle_free_byindex(process_t* proc, handleindex_t index)
 	errorcode_t err = handle_lookup(proc, index, HANDLE_TYPE_ANY, &handle);
 	ANANAS_ERROR_RETURN(err);
 
-	return handle_free(handle);
+	err = handle_free_at(handle, index);
+	handle_deref(handle);
+	return err;
 }
 
 errorcode_t
@@ -201,23 +410,43 @@ handle_clone(process_t* proc_in, handleindex_t index, struct CLONE_OPTIONS* opts
 		err = ANANAS_ERROR(BAD_OPERATION);
 	}
 	mutex_unlock(&handle->h_mutex);
+	handle_deref(handle);
 	return err;
 }
 
+errorcode_t
+handle_poll(thread_t* t, handleindex_t index, struct HANDLE* handle, struct POLL_ENTRY* pe, unsigned int* events)
+{
+	if (handle->h_hops->hop_poll == NULL) {
+		/* Nothing to wait for; the handle is always ready */
+		*events = POLLIN | POLLOUT;
+		return ananas_success();
+	}
+	return handle->h_hops->hop_poll(t, index, handle, pe, events);
+}
+
 errorcode_t
 handle_register_type(struct HANDLE_TYPE* ht)
 {
+	if (ht->ht_id <= HANDLE_TYPE_UNUSED || ht->ht_id >= HANDLE_NUM_TYPES)
+		return ANANAS_ERROR(BAD_TYPE);
+
 	spinlock_lock(&spl_handletypes);
-	LIST_APPEND(&handle_types, ht);
+	errorcode_t err = ananas_success();
+	if (handle_types[ht->ht_id] == NULL)
+		handle_types[ht->ht_id] = ht;
+	else
+		err = ANANAS_ERROR(FILE_EXISTS);
 	spinlock_unlock(&spl_handletypes);
-	return ananas_success();
+	return err;
 }
 
 errorcode_t
 handle_unregister_type(struct HANDLE_TYPE* ht)
 {
 	spinlock_lock(&spl_handletypes);
-	LIST_REMOVE(&handle_types, ht);
+	if (handle_types[ht->ht_id] == ht)
+		handle_types[ht->ht_id] = NULL;
 	spinlock_unlock(&spl_handletypes);
 	return ananas_success();
 }
@@ -228,6 +457,7 @@ KDB_COMMAND(handle, "i:handle", "Display handle information")
 	struct HANDLE* handle = static_cast<struct HANDLE*>((void*)(uintptr_t)arg[1].a_u.u_value);
 	kprintf("type          : %u\n", handle->h_type);
 	kprintf("flags         : %u\n", handle->h_flags);
+	kprintf("refcount      : %u\n", handle->h_refcount);
 	kprintf("owner process : 0x%p\n", handle->h_process);
 	switch(handle->h_type) {
 		case HANDLE_TYPE_FILE: {
@@ -7,6 +7,7 @@
 #include <ananas/thread.h>
 #include <ananas/time.h>
 #include <ananas/vfs.h>
+#include <ananas/vmspace.h>
 #include "options.h"
 
 namespace {
@@ -83,14 +84,24 @@ userinit_func(void*)
 		thread_exit(0);
 	}
 
-	const char args[] = "init\0\0";
-	const char env[] = "OS=Ananas\0USER=root\0\0";
-	process_set_args(proc, args, sizeof(args));
-	process_set_environment(proc, env, sizeof(env));
-
 	addr_t exec_addr;
 	register_t exec_arg;
 	err = exec_load(proc->p_vmspace, file.f_dentry, &exec_addr, &exec_arg);
+	if (ananas_is_success(err)) {
+		const char* argv[] = { "init", nullptr };
+		const char* envp[] = { "OS=Ananas", "USER=root", nullptr };
+		/*
+		 * vs_next_mapping only accounts for dynamic mappings such as the PROCINFO;
+		 * move it beyond the image we just loaded at fixed addresses, so the
+		 * arguments cannot be placed on top of it.
+		 */
+		vmspace_set_next_mapping(proc->p_vmspace, proc->p_vmspace->vs_next_mapping);
+
+		struct EXEC_ARGS ea;
+		err = exec_prepare_args(proc->p_vmspace, argv, envp, false, &ea);
+		if (ananas_is_success(err))
+			process_set_args(proc, &ea);
+	}
 	if (ananas_is_success(err)) {
 		kprintf(" ok\n");
 		md_setup_post_exec(t, exec_addr, exec_arg);
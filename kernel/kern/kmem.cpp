@@ -61,7 +61,12 @@ kmem_map(addr_t phys, size_t length, int flags)
 	   (flags & VM_FLAG_FORCEMAP) == 0) {
 		addr_t va = PTOKV(pa);
 		KMEM_DEBUG("kmem_map(): doing direct map: pa=%p va=%p size=%d\n", pa, va, size);
-		md_kmap(pa, va, size, flags);
+		/*
+		 * The direct map is shared by all users of the page and is never torn
+		 * down, so never restrict it: a read-only user must not take away
+		 * write access from the others.
+		 */
+		md_kmap(pa, va, size, flags | VM_FLAG_READ | VM_FLAG_WRITE);
 		return (void*)(va + offset);
 	}
 
@@ -73,6 +78,7 @@ kmem_map(addr_t phys, size_t length, int flags)
 		 * XXX We just hope that this won't happen for now
 		 */
 		kmem_mappings = static_cast<struct KMEM_MAPPING*>(page_alloc_single_mapped(&kmem_page, VM_FLAG_READ | VM_FLAG_WRITE));
+		KASSERT(kmem_mappings != NULL, "out of memory");
 		memset(kmem_mappings, 0, PAGE_SIZE);
 	}
 
@@ -153,12 +159,14 @@ kmem_unmap(void* virt, size_t length)
 	size_t size = (length + offset + PAGE_SIZE - 1) / PAGE_SIZE;
 	KMEM_DEBUG("kmem_unmap(): virt=%p len=%d\n", virt, length);
 
-	/* If this is a direct mapping, we can just as easily undo it */
+	/*
+	 * Direct mappings are left in place; tearing them down would only force
+	 * a TLB shootdown on every CPU, and mapping them again is a no-op unless
+	 * the flags change.
+	 */
 	if (va >= PA_TO_DIRECT_VA(KMEM_DIRECT_PA_START) && va < PA_TO_DIRECT_VA(KMEM_DIRECT_PA_END)) {
-		KMEM_DEBUG("kmem_unmap(): direct removed: virt=%p len=%d (range %p-%p)\n", virt, length,
+		KMEM_DEBUG("kmem_unmap(): direct kept: virt=%p len=%d (range %p-%p)\n", virt, length,
 		 PA_TO_DIRECT_VA(KMEM_DIRECT_PA_START), PA_TO_DIRECT_VA(KMEM_DIRECT_PA_END));
-
-		md_kunmap(va, size);
 		return;
 	}
 
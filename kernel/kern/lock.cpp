@@ -33,6 +33,13 @@ spinlock_init(spinlock_t* s)
 	atomic_set(&s->sl_var, 0);
 }
 
+/* Attempts to take the lock without spinning; returns non-zero on success */
+int
+spinlock_trylock(spinlock_t* s)
+{
+	return atomic_read(&s->sl_var) == 0 && atomic_xchg(&s->sl_var, 1) == 0;
+}
+
 register_t
 spinlock_lock_unpremptible(spinlock_t* s)
 {
@@ -1,11 +1,13 @@
 #include <ananas/page.h>
 #include <machine/param.h>
+#include <machine/vm.h>
 #include <ananas/init.h>
 #include <ananas/kdb.h>
 #include <ananas/lib.h>
 #include <ananas/list.h>
 #include <ananas/vm.h>
 #include <ananas/kmem.h>
+#include <ananas/pagedaemon.h>
 #include "options.h"
 
 #undef PAGE_DEBUG
@@ -18,6 +20,16 @@
 
 static struct zone_list zones;
 
+/* Number of pre-zeroed pages the idle thread tries to keep around */
+#define PAGE_ZERO_POOL_SIZE 64
+
+/* The pool is only filled if at least this many pages are available */
+#define PAGE_ZERO_POOL_MIN_AVAIL 1024
+
+static spinlock_t zero_pool_lock = SPINLOCK_DEFAULT_INIT;
+static struct page_list zero_pool;
+static unsigned int zero_pool_count;
+
 static inline void
 page_assert_sane(struct PAGE* p)
 {
@@ -200,6 +212,10 @@ page_zone_add(addr_t base, size_t length)
 	z->z_avail_pages = 0;
 	z->z_phys_addr = base + num_admin_pages * PAGE_SIZE;
 
+	/* Keep all pages in the direct map; this allows zeroing them without mapping */
+	KASSERT(base + length <= KMEM_DIRECT_PA_END, "zone %p-%p outside of the direct map", base, base + length);
+	kmem_map(z->z_phys_addr, (size_t)z->z_num_pages * PAGE_SIZE, VM_FLAG_READ | VM_FLAG_WRITE);
+
 	/* Create the page structures; we mark everything as a order 0 page */
 	struct PAGE* p = z->z_base;
 	for (unsigned int n = 0; n < z->z_num_pages; n++, p++) {
@@ -228,6 +244,26 @@ page_get_paddr(struct PAGE* p)
 	return z->z_phys_addr + index * PAGE_SIZE;
 }
 
+static struct PAGE*
+page_zero_pool_get()
+{
+	struct PAGE* p = NULL;
+	spinlock_lock(&zero_pool_lock);
+	if (!LIST_EMPTY(&zero_pool)) {
+		p = LIST_HEAD(&zero_pool);
+		LIST_POP_HEAD(&zero_pool);
+		zero_pool_count--;
+	}
+	spinlock_unlock(&zero_pool_lock);
+	return p;
+}
+
+static void
+page_zero(struct PAGE* p)
+{
+	memset((void*)PA_TO_DIRECT_VA(page_get_paddr(p)), 0, PAGE_SIZE);
+}
+
 struct PAGE*
 page_alloc_order(int order)
 {
@@ -238,11 +274,32 @@ page_alloc_order(int order)
 
 	LIST_FOREACH(&zones, z, struct PAGE_ZONE) {
 		struct PAGE* page = page_alloc_zone(z, order);
+		if (page != NULL) {
+			/* Have the page daemon replenish the zone if it is running low */
+			if (z->z_avail_pages < PAGEDAEMON_LOW_WATER(z->z_num_pages))
+				pagedaemon_wakeup();
+			return page;
+		}
+	}
+
+	/* Hand out a page from the zero pool if we can */
+	if (order == 0) {
+		struct PAGE* page = page_zero_pool_get();
 		if (page != NULL)
 			return page;
 	}
 
-	panic("page_alloc(): failed for order %d", order);
+	/* As a last resort, evict cached pages until we have enough free memory */
+	while (pagedaemon_reclaim(PAGEDAEMON_BATCH << order) > 0) {
+		LIST_FOREACH(&zones, z, struct PAGE_ZONE) {
+			struct PAGE* page = page_alloc_zone(z, order);
+			if (page != NULL)
+				return page;
+		}
+	}
+
+	/* Nothing left to reclaim; let the caller deal with it */
+	return NULL;
 }
 
 void*
@@ -266,6 +323,56 @@ page_alloc_length_mapped(size_t length, struct PAGE** p, int vm_flags)
 	return page_alloc_order_mapped(bytes2order(length), p, vm_flags);
 }
 
+struct PAGE*
+page_alloc_zeroed()
+{
+	struct PAGE* p = page_zero_pool_get();
+	if (p != NULL)
+		return p;
+
+	/* Pool is empty; we'll have to clear the page ourselves */
+	p = page_alloc_single();
+	if (p != NULL)
+		page_zero(p);
+	return p;
+}
+
+int
+page_zero_pool_fill()
+{
+	if (LIST_EMPTY(&zones))
+		return 0;
+
+	/* Do not hog memory that is better spent elsewhere */
+	unsigned int total_pages, avail_pages;
+	page_get_stats(&total_pages, &avail_pages);
+	if (avail_pages < PAGE_ZERO_POOL_MIN_AVAIL)
+		return 0;
+
+	/* Reserve our spot in the pool first so that it can't be overfilled */
+	spinlock_lock(&zero_pool_lock);
+	bool have_room = zero_pool_count < PAGE_ZERO_POOL_SIZE;
+	if (have_room)
+		zero_pool_count++;
+	spinlock_unlock(&zero_pool_lock);
+	if (!have_room)
+		return 0;
+
+	struct PAGE* p = page_alloc_single();
+	if (p == NULL) {
+		spinlock_lock(&zero_pool_lock);
+		zero_pool_count--;
+		spinlock_unlock(&zero_pool_lock);
+		return 0;
+	}
+	page_zero(p);
+
+	spinlock_lock(&zero_pool_lock);
+	LIST_APPEND(&zero_pool, p);
+	spinlock_unlock(&zero_pool_lock);
+	return 1;
+}
+
 void
 page_get_stats(unsigned int* total_pages, unsigned int* avail_pages)
 {
@@ -312,6 +419,7 @@ KDB_COMMAND(pages, NULL, "Display page zones")
 	LIST_FOREACH(&zones, z, struct PAGE_ZONE) {
 		page_dump(z);
 	}
+	kprintf("zero pool: %u pages\n", zero_pool_count);
 }
 #endif
 
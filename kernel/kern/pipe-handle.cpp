@@ -1,92 +1,168 @@
 #include <ananas/types.h>
 #include <ananas/error.h>
+#include <ananas/flags.h>
 #include <ananas/handle.h>
-#include <ananas/handle-options.h>
+#include <ananas/kmem.h>
+#include <ananas/lib.h>
+#include <ananas/lock.h>
+#include <ananas/mm.h>
+#include <ananas/page.h>
+#include <ananas/poll.h>
 #include <ananas/trace.h>
 #include <ananas/thread.h>
-#include <ananas/mm.h>
-#include <ananas/lib.h>
+#include <ananas/vm.h>
+#include <machine/param.h> /* for PAGE_SIZE */
 
-#if 0
 TRACE_SETUP;
 
-/* Note that pipehandle_signal() signals everything *except* the hpi passed to it! */
+#define PIPE_PAGES 16 /* Maximum number of pages buffered per pipe */
+#define PIPE_SPARE_PAGES 2 /* Drained pages kept around for the next write */
+
+/*
+ * Pipe data is kept in whole pages, which form a ring; writers append to the
+ * final page or add a new one, readers consume from the first page and drop
+ * it once it has been drained. Pages are handed over from writer to reader as
+ * a whole, so data is never moved around inside the pipe.
+ */
+struct HANDLE_PIPE_PAGE {
+	struct PAGE* pp_page;
+	char* pp_data;			/* Kernel mapping of the page */
+	size_t pp_offset;		/* Next byte to read */
+	size_t pp_length;		/* Bytes written */
+};
+
+struct HANDLE_PIPE_BUFFER {
+	mutex_t hpb_mutex;		/* Protects everything below */
+	refcount_t hpb_read_count;	/* Number of read handles */
+	refcount_t hpb_write_count;	/* Number of write handles */
+	semaphore_t hpb_read_sem;	/* Signalled when data arrives */
+	semaphore_t hpb_write_sem;	/* Signalled when space frees up */
+	unsigned int hpb_read_waiters;
+	unsigned int hpb_write_waiters;
+	struct POLL_QUEUE hpb_poll;	/* Pollers of either end */
+	unsigned int hpb_head;		/* Index of the first page in use */
+	unsigned int hpb_count;		/* Number of pages in use */
+	unsigned int hpb_num_spare;
+	struct HANDLE_PIPE_PAGE hpb_page[PIPE_PAGES];
+	struct HANDLE_PIPE_PAGE hpb_spare[PIPE_SPARE_PAGES];
+};
+
 static void
-pipehandle_signal(struct HANDLE_PIPE_INFO* hpi, handle_event_t event, handle_event_result_t result)
+pipe_wakeup(semaphore_t* sem, unsigned int* waiters)
 {
-	struct HANDLE_PIPE_INFO* cur_hpi = hpi->hpi_next;
-	for (/* nothing */; cur_hpi != hpi; cur_hpi = cur_hpi->hpi_next) {
-		handle_signal(cur_hpi->hpi_handle, event, result);
-	}
+	for (/* nothing */; *waiters > 0; (*waiters)--)
+		sem_signal(sem);
+}
+
+/* Drops the pipe lock until woken up; the caller must re-check its condition */
+static void
+pipe_wait(struct HANDLE_PIPE_BUFFER* hpb, semaphore_t* sem, unsigned int* waiters)
+{
+	(*waiters)++;
+	mutex_unlock(&hpb->hpb_mutex);
+	sem_wait(sem);
+	mutex_lock(&hpb->hpb_mutex);
 }
 
 static errorcode_t
-pipehandle_create(thread_t* thread, handleindex_t index, struct HANDLE* handle, struct CREATE_OPTIONS* opts)
+pipe_get_page(struct HANDLE_PIPE_BUFFER* hpb, struct HANDLE_PIPE_PAGE* pp)
+{
+	if (hpb->hpb_num_spare > 0) {
+		*pp = hpb->hpb_spare[--hpb->hpb_num_spare];
+	} else {
+		pp->pp_data = static_cast<char*>(page_alloc_single_mapped(&pp->pp_page, VM_FLAG_READ | VM_FLAG_WRITE));
+		if (pp->pp_data == NULL)
+			return ANANAS_ERROR(OUT_OF_MEMORY);
+	}
+	pp->pp_offset = 0;
+	pp->pp_length = 0;
+	return ananas_success();
+}
+
+static void
+pipe_put_page(struct HANDLE_PIPE_BUFFER* hpb, struct HANDLE_PIPE_PAGE* pp)
+{
+	if (hpb->hpb_num_spare < PIPE_SPARE_PAGES) {
+		hpb->hpb_spare[hpb->hpb_num_spare++] = *pp;
+		return;
+	}
+	kmem_unmap(pp->pp_data, PAGE_SIZE);
+	page_free(pp->pp_page);
+}
+
+static void
+pipe_destroy(struct HANDLE_PIPE_BUFFER* hpb)
+{
+	for (unsigned int n = 0; n < hpb->hpb_count; n++) {
+		struct HANDLE_PIPE_PAGE* pp = &hpb->hpb_page[(hpb->hpb_head + n) % PIPE_PAGES];
+		kmem_unmap(pp->pp_data, PAGE_SIZE);
+		page_free(pp->pp_page);
+	}
+	for (unsigned int n = 0; n < hpb->hpb_num_spare; n++) {
+		kmem_unmap(hpb->hpb_spare[n].pp_data, PAGE_SIZE);
+		page_free(hpb->hpb_spare[n].pp_page);
+	}
+	kfree(hpb);
+}
+
+errorcode_t
+pipe_connect(struct HANDLE* read_handle, struct HANDLE* write_handle)
 {
-	if (opts->cr_flags != CREATE_PIPE_FLAG_MASK )
-		return ANANAS_ERROR(BAD_FLAG);
-	if (opts->cr_length <= 0 || opts->cr_length > CREATE_PIPE_MAX_LENGTH)
-		return ANANAS_ERROR(BAD_LENGTH);
-
-	/* Create a new pipe */
-	struct HANDLE_PIPE_BUFFER* hpb = kmalloc(sizeof(struct HANDLE_PIPE_BUFFER) + opts->cr_length);
-	/* XXX check error on hpb == NULL */
+	KASSERT(read_handle->h_type == HANDLE_TYPE_PIPE, "read handle is not a pipe");
+	KASSERT(write_handle->h_type == HANDLE_TYPE_PIPE, "write handle is not a pipe");
+
+	auto hpb = new HANDLE_PIPE_BUFFER;
+	memset(hpb, 0, sizeof(*hpb));
 	mutex_init(&hpb->hpb_mutex, "pipe");
+	sem_init(&hpb->hpb_read_sem, 0);
+	sem_init(&hpb->hpb_write_sem, 0);
+	poll_queue_init(&hpb->hpb_poll);
 	hpb->hpb_read_count = 1;
 	hpb->hpb_write_count = 1;
-	memset(hpb->hpb_buffer, 0, opts->cr_length); /* prevent information leakage */
-	CBUFFER_INIT(hpb, hpb->hpb_buffer, opts->cr_length);
 
-	/* Hook the pipe buffer to the pipe handle */
-	struct HANDLE_PIPE_INFO* hpi = &handle->h_data.d_pipe;
-	hpi->hpi_flags = HPI_FLAG_READ | HPI_FLAG_WRITE;
+	struct HANDLE_PIPE_INFO* hpi = &read_handle->h_data.d_pipe;
+	hpi->hpi_flags = HPI_FLAG_READ;
+	hpi->hpi_buffer = hpb;
+	hpi = &write_handle->h_data.d_pipe;
+	hpi->hpi_flags = HPI_FLAG_WRITE;
 	hpi->hpi_buffer = hpb;
-	hpi->hpi_next = hpi;
-	hpi->hpi_handle = handle;
 	return ananas_success();
 }
 
 static errorcode_t
-pipehandle_free(thread_t* thread, struct HANDLE* handle)
+pipehandle_free(process_t* proc, struct HANDLE* handle)
 {
 	struct HANDLE_PIPE_INFO* hpi = &handle->h_data.d_pipe;
 	struct HANDLE_PIPE_BUFFER* hpb = hpi->hpi_buffer;
+	if (hpb == NULL)
+		return ananas_success(); /* never connected */
+
 	mutex_lock(&hpb->hpb_mutex);
-	if (hpi->hpi_flags & HPI_FLAG_READ)
+	if (hpi->hpi_flags & HPI_FLAG_READ) {
+		KASSERT(hpb->hpb_read_count > 0, "read_count underflow");
 		hpb->hpb_read_count--;
-	KASSERT(hpb->hpb_read_count >= 0, "read_count < 0");
-	if (hpi->hpi_flags & HPI_FLAG_WRITE)
+	}
+	if (hpi->hpi_flags & HPI_FLAG_WRITE) {
+		KASSERT(hpb->hpb_write_count > 0, "write_count underflow");
 		hpb->hpb_write_count--;
-	KASSERT(hpb->hpb_write_count >= 0, "write_count < 0");
-	if (hpb->hpb_read_count != 0 || hpb->hpb_write_count != 0) {
-		/*
-		 * Still readers or writers available; don't free the pipe. If we just
-		 * freed a final reader of writer, signal accordingly.
-		 */
-		if (hpb->hpb_read_count == 0) {
-			pipehandle_signal(hpi, HANDLE_EVENT_READ, 0);
-		} else if (hpb->hpb_write_count == 0) {
-			pipehandle_signal(hpi, HANDLE_EVENT_WRITE, 0);
-		}
+	}
+	hpi->hpi_buffer = NULL;
 
+	if (hpb->hpb_read_count != 0 || hpb->hpb_write_count != 0) {
 		/*
-	 	 * Remove ourselves from the linked list; this works by finding our parent
-		 * (i.e. the one who has our hpi in their hpi_next field) and replacing it
-		 * with our hpi_next.
+		 * Still readers or writers available; don't free the pipe, but wake
+		 * everyone up: readers may need to see EOF, writers a broken pipe.
 		 */
-		struct HANDLE_PIPE_INFO* parent_hpi = hpi->hpi_next;
-		while (parent_hpi->hpi_next != hpi)
-			parent_hpi = parent_hpi->hpi_next;
-		parent_hpi->hpi_next = hpi->hpi_next;
-
+		pipe_wakeup(&hpb->hpb_read_sem, &hpb->hpb_read_waiters);
+		pipe_wakeup(&hpb->hpb_write_sem, &hpb->hpb_write_waiters);
+		poll_wakeup(&hpb->hpb_poll, POLLHUP | POLLERR);
 		mutex_unlock(&hpb->hpb_mutex);
 		return ananas_success();
 	}
-	
-	/* OK, we can free the buffer */
+
+	/* OK, we can free the buffer; no one can reach it anymore */
 	mutex_unlock(&hpb->hpb_mutex);
-	hpi->hpi_buffer = NULL;
-	kfree(hpb);
+	pipe_destroy(hpb);
 	return ananas_success();
 }
 
@@ -96,16 +172,52 @@ pipehandle_read(thread_t* thread, handleindex_t index, struct HANDLE* handle, vo
 	struct HANDLE_PIPE_INFO* hpi = &handle->h_data.d_pipe;
 	if ((hpi->hpi_flags & HPI_FLAG_READ) == 0)
 		return ANANAS_ERROR(BAD_OPERATION);
+	if (*len == 0)
+		return ananas_success();
 
 	struct HANDLE_PIPE_BUFFER* hpb = hpi->hpi_buffer;
 	mutex_lock(&hpb->hpb_mutex);
-	size_t n = CBUFFER_READ(hpb, buf, *len);
-	if (n > 0) {
-		/* Something was read; we should signal the read */
-		pipehandle_signal(hpi, HANDLE_EVENT_READ, n);
+
+	/* Wait until there is something to read, or no one can write anymore */
+	while (hpb->hpb_count == 0) {
+		if (hpb->hpb_write_count == 0) {
+			mutex_unlock(&hpb->hpb_mutex);
+			*len = 0; /* end of file */
+			return ananas_success();
+		}
+		if (handle->h_flags & O_NONBLOCK) {
+			mutex_unlock(&hpb->hpb_mutex);
+			return ANANAS_ERROR(WOULD_BLOCK);
+		}
+		pipe_wait(hpb, &hpb->hpb_read_sem, &hpb->hpb_read_waiters);
+	}
+
+	/* Copy whatever is available, releasing pages as they are drained */
+	auto dest = static_cast<char*>(buf);
+	size_t left = *len;
+	while (left > 0 && hpb->hpb_count > 0) {
+		struct HANDLE_PIPE_PAGE* pp = &hpb->hpb_page[hpb->hpb_head];
+		size_t chunk = pp->pp_length - pp->pp_offset;
+		if (chunk > left)
+			chunk = left;
+		memcpy(dest, pp->pp_data + pp->pp_offset, chunk);
+		pp->pp_offset += chunk;
+		dest += chunk;
+		left -= chunk;
+
+		/* Drained pages go back to the spares; writers will pick them up again */
+		if (pp->pp_offset == pp->pp_length) {
+			pipe_put_page(hpb, pp);
+			hpb->hpb_head = (hpb->hpb_head + 1) % PIPE_PAGES;
+			hpb->hpb_count--;
+		}
 	}
+	*len -= left;
+
+	/* Room may have been made; let the writers know */
+	pipe_wakeup(&hpb->hpb_write_sem, &hpb->hpb_write_waiters);
+	poll_wakeup(&hpb->hpb_poll, POLLOUT);
 	mutex_unlock(&hpb->hpb_mutex);
-	*len = n;
 	return ananas_success();
 }
 
@@ -118,76 +230,124 @@ pipehandle_write(thread_t* thread, handleindex_t index, struct HANDLE* handle, c
 
 	struct HANDLE_PIPE_BUFFER* hpb = hpi->hpi_buffer;
 	mutex_lock(&hpb->hpb_mutex);
-	size_t n = CBUFFER_WRITE(hpb, buf, *len);
-	if (n > 0) {
-		/* Something was written; we should signal the write */
-		pipehandle_signal(hpi, HANDLE_EVENT_WRITE, n);
+
+	auto src = static_cast<const char*>(buf);
+	size_t left = *len;
+	errorcode_t err = ananas_success();
+	while (left > 0) {
+		if (hpb->hpb_read_count == 0) {
+			err = ANANAS_ERROR(BROKEN_PIPE);
+			break;
+		}
+
+		/* Fill up the final page first; this keeps small writes together */
+		struct HANDLE_PIPE_PAGE* pp = NULL;
+		if (hpb->hpb_count > 0) {
+			pp = &hpb->hpb_page[(hpb->hpb_head + hpb->hpb_count - 1) % PIPE_PAGES];
+			if (pp->pp_length == PAGE_SIZE)
+				pp = NULL;
+		}
+		if (pp == NULL && hpb->hpb_count < PIPE_PAGES) {
+			pp = &hpb->hpb_page[(hpb->hpb_head + hpb->hpb_count) % PIPE_PAGES];
+			err = pipe_get_page(hpb, pp);
+			if (ananas_is_failure(err))
+				break;
+			hpb->hpb_count++;
+		}
+
+		if (pp == NULL) {
+			/* Pipe is full; readers can start on what we have so far */
+			if (handle->h_flags & O_NONBLOCK) {
+				if (left == *len)
+					err = ANANAS_ERROR(WOULD_BLOCK);
+				break;
+			}
+			pipe_wakeup(&hpb->hpb_read_sem, &hpb->hpb_read_waiters);
+			poll_wakeup(&hpb->hpb_poll, POLLIN);
+			pipe_wait(hpb, &hpb->hpb_write_sem, &hpb->hpb_write_waiters);
+			continue;
+		}
+
+		size_t chunk = PAGE_SIZE - pp->pp_length;
+		if (chunk > left)
+			chunk = left;
+		memcpy(pp->pp_data + pp->pp_length, src, chunk);
+		pp->pp_length += chunk;
+		src += chunk;
+		left -= chunk;
+	}
+
+	if (left != *len) {
+		/* Something was written; a partial write is not an error */
+		pipe_wakeup(&hpb->hpb_read_sem, &hpb->hpb_read_waiters);
+		poll_wakeup(&hpb->hpb_poll, POLLIN);
+		err = ananas_success();
 	}
 	mutex_unlock(&hpb->hpb_mutex);
-	*len = n;
-	return ananas_success();
+	*len -= left;
+	return err;
 }
 
 static errorcode_t
-pipehandle_clone(thread_t* thread_in, handleindex_t index, struct HANDLE* handle, struct CLONE_OPTIONS* opts, thread_t* thread_out, struct HANDLE** handle_out, handleindex_t* index_out)
+pipehandle_clone(process_t* proc_in, handleindex_t index, struct HANDLE* handle, struct CLONE_OPTIONS* opts, process_t* proc_out, struct HANDLE** handle_out, handleindex_t index_out_min, handleindex_t* index_out)
 {
-	/*
- 	 * Inspect the flags; if the verdict is an unusable handle, refuse to create
-	 * it.
-	 *
-	 * XXX Should we disallow a readonly handle to be cloned writeonly?
-	 */
-	struct HANDLE_PIPE_INFO* parent_hpi = &handle->h_data.d_pipe;
-	int flags = 0;
-	if (opts != NULL) {
-		if (opts->cl_flags & CLONE_FLAG_READONLY)
-			flags |= HPI_FLAG_READ;
-		if (opts->cl_flags & CLONE_FLAG_WRITEONLY)
-			flags |= HPI_FLAG_WRITE;
-	} else {
-		/* Default to read/write clone if no flags are present */
-		flags = HPI_FLAG_READ | HPI_FLAG_WRITE;
-	}
-	if (flags == 0) {
-		/* No flags given; recycle what the original handle had */
-		flags = parent_hpi->hpi_flags;
-	}
-
-	/* Allocate a brand new handle for the thread */
-	errorcode_t err = handle_alloc(HANDLE_TYPE_PIPE, thread_out, 0, handle_out, index_out);
-	ANANAS_ERROR_RETURN(err);
+	struct HANDLE_PIPE_INFO* hpi = &handle->h_data.d_pipe;
+	struct HANDLE_PIPE_BUFFER* hpb = hpi->hpi_buffer;
+	if (hpb == NULL)
+		return ANANAS_ERROR(BAD_HANDLE);
 
 	/* Lock the pipe; we don't want anyone throwing it away while we hook it */
-	struct HANDLE_PIPE_BUFFER* hpb = parent_hpi->hpi_buffer;
 	mutex_lock(&hpb->hpb_mutex);
+	errorcode_t err = handle_clone_generic(handle, proc_out, handle_out, index_out_min, index_out);
+	if (ananas_is_success(err)) {
+		(*handle_out)->h_flags = handle->h_flags;
+		if (hpi->hpi_flags & HPI_FLAG_READ)
+			hpb->hpb_read_count++;
+		if (hpi->hpi_flags & HPI_FLAG_WRITE)
+			hpb->hpb_write_count++;
+	}
+	mutex_unlock(&hpb->hpb_mutex);
+	return err;
+}
 
-	/* Hook the pipe to the new handle */
-	struct HANDLE_PIPE_INFO* hpi = &(*handle_out)->h_data.d_pipe;
-	hpi->hpi_flags = flags;
-	hpi->hpi_buffer = hpb;
-	hpi->hpi_handle = *handle_out;
-	if (flags & HPI_FLAG_READ)
-		hpb->hpb_read_count++;
-	if (flags & HPI_FLAG_WRITE)
-		hpb->hpb_write_count++;
+static errorcode_t
+pipehandle_poll(thread_t* thread, handleindex_t index, struct HANDLE* handle, struct POLL_ENTRY* pe, unsigned int* events)
+{
+	struct HANDLE_PIPE_INFO* hpi = &handle->h_data.d_pipe;
+	struct HANDLE_PIPE_BUFFER* hpb = hpi->hpi_buffer;
+	if (hpb == NULL)
+		return ANANAS_ERROR(BAD_HANDLE);
 
-	/* Hook our handle to the handle chain */
-	hpi->hpi_next = parent_hpi->hpi_next;
-	parent_hpi->hpi_next = hpi;
+	mutex_lock(&hpb->hpb_mutex);
+	if (pe != NULL)
+		poll_register(&hpb->hpb_poll, pe);
 
-	/* All done */
+	unsigned int ev = 0;
+	if (hpi->hpi_flags & HPI_FLAG_READ) {
+		if (hpb->hpb_count > 0)
+			ev |= POLLIN;
+		if (hpb->hpb_write_count == 0)
+			ev |= POLLHUP;
+	}
+	if (hpi->hpi_flags & HPI_FLAG_WRITE) {
+		if (hpb->hpb_read_count == 0)
+			ev |= POLLERR;
+		else if (hpb->hpb_count < PIPE_PAGES || hpb->hpb_page[(hpb->hpb_head + hpb->hpb_count - 1) % PIPE_PAGES].pp_length < PAGE_SIZE)
+			ev |= POLLOUT;
+	}
 	mutex_unlock(&hpb->hpb_mutex);
-	return err;
+
+	*events = ev;
+	return ananas_success();
 }
 
 static struct HANDLE_OPS pipe_hops = {
-	.hop_create = pipehandle_create,
-	.hop_free = pipehandle_free,
 	.hop_read = pipehandle_read,
 	.hop_write = pipehandle_write,
+	.hop_free = pipehandle_free,
 	.hop_clone = pipehandle_clone,
+	.hop_poll = pipehandle_poll,
 };
 HANDLE_TYPE(HANDLE_TYPE_PIPE, "pipe", pipe_hops);
-#endif
 
 /* vim:set ts=2 sw=2: */
@@ -0,0 +1,77 @@
+#include <ananas/types.h>
+#include <ananas/lib.h>
+#include <ananas/lock.h>
+#include <ananas/poll.h>
+#include <ananas/schedule.h>
+#include <ananas/timer.h>
+
+void
+poll_queue_init(struct POLL_QUEUE* pq)
+{
+	spinlock_init(&pq->pq_lock);
+	LIST_INIT(&pq->pq_entries);
+}
+
+void
+poll_register(struct POLL_QUEUE* pq, struct POLL_ENTRY* pe)
+{
+	KASSERT(pe->pe_queue == NULL, "poll entry %p already registered", pe);
+
+	register_t state = spinlock_lock_unpremptible(&pq->pq_lock);
+	pe->pe_queue = pq;
+	LIST_APPEND(&pq->pq_entries, pe);
+	spinlock_unlock_unpremptible(&pq->pq_lock, state);
+}
+
+void
+poll_unregister(struct POLL_ENTRY* pe)
+{
+	struct POLL_QUEUE* pq = pe->pe_queue;
+	if (pq == NULL)
+		return;
+
+	register_t state = spinlock_lock_unpremptible(&pq->pq_lock);
+	LIST_REMOVE(&pq->pq_entries, pe);
+	pe->pe_queue = NULL;
+	spinlock_unlock_unpremptible(&pq->pq_lock, state);
+}
+
+void
+poll_wakeup(struct POLL_QUEUE* pq, unsigned int events)
+{
+	register_t state = spinlock_lock_unpremptible(&pq->pq_lock);
+	LIST_FOREACH(&pq->pq_entries, pe, struct POLL_ENTRY) {
+		if (events & (pe->pe_events | POLLERR | POLLHUP))
+			pe->pe_notify(pe, events);
+	}
+	spinlock_unlock_unpremptible(&pq->pq_lock, state);
+}
+
+uint64_t
+poll_deadline(int timeout)
+{
+	if (timeout <= 0)
+		return 0;
+	return timer_get_ticks() + ((uint64_t)timeout * HZ + 999) / 1000;
+}
+
+int
+poll_sleep(semaphore_t* sem, int timeout, uint64_t deadline)
+{
+	if (timeout == 0)
+		return 0;
+	if (timeout < 0) {
+		sem_wait(sem);
+		return 1;
+	}
+
+	/* XXX We have no timed sleeps yet; keep yielding until signalled or out of time */
+	while (!sem_trywait(sem)) {
+		if (timer_get_ticks() >= deadline)
+			return 0;
+		reschedule();
+	}
+	return 1;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -1,14 +1,18 @@
 #include <ananas/types.h>
 #include <ananas/error.h>
+#include <ananas/flags.h>
 #include <ananas/lib.h>
 #include <ananas/init.h>
 #include <ananas/kdb.h>
 #include <ananas/mm.h>
 #include <ananas/kmem.h>
 #include <ananas/page.h>
+#include <ananas/pcpu.h>
 #include <ananas/handle.h>
+#include <ananas/exec.h>
 #include <ananas/process.h>
 #include <ananas/procinfo.h>
+#include <ananas/thread.h>
 #include <ananas/vm.h>
 #include <ananas/vmspace.h>
 #include <machine/param.h> /* for PAGE_SIZE */
@@ -16,6 +20,9 @@
 
 TRACE_SETUP;
 
+#define PROCESS_HASH_SIZE 256 /* Buckets for PID lookups, power of two */
+#define PID_MAX 32768 /* PIDs are 1 .. PID_MAX - 1 */
+
 /* XXX These should be locked */
 static struct PROCESS_CALLBACKS process_callbacks_init;
 static struct PROCESS_CALLBACKS process_callbacks_exit;
@@ -23,26 +30,57 @@ static struct PROCESS_CALLBACKS process_callbacks_exit;
 namespace Ananas {
 namespace Process {
 
+/* Protects the process lists, the PID administration and parent/child relations */
 mutex_t process_mtx;
 struct PROCESS_QUEUE process_all;
 
 namespace {
-semaphore_t process_sleep_sem;
-pid_t process_curpid = -1;
+struct PROCESS_QUEUE process_hash[PROCESS_HASH_SIZE];
+uint32_t process_pid_bitmap[PID_MAX / 32];	/* PIDs in use, one bit each */
+pid_t process_nextpid = 1;
 } // unnamed namespace
 
 } // namespace Process
 } // namespace Ananas
 
-static pid_t
-process_alloc_pid()
+#define PROCESS_HASH(pid) (&Ananas::Process::process_hash[(pid) & (PROCESS_HASH_SIZE - 1)])
+
+/*
+ * Reserves a PID; these are handed out in increasing order and wrap around,
+ * so that a PID is not reused right after its process is gone.
+ */
+static errorcode_t
+process_alloc_pid(pid_t* out)
 {
-	/* XXX this is a bit of a kludge for now ... */
-	mutex_lock(&Ananas::Process::process_mtx);
-	pid_t pid = Ananas::Process::process_curpid++;
-	mutex_unlock(&Ananas::Process::process_mtx);
+	using namespace Ananas::Process;
+	const unsigned int num_words = PID_MAX / 32;
+
+	mutex_lock(&process_mtx);
+	/* Start at the word of the next PID; the final iteration covers what we skipped there */
+	for (unsigned int n = 0; n <= num_words; n++) {
+		unsigned int w = (process_nextpid / 32 + n) % num_words;
+		uint32_t used = process_pid_bitmap[w];
+		if (n == 0)
+			used |= (1U << (process_nextpid % 32)) - 1;
+		if (used == 0xffffffff)
+			continue;
 
-	return pid;
+		pid_t pid = w * 32 + __builtin_ctz(~used);
+		process_pid_bitmap[w] |= 1U << (pid % 32);
+		process_nextpid = pid + 1 < PID_MAX ? pid + 1 : 1;
+		mutex_unlock(&process_mtx);
+		*out = pid;
+		return ananas_success();
+	}
+	mutex_unlock(&process_mtx);
+	return ANANAS_ERROR(NO_RESOURCE);
+}
+
+/* Must be called with process_mtx held */
+static void
+process_free_pid(pid_t pid)
+{
+	Ananas::Process::process_pid_bitmap[pid / 32] &= ~(1U << (pid % 32));
 }
 
 static errorcode_t
@@ -50,14 +88,21 @@ process_alloc_ex(process_t* parent, process_t** dest, int flags)
 {
 	errorcode_t err;
 
+	pid_t pid;
+	err = process_alloc_pid(&pid);
+	ANANAS_ERROR_RETURN(err);
+
 	auto p = new PROCESS;
 	memset(p, 0, sizeof(*p));
 	p->p_parent = parent; /* XXX should we take a ref here? */
 	p->p_refcount = 1; /* caller */
 	p->p_state = PROCESS_STATE_ACTIVE;
-	p->p_pid = process_alloc_pid();
+	p->p_pid = pid;
 	mutex_init(&p->p_lock, "plock");
+	sem_init(&p->p_vfork_sem, 0);
+	sem_init(&p->p_child_sem, 0);
 	LIST_INIT(&p->p_children);
+	LIST_INIT(&p->p_zombies);
 
 	/* Create the process's vmspace */
 	err = vmspace_create(&p->p_vmspace);
@@ -75,6 +120,10 @@ process_alloc_ex(process_t* parent, process_t** dest, int flags)
 	{
 		// XXX we should have a separate vmpage_create_...() for this that sets vp_vaddr
 		struct VM_PAGE* vp = vmpage_create_private(va, 0);
+		if (vp == nullptr) {
+			err = ANANAS_ERROR(OUT_OF_MEMORY);
+			goto fail;
+		}
 		vp->vp_vaddr = va->va_virt;
 		p->p_info = static_cast<struct PROCINFO*>(kmem_map(page_get_paddr(vmpage_get_page(vp)), sizeof(struct PROCINFO), VM_FLAG_READ | VM_FLAG_WRITE));
 		vmpage_map(p->p_vmspace, va, vp);
@@ -85,21 +134,29 @@ process_alloc_ex(process_t* parent, process_t** dest, int flags)
 	memset(p->p_info, 0, sizeof(struct PROCINFO));
 	p->p_info->pi_size = sizeof(struct PROCINFO);
 	p->p_info->pi_pid = p->p_pid;
-	if (parent != NULL)
-		process_set_environment(p, parent->p_info->pi_env, PROCINFO_ENV_LENGTH - 1);
+	if (parent != NULL) {
+		/* The vectors live in process memory, which the child gets a copy of */
+		p->p_info->pi_argc = parent->p_info->pi_argc;
+		p->p_info->pi_argv = parent->p_info->pi_argv;
+		p->p_info->pi_envp = parent->p_info->pi_envp;
+		strcpy(p->p_name, parent->p_name);
+	}
 
 	// Clone the parent's handles
 	if (parent != NULL) {
-		for (unsigned int n = 0; n < PROCESS_MAX_HANDLES; n++) {
-			if (parent->p_handle[n] == NULL)
+		struct HANDLE_TABLE* tab = parent->p_handle_table;
+		for (unsigned int n = 0; tab != NULL && n < tab->htab_size; n++) {
+			if (tab->htab_handle[n] == NULL)
 				continue;
 
 			struct HANDLE* handle;
 			handleindex_t out;
 			err = handle_clone(parent, n, NULL, p, &handle, n, &out);
+			if (ANANAS_ERROR_CODE(err) == ANANAS_ERROR_BAD_HANDLE)
+				continue; /* closed while we were looking; nothing to clone */
 			if (ananas_is_failure(err))
 				goto fail;
-			KASSERT(n == out, "cloned handle %d to new handle %d", n, out);
+			KASSERT(n == (unsigned int)out, "cloned handle %d to new handle %d", n, out);
 		}
 	}
 	/* Run all process initialization callbacks */
@@ -109,24 +166,24 @@ process_alloc_ex(process_t* parent, process_t** dest, int flags)
 			goto fail;
 	}
 
-	/* Grab the parent's lock and insert the child */
-	if (parent != NULL) {
-		process_lock(parent);
-		LIST_APPEND_IP(&parent->p_children, children, p);
-		process_unlock(parent);
-	}
-
-	/* Finally, add the process to all processes */
+	/* Finally, hook the process to its parent and make it visible to everyone */
 	mutex_lock(&Ananas::Process::process_mtx);
+	if (parent != NULL)
+		LIST_APPEND_IP(&parent->p_children, children, p);
 	LIST_APPEND_IP(&Ananas::Process::process_all, all, p);
+	LIST_APPEND_IP(PROCESS_HASH(p->p_pid), hash, p);
 	mutex_unlock(&Ananas::Process::process_mtx);
 
 	*dest = p;
 	return ananas_success();
 
 fail:
+	handle_table_destroy(p);
 	if (p->p_vmspace != NULL)
 		vmspace_destroy(p->p_vmspace);
+	mutex_lock(&Ananas::Process::process_mtx);
+	process_free_pid(p->p_pid);
+	mutex_unlock(&Ananas::Process::process_mtx);
 	kfree(p);
 	return err;
 }
@@ -145,6 +202,17 @@ process_clone(process_t* p, int flags, process_t** out_p)
 	err = process_alloc_ex(p, &newp, 0);
 	ANANAS_ERROR_RETURN(err);
 
+	if (flags & CLONE_FLAG_VFORK) {
+		/*
+		 * Borrow the parent's vmspace; our own will only be filled once we exec().
+		 * The parent must not run until process_vfork_release() is called.
+		 */
+		newp->p_vfork_vmspace = newp->p_vmspace;
+		newp->p_vmspace = p->p_vmspace;
+		*out_p = newp;
+		return ananas_success();
+	}
+
 	/* Duplicate the vmspace - this should leave the private mappings alone */
 	err = vmspace_clone(p->p_vmspace, newp->p_vmspace, 0);
 	if (ananas_is_failure(err))
@@ -167,15 +235,32 @@ process_destroy(process_t* p)
 	}
 
 	/* Free all handles */
-	for(unsigned int n = 0; n < PROCESS_MAX_HANDLES; n++)
-		handle_free_byindex(p, n);
+	handle_table_destroy(p);
+
+	/* If we are still borrowing our parent's vmspace, leave it alone */
+	if (p->p_vfork_vmspace != nullptr) {
+		p->p_vmspace = p->p_vfork_vmspace;
+		p->p_vfork_vmspace = nullptr;
+	}
 
 	/* Clean the process's vmspace up - this will remove all non-essential mappings */
 	vmspace_cleanup(p->p_vmspace);
 
-	/* Remove the process from the all-process list */
+	/*
+	 * Remove the process from the all-process list and give up the PID. We
+	 * are only still hooked to our parent if we never ran (i.e. clone failed)
+	 */
 	mutex_lock(&Ananas::Process::process_mtx);
 	LIST_REMOVE_IP(&Ananas::Process::process_all, all, p);
+	LIST_REMOVE_IP(PROCESS_HASH(p->p_pid), hash, p);
+	process_free_pid(p->p_pid);
+	if (p->p_parent != NULL) {
+		if (p->p_state == PROCESS_STATE_ZOMBIE)
+			LIST_REMOVE_IP(&p->p_parent->p_zombies, children, p);
+		else
+			LIST_REMOVE_IP(&p->p_parent->p_children, children, p);
+		p->p_parent = NULL;
+	}
 	mutex_unlock(&Ananas::Process::process_mtx);
 
 	/*
@@ -189,7 +274,21 @@ void
 process_ref(process_t* p)
 {
 	KASSERT(p->p_refcount > 0, "reffing process with invalid refcount %d", p->p_refcount);
-	++p->p_refcount;
+	__sync_fetch_and_add(&p->p_refcount, 1);
+}
+
+/* Obtains a reference unless the process is already being destroyed */
+static bool
+process_tryref(process_t* p)
+{
+	refcount_t refs = p->p_refcount;
+	while (refs > 0) {
+		refcount_t prev = __sync_val_compare_and_swap(&p->p_refcount, refs, refs + 1);
+		if (prev == refs)
+			return true;
+		refs = prev;
+	}
+	return false;
 }
 
 void
@@ -197,19 +296,75 @@ process_deref(process_t* p)
 {
 	KASSERT(p->p_refcount > 0, "dereffing process with invalid refcount %d", p->p_refcount);
 
-	if (--p->p_refcount == 0)
+	if (__sync_sub_and_fetch(&p->p_refcount, 1) == 0)
 		process_destroy(p);
 }
 
+void
+process_vfork_release(process_t* p)
+{
+	if (p->p_vfork_vmspace == nullptr)
+		return;
+
+	/*
+	 * Switch to our own vmspace before waking up the parent; it may change or
+	 * destroy its vmspace as soon as it runs.
+	 */
+	thread_t* t = PCPU_GET(curthread);
+	KASSERT(t->t_process == p, "releasing vfork of process %p from non-current process %p", p, t->t_process);
+	p->p_vmspace = p->p_vfork_vmspace;
+	p->p_vfork_vmspace = nullptr;
+	md_thread_reload_vmspace(t);
+
+	sem_signal(&p->p_vfork_sem);
+}
+
 void
 process_exit(process_t* p, int status)
 {
+	/* If we were vfork()-ed, let our parent continue */
+	process_vfork_release(p);
+
 	process_lock(p);
 	p->p_state = PROCESS_STATE_ZOMBIE;
 	p->p_exit_status = status;
 	process_unlock(p);
 
-	sem_signal(&Ananas::Process::process_sleep_sem);
+	/*
+	 * Orphan our children; no one will wait for them anymore, so we drop the
+	 * reference we held on their behalf. Living children still have one from
+	 * their threads. Then hand ourselves over to our parent.
+	 */
+	struct PROCESS_QUEUE orphans;
+	LIST_INIT(&orphans);
+	mutex_lock(&Ananas::Process::process_mtx);
+	while (!LIST_EMPTY(&p->p_children)) {
+		process_t* child = LIST_HEAD(&p->p_children);
+		LIST_POP_HEAD_IP(&p->p_children, children);
+		LIST_APPEND_IP(&orphans, children, child);
+	}
+	while (!LIST_EMPTY(&p->p_zombies)) {
+		process_t* child = LIST_HEAD(&p->p_zombies);
+		LIST_POP_HEAD_IP(&p->p_zombies, children);
+		LIST_APPEND_IP(&orphans, children, child);
+	}
+	LIST_FOREACH_IP(&orphans, children, child, struct PROCESS) {
+		child->p_parent = NULL;
+	}
+
+	process_t* parent = p->p_parent;
+	if (parent != NULL) {
+		LIST_REMOVE_IP(&parent->p_children, children, p);
+		LIST_APPEND_IP(&parent->p_zombies, children, p);
+		sem_signal(&parent->p_child_sem);
+	}
+	mutex_unlock(&Ananas::Process::process_mtx);
+
+	while (!LIST_EMPTY(&orphans)) {
+		process_t* child = LIST_HEAD(&orphans);
+		LIST_POP_HEAD_IP(&orphans, children);
+		process_deref(child);
+	}
 }
 
 errorcode_t
@@ -217,75 +372,53 @@ process_wait_and_lock(process_t* parent, int flags, process_t** p_out)
 {
 	if (flags != 0)
 		return ANANAS_ERROR(BAD_FLAG);
-	/*
-	 * XXX We aren't going for efficiency here - thus we use a single
-	 *     semaphore to wake anything up once a process has exited.
-	 */
+
+	/* Exited children are placed on the zombie list, so we need only take the first */
 	for(;;) {
-		process_lock(parent);
-		LIST_FOREACH_IP(&parent->p_children, children, child, struct PROCESS) {
+		mutex_lock(&Ananas::Process::process_mtx);
+		process_t* child = LIST_HEAD(&parent->p_zombies);
+		if (child != NULL) {
+			LIST_POP_HEAD_IP(&parent->p_zombies, children);
+			child->p_parent = NULL;
+			mutex_unlock(&Ananas::Process::process_mtx);
+
+			/* Note that we give our ref to the caller! */
 			process_lock(child);
-			if (child->p_state == PROCESS_STATE_ZOMBIE) {
-				/* Found one; remove it from the parent's list */
-				LIST_REMOVE_IP(&parent->p_children, children, child);
-				process_unlock(parent);
-
-				/* Note that we give our ref to the caller! */
-				*p_out = child;
-				return ananas_success();
-			}
-			process_unlock(child);
+			*p_out = child;
+			return ananas_success();
 		}
-		process_unlock(parent);
+		mutex_unlock(&Ananas::Process::process_mtx);
 
-		/* Nothing good yet; sleep on it */
-		sem_wait(&Ananas::Process::process_sleep_sem);
+		/* Nothing good yet; sleep until one of our children exits */
+		sem_wait(&parent->p_child_sem);
 	}
 
 	/* NOTREACHED */
 }
 
-errorcode_t
-process_set_args(process_t* p, const char* args, size_t args_len)
-{
-	if (args_len >= (PROCINFO_ARGS_LENGTH - 1))
-		args_len = PROCINFO_ARGS_LENGTH - 1;
-	for (unsigned int i = 0; i < args_len; i++)
-		if(args[i] == '\0' && args[i + 1] == '\0') {
-			memcpy(p->p_info->pi_args, args, i + 2 /* terminating \0\0 */);
-			return ananas_success();
-		}
-	return ANANAS_ERROR(BAD_LENGTH);
-}
-
-errorcode_t
-process_set_environment(process_t* p, const char* env, size_t env_len)
+void
+process_set_args(process_t* p, const struct EXEC_ARGS* ea)
 {
-	if (env_len >= (PROCINFO_ENV_LENGTH - 1))
-		env_len = PROCINFO_ENV_LENGTH - 1;
-	for (unsigned int i = 0; i < env_len; i++)
-		if(env[i] == '\0' && env[i + 1] == '\0') {
-			memcpy(p->p_info->pi_env, env, i + 2 /* terminating \0\0 */);
-			return ananas_success();
-		}
-
-	return ANANAS_ERROR(BAD_LENGTH);
+	p->p_info->pi_argc = ea->ea_argc;
+	p->p_info->pi_argv = reinterpret_cast<char**>(ea->ea_argv);
+	p->p_info->pi_envp = reinterpret_cast<char**>(ea->ea_envp);
+	strcpy(p->p_name, ea->ea_name);
 }
 
 process_t*
 process_lookup_by_id_and_ref(pid_t pid)
 {
+	if (pid <= 0 || pid >= PID_MAX)
+		return nullptr;
+
 	mutex_lock(&Ananas::Process::process_mtx);
-	LIST_FOREACH_IP(&Ananas::Process::process_all, all, p, struct PROCESS) {
-		process_lock(p);
-		if (p->p_pid != pid) {
-			process_unlock(p);
+	LIST_FOREACH_IP(PROCESS_HASH(pid), hash, p, struct PROCESS) {
+		if (p->p_pid != pid)
 			continue;
-		}
 
-		// Process found; get a ref and return it
-		process_ref(p);
-		process_unlock(p);
+		// Process found; get a ref and return it - unless it is on its way out
+		if (!process_tryref(p))
+			p = nullptr;
 		mutex_unlock(&Ananas::Process::process_mtx);
 		return p;
 	}
@@ -325,9 +458,11 @@ static errorcode_t
 process_init()
 {
 	mutex_init(&Ananas::Process::process_mtx, "proc");
-	sem_init(&Ananas::Process::process_sleep_sem, 0);
 	LIST_INIT(&Ananas::Process::process_all);
-	Ananas::Process::process_curpid = 1;
+	for (unsigned int n = 0; n < PROCESS_HASH_SIZE; n++)
+		LIST_INIT(&Ananas::Process::process_hash[n]);
+	Ananas::Process::process_pid_bitmap[0] = 1; /* PID 0 is never handed out */
+	Ananas::Process::process_nextpid = 1;
 
 	return ananas_success();
 }
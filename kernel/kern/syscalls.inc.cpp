@@ -0,0 +1,62 @@
+case 0: 
+	sys_exit(curthread,(int)a->arg1); return ananas_success();
+case 1: 
+	return (register_t)sys_read(curthread,(handleindex_t)a->arg1,(void*)a->arg2,(size_t*)a->arg3);
+case 2: 
+	return (register_t)sys_write(curthread,(handleindex_t)a->arg1,(const void*)a->arg2,(size_t*)a->arg3);
+case 3: 
+	return (register_t)sys_open(curthread,(const char*)a->arg1,(int)a->arg2,(int)a->arg3,(handleindex_t*)a->arg4);
+case 4: 
+	return (register_t)sys_close(curthread,(handleindex_t)a->arg1);
+case 5: 
+	return (register_t)sys_unlink(curthread,(const char*)a->arg1);
+case 6: 
+	return (register_t)sys_seek(curthread,(handleindex_t)a->arg1,(off_t*)a->arg2,(int)a->arg3);
+case 7: 
+	return (register_t)sys_clone(curthread,(int)a->arg1,(pid_t*)a->arg2);
+case 8: 
+	return (register_t)sys_waitpid(curthread,(pid_t*)a->arg1,(int*)a->arg2,(int)a->arg3);
+case 9: 
+	return (register_t)sys_execve(curthread,(const char*)a->arg1,(const char**)a->arg2,(const char**)a->arg3);
+case 10: 
+	return (register_t)sys_vmop(curthread,(struct VMOP_OPTIONS*)a->arg1);
+case 11: 
+	return (register_t)sys_dupfd(curthread,(handleindex_t)a->arg1,(int)a->arg2,(handleindex_t*)a->arg3);
+case 12: 
+	return (register_t)sys_rename(curthread,(const char*)a->arg1,(const char*)a->arg2);
+case 13: 
+	return (register_t)sys_stat(curthread,(const char*)a->arg1,(struct stat*)a->arg2);
+case 14: 
+	return (register_t)sys_chdir(curthread,(const char*)a->arg1);
+case 15: 
+	return (register_t)sys_fstat(curthread,(handleindex_t)a->arg1,(struct stat*)a->arg2);
+case 16: 
+	return (register_t)sys_fchdir(curthread,(handleindex_t)a->arg1);
+case 17: 
+	return (register_t)sys_fcntl(curthread,(handleindex_t)a->arg1,(int)a->arg2,(const void*)a->arg3,(void*)a->arg4);
+case 18: 
+	return (register_t)sys_link(curthread,(const char*)a->arg1,(const char*)a->arg2);
+case 19: 
+	return (register_t)sys_utime(curthread,(const char*)a->arg1,(const struct utimbuf*)a->arg2);
+case 20: 
+	return (register_t)sys_readv(curthread,(handleindex_t)a->arg1,(const struct iovec*)a->arg2,(int)a->arg3,(size_t*)a->arg4);
+case 21: 
+	return (register_t)sys_writev(curthread,(handleindex_t)a->arg1,(const struct iovec*)a->arg2,(int)a->arg3,(size_t*)a->arg4);
+case 22: 
+	return (register_t)sys_pread(curthread,(handleindex_t)a->arg1,(void*)a->arg2,(size_t*)a->arg3,(const off_t*)a->arg4);
+case 23: 
+	return (register_t)sys_pwrite(curthread,(handleindex_t)a->arg1,(const void*)a->arg2,(size_t*)a->arg3,(const off_t*)a->arg4);
+case 24: 
+	return (register_t)sys_ring_setup(curthread,(struct RING*)a->arg1,(size_t)a->arg2);
+case 25: 
+	return (register_t)sys_ring_enter(curthread,(unsigned int*)a->arg1);
+case 26: 
+	return (register_t)sys_pipe(curthread,(handleindex_t*)a->arg1);
+case 27: 
+	return (register_t)sys_poll(curthread,(struct pollfd*)a->arg1,(size_t)a->arg2,(int)a->arg3,(size_t*)a->arg4);
+case 28: 
+	return (register_t)sys_evq_create(curthread,(handleindex_t*)a->arg1);
+case 29: 
+	return (register_t)sys_evq_ctl(curthread,(handleindex_t)a->arg1,(int)a->arg2,(const struct EVQ_EVENT*)a->arg3);
+case 30: 
+	return (register_t)sys_evq_wait(curthread,(handleindex_t)a->arg1,(struct EVQ_EVENT*)a->arg2,(size_t*)a->arg3,(int)a->arg4);
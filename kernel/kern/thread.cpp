@@ -33,6 +33,7 @@
 #include <ananas/vm.h>
 #include <ananas/lib.h>
 #include <ananas/mm.h>
+#include <ananas/page.h>
 #include <ananas/vmspace.h>
 #include "options.h"
 
@@ -58,7 +59,12 @@ thread_alloc(process_t* p, thread_t** dest, const char* name, int flags)
 	t->t_affinity = THREAD_AFFINITY_ANY;
 
 	/* Ask machine-dependant bits to initialize our thread data */
-	md_thread_init(t, flags);
+	errorcode_t err = md_thread_init(t, flags);
+	if (ananas_is_failure(err)) {
+		process_deref(p);
+		kfree(t);
+		return err;
+	}
 	md_thread_set_argument(t, p->p_info_va);
 
 	/* If we don't yet have a main thread, this thread will become the main */
@@ -92,7 +98,8 @@ kthread_init(thread_t* t, const char* name, kthread_func_t func, void* arg)
 	thread_set_name(t, name);
 
 	/* Initialize MD-specifics */
-	md_kthread_init(t, func, arg);
+	errorcode_t err = md_kthread_init(t, func, arg);
+	KASSERT(ananas_is_success(err), "cannot initialize kernel thread '%s': %d", name, err);
 
 	/* Initialize scheduler-specific parts */
 	scheduler_init_thread(t);
@@ -329,7 +336,9 @@ void
 idle_thread(void*)
 {
 	while(1) {
-		md_cpu_relax();
+		/* Use our spare time to prepare zeroed pages; only relax if there is nothing to do */
+		if (!page_zero_pool_fill())
+			md_cpu_relax();
 	}
 }
 
@@ -49,6 +49,7 @@ public:
 
 	errorcode_t	Write(const void* data, size_t& len, off_t offset) override;
 	errorcode_t Read(void* buf, size_t& len, off_t offset) override;
+	unsigned int GetReadiness() override;
 
 	/*
 	 * This is crude, but we'll need a queue for all TTY devices so that
@@ -73,6 +74,7 @@ public:
 private:
 	void PutChar(unsigned char ch);
 	void HandleEcho(unsigned char byte);
+	bool HaveLine(unsigned int& in_len);
 
 	struct termios	tty_termios;
 	char						tty_input_queue[MAX_INPUT];
@@ -146,40 +148,11 @@ TTY::Read(void* buf, size_t& len, off_t offset)
 			panic("XXX implement me: icanon off!");
 		}
 
-		if (tty_in_readpos == tty_in_writepos) {
+		unsigned int in_len;
+		if (!HaveLine(in_len)) {
 			/*
-			 * Buffer is empty - schedule the thread for a wakeup once we have data.
-			  */
-			sem_wait(&d_Waiters);
-			continue;
-		}
-
-		/*
-		 * A line is delimited by a newline NL, end-of-file char EOF or end-of-line
-		 * EOL char. We will have to scan our input buffer for any of these.
-		 */
-		int in_len;
-		if (tty_in_readpos < tty_in_writepos) {
-			in_len = tty_in_writepos - tty_in_readpos;
-		} else /* if (tty_in_readpos > tty_in_writepos) */ {
-			in_len = (MAX_INPUT - tty_in_writepos) + tty_in_readpos;
-		}
-
-		/* See if we can find a delimiter here */
-#define CHAR_AT(i) (tty_input_queue[(tty_in_readpos + i) % MAX_INPUT])
-		unsigned int n = 0;
-		while (n < in_len) {
-			if (CHAR_AT(n) == NL)
-				break;
-			if (tty_termios.c_cc[VEOF] != _POSIX_VDISABLE && CHAR_AT(n) == tty_termios.c_cc[VEOF])
-				break;
-			if (tty_termios.c_cc[VEOL] != _POSIX_VDISABLE && CHAR_AT(n) == tty_termios.c_cc[VEOL])
-				break;
-			n++;
-		}
-#undef CHAR_AT
-		if (n == in_len) {
-			/* Line is not complete - try again later */
+			 * Line is not complete - schedule the thread for a wakeup once we have data.
+			 */
 			sem_wait(&d_Waiters);
 			continue;
 		}
@@ -200,6 +173,46 @@ TTY::Read(void* buf, size_t& len, off_t offset)
 	/* NOTREACHED */
 }
 
+/*
+ * Determines whether a complete line is available; 'in_len' is set to the
+ * number of bytes queued.
+ */
+bool
+TTY::HaveLine(unsigned int& in_len)
+{
+	if (tty_in_readpos <= tty_in_writepos) {
+		in_len = tty_in_writepos - tty_in_readpos;
+	} else /* if (tty_in_readpos > tty_in_writepos) */ {
+		in_len = (MAX_INPUT - tty_in_readpos) + tty_in_writepos;
+	}
+
+	/*
+	 * A line is delimited by a newline NL, end-of-file char EOF or end-of-line
+	 * EOL char. We will have to scan our input buffer for any of these.
+	 */
+#define CHAR_AT(i) (tty_input_queue[(tty_in_readpos + i) % MAX_INPUT])
+	for (unsigned int n = 0; n < in_len; n++) {
+		if (CHAR_AT(n) == NL)
+			return true;
+		if (tty_termios.c_cc[VEOF] != _POSIX_VDISABLE && CHAR_AT(n) == tty_termios.c_cc[VEOF])
+			return true;
+		if (tty_termios.c_cc[VEOL] != _POSIX_VDISABLE && CHAR_AT(n) == tty_termios.c_cc[VEOL])
+			return true;
+	}
+#undef CHAR_AT
+	return false;
+}
+
+unsigned int
+TTY::GetReadiness()
+{
+	/* Output is never held back; input is only there once a line is complete */
+	unsigned int in_len;
+	if (HaveLine(in_len))
+		return POLLIN | POLLOUT;
+	return POLLOUT;
+}
+
 void
 TTY::PutChar(unsigned char ch)
 {
@@ -282,6 +295,7 @@ TTY::ProcessInput()
 
 	/* If we have waiters, awaken them */
 	sem_signal(&d_Waiters);
+	poll_wakeup(&d_PollQueue, POLLIN);
 }
 
 static void
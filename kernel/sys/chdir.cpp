@@ -1,5 +1,6 @@
 #include <ananas/types.h>
 #include <ananas/error.h>
+#include <ananas/limits.h>
 #include <ananas/process.h>
 #include <ananas/syscall.h>
 #include <ananas/trace.h>
@@ -8,14 +9,18 @@
 TRACE_SETUP;
 
 errorcode_t
-sys_chdir(thread_t* t, const char* path)
+sys_chdir(thread_t* t, const char* upath)
 {
+	char path[MAX_PATH];
+	errorcode_t err = syscall_fetch_path(t, upath, path);
+	ANANAS_ERROR_RETURN(err);
+
 	TRACE(SYSCALL, FUNC, "t=%p, path='%s'", t, path);
 	process_t* proc = t->t_process;
 	struct DENTRY* cwd = proc->p_cwd;
 
 	struct VFS_FILE file;
-	errorcode_t err = vfs_open(path, cwd, &file);
+	err = vfs_open(path, cwd, &file);
 	ANANAS_ERROR_RETURN(err);
 
 	/* XXX Check if file has a directory */
@@ -1,6 +1,8 @@
 #include <ananas/syscalls.h>
 #include <ananas/error.h>
+#include <ananas/flags.h>
 #include <ananas/process.h>
+#include <ananas/syscall.h>
 #include <ananas/thread.h>
 #include <ananas/trace.h>
 
@@ -13,13 +15,12 @@ sys_clone(thread_t* t, int flags, pid_t* out_pid)
 	errorcode_t err;
 	process_t* proc = t->t_process;
 
-	/* XXX Future improvement so we can do vfork() and such */
-	if (flags != 0)
+	if ((flags & ~CLONE_FLAG_VFORK) != 0)
 		return ANANAS_ERROR(BAD_FLAG);
 
 	/* First, make a copy of the process; this inherits all files and such */
 	process_t* new_proc;
-	err = process_clone(proc, 0, &new_proc);
+	err = process_clone(proc, flags, &new_proc);
 	ANANAS_ERROR_RETURN(err);
 
 	/* Now clone the handle to the new process */
@@ -27,12 +28,25 @@ sys_clone(thread_t* t, int flags, pid_t* out_pid)
 	err = thread_clone(new_proc, &new_thread);
 	if (ananas_is_failure(err))
 		goto fail;
-	*out_pid = new_proc->p_pid;
 
 	/* Resume the cloned thread - it'll have a different return value from ours */
 	thread_resume(new_thread);
 
-	TRACE(SYSCALL, FUNC, "t=%p, success, new pid=%u", t, *out_pid);
+	if (flags & CLONE_FLAG_VFORK) {
+		/*
+		 * The child is using our vmspace; wait until it has exec()'d or exited. As
+		 * it ran on our stack, userland cannot rely on anything stored there and
+		 * must get all registers back intact.
+		 */
+		sem_wait(&new_proc->p_vfork_sem);
+		md_thread_restore_all(t);
+	}
+	{
+		pid_t new_pid = new_proc->p_pid;
+		err = copyout(out_pid, &new_pid, sizeof(new_pid));
+		ANANAS_ERROR_RETURN(err);
+		TRACE(SYSCALL, FUNC, "t=%p, success, new pid=%u", t, new_pid);
+	}
 	return err;
 
 fail:
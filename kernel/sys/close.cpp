@@ -1,5 +1,7 @@
 #include <ananas/types.h>
 #include <ananas/error.h>
+#include <ananas/handle.h>
+#include <ananas/process.h>
 #include <ananas/syscall.h>
 #include <ananas/trace.h>
 #include <ananas/vm.h>
@@ -11,10 +13,7 @@ sys_close(thread_t* t, handleindex_t hindex)
 {
 	TRACE(SYSCALL, FUNC, "t=%p, hindex=%p", t, hindex);
 
-	struct HANDLE* h;
-	errorcode_t err = syscall_get_handle(t, hindex, &h);
-	ANANAS_ERROR_RETURN(err);
-	err = handle_free(h);
+	errorcode_t err = handle_free_byindex(t->t_process, hindex);
 	ANANAS_ERROR_RETURN(err);
 
 	TRACE(SYSCALL, INFO, "t=%p, success", t);
@@ -17,10 +17,8 @@ sys_create(thread_t* t, struct CREATE_OPTIONS* opts, handleindex_t* out)
 
 	/* Obtain arguments */
 	struct CREATE_OPTIONS cropts;
-	void* opts_ptr;
-	err = syscall_map_buffer(t, opts, sizeof(cropts), VM_FLAG_READ, &opts_ptr);
+	err = copyin(&cropts, opts, sizeof(cropts));
 	ANANAS_ERROR_RETURN(err);
-	memcpy(&cropts, opts_ptr, sizeof(cropts));
 	if (cropts.cr_size != sizeof(cropts))
 		return ANANAS_ERROR(BAD_LENGTH);
 
@@ -1,6 +1,8 @@
 #include <ananas/syscalls.h>
 #include <ananas/error.h>
+#include <ananas/handle.h>
 #include <ananas/process.h>
+#include <ananas/syscall.h>
 #include <ananas/thread.h>
 #include <ananas/handle-options.h>
 #include <ananas/trace.h>
@@ -15,7 +17,8 @@ sys_dupfd(thread_t* t, handleindex_t index, int flags, handleindex_t* out)
 	process_t* process = t->t_process;
 	handleindex_t new_idx = 0;
 	if (flags & HANDLE_DUPFD_TO) {
-		new_idx = *out;
+		errorcode_t err = copyin(&new_idx, out, sizeof(new_idx));
+		ANANAS_ERROR_RETURN(err);
 		sys_close(t, new_idx); /* ensure it is available; not an error if this fails */
 	}
 
@@ -24,8 +27,10 @@ sys_dupfd(thread_t* t, handleindex_t index, int flags, handleindex_t* out)
 	errorcode_t err = handle_clone(process, index, NULL, process, &handle_out, new_idx, &hidx_out);
 	ANANAS_ERROR_RETURN(err);
 
-	*out = hidx_out;
-	return ananas_success();
+	err = syscall_set_handleindex(t, out, hidx_out);
+	if (ananas_is_failure(err))
+		handle_free_byindex(process, hidx_out);
+	return err;
 }
 
 /* vim:set ts=2 sw=2: */
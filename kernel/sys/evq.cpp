@@ -0,0 +1,82 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/handle.h>
+#include <ananas/mm.h>
+#include <ananas/poll.h>
+#include <ananas/process.h>
+#include <ananas/syscall.h>
+#include <ananas/trace.h>
+
+TRACE_SETUP;
+
+errorcode_t
+sys_evq_create(thread_t* t, handleindex_t* out)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, out=%p", t, out);
+	process_t* proc = t->t_process;
+
+	struct HANDLE* handle;
+	handleindex_t index;
+	errorcode_t err = handle_alloc(HANDLE_TYPE_EVQ, proc, 0, &handle, &index);
+	ANANAS_ERROR_RETURN(err);
+
+	err = evq_connect(handle);
+	if (ananas_is_success(err))
+		err = copyout(out, &index, sizeof(index));
+	if (ananas_is_failure(err)) {
+		handle_free_byindex(proc, index);
+		return err;
+	}
+
+	TRACE(SYSCALL, INFO, "t=%p, success, index=%u", t, index);
+	return ananas_success();
+}
+
+errorcode_t
+sys_evq_ctl(thread_t* t, handleindex_t hindex, int op, const struct EVQ_EVENT* ev)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, hindex=%u, op=%d, ev=%p", t, hindex, op, ev);
+
+	struct EVQ_EVENT event;
+	errorcode_t err = copyin(&event, ev, sizeof(event));
+	ANANAS_ERROR_RETURN(err);
+
+	struct HANDLE* h;
+	err = syscall_get_handle(t, hindex, &h);
+	ANANAS_ERROR_RETURN(err);
+
+	err = evq_control(t, h, op, &event);
+	handle_deref(h);
+	return err;
+}
+
+errorcode_t
+sys_evq_wait(thread_t* t, handleindex_t hindex, struct EVQ_EVENT* events, size_t* num, int timeout)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, hindex=%u, events=%p, num=%p, timeout=%d", t, hindex, events, num, timeout);
+
+	size_t max;
+	errorcode_t err = syscall_fetch_size(t, num, &max);
+	ANANAS_ERROR_RETURN(err);
+	if (max == 0 || max > POLL_MAX)
+		return ANANAS_ERROR(BAD_LENGTH);
+
+	struct HANDLE* h;
+	err = syscall_get_handle(t, hindex, &h);
+	ANANAS_ERROR_RETURN(err);
+
+	auto ev = new struct EVQ_EVENT[max];
+	size_t count = max;
+	err = evq_collect(t, h, ev, &count, timeout);
+	handle_deref(h);
+	if (ananas_is_success(err))
+		err = copyout(events, ev, sizeof(struct EVQ_EVENT) * count);
+	kfree(ev);
+	ANANAS_ERROR_RETURN(err);
+
+	err = syscall_set_size(t, num, count);
+	ANANAS_ERROR_RETURN(err);
+
+	TRACE(SYSCALL, FUNC, "t=%p, success: count=%u", t, count);
+	return err;
+}
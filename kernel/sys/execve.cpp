@@ -1,7 +1,9 @@
+#include <ananas/syscall.h>
 #include <ananas/syscalls.h>
 #include <ananas/error.h>
 #include <ananas/exec.h>
 #include <ananas/lib.h>
+#include <ananas/limits.h>
 #include <ananas/process.h>
 #include <ananas/procinfo.h>
 #include <ananas/thread.h>
@@ -12,41 +14,6 @@
 
 TRACE_SETUP;
 
-enum SET_PROC_ATTR {
-	A_Args,
-	A_Env
-};
-
-static errorcode_t
-set_proc_attribute(process_t* process, enum SET_PROC_ATTR attr, const char** list)
-{
-	char buf[PROCINFO_ENV_LENGTH];
-
-	/* Convert list to a \0-separated string, \0\0-terminated */
-	int arg_len = 2; /* \0\0-terminator */
-	for (const char** p = list; *p != NULL; p++) {
-		arg_len += strlen(*p) + 1; /* \0 */
-	}
-	KASSERT(arg_len < sizeof(buf), "buffer too large (calculated %d, have %d)", arg_len, sizeof(buf));
-
-	/* Copy the items over */
-	int pos = 0;
-	memset(buf, 0, sizeof(buf));
-	for (const char** p = list; *p != NULL; p++) {
-		strcpy(&buf[pos], *p);
-		pos += strlen(*p) + 1;
-	}
-
-	switch(attr) {
-		case A_Args:
-			return process_set_args(process, buf, pos);
-		case A_Env:
-			return process_set_environment(process, buf, pos);
-		default:
-			panic("unexpected attribute %d", attr);
-	}
-}
-
 errorcode_t
 sys_execve(thread_t* t, const char* path, const char** argv, const char** envp)
 {
@@ -54,8 +21,12 @@ sys_execve(thread_t* t, const char* path, const char** argv, const char** envp)
 	process_t* proc = t->t_process;
 
 	/* First step is to open the file */
+	char kpath[MAX_PATH];
+	errorcode_t err = syscall_fetch_path(t, path, kpath);
+	ANANAS_ERROR_RETURN(err);
+
 	struct VFS_FILE file;
-	errorcode_t err = vfs_open(path, proc->p_cwd, &file);
+	err = vfs_open(kpath, proc->p_cwd, &file);
 	ANANAS_ERROR_RETURN(err);
 
 	/*
@@ -66,27 +37,11 @@ sys_execve(thread_t* t, const char* path, const char** argv, const char** envp)
 	dentry_ref(dentry);
 	vfs_close(&file);
 
-	/* XXX Do we inherit correctly here? */
-	vmspace_t* vmspace = NULL;
-	if (argv != NULL) {
-		err = set_proc_attribute(proc, A_Args, argv);
-		if (ananas_is_failure(err)) {
-			dentry_deref(dentry);
-			goto fail;
-		}
-	}
-	if (envp != NULL) {
-		err = set_proc_attribute(proc, A_Env, envp);
-		if (ananas_is_failure(err)) {
-			dentry_deref(dentry);
-			goto fail;
-		}
-	}
-
 	/*
 	 * Create a new vmspace to execute in; if the exec() works, we'll use it to
 	 * override our current vmspace.
 	 */
+	vmspace_t* vmspace = NULL;
 	err = vmspace_create(&vmspace);
 	if (ananas_is_failure(err)) {
 		dentry_deref(dentry);
@@ -106,17 +61,47 @@ sys_execve(thread_t* t, const char* path, const char** argv, const char** envp)
 		goto fail;
 
 	/*
-	 * Loading went okay; we can now set the new thread name (we won't be able to
-	 * access argv after the vmspace_clone() so best do it here)
+	 * Anything we map at a dynamic address must stay clear of what was just
+	 * loaded, as well as the areas that survive exec() such as the PROCINFO;
+	 * the latter were allocated from our own vmspace, so start beyond them.
+	 */
+	{
+		vmspace_t* vs_own = proc->p_vfork_vmspace != nullptr ? proc->p_vfork_vmspace : proc->p_vmspace;
+		vmspace_set_next_mapping(vmspace, vs_own->vs_next_mapping);
+	}
+
+	/*
+	 * Place the arguments and environment in the new vmspace; they are copied
+	 * from our caller straight into it, so there is no limit besides ARG_MAX.
+	 */
+	struct EXEC_ARGS ea;
+	err = exec_prepare_args(vmspace, argv, envp, true, &ea);
+	if (ananas_is_failure(err))
+		goto fail;
+
+	/* Loading went okay; we can now set the new thread name */
+	if (ea.ea_name[0] != '\0')
+		thread_set_name(t, ea.ea_name);
+
+	/*
+	 * If we were vfork()-ed, we are still using our parent's vmspace; our own
+	 * vmspace needs a stack before we can switch to it and let the parent go.
 	 */
-	if (argv != NULL && argv[0] != NULL)
-		thread_set_name(t, argv[0]);
+	if (proc->p_vfork_vmspace != nullptr) {
+		err = vmspace_clone(proc->p_vmspace, proc->p_vfork_vmspace, VMSPACE_CLONE_VFORK);
+		KASSERT(ananas_is_success(err), "unable to clone vfork vmspace: %d", err);
+		process_vfork_release(proc);
+	}
 
 	/* Copy the new vmspace to the destination */
 	err = vmspace_clone(vmspace, proc->p_vmspace, VMSPACE_CLONE_EXEC);
 	KASSERT(ananas_is_success(err), "unable to clone exec vmspace: %d", err);
 	vmspace_destroy(vmspace);
 
+	/* Any submission ring was part of the old image */
+	proc->p_ring = NULL;
+	process_set_args(proc, &ea);
+
 	/* Now force a full return into the new thread state */
 	md_setup_post_exec(t, exec_addr, exec_arg);
 	return ananas_success();
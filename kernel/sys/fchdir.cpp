@@ -19,8 +19,10 @@ sys_fchdir(thread_t* t, handleindex_t index)
 	errorcode_t err = syscall_get_handle(t, index, &h);
 	ANANAS_ERROR_RETURN(err);
 
-	if (h->h_type != HANDLE_TYPE_FILE)
+	if (h->h_type != HANDLE_TYPE_FILE) {
+		handle_deref(h);
 		return ANANAS_ERROR(BAD_HANDLE);
+	}
 
         struct VFS_FILE* file = &h->h_data.d_vfs_file;
 	struct DENTRY* new_cwd = file->f_dentry;
@@ -28,5 +30,6 @@ sys_fchdir(thread_t* t, handleindex_t index)
 	proc->p_cwd = new_cwd;
 	dentry_deref(cwd);
 
+	handle_deref(h);
 	return err;
 }
@@ -8,48 +8,44 @@
 
 TRACE_SETUP;
 
-errorcode_t
-sys_fcntl(thread_t* t, handleindex_t hindex, int cmd, const void* in, void* out)
+static errorcode_t
+fcntl_handle(thread_t* t, handleindex_t hindex, struct HANDLE* h, int cmd, const void* in, void* out)
 {
-	TRACE(SYSCALL, FUNC, "t=%p, hindex=%d cmd=%d", t, hindex, cmd);
 	process_t* process = t->t_process;
-
-	/* Get the handle */
-	struct HANDLE* h;
-	errorcode_t err = syscall_get_handle(t, hindex, &h);
-	ANANAS_ERROR_RETURN(err);
-
-	if (h->h_type != HANDLE_TYPE_FILE)
-		return ANANAS_ERROR(BAD_HANDLE);
+	errorcode_t err;
 
 	switch(cmd) {
 		case F_DUPFD: {
-			int min_fd = (int)(uintptr_t)out;
+			int min_fd = (int)(uintptr_t)in;
 			struct HANDLE* handle_out;
 			handleindex_t hidx_out;
 			err = handle_clone(process, hindex, NULL, process, &handle_out, min_fd, &hidx_out);
 			ANANAS_ERROR_RETURN(err);
-			*(int*)out = hidx_out;
-			break;
+			int result = hidx_out;
+			err = copyout(out, &result, sizeof(result));
+			if (ananas_is_failure(err))
+				handle_free_byindex(process, hidx_out);
+			return err;
 		}
-		case F_GETFD:
+		case F_GETFD: {
 			/* TODO */
-			*(int*)out = 0;
-			break;
-		case F_GETFL:
-			/* TODO */
-			*(int*)out = 0;
-			break;
+			int result = 0;
+			return copyout(out, &result, sizeof(result));
+		}
+		case F_GETFL: {
+			int result = h->h_flags & O_NONBLOCK;
+			return copyout(out, &result, sizeof(result));
+		}
 		case F_SETFD: {
-			int fd = (int)(uintptr_t)out;
+			int fd = (int)(uintptr_t)in;
 			/* TODO */
 			(void)fd;
 			break;
 		}
 		case F_SETFL: {
-			int fl = (int)(uintptr_t)out;
-			/* TODO */
-			(void)fl;
+			/* Only O_NONBLOCK can be changed; it's up to the handle to honour it */
+			int fl = (int)(uintptr_t)in;
+			h->h_flags = (h->h_flags & ~O_NONBLOCK) | (fl & O_NONBLOCK);
 			break;
 		}
 		default:
@@ -58,3 +54,18 @@ sys_fcntl(thread_t* t, handleindex_t hindex, int cmd, const void* in, void* out)
 
 	return ananas_success();
 }
+
+errorcode_t
+sys_fcntl(thread_t* t, handleindex_t hindex, int cmd, const void* in, void* out)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, hindex=%d cmd=%d", t, hindex, cmd);
+
+	/* Get the handle */
+	struct HANDLE* h;
+	errorcode_t err = syscall_get_handle(t, hindex, &h);
+	ANANAS_ERROR_RETURN(err);
+
+	err = fcntl_handle(t, hindex, h, cmd, in, out);
+	handle_deref(h);
+	return err;
+}
@@ -2,6 +2,7 @@
 #include <ananas/error.h>
 #include <ananas/flags.h>
 #include <ananas/lib.h>
+#include <ananas/limits.h>
 #include <ananas/syscall.h>
 #include <ananas/trace.h>
 #include <ananas/vm.h>
@@ -9,12 +10,16 @@
 TRACE_SETUP;
 
 errorcode_t
-sys_open(thread_t* t, const char* path, int flags, int mode, handleindex_t* out)
+sys_open(thread_t* t, const char* upath, int flags, int mode, handleindex_t* out)
 {
-	TRACE(SYSCALL, FUNC, "t=%p, path='%s', flags=%d, mode=%o", t, path, flags, mode);
 	errorcode_t err;
 	process_t* proc = t->t_process;
 
+	char path[MAX_PATH];
+	err = syscall_fetch_path(t, upath, path);
+	ANANAS_ERROR_RETURN(err);
+	TRACE(SYSCALL, FUNC, "t=%p, path='%s', flags=%d, mode=%o", t, path, flags, mode);
+
 	/* Obtain a new handle */
 	struct HANDLE* handle_out;
 	handleindex_t index_out;
@@ -37,7 +42,11 @@ sys_open(thread_t* t, const char* path, int flags, int mode, handleindex_t* out)
 		handle_free_byindex(proc, index_out);
 		return err;
 	}
-	*out = index_out;
+	err = syscall_set_handleindex(t, out, index_out);
+	if (ananas_is_failure(err)) {
+		handle_free_byindex(proc, index_out);
+		return err;
+	}
 	TRACE(SYSCALL, FUNC, "t=%p, success, hindex=%u", t, index_out);
 	return err;
 }
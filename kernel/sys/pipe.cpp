@@ -0,0 +1,43 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/handle.h>
+#include <ananas/process.h>
+#include <ananas/syscall.h>
+#include <ananas/trace.h>
+#include "options.h"
+
+TRACE_SETUP;
+
+errorcode_t
+sys_pipe(thread_t* t, handleindex_t* hindex)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, hindex=%p", t, hindex);
+#ifdef OPTION_PIPE
+	process_t* proc = t->t_process;
+
+	/* Allocate both ends; the first one is for reading, the second for writing */
+	struct HANDLE* handle[2];
+	handleindex_t index[2];
+	errorcode_t err = handle_alloc(HANDLE_TYPE_PIPE, proc, 0, &handle[0], &index[0]);
+	ANANAS_ERROR_RETURN(err);
+	err = handle_alloc(HANDLE_TYPE_PIPE, proc, 0, &handle[1], &index[1]);
+	if (ananas_is_failure(err)) {
+		handle_free_byindex(proc, index[0]);
+		return err;
+	}
+
+	err = pipe_connect(handle[0], handle[1]);
+	if (ananas_is_success(err))
+		err = copyout(hindex, index, sizeof(index));
+	if (ananas_is_failure(err)) {
+		handle_free_byindex(proc, index[1]);
+		handle_free_byindex(proc, index[0]);
+		return err;
+	}
+
+	TRACE(SYSCALL, INFO, "t=%p, success, read=%u write=%u", t, index[0], index[1]);
+	return ananas_success();
+#else
+	return ANANAS_ERROR(BAD_SYSCALL);
+#endif
+}
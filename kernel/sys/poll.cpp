@@ -0,0 +1,99 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/handle.h>
+#include <ananas/lib.h>
+#include <ananas/lock.h>
+#include <ananas/mm.h>
+#include <ananas/poll.h>
+#include <ananas/syscall.h>
+#include <ananas/trace.h>
+
+TRACE_SETUP;
+
+static void
+poll_notify(struct POLL_ENTRY* pe, unsigned int events)
+{
+	sem_signal(static_cast<semaphore_t*>(pe->pe_context));
+}
+
+errorcode_t
+sys_poll(thread_t* t, struct pollfd* fds, size_t nfds, int timeout, size_t* nready)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, fds=%p, nfds=%u, timeout=%d, nready=%p", t, fds, nfds, timeout, nready);
+	errorcode_t err;
+
+	if (nfds > POLL_MAX)
+		return ANANAS_ERROR(BAD_LENGTH);
+
+	/* Fetch the entries; every entry gets its own poll entry and handle */
+	size_t num = nfds > 0 ? nfds : 1;
+	auto pfd = new struct pollfd[num];
+	auto pe = new struct POLL_ENTRY[num];
+	auto handle = new struct HANDLE*[num];
+	err = copyin(pfd, fds, sizeof(struct pollfd) * nfds);
+	if (ananas_is_failure(err)) {
+		kfree(handle);
+		kfree(pe);
+		kfree(pfd);
+		return err;
+	}
+
+	/*
+	 * Wakeups of any of the handles will signal our semaphore; this means
+	 * all we have to do is check everything once it is signalled. Handles we
+	 * cannot look up are reported as invalid.
+	 */
+	semaphore_t sem;
+	sem_init(&sem, 0);
+	memset(pe, 0, sizeof(struct POLL_ENTRY) * num);
+	for (size_t n = 0; n < nfds; n++) {
+		pe[n].pe_events = pfd[n].events;
+		pe[n].pe_notify = poll_notify;
+		pe[n].pe_context = &sem;
+		if (pfd[n].fd < 0 || ananas_is_failure(syscall_get_handle(t, pfd[n].fd, &handle[n])))
+			handle[n] = NULL;
+	}
+
+	uint64_t deadline = poll_deadline(timeout);
+	bool registered = false;
+	size_t num_ready;
+	for (;;) {
+		num_ready = 0;
+		for (size_t n = 0; n < nfds; n++) {
+			pfd[n].revents = 0;
+			if (pfd[n].fd < 0)
+				continue;
+
+			/* Only register once; we stay registered until we are done */
+			unsigned int events = POLLNVAL;
+			struct POLL_ENTRY* entry = !registered && timeout != 0 ? &pe[n] : NULL;
+			if (handle[n] != NULL && ananas_is_failure(handle_poll(t, pfd[n].fd, handle[n], entry, &events)))
+				events = POLLERR;
+			pfd[n].revents = events & (pfd[n].events | POLLERR | POLLHUP | POLLNVAL);
+			if (pfd[n].revents != 0)
+				num_ready++;
+		}
+		registered = true;
+
+		if (num_ready > 0 || !poll_sleep(&sem, timeout, deadline))
+			break;
+	}
+
+	for (size_t n = 0; n < nfds; n++) {
+		poll_unregister(&pe[n]);
+		if (handle[n] != NULL)
+			handle_deref(handle[n]);
+	}
+
+	err = copyout(fds, pfd, sizeof(struct pollfd) * nfds);
+	kfree(handle);
+	kfree(pe);
+	kfree(pfd);
+	ANANAS_ERROR_RETURN(err);
+
+	err = syscall_set_size(t, nready, num_ready);
+	ANANAS_ERROR_RETURN(err);
+
+	TRACE(SYSCALL, FUNC, "t=%p, success: num_ready=%u", t, num_ready);
+	return err;
+}
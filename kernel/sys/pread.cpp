@@ -0,0 +1,50 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/handle.h>
+#include <ananas/syscall.h>
+#include <ananas/trace.h>
+#include <ananas/vm.h>
+
+TRACE_SETUP;
+
+errorcode_t
+sys_pread(thread_t* t, handleindex_t hindex, void* buf, size_t* len, const off_t* offset)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, hindex=%u, buf=%p, len=%p, offset=%p", t, hindex, buf, len, offset);
+	errorcode_t err;
+
+	/* Fetch the size and offset operands */
+	size_t size;
+	err = syscall_fetch_size(t, len, &size);
+	ANANAS_ERROR_RETURN(err);
+	off_t offs;
+	err = syscall_fetch_offset(t, offset, &offs);
+	ANANAS_ERROR_RETURN(err);
+	if (offs < 0)
+		return ANANAS_ERROR(BAD_RANGE);
+
+	/* Attempt to map the buffer write-only */
+	void* buffer;
+	err = syscall_map_buffer(t, buf, size, VM_FLAG_WRITE, &buffer);
+	ANANAS_ERROR_RETURN(err);
+
+	/* Get the handle */
+	struct HANDLE* h;
+	err = syscall_get_handle(t, hindex, &h);
+	ANANAS_ERROR_RETURN(err);
+
+	/* And read the data; this does not affect the handle's offset */
+	if (h->h_hops->hop_pread != NULL)
+		err = h->h_hops->hop_pread(t, hindex, h, buf, &size, offs);
+	else
+		err = ANANAS_ERROR(BAD_OPERATION);
+	handle_deref(h);
+	ANANAS_ERROR_RETURN(err);
+
+	/* Finally, inform the user of the length read */
+	err = syscall_set_size(t, len, size);
+	ANANAS_ERROR_RETURN(err);
+
+	TRACE(SYSCALL, FUNC, "t=%p, success: size=%u", t, size);
+	return err;
+}
@@ -12,11 +12,6 @@ sys_read(thread_t* t, handleindex_t hindex, void* buf, size_t* len)
 	TRACE(SYSCALL, FUNC, "t=%p, hindex=%u, buf=%p, len=%p", t, hindex, buf, len);
 	errorcode_t err;
 
-	/* Get the handle */
-	struct HANDLE* h;
-	err = syscall_get_handle(t, hindex, &h);
-	ANANAS_ERROR_RETURN(err);
-
 	/* Fetch the size operand */
 	size_t size;
 	err = syscall_fetch_size(t, len, &size);
@@ -27,11 +22,17 @@ sys_read(thread_t* t, handleindex_t hindex, void* buf, size_t* len)
 	err = syscall_map_buffer(t, buf, size, VM_FLAG_WRITE, &buffer);
 	ANANAS_ERROR_RETURN(err);
 
+	/* Get the handle */
+	struct HANDLE* h;
+	err = syscall_get_handle(t, hindex, &h);
+	ANANAS_ERROR_RETURN(err);
+
 	/* And read data to it */
 	if (h->h_hops->hop_read != NULL)
 		err = h->h_hops->hop_read(t, hindex, h, buf, &size);
 	else
 		err = ANANAS_ERROR(BAD_OPERATION);
+	handle_deref(h);
 
 	/* Finally, inform the user of the length read - the read went OK */
 	err = syscall_set_size(t, len, size);
@@ -1,5 +1,6 @@
 #include <ananas/types.h>
 #include <ananas/error.h>
+#include <ananas/limits.h>
 #include <ananas/process.h>
 #include <ananas/syscall.h>
 #include <ananas/trace.h>
@@ -8,14 +9,20 @@
 TRACE_SETUP;
 
 errorcode_t
-sys_rename(thread_t* t, const char* oldpath, const char* newpath)
+sys_rename(thread_t* t, const char* uoldpath, const char* unewpath)
 {
+	char oldpath[MAX_PATH], newpath[MAX_PATH];
+	errorcode_t err = syscall_fetch_path(t, uoldpath, oldpath);
+	ANANAS_ERROR_RETURN(err);
+	err = syscall_fetch_path(t, unewpath, newpath);
+	ANANAS_ERROR_RETURN(err);
+
 	TRACE(SYSCALL, FUNC, "t=%p, oldpath='%s' newpath='%s'", t, oldpath, newpath);
 	process_t* proc = t->t_process;
 	struct DENTRY* cwd = proc->p_cwd;
 
 	struct VFS_FILE file;
-	errorcode_t err = vfs_open(oldpath, cwd, &file);
+	err = vfs_open(oldpath, cwd, &file);
 	ANANAS_ERROR_RETURN(err);
 
 	err = vfs_rename(&file, proc->p_cwd, newpath);
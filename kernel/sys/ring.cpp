@@ -0,0 +1,161 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/process.h>
+#include <ananas/stat.h>
+#include <ananas/syscall.h>
+#include <ananas/syscalls.h>
+#include <ananas/syscall-ring.h>
+#include <ananas/trace.h>
+#include <ananas/vm.h>
+
+TRACE_SETUP;
+
+static bool
+ring_valid_entries(unsigned int n)
+{
+	return n > 0 && n <= RING_MAX_ENTRIES && (n & (n - 1)) == 0;
+}
+
+/*
+ * Performs a single submission entry; this just calls the ordinary system
+ * call implementations so that the semantics are identical. The completion
+ * entry lives in the ring, so its fields double as the userland in/out
+ * arguments of those calls.
+ */
+static void
+ring_perform(thread_t* t, const struct RING_SQE* sqe, struct RING_CQE* cqe)
+{
+	cqe->cqe_user_data = sqe->sqe_user_data;
+	cqe->cqe_length = 0;
+	cqe->cqe_offset = 0;
+	cqe->cqe_handle = 0;
+
+	errorcode_t err;
+	switch(sqe->sqe_op) {
+		case RING_OP_NOP:
+			err = ananas_success();
+			break;
+		case RING_OP_READ:
+			cqe->cqe_length = sqe->sqe_len;
+			if (sqe->sqe_offset < 0) {
+				err = sys_read(t, sqe->sqe_handle, sqe->sqe_buf, &cqe->cqe_length);
+			} else {
+				cqe->cqe_offset = sqe->sqe_offset;
+				err = sys_pread(t, sqe->sqe_handle, sqe->sqe_buf, &cqe->cqe_length, &cqe->cqe_offset);
+				cqe->cqe_offset = 0;
+			}
+			break;
+		case RING_OP_WRITE:
+			cqe->cqe_length = sqe->sqe_len;
+			if (sqe->sqe_offset < 0) {
+				err = sys_write(t, sqe->sqe_handle, sqe->sqe_buf, &cqe->cqe_length);
+			} else {
+				cqe->cqe_offset = sqe->sqe_offset;
+				err = sys_pwrite(t, sqe->sqe_handle, sqe->sqe_buf, &cqe->cqe_length, &cqe->cqe_offset);
+				cqe->cqe_offset = 0;
+			}
+			break;
+		case RING_OP_OPEN:
+			err = sys_open(t, sqe->sqe_path, sqe->sqe_flags, sqe->sqe_mode, &cqe->cqe_handle);
+			break;
+		case RING_OP_CLOSE:
+			err = sys_close(t, sqe->sqe_handle);
+			break;
+		case RING_OP_STAT:
+			err = sys_stat(t, sqe->sqe_path, static_cast<struct stat*>(sqe->sqe_buf));
+			break;
+		case RING_OP_FSTAT:
+			err = sys_fstat(t, sqe->sqe_handle, static_cast<struct stat*>(sqe->sqe_buf));
+			break;
+		case RING_OP_SEEK:
+			cqe->cqe_offset = sqe->sqe_offset;
+			err = sys_seek(t, sqe->sqe_handle, &cqe->cqe_offset, sqe->sqe_flags);
+			break;
+		default:
+			err = ANANAS_ERROR(BAD_OPERATION);
+			break;
+	}
+	cqe->cqe_result = err;
+}
+
+errorcode_t
+sys_ring_setup(thread_t* t, struct RING* ring, size_t len)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, ring=%p, len=%u", t, ring, len);
+	process_t* proc = t->t_process;
+
+	/* A NULL ring unregisters the current one */
+	if (ring == NULL) {
+		proc->p_ring = NULL;
+		return ananas_success();
+	}
+
+	if (len < sizeof(struct RING))
+		return ANANAS_ERROR(BAD_LENGTH);
+	struct RING* r;
+	errorcode_t err = syscall_map_buffer(t, ring, len, VM_FLAG_READ | VM_FLAG_WRITE, (void**)&r);
+	ANANAS_ERROR_RETURN(err);
+
+	/*
+	 * We keep our own copy of the sizes; the process could change them at any
+	 * time, and we mustn't be tricked into going beyond the ring.
+	 */
+	unsigned int sq_entries = r->r_sq_entries;
+	unsigned int cq_entries = r->r_cq_entries;
+	if (!ring_valid_entries(sq_entries) || !ring_valid_entries(cq_entries))
+		return ANANAS_ERROR(BAD_RANGE);
+	if (RING_LENGTH(sq_entries, cq_entries) > len)
+		return ANANAS_ERROR(BAD_LENGTH);
+
+	proc->p_ring = ring;
+	proc->p_ring_sq_entries = sq_entries;
+	proc->p_ring_cq_entries = cq_entries;
+	return ananas_success();
+}
+
+errorcode_t
+sys_ring_enter(thread_t* t, unsigned int* num)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, num=%p", t, num);
+	process_t* proc = t->t_process;
+	if (proc->p_ring == NULL)
+		return ANANAS_ERROR(BAD_OPERATION);
+
+	unsigned int max;
+	errorcode_t err = copyin(&max, num, sizeof(max));
+	ANANAS_ERROR_RETURN(err);
+
+	unsigned int sq_entries = proc->p_ring_sq_entries;
+	unsigned int cq_entries = proc->p_ring_cq_entries;
+	struct RING* r;
+	err = syscall_map_buffer(t, proc->p_ring, RING_LENGTH(sq_entries, cq_entries), VM_FLAG_READ | VM_FLAG_WRITE, (void**)&r);
+	ANANAS_ERROR_RETURN(err);
+	auto sqes = reinterpret_cast<struct RING_SQE*>(r + 1);
+	auto cqes = reinterpret_cast<struct RING_CQE*>(sqes + sq_entries);
+
+	/*
+	 * Handle submissions in order until we run out, the caller's limit is
+	 * reached (0 means no limit) or there is no room for the completion.
+	 */
+	unsigned int done = 0;
+	while (r->r_sq_head != r->r_sq_tail && (max == 0 || done < max)) {
+		if (r->r_sq_tail - r->r_sq_head > sq_entries) {
+			err = ANANAS_ERROR(BAD_RANGE);
+			break;
+		}
+		if (r->r_cq_tail - r->r_cq_head >= cq_entries)
+			break;
+
+		/* Work on a copy so the process can't change the entry under our feet */
+		struct RING_SQE sqe = sqes[r->r_sq_head & (sq_entries - 1)];
+		ring_perform(t, &sqe, &cqes[r->r_cq_tail & (cq_entries - 1)]);
+
+		r->r_cq_tail++;
+		r->r_sq_head++;
+		done++;
+	}
+
+	TRACE(SYSCALL, FUNC, "t=%p, done=%u", t, done);
+	errorcode_t copy_err = copyout(num, &done, sizeof(done));
+	return ananas_is_success(err) ? copy_err : err;
+}
@@ -8,31 +8,31 @@
 
 TRACE_SETUP;
 
-errorcode_t
-sys_seek(thread_t* t, handleindex_t hindex, off_t* offset, int whence)
+static errorcode_t
+seek_handle(thread_t* t, struct HANDLE* h, off_t* uoffset, int whence)
 {
-	/* Get the handle */
-	struct HANDLE* h;
-	errorcode_t err = syscall_get_handle(t, hindex, &h);
-	ANANAS_ERROR_RETURN(err);
-
+	errorcode_t err;
 	if (h->h_type != HANDLE_TYPE_FILE)
 		return ANANAS_ERROR(BAD_HANDLE);
         struct VFS_FILE* file = &h->h_data.d_vfs_file;
 	if (file->f_dentry == NULL)
 		return ANANAS_ERROR(BAD_OPERATION); /* XXX maybe re-think this for devices */
 
+	off_t offset;
+	err = syscall_fetch_offset(t, uoffset, &offset);
+	ANANAS_ERROR_RETURN(err);
+
 	/* Update the offset */
 	off_t new_offset;
 	switch(whence) {
 		case HCTL_SEEK_WHENCE_SET:
-			new_offset = *offset;
+			new_offset = offset;
 			break;
 		case HCTL_SEEK_WHENCE_CUR:
-			new_offset = file->f_offset + *offset;
+			new_offset = file->f_offset + offset;
 			break;
 		case HCTL_SEEK_WHENCE_END:
-			new_offset = file->f_dentry->d_inode->i_sb.st_size - *offset;
+			new_offset = file->f_dentry->d_inode->i_sb.st_size - offset;
 			break;
 		default:
 			return ANANAS_ERROR(BAD_TYPE);
@@ -45,6 +45,18 @@ sys_seek(thread_t* t, handleindex_t hindex, off_t* offset, int whence)
 		ANANAS_ERROR_RETURN(err);
 	}
 	file->f_offset = new_offset;
-	*offset = new_offset;
-	return ananas_success();
+	return syscall_set_offset(t, uoffset, new_offset);
+}
+
+errorcode_t
+sys_seek(thread_t* t, handleindex_t hindex, off_t* uoffset, int whence)
+{
+	/* Get the handle */
+	struct HANDLE* h;
+	errorcode_t err = syscall_get_handle(t, hindex, &h);
+	ANANAS_ERROR_RETURN(err);
+
+	err = seek_handle(t, h, uoffset, whence);
+	handle_deref(h);
+	return err;
 }
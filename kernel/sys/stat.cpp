@@ -1,6 +1,7 @@
 #include <ananas/types.h>
 #include <ananas/error.h>
 #include <ananas/lib.h>
+#include <ananas/limits.h>
 #include <ananas/process.h>
 #include <ananas/syscall.h>
 #include <ananas/trace.h>
@@ -9,20 +10,24 @@
 TRACE_SETUP;
 
 errorcode_t
-sys_stat(thread_t* t, const char* path, struct stat* buf)
+sys_stat(thread_t* t, const char* upath, struct stat* buf)
 {
 	process_t* proc = t->t_process;
 
+	char path[MAX_PATH];
+	errorcode_t err = syscall_fetch_path(t, upath, path);
+	ANANAS_ERROR_RETURN(err);
+
 	struct VFS_FILE file;
-	errorcode_t err = vfs_open(path, proc->p_cwd, &file);
+	err = vfs_open(path, proc->p_cwd, &file);
 	ANANAS_ERROR_RETURN(err);
 
 	if (file.f_dentry != NULL) {
-		memcpy(buf, &file.f_dentry->d_inode->i_sb, sizeof(struct stat));
+		err = copyout(buf, &file.f_dentry->d_inode->i_sb, sizeof(struct stat));
 	} else {
 		err = ANANAS_ERROR(BAD_OPERATION); /* XXX maybe re-think this for devices */
 	}
 
 	vfs_close(&file);
-	return ananas_success();
+	return err;
 }
@@ -1,7 +1,9 @@
 #include <machine/param.h>
+#include <machine/vm.h>
 #include <ananas/types.h>
 #include <ananas/error.h>
 #include <ananas/lib.h>
+#include <ananas/limits.h>
 #include <ananas/handle.h>
 #include <ananas/thread.h>
 #include <ananas/trace.h>
@@ -9,27 +11,64 @@
 
 TRACE_SETUP;
 
+namespace {
+
+inline bool
+is_user_range(const void* uaddr, size_t len)
+{
+	addr_t a = reinterpret_cast<addr_t>(uaddr);
+	return a < USER_VA_END && len <= USER_VA_END - a;
+}
+
+} // unnamed namespace
+
 errorcode_t
-syscall_get_handle(thread_t* t, handleindex_t hindex, struct HANDLE** out)
+copyin(void* kaddr, const void* uaddr, size_t len)
 {
-	return handle_lookup(t->t_process, hindex, HANDLE_TYPE_ANY, out);
+	if (!is_user_range(uaddr, len))
+		return ANANAS_ERROR(BAD_ADDRESS);
+	if (md_copy_user(kaddr, uaddr, len) != 0)
+		return ANANAS_ERROR(BAD_ADDRESS);
+	return ananas_success();
 }
 
 errorcode_t
-syscall_get_file(thread_t* t, handleindex_t hindex, struct VFS_FILE** out)
+copyout(void* uaddr, const void* kaddr, size_t len)
 {
-	struct HANDLE* handle;
-	errorcode_t err = handle_lookup(t->t_process, hindex, HANDLE_TYPE_ANY, &handle);
-	ANANAS_ERROR_RETURN(err);
+	if (!is_user_range(uaddr, len))
+		return ANANAS_ERROR(BAD_ADDRESS);
+	if (md_copy_user(uaddr, kaddr, len) != 0)
+		return ANANAS_ERROR(BAD_ADDRESS);
+	return ananas_success();
+}
 
-	struct VFS_FILE* file = &((struct HANDLE*)handle)->h_data.d_vfs_file;
-	if (file->f_dentry == NULL && file->f_device == NULL)
-		return ANANAS_ERROR(BAD_HANDLE);
+errorcode_t
+copyinstr(char* kaddr, const void* uaddr, size_t max, size_t* len)
+{
+	addr_t a = reinterpret_cast<addr_t>(uaddr);
+	if (a >= USER_VA_END)
+		return ANANAS_ERROR(BAD_ADDRESS);
+	if (max > USER_VA_END - a)
+		max = USER_VA_END - a;
 
-	*out = file;
+	size_t copied;
+	int r = md_copy_user_string(kaddr, uaddr, max, &copied);
+	if (r < 0)
+		return ANANAS_ERROR(BAD_ADDRESS);
+	if (r > 0)
+		return ANANAS_ERROR(BAD_LENGTH);
+	if (len != NULL)
+		*len = copied;
 	return ananas_success();
 }
 
+/* Looks up a handle; the caller must handle_deref() it when done */
+errorcode_t
+syscall_get_handle(thread_t* t, handleindex_t hindex, struct HANDLE** out)
+{
+	return handle_lookup(t->t_process, hindex, HANDLE_TYPE_ANY, out);
+}
+
 errorcode_t
 syscall_map_string(thread_t* t, const void* ptr, const char** out)
 {
@@ -47,6 +86,12 @@ syscall_map_string(thread_t* t, const void* ptr, const char** out)
 	return ANANAS_ERROR(BAD_ADDRESS);
 }
 
+errorcode_t
+syscall_fetch_path(thread_t* t, const char* ptr, char* out)
+{
+	return copyinstr(out, ptr, MAX_PATH, NULL);
+}
+
 errorcode_t
 syscall_map_buffer(thread_t* t, const void* ptr, size_t len, int flags, void** out)
 {
@@ -61,56 +106,31 @@ syscall_map_buffer(thread_t* t, const void* ptr, size_t len, int flags, void** o
 errorcode_t
 syscall_fetch_size(thread_t* t, const void* ptr, size_t* out)
 {
-	auto s = static_cast<size_t*>(md_map_thread_memory(t, (void*)ptr, sizeof(size_t), VM_FLAG_READ));
-	if (s == NULL)
-		return ANANAS_ERROR(BAD_ADDRESS);
-
-	*out = *s;
-	return ananas_success();
+	return copyin(out, ptr, sizeof(size_t));
 }
 
 errorcode_t
 syscall_set_size(thread_t* t, void* ptr, size_t len)
 {
-	auto s = static_cast<size_t*>(md_map_thread_memory(t, (void*)ptr, sizeof(size_t), VM_FLAG_WRITE));
-	if (s == NULL)
-		return ANANAS_ERROR(BAD_ADDRESS);
-
-	*s = len;
-	return ananas_success();
+	return copyout(ptr, &len, sizeof(size_t));
 }
 
 errorcode_t
 syscall_set_handleindex(thread_t* t, handleindex_t* ptr, handleindex_t index)
 {
-	auto p = static_cast<handleindex_t*>(md_map_thread_memory(t, (void*)ptr, sizeof(handleindex_t), VM_FLAG_WRITE));
-	if (p == NULL)
-		return ANANAS_ERROR(BAD_ADDRESS);
-
-	*p = index;
-	return ananas_success();
+	return copyout(ptr, &index, sizeof(handleindex_t));
 }
 
 errorcode_t
 syscall_fetch_offset(thread_t* t, const void* ptr, off_t* out)
 {
-	auto o = static_cast<off_t*>(md_map_thread_memory(t, (void*)ptr, sizeof(off_t), VM_FLAG_READ));
-	if (o == NULL)
-		return ANANAS_ERROR(BAD_ADDRESS);
-
-	*out = *o;
-	return ananas_success();
+	return copyin(out, ptr, sizeof(off_t));
 }
 
 errorcode_t
 syscall_set_offset(thread_t* t, void* ptr, off_t len)
 {
-	auto o = static_cast<size_t*>(md_map_thread_memory(t, (void*)ptr, sizeof(size_t), VM_FLAG_WRITE));
-	if (o == NULL)
-		return ANANAS_ERROR(BAD_ADDRESS);
-
-	*o = len;
-	return ananas_success();
+	return copyout(ptr, &len, sizeof(off_t));
 }
 
 /* vim:set ts=2 sw=2: */
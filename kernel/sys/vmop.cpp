@@ -1,4 +1,5 @@
 #include <ananas/types.h>
+#include <machine/vm.h> /* for USER_VA_END */
 #include <ananas/syscall.h>
 #include <ananas/syscalls.h>
 #include <ananas/process.h>
@@ -18,6 +19,20 @@ sys_vmop_map(ARG_CURTHREAD struct VMOP_OPTIONS* vo)
 	if ((vo->vo_flags & (VMOP_FLAG_PRIVATE | VMOP_FLAG_SHARED)) == 0)
 		return ANANAS_ERROR(BAD_FLAG);
 
+	/*
+	 * Fixed mappings, and handle mappings given an address, replace whatever
+	 * is there; they must be page-aligned and stay within userland.
+	 */
+	addr_t addr = reinterpret_cast<addr_t>(vo->vo_addr);
+	if ((vo->vo_flags & VMOP_FLAG_FIXED) || ((vo->vo_flags & VMOP_FLAG_HANDLE) && addr != 0)) {
+		if ((addr & (PAGE_SIZE - 1)) != 0)
+			return ANANAS_ERROR(BAD_ADDRESS);
+		if (addr >= USER_VA_END || vo->vo_len > USER_VA_END - addr)
+			return ANANAS_ERROR(BAD_RANGE);
+	}
+	if ((vo->vo_flags & VMOP_FLAG_HANDLE) && (vo->vo_offset & (PAGE_SIZE - 1)) != 0)
+		return ANANAS_ERROR(BAD_RANGE);
+
 	int vm_flags = VM_FLAG_USER | VM_FLAG_FAULT;
 	if (vo->vo_flags & VMOP_FLAG_READ)
 		vm_flags |= VM_FLAG_READ;
@@ -36,18 +51,29 @@ sys_vmop_map(ARG_CURTHREAD struct VMOP_OPTIONS* vo)
 		err = syscall_get_handle(curthread, vo->vo_handle, &h);
 		ANANAS_ERROR_RETURN(err);
 
-		if (h->h_type != HANDLE_TYPE_FILE)
-			return ANANAS_ERROR(BAD_HANDLE);
-		struct DENTRY* dentry = h->h_data.d_vfs_file.f_dentry;
-		if (dentry == nullptr)
+		struct DENTRY* dentry = h->h_type == HANDLE_TYPE_FILE ? h->h_data.d_vfs_file.f_dentry : nullptr;
+		if (dentry == nullptr) {
+			handle_deref(h);
 			return ANANAS_ERROR(BAD_HANDLE);
+		}
 
-		err = vmspace_mapto_dentry(vs, reinterpret_cast<addr_t>(vo->vo_addr), 0, vo->vo_len, dentry, vo->vo_offset, vo->vo_len, vm_flags, &va);
+		err = vmspace_mapto_dentry(vs, addr, 0, vo->vo_len, dentry, vo->vo_offset, vo->vo_len, vm_flags, &va);
+		handle_deref(h);
+	} else if (vo->vo_flags & VMOP_FLAG_FIXED) {
+		err = vmspace_mapto(vs, addr, vo->vo_len, vm_flags, &va);
 	} else {
 		err = vmspace_map(vs, vo->vo_len, vm_flags, &va);
 	}
 	ANANAS_ERROR_RETURN(err);
 
+	if (vo->vo_flags & VMOP_FLAG_POPULATE) {
+		err = vmspace_area_populate(vs, va);
+		if (ananas_is_failure(err)) {
+			vmspace_area_free(vs, va);
+			return err;
+		}
+	}
+
 	vo->vo_addr = (void*)va->va_virt;
 	vo->vo_len = va->va_len;
 	return ananas_success();
@@ -66,21 +92,24 @@ sys_vmop(ARG_CURTHREAD struct VMOP_OPTIONS* opts)
 	TRACE(SYSCALL, FUNC, "t=%p, opts=%p", curthread, opts);
 	errorcode_t err;
 
-	/* Opbtain options */
-	struct VMOP_OPTIONS* vmop_opts;
-	err = syscall_map_buffer(curthread, opts, sizeof(*vmop_opts), VM_FLAG_READ | VM_FLAG_WRITE, (void**)&vmop_opts);
+	/* Obtain options; we work on our own copy and hand back the result */
+	struct VMOP_OPTIONS vmop_opts;
+	err = copyin(&vmop_opts, opts, sizeof(vmop_opts));
 	ANANAS_ERROR_RETURN(err);
-	if (vmop_opts->vo_size != sizeof(*vmop_opts))
+	if (vmop_opts.vo_size != sizeof(vmop_opts))
 		return ANANAS_ERROR(BAD_LENGTH);
 
-	switch(vmop_opts->vo_op) {
+	switch(vmop_opts.vo_op) {
 		case OP_MAP:
-			return sys_vmop_map(curthread, vmop_opts);
+			err = sys_vmop_map(curthread, &vmop_opts);
+			break;
 		case OP_UNMAP:
-			return sys_vmop_unmap(curthread, vmop_opts);
+			err = sys_vmop_unmap(curthread, &vmop_opts);
+			break;
 		default:
 			return ANANAS_ERROR(BAD_OPERATION);
 	}
+	ANANAS_ERROR_RETURN(err);
 
-	/* NOTREACHED */
+	return copyout(opts, &vmop_opts, sizeof(vmop_opts));
 }
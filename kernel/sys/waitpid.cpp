@@ -1,6 +1,7 @@
 #include <ananas/syscalls.h>
 #include <ananas/error.h>
 #include <ananas/process.h>
+#include <ananas/syscall.h>
 #include <ananas/thread.h>
 #include <ananas/trace.h>
 
@@ -17,15 +18,17 @@ sys_waitpid(thread_t* t, pid_t* pid, int* stat_loc, int options)
 	errorcode_t err = process_wait_and_lock(t->t_process, options, &p);
 	ANANAS_ERROR_RETURN(err);
 
-	*pid = p->p_pid;
-	if (stat_loc != nullptr)
-		*stat_loc = p->p_exit_status;
+	pid_t child_pid = p->p_pid;
+	int exit_status = p->p_exit_status;
 	process_unlock(p);
 
 	/* Give up our refence to the zombie child; this should destroy it */
 	process_deref(p);
 
-	return ananas_success();
+	err = copyout(pid, &child_pid, sizeof(child_pid));
+	if (ananas_is_success(err) && stat_loc != nullptr)
+		err = copyout(stat_loc, &exit_status, sizeof(exit_status));
+	return err;
 }
 
 /* vim:set ts=2 sw=2: */
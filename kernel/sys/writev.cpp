@@ -0,0 +1,64 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/handle.h>
+#include <ananas/syscall.h>
+#include <ananas/trace.h>
+#include <ananas/uio.h>
+#include <ananas/vm.h>
+
+TRACE_SETUP;
+
+errorcode_t
+sys_writev(thread_t* t, handleindex_t hindex, const struct iovec* iov, int iovcnt, size_t* len)
+{
+	TRACE(SYSCALL, FUNC, "t=%p, hindex=%u, iov=%p, iovcnt=%d, len=%p", t, hindex, iov, iovcnt, len);
+	errorcode_t err;
+
+	/* Fetch the I/O vector itself */
+	if (iovcnt <= 0 || iovcnt > IOV_MAX)
+		return ANANAS_ERROR(BAD_LENGTH);
+	struct iovec vec[IOV_MAX];
+	err = copyin(vec, iov, sizeof(struct iovec) * iovcnt);
+	ANANAS_ERROR_RETURN(err);
+
+	/* Get the handle */
+	struct HANDLE* h;
+	err = syscall_get_handle(t, hindex, &h);
+	ANANAS_ERROR_RETURN(err);
+	if (h->h_hops->hop_write == NULL) {
+		handle_deref(h);
+		return ANANAS_ERROR(BAD_OPERATION);
+	}
+
+	/*
+	 * Handle the entries one by one; we stop at the first short write, as
+	 * anything beyond it would leave a gap. An error is only reported if nothing
+	 * was transferred at all.
+	 */
+	size_t total = 0;
+	for (int n = 0; n < iovcnt; n++) {
+		/* Attempt to map the buffer readonly */
+		void* buffer;
+		err = syscall_map_buffer(t, vec[n].iov_base, vec[n].iov_len, VM_FLAG_READ, &buffer);
+		if (ananas_is_failure(err))
+			break;
+
+		size_t size = vec[n].iov_len;
+		err = h->h_hops->hop_write(t, hindex, h, vec[n].iov_base, &size);
+		if (ananas_is_failure(err))
+			break;
+		total += size;
+		if (size < vec[n].iov_len)
+			break;
+	}
+	handle_deref(h);
+	if (ananas_is_failure(err) && total == 0)
+		return err;
+
+	/* Finally, inform the user of the length written */
+	err = syscall_set_size(t, len, total);
+	ANANAS_ERROR_RETURN(err);
+
+	TRACE(SYSCALL, FUNC, "t=%p, success: size=%u", t, total);
+	return err;
+}
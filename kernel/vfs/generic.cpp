@@ -130,15 +130,20 @@ vfs_generic_write(struct VFS_FILE* file, const void* buf, size_t* len)
 	while(left > 0) {
 		int create = 0;
 		blocknr_t logical_block = file->f_offset / (blocknr_t)fs->fs_block_size;
-		if (logical_block >= inode->i_sb.st_blocks /* XXX is this correct with sparse files? */)
-			create++;
 
 		if (!vfs_is_filesystem_sane(inode->i_fs))
 			return ANANAS_ERROR(IO);
 
-		/* Figure out which block to use next */
+		/*
+		 * Figure out which block to use next; if there is none yet (we are beyond
+		 * the end of the file, or in a hole) we need to have one created.
+		 */
 		blocknr_t want_block;
-		errorcode_t err = inode->i_iops->block_map(inode, logical_block, &want_block, create);
+		errorcode_t err = inode->i_iops->block_map(inode, logical_block, &want_block, 0);
+		if ((ananas_is_success(err) && want_block == 0) || ANANAS_ERROR_CODE(err) == ANANAS_ERROR_BAD_RANGE) {
+			create++;
+			err = inode->i_iops->block_map(inode, logical_block, &want_block, create);
+		}
 		ANANAS_ERROR_RETURN(err);
 
 		/* Calculate how much we have to put in the block */
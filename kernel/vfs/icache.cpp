@@ -1,5 +1,6 @@
 #include <ananas/types.h>
 #include <ananas/error.h>
+#include <ananas/exec.h>
 #include <ananas/vfs.h>
 #include <ananas/vfs/icache.h>
 #include <ananas/mm.h>
@@ -89,6 +90,9 @@ icache_purge_old_entries()
 			continue;
 		}
 
+		// Get rid of any cached pages; they would otherwise end up in the next inode
+		vmpage_discard_inode(inode);
+
 		// Throw the actual inode away
 		struct VFS_MOUNTED_FS* fs = inode->i_fs;
 		if (fs->fs_fsops->discard_inode != NULL)
@@ -97,8 +101,14 @@ icache_purge_old_entries()
 		inode->i_refcount = -1; // in case someone tries to use it
 		inode->i_privdata = nullptr;
 		inode->i_flags |= INODE_FLAG_GONE;
+		struct EXEC_CACHE* ec = inode->i_exec_cache;
+		inode->i_exec_cache = nullptr;
 		INODE_UNLOCK(inode);
 
+		// Only exec() in progress could still be using the cache
+		if (ec != nullptr)
+			exec_cache_deref(ec);
+
 		// Move the inode to the freelist as we can re-use it again
 		LIST_REMOVE(&icache_inuse, inode);
 		LIST_APPEND(&icache_free, inode);
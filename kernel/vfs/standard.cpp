@@ -1,14 +1,21 @@
 #include <ananas/types.h>
+#include <machine/param.h> /* for PAGE_SIZE */
 #include <ananas/bio.h>
 #include <ananas/device.h>
 #include <ananas/error.h>
+#include <ananas/exec.h>
+#include <ananas/kmem.h>
 #include <ananas/lib.h>
 #include <ananas/mm.h>
+#include <ananas/page.h>
 #include <ananas/schedule.h>
 #include <ananas/trace.h>
 #include <ananas/vfs.h>
 #include <ananas/vfs/generic.h>
 #include <ananas/vfs/mount.h>
+#include <ananas/vm.h>
+#include <ananas/vmpage.h>
+#include <ananas/vmspace.h>
 
 TRACE_SETUP;
 
@@ -79,6 +86,67 @@ vfs_read(struct VFS_FILE* file, void* buf, size_t* len)
 	return inode->i_iops->readdir(file, buf, len);
 }
 
+errorcode_t
+vfs_read_cached(struct VFS_FILE* file, void* buf, size_t* len)
+{
+	/*
+	 * Only large reads of regular files go through the page cache; small ones
+	 * aren't worth the trouble of setting up a page, and anything else isn't
+	 * backed by pages anyway.
+	 */
+	struct VFS_INODE* inode = file->f_dentry != NULL ? file->f_dentry->d_inode : NULL;
+	if (*len < PAGE_SIZE || inode == NULL || inode->i_iops == NULL || inode->i_iops->read == NULL ||
+	    !S_ISREG(inode->i_sb.st_mode))
+		return vfs_read(file, buf, len);
+
+	if (!vfs_is_filesystem_sane(inode->i_fs))
+		return ANANAS_ERROR(IO);
+
+	size_t total = 0, left = *len;
+	if (file->f_offset >= inode->i_sb.st_size)
+		left = 0;
+	else if (file->f_offset + (off_t)left > inode->i_sb.st_size)
+		left = inode->i_sb.st_size - file->f_offset;
+
+	while (left > 0) {
+		off_t page_offset = file->f_offset & ~(PAGE_SIZE - 1);
+		size_t in_page = file->f_offset - page_offset;
+		size_t chunk_len = PAGE_SIZE - in_page;
+		if (chunk_len > left)
+			chunk_len = left;
+
+		struct VM_PAGE* vp;
+		errorcode_t err = vmspace_get_dentry_page(file->f_dentry, page_offset, &vp);
+		if (ananas_is_failure(err)) {
+			if (total > 0)
+				break; /* report what we have so far */
+			return err;
+		}
+
+		/*
+		 * Hold a reference instead of the lock while copying; the destination may
+		 * need to be faulted in, which must not wait for this page.
+		 */
+		vmpage_ref(vp);
+		vmpage_unlock(vp);
+
+		auto src = static_cast<char*>(kmem_map(page_get_paddr(vmpage_get_page(vp)), PAGE_SIZE, VM_FLAG_READ));
+		memcpy(buf, src + in_page, chunk_len);
+		kmem_unmap(src, PAGE_SIZE);
+
+		vmpage_lock(vp);
+		vmpage_deref(vp);
+
+		buf = static_cast<void*>(static_cast<char*>(buf) + chunk_len);
+		file->f_offset += chunk_len;
+		total += chunk_len;
+		left -= chunk_len;
+	}
+
+	*len = total;
+	return ananas_success();
+}
+
 errorcode_t
 vfs_write(struct VFS_FILE* file, const void* buf, size_t* len)
 {
@@ -106,7 +174,16 @@ vfs_write(struct VFS_FILE* file, const void* buf, size_t* len)
 	/* Regular file */
 	if (inode->i_iops->write == NULL)
 		return ANANAS_ERROR(BAD_OPERATION);
-	return inode->i_iops->write(file, buf, len);
+	off_t offset = file->f_offset;
+	errorcode_t err = inode->i_iops->write(file, buf, len);
+	ANANAS_ERROR_RETURN(err);
+
+	/* Ensure anyone reading through the page cache sees what we wrote */
+	vmpage_update_inode(inode, offset, buf, *len);
+
+	/* Anything parsed from this file for exec() is no longer valid */
+	exec_cache_invalidate(inode);
+	return err;
 }
 
 errorcode_t
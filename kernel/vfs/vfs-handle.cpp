@@ -1,9 +1,11 @@
 #include <ananas/types.h>
 #include <ananas/error.h>
 #include <ananas/bio.h>
+#include <ananas/device.h>
 #include <ananas/flags.h>
 #include <ananas/handle.h>
 #include <ananas/handle-options.h>
+#include <ananas/poll.h>
 #include <ananas/process.h>
 #include <ananas/syscall.h>
 #include <ananas/trace.h>
@@ -34,7 +36,7 @@ vfshandle_read(thread_t* t, handleindex_t index, struct HANDLE* handle, void* bu
 	errorcode_t err = vfshandle_get_file(handle, &file);
 	ANANAS_ERROR_RETURN(err);
 
-	return vfs_read(file, buffer, size);
+	return vfs_read_cached(file, buffer, size);
 }
 
 errorcode_t
@@ -47,6 +49,38 @@ vfshandle_write(thread_t* t, handleindex_t index, struct HANDLE* handle, const v
 	return vfs_write(file, buffer, size);
 }
 
+/*
+ * Positional I/O works on a private copy of the file; this leaves the offset
+ * shared by everyone using the handle alone.
+ */
+static errorcode_t
+vfshandle_pread(thread_t* t, handleindex_t index, struct HANDLE* handle, void* buffer, size_t* size, off_t offset)
+{
+	struct VFS_FILE* file;
+	errorcode_t err = vfshandle_get_file(handle, &file);
+	ANANAS_ERROR_RETURN(err);
+	if (file->f_dentry == NULL)
+		return ANANAS_ERROR(BAD_OPERATION); /* devices have no position */
+
+	struct VFS_FILE f = *file;
+	f.f_offset = offset;
+	return vfs_read_cached(&f, buffer, size);
+}
+
+static errorcode_t
+vfshandle_pwrite(thread_t* t, handleindex_t index, struct HANDLE* handle, const void* buffer, size_t* size, off_t offset)
+{
+	struct VFS_FILE* file;
+	errorcode_t err = vfshandle_get_file(handle, &file);
+	ANANAS_ERROR_RETURN(err);
+	if (file->f_dentry == NULL)
+		return ANANAS_ERROR(BAD_OPERATION); /* devices have no position */
+
+	struct VFS_FILE f = *file;
+	f.f_offset = offset;
+	return vfs_write(&f, buffer, size);
+}
+
 static errorcode_t
 vfshandle_open(thread_t* t, handleindex_t index, struct HANDLE* handle, const char* path, int flags, int mode)
 {
@@ -121,13 +155,37 @@ vfshandle_clone(process_t* p_in, handleindex_t index_in, struct HANDLE* handle_i
 	return handle_clone_generic(handle_in, proc_out, handle_out, index_out_min, index_out);
 }
 
+static errorcode_t
+vfshandle_poll(thread_t* t, handleindex_t index, struct HANDLE* handle, struct POLL_ENTRY* pe, unsigned int* events)
+{
+	struct VFS_FILE* file;
+	errorcode_t err = vfshandle_get_file(handle, &file);
+	ANANAS_ERROR_RETURN(err);
+
+	/* Files never block; character devices know best whether they would */
+	Ananas::Device* device = file->f_device;
+	Ananas::ICharDeviceOperations* cdo = device != NULL ? device->GetCharDeviceOperations() : NULL;
+	if (cdo == NULL) {
+		*events = POLLIN | POLLOUT;
+		return ananas_success();
+	}
+
+	if (pe != NULL)
+		poll_register(&device->d_PollQueue, pe);
+	*events = cdo->GetReadiness();
+	return ananas_success();
+}
+
 struct HANDLE_OPS vfs_hops = {
 	.hop_read = vfshandle_read,
 	.hop_write = vfshandle_write,
+	.hop_pread = vfshandle_pread,
+	.hop_pwrite = vfshandle_pwrite,
 	.hop_open = vfshandle_open,
 	.hop_free = vfshandle_free,
 	.hop_unlink = vfshandle_unlink,
 	.hop_clone = vfshandle_clone,
+	.hop_poll = vfshandle_poll,
 };
 HANDLE_TYPE(HANDLE_TYPE_FILE, "file", vfs_hops);
 
@@ -0,0 +1,87 @@
+/*
+ * The page daemon keeps a reserve of available pages by evicting unused pages
+ * from the inode page caches; it is woken up once the number of available
+ * pages drops below the low-water mark and runs until the high-water mark is
+ * reached again.
+ *
+ * Allocations that cannot be satisfied reclaim pages directly using
+ * pagedaemon_reclaim() before giving up.
+ */
+#include <ananas/pagedaemon.h>
+#include <machine/interrupts.h>
+#include <ananas/error.h>
+#include <ananas/init.h>
+#include <ananas/lib.h>
+#include <ananas/lock.h>
+#include <ananas/page.h>
+#include <ananas/schedule.h>
+#include <ananas/thread.h>
+#include <ananas/vmpage.h>
+
+static thread_t pagedaemon_thread;
+static semaphore_t pagedaemon_sem;
+static volatile int pagedaemon_running = 0;
+static volatile int pagedaemon_wanted = 0;
+
+void
+pagedaemon_wakeup()
+{
+	/* We may be called from just about anywhere; only wake up if this is safe */
+	if (!pagedaemon_running || !md_interrupts_save())
+		return;
+
+	if (__sync_lock_test_and_set(&pagedaemon_wanted, 1) == 0)
+		sem_signal(&pagedaemon_sem);
+}
+
+size_t
+pagedaemon_reclaim(size_t num_pages)
+{
+	/* Reclaiming needs locks, so we can't do it early on or with interrupts disabled */
+	if (!scheduler_activated() || !md_interrupts_save())
+		return 0;
+
+	/*
+	 * We may be called from within kmalloc(), so we cannot free the VM pages
+	 * here; have the page daemon take care of them instead.
+	 */
+	size_t num_freed = vmpage_reclaim(num_pages);
+	if (num_freed > 0)
+		pagedaemon_wakeup();
+	return num_freed;
+}
+
+static void
+pagedaemon_run(void* context)
+{
+	while(1) {
+		sem_wait(&pagedaemon_sem);
+		pagedaemon_wanted = 0;
+
+		unsigned int total_pages, avail_pages;
+		page_get_stats(&total_pages, &avail_pages);
+		while (avail_pages < PAGEDAEMON_HIGH_WATER(total_pages)) {
+			if (vmpage_reclaim(PAGEDAEMON_BATCH) == 0)
+				break; /* nothing left to reclaim */
+			vmpage_reclaim_finish();
+			page_get_stats(&total_pages, &avail_pages);
+		}
+
+		/* Free anything reclaimed on our behalf */
+		vmpage_reclaim_finish();
+	}
+}
+
+static errorcode_t
+start_pagedaemon()
+{
+	sem_init(&pagedaemon_sem, 0);
+	kthread_init(&pagedaemon_thread, "pagedaemon", &pagedaemon_run, NULL);
+	thread_resume(&pagedaemon_thread);
+	pagedaemon_running = 1;
+	return ananas_success();
+}
+
+INIT_FUNCTION(start_pagedaemon, SUBSYSTEM_SCHEDULER, ORDER_MIDDLE);
+
+/* vim:set ts=2 sw=2: */
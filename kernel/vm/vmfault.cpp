@@ -1,6 +1,9 @@
 #include <ananas/types.h>
 #include <machine/param.h> /* for PAGE_SIZE */
+#include <machine/vm.h> /* for md_map_pages_vector() */
+#include <ananas/cmdline.h>
 #include <ananas/error.h>
+#include <ananas/init.h>
 #include <ananas/lib.h>
 #include <ananas/process.h>
 #include <ananas/trace.h>
@@ -14,8 +17,28 @@
 
 TRACE_SETUP;
 
+/* Default number of pages mapped around a file-backed fault */
+#define VM_FAULT_AROUND_DEFAULT 16
+
+/* Maximum number of pages mapped around a file-backed fault */
+#define VM_FAULT_AROUND_MAX 64
+
 namespace {
 
+/* Number of pages in the fault-around window; can be set using 'faultaround=' */
+unsigned int vm_fault_around_pages = VM_FAULT_AROUND_DEFAULT;
+
+errorcode_t
+vmfault_init()
+{
+	const char* arg = cmdline_get_string("faultaround");
+	if (arg != nullptr && *arg != '\0') {
+		unsigned int n = strtoul(arg, nullptr, 10);
+		vm_fault_around_pages = (n < VM_FAULT_AROUND_MAX) ? n : VM_FAULT_AROUND_MAX;
+	}
+	return ananas_success();
+}
+
 errorcode_t
 read_data(struct DENTRY* dentry, void* buf, off_t offset, size_t len)
 {
@@ -45,187 +68,365 @@ vmspace_page_flags_from_va(vmarea_t* va)
 	return flags;
 }
 
-struct VM_PAGE*
-vmspace_get_dentry_backed_page(vmarea_t* va, off_t read_off)
+bool
+vmspace_can_share_dentry_page(vmarea_t* va, off_t read_off)
 {
-	// First, try to lookup the page; if we already have it, no need to read it
-	struct VM_PAGE* vmpage = vmpage_lookup_locked(va, va->va_dentry->d_inode, read_off);
-	if (vmpage == nullptr) {
-		// Page not found - we need to allocate one. This is always a shared mapping, which we'll copy if needed
-		vmpage = vmpage_create_shared(va->va_dentry->d_inode, read_off, VM_PAGE_FLAG_PENDING | vmspace_page_flags_from_va(va));
-	}
-	// vmpage will be locked at this point!
+	// Shared mappings cannot be reused as each process needs its own copy
+	if (va->va_flags & VM_FLAG_PRIVATE)
+		return false;
 
-	if ((vmpage->vp_flags & VM_PAGE_FLAG_PENDING) == 0)
-		return vmpage;
+	// Reusing means the page resides in the section...
+	if ((read_off + PAGE_SIZE) > va->va_dlength)
+		return false;
+	// ... and we have a page-aligned offset ...
+	if ((va->va_doffset & (PAGE_SIZE - 1)) != 0)
+		return false;
+	// ... and we didn't have to skip anything
+	return (read_off >= PAGE_SIZE) || va->va_dvskip == 0;
+}
 
-	// Read the page - note that we hold the vmpage lock while doing this
+/*
+ * Reads the contents of a pending page; note that we hold the vmpage lock
+ * while doing this. Anything beyond the end of the inode is zero-filled.
+ */
+errorcode_t
+fill_dentry_page(struct DENTRY* dentry, struct VM_PAGE* vmpage, off_t read_off)
+{
+	vmpage_assert_locked(vmpage);
+	KASSERT(vmpage->vp_flags & VM_PAGE_FLAG_PENDING, "filling page %p that isn't pending", vmpage);
+
+	// If memory is tight, this evicts unused pages from the page caches first
 	struct PAGE* p;
 	void* page = page_alloc_single_mapped(&p, VM_FLAG_READ | VM_FLAG_WRITE);
-	KASSERT(p != nullptr, "out of memory"); // XXX handle this
+	if (page == nullptr)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
 
-	size_t read_length = PAGE_SIZE;
-	if (read_off + read_length > va->va_dentry->d_inode->i_sb.st_size) {
-		// This inode is simply not long enough to cover our read - adjust XXX what when it grows?
-		read_length = va->va_dentry->d_inode->i_sb.st_size - read_off;
+	// XXX what if the inode grows?
+	off_t file_size = dentry->d_inode->i_sb.st_size;
+	size_t read_length = 0;
+	if (read_off < file_size) {
+		// The inode may not be long enough to cover the entire page
+		read_length = PAGE_SIZE;
+		if (read_off + (off_t)read_length > file_size)
+			read_length = file_size - read_off;
 	}
 
-	errorcode_t err = read_data(va->va_dentry, page, read_off, read_length);
+	// Pages entirely beyond the end of the inode have nothing to read
+	errorcode_t err = ananas_success();
+	if (read_length > 0)
+		err = read_data(dentry, page, read_off, read_length);
+	if (read_length < PAGE_SIZE)
+		memset(static_cast<char*>(page) + read_length, 0, PAGE_SIZE - read_length);
 	kmem_unmap(page, PAGE_SIZE);
-	KASSERT(ananas_is_success(err), "cannot deal with error %d", err); // XXX
+	if (ananas_is_failure(err)) {
+		page_free(p);
+		return err;
+	}
 
 	// Update the vm page to contain our new address
 	vmpage->vp_page = p;
 	vmpage->vp_flags &= ~VM_PAGE_FLAG_PENDING;
-	return vmpage;
+	return ananas_success();
 }
 
-} // unnamed namespace
-
+/* On success, the page is returned locked */
 errorcode_t
-vmspace_handle_fault(vmspace_t* vs, addr_t virt, int flags)
+vmspace_get_dentry_backed_page(vmarea_t* va, off_t read_off, struct VM_PAGE** vp_out)
 {
-	TRACE(VM, INFO, "vmspace_handle_fault(): vs=%p, virt=%p, flags=0x%x", vs, virt, flags);
-	//kprintf("vmspace_handle_fault(): vs=%p, virt=%p, flags=0x%x\n", vs, virt, flags);
+	// First, try to lookup the page; if we already have it, no need to read it
+	struct VM_PAGE* vmpage = vmpage_lookup_locked(va, va->va_dentry->d_inode, read_off);
+	if (vmpage == nullptr) {
+		// Page not found - we need to allocate one. This is always a shared mapping, which we'll copy if needed
+		vmpage = vmpage_create_shared(va->va_dentry->d_inode, read_off, VM_PAGE_FLAG_PENDING | vmspace_page_flags_from_va(va));
+	}
+	// vmpage will be locked at this point!
 
-	/* Walk through the areas one by one */
-	LIST_FOREACH(&vs->vs_areas, va, vmarea_t) {
-		if (!(virt >= va->va_virt && (virt < (va->va_virt + va->va_len))))
+	if (vmpage->vp_flags & VM_PAGE_FLAG_PENDING) {
+		errorcode_t err = fill_dentry_page(va->va_dentry, vmpage, read_off);
+		if (ananas_is_failure(err)) {
+			// Leave the page pending; the next fault will try to read it again
+			vmpage_unlock(vmpage);
+			return err;
+		}
+	}
+
+	*vp_out = vmpage;
+	return ananas_success();
+}
+
+/*
+ * Maps the pages surrounding a file-backed fault at v_fault, provided they are
+ * already present in the inode's page cache. This avoids taking a trap for
+ * each page when a binary is started; all pages are mapped using a single
+ * pagetable update.
+ */
+void
+vmspace_fault_around(vmspace_t* vs, vmarea_t* va, addr_t v_fault)
+{
+	if (vm_fault_around_pages <= 1)
+		return;
+
+	// Determine the window containing v_fault, clipped to the area
+	addr_t window = vm_fault_around_pages * PAGE_SIZE;
+	addr_t v_start = va->va_virt + ROUND_DOWN(v_fault - va->va_virt, window);
+	addr_t v_end = v_start + window;
+	if (v_end > va->va_virt + va->va_len)
+		v_end = va->va_virt + va->va_len;
+
+	addr_t phys[VM_FAULT_AROUND_MAX];
+	size_t num_pages = (v_end - v_start) / PAGE_SIZE;
+
+	// Find out what we already have mapped in a single pass over the area
+	bool mapped[VM_FAULT_AROUND_MAX] = { };
+	mapped[(v_fault - v_start) / PAGE_SIZE] = true; // already taken care of
+	LIST_FOREACH(&va->va_pages, vp, struct VM_PAGE) {
+		if (vp->vp_vaddr >= v_start && vp->vp_vaddr < v_end)
+			mapped[(vp->vp_vaddr - v_start) / PAGE_SIZE] = true;
+	}
+
+	// Only use pages which are readily available; we never want to wait here
+	struct VM_PAGE* cached[VM_FAULT_AROUND_MAX];
+	struct VFS_INODE* inode = va->va_dentry->d_inode;
+	vmpage_lookup_cached_range_locked(inode, v_start - va->va_virt + va->va_doffset, num_pages, cached);
+
+	bool need_map = false;
+	for (size_t n = 0; n < num_pages; n++) {
+		phys[n] = 0;
+		struct VM_PAGE* vp = cached[n];
+		if (vp == nullptr)
 			continue;
 
-		/* We should only get faults for lazy areas (filled by a function) or when we have to dynamically allocate things */
-		KASSERT((va->va_flags & VM_FLAG_FAULT) != 0, "unexpected pagefault in area %p, virt=%p, len=%d, flags 0x%x", va, va->va_virt, va->va_len, va->va_flags);
+		addr_t v_page = v_start + n * PAGE_SIZE;
+		if (mapped[n] || !vmspace_can_share_dentry_page(va, v_page - va->va_virt)) {
+			vmpage_unlock(vp);
+			continue;
+		}
 
-		// See if we have this page mapped
-		struct VM_PAGE* vp = vmpage_lookup_vaddr_locked(va, virt & ~(PAGE_SIZE - 1));
-		if (vp != nullptr) {
-			if ((flags & VM_FLAG_WRITE) && (vp->vp_flags & VM_PAGE_FLAG_COW)) {
-				// Promote our copy to a writable page and update the mapping
-				vp = vmpage_promote(vs, va, vp);
-				vmpage_map(vs, va, vp);
+		struct VM_PAGE* new_vp = vmpage_link(va, vp);
+		vmpage_unlock(vp);
+		new_vp->vp_vaddr = v_page;
+		phys[n] = page_get_paddr(vmpage_get_page(new_vp));
+		vmpage_unlock(new_vp);
+		need_map = true;
+	}
+
+	if (need_map)
+		md_map_pages_vector(vs, v_start, phys, num_pages, va->va_flags);
+}
+
+errorcode_t
+vmspace_handle_fault_area(vmspace_t* vs, vmarea_t* va, addr_t virt, int flags)
+{
+	/* We should only get faults for lazy areas (filled by a function) or when we have to dynamically allocate things */
+	KASSERT((va->va_flags & VM_FLAG_FAULT) != 0, "unexpected pagefault in area %p, virt=%p, len=%d, flags 0x%x", va, va->va_virt, va->va_len, va->va_flags);
+
+	// See if we have this page mapped
+	struct VM_PAGE* vp = vmpage_lookup_vaddr_locked(va, virt & ~(PAGE_SIZE - 1));
+	if (vp != nullptr) {
+		if ((flags & VM_FLAG_WRITE) && (vp->vp_flags & VM_PAGE_FLAG_COW)) {
+			// Promote our copy to a writable page and update the mapping
+			struct VM_PAGE* new_vp = vmpage_promote(vs, va, vp);
+			if (new_vp == nullptr) {
 				vmpage_unlock(vp);
-				return ananas_success();
+				return ANANAS_ERROR(OUT_OF_MEMORY);
 			}
-
-			// Page is already mapped, but not COW. Bad, reject
-			vmpage_unlock(vp);
-			return ANANAS_ERROR(BAD_ADDRESS);
+			vmpage_map(vs, va, new_vp);
+			vmpage_unlock(new_vp);
+			return ananas_success();
 		}
 
-		// XXX we expect va_doffset to be page-aligned here (i.e. we can always use a page directly)
-		// this needs to be enforced when making mappings!
-		KASSERT((va->va_doffset & (PAGE_SIZE - 1)) == 0, "doffset %x not page-aligned", (int)va->va_doffset);
-
-		// If there is a dentry attached here, perhaps we may find what we need in the corresponding inode
-		if (va->va_dentry != nullptr) {
-			/*
-			 * The way dentries are mapped to virtual address is:
-			 *
-			 * 0       va_doffset                               file length
-			 * +------------+-------------+-------------------------------+
-			 * |            |XXXXXXXXXXXXX|                               |
-			 * |            |XXXXXXXXXXXXX|                               |
-			 * +------------+-------------+-------------------------------+
-			 *             /     |||      \ va_doffset + va_dlength
-			 *            /      vvv
-			 *     +-----+-------------+---------------+
-			 *     |00000|XXXXXXXXXXXXX|000000000000000|
-			 *     |00000|XXXXXXXXXXXXX|000000000000000|
-			 *     +-----+-------------+---------------+
-			 *     0     ^             \                \
-			 *           ^              \                \
-			 *      va_dvskip     va_dvskip + va_dlength  va_le
-			 */
-			addr_t v_page = virt & ~(PAGE_SIZE - 1);
-			off_t read_off = v_page - va->va_virt; // offset in area, still needs va_doffset added
-			off_t read_skip = va->va_dvskip; // this is always < PAGE_SIZE, so we need to work regardless
-			if (read_off < va->va_dlength) {
-				// At least (part of) the page is to be read from disk - this means we want
-				// the entire page
-				struct VM_PAGE* vmpage = vmspace_get_dentry_backed_page(va, read_off + va->va_doffset);
-				// vmpage is locked at this point
-
-				// If the mapping is page-aligned and read-only or shared, we can re-use the
-				// mapping and avoid the entire copy
-				struct VM_PAGE* new_vp;
-				bool can_reuse_page_1on1 = true;
-				// Reusing means the page resides in the section...
-				can_reuse_page_1on1 &= (read_off + PAGE_SIZE) <= va->va_dlength;
-				// ... and we have a page-aligned offset ...
-				can_reuse_page_1on1 &= (va->va_doffset & (PAGE_SIZE - 1)) == 0;
-				// ... and we didn't have to skip anything
-				can_reuse_page_1on1 &= (read_off >= PAGE_SIZE) || read_skip == 0;
-				if (can_reuse_page_1on1 && (va->va_flags & VM_FLAG_PRIVATE) == 0) {
-					new_vp = vmpage_link(va, vmpage);
-				} else {
-					// Cannot re-use; create a new VM page, with appropriate flags based on the va
-					new_vp = vmpage_create_private(va, VM_PAGE_FLAG_PRIVATE | vmspace_page_flags_from_va(va));
-
-					// Now copy the parts of the dentry-backed page
-					size_t src_off = 0;
-					size_t copy_len = PAGE_SIZE;
-					if (read_off < PAGE_SIZE && read_skip > 0) {
-						// Need to skip pieces of the first page
-						src_off = read_skip;
-						copy_len -= read_skip;
-						kprintf("doing read skip! copy_len %d src_off %d\n", copy_len, src_off);
-					}
-					vmpage_copy_extended(vmpage, new_vp, copy_len, src_off, 0);
-
-					// XXX Ensure we don't have to piece together two pages
-					if (read_skip > 0 && copy_len < va->va_dlength && read_off != (va->va_doffset & (PAGE_SIZE - 1))) {
-						/*
-						* We'll assume that the lower PAGE_SIZE - 1 bits of the virtual and
-						* offset line up, i.e.:
-						*
-						* Page:
-						*           va_dvskip
-						*             v
-						*  +----------+--------+
-						*  |0000000000|XXXXXXXX|
-						*  |0000000000|XXXXXXXX|
-						*  +----------+--------+
-						*              \        \
-						*  File:        \        \
-						*    +-----------+--------+
-						*    |           |XXXXXXXX|
-						*    |           |XXXXXXXX|
-						*    +-----------+--------+
-						*                v
-						*            va_doffset
-						*
-						* And these align (i.e. va_dvskip & (PAGE_SIZE - 1) == va_doffset & (PAGE_SIZE - 1) - this prevents us
-						* having to grab another page and keep merging them, which hurts performance and makes things far more
-						* difficult than they need to be.
-						*/
-						panic("unaligned vskip <-> doffset (%x, %x)", va->va_doffset, read_off);
-					}
+		// Page is already mapped, but not COW. Bad, reject
+		vmpage_unlock(vp);
+		return ANANAS_ERROR(BAD_ADDRESS);
+	}
+
+	// XXX we expect va_doffset to be page-aligned here (i.e. we can always use a page directly)
+	// this needs to be enforced when making mappings!
+	KASSERT((va->va_doffset & (PAGE_SIZE - 1)) == 0, "doffset %x not page-aligned", (int)va->va_doffset);
+
+	// If there is a dentry attached here, perhaps we may find what we need in the corresponding inode
+	if (va->va_dentry != nullptr) {
+		/*
+		 * The way dentries are mapped to virtual address is:
+		 *
+		 * 0       va_doffset                               file length
+		 * +------------+-------------+-------------------------------+
+		 * |            |XXXXXXXXXXXXX|                               |
+		 * |            |XXXXXXXXXXXXX|                               |
+		 * +------------+-------------+-------------------------------+
+		 *             /     |||      \ va_doffset + va_dlength
+		 *            /      vvv
+		 *     +-----+-------------+---------------+
+		 *     |00000|XXXXXXXXXXXXX|000000000000000|
+		 *     |00000|XXXXXXXXXXXXX|000000000000000|
+		 *     +-----+-------------+---------------+
+		 *     0     ^             \                \
+		 *           ^              \                \
+		 *      va_dvskip     va_dvskip + va_dlength  va_le
+		 */
+		addr_t v_page = virt & ~(PAGE_SIZE - 1);
+		off_t read_off = v_page - va->va_virt; // offset in area, still needs va_doffset added
+		off_t read_skip = va->va_dvskip; // this is always < PAGE_SIZE, so we need to work regardless
+		if (read_off < va->va_dlength) {
+			// At least (part of) the page is to be read from disk - this means we want
+			// the entire page
+			struct VM_PAGE* vmpage;
+			errorcode_t err = vmspace_get_dentry_backed_page(va, read_off + va->va_doffset, &vmpage);
+			ANANAS_ERROR_RETURN(err);
+			// vmpage is locked at this point
+
+			// If the mapping is page-aligned and read-only or shared, we can re-use the
+			// mapping and avoid the entire copy
+			struct VM_PAGE* new_vp;
+			bool can_share = vmspace_can_share_dentry_page(va, read_off);
+			if (can_share) {
+				new_vp = vmpage_link(va, vmpage);
+			} else {
+				// Cannot re-use; create a new VM page, with appropriate flags based on the va
+				new_vp = vmpage_create_private(va, VM_PAGE_FLAG_PRIVATE | vmspace_page_flags_from_va(va));
+				if (new_vp == nullptr) {
+					vmpage_unlock(vmpage);
+					return ANANAS_ERROR(OUT_OF_MEMORY);
 				}
-				vmpage_unlock(vmpage);
 
-				new_vp->vp_vaddr = virt & ~(PAGE_SIZE - 1);
+				// Now copy the parts of the dentry-backed page
+				size_t src_off = 0;
+				size_t copy_len = PAGE_SIZE;
+				if (read_off < PAGE_SIZE && read_skip > 0) {
+					// Need to skip pieces of the first page
+					src_off = read_skip;
+					copy_len -= read_skip;
+					kprintf("doing read skip! copy_len %d src_off %d\n", copy_len, src_off);
+				}
+				vmpage_copy_extended(vmpage, new_vp, copy_len, src_off, 0);
 
-				// Finally, update the permissions and we are done
-				vmpage_map(vs, va, new_vp);
-				vmpage_unlock(new_vp);
-				return ananas_success();
+				// XXX Ensure we don't have to piece together two pages
+				if (read_skip > 0 && copy_len < va->va_dlength && read_off != (va->va_doffset & (PAGE_SIZE - 1))) {
+					/*
+					* We'll assume that the lower PAGE_SIZE - 1 bits of the virtual and
+					* offset line up, i.e.:
+					*
+					* Page:
+					*           va_dvskip
+					*             v
+					*  +----------+--------+
+					*  |0000000000|XXXXXXXX|
+					*  |0000000000|XXXXXXXX|
+					*  +----------+--------+
+					*              \        \
+					*  File:        \        \
+					*    +-----------+--------+
+					*    |           |XXXXXXXX|
+					*    |           |XXXXXXXX|
+					*    +-----------+--------+
+					*                v
+					*            va_doffset
+					*
+					* And these align (i.e. va_dvskip & (PAGE_SIZE - 1) == va_doffset & (PAGE_SIZE - 1) - this prevents us
+					* having to grab another page and keep merging them, which hurts performance and makes things far more
+					* difficult than they need to be.
+					*/
+					panic("unaligned vskip <-> doffset (%x, %x)", va->va_doffset, read_off);
+				}
 			}
+			vmpage_unlock(vmpage);
+
+			new_vp->vp_vaddr = virt & ~(PAGE_SIZE - 1);
+
+			// Update the permissions; the faulting page is now available
+			vmpage_map(vs, va, new_vp);
+			vmpage_unlock(new_vp);
+
+			// Try to map the neighbouring pages as well, so we won't fault on them
+			if (can_share)
+				vmspace_fault_around(vs, va, v_page);
+			return ananas_success();
 		}
+	}
 
-		// We need a new VM page here; this is an anonymous mapping which we need to back
-		struct VM_PAGE* new_vp = vmpage_create_private(va, VM_PAGE_FLAG_PRIVATE);
-		new_vp->vp_vaddr = virt & ~(PAGE_SIZE - 1);
+	// This is an anonymous mapping which we need to back. If we are only reading,
+	// use the shared zero page; the first write will give us a private copy
+	struct VM_PAGE* new_vp;
+	if (flags & VM_FLAG_WRITE)
+		new_vp = vmpage_create_zeroed(va, VM_PAGE_FLAG_PRIVATE);
+	else
+		new_vp = vmpage_link_zero(va);
+	if (new_vp == nullptr)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+	new_vp->vp_vaddr = virt & ~(PAGE_SIZE - 1);
 
-		// Ensure the page cleaned so we don't leak any information
-		vmpage_zero(vs, new_vp);
+	// And now (re)map the page for the caller
+	vmpage_map(vs, va, new_vp);
+	vmpage_unlock(new_vp);
+	return ananas_success();
+}
 
-		// And now (re)map the page for the caller
-		vmpage_map(vs, va, new_vp);
-		vmpage_unlock(new_vp);
-		return ananas_success();
+} // unnamed namespace
+
+/*
+ * Obtains the page cache page of 'dentry' at (page-aligned) 'offset', reading
+ * it if needed. This is for users outside of the fault path that want to use
+ * the same pages as any mappings of the dentry, i.e. read(); it must not be
+ * used by filesystems as filling a page calls vfs_read() with the page locked.
+ */
+errorcode_t
+vmspace_get_dentry_page(struct DENTRY* dentry, off_t offset, struct VM_PAGE** vp_out)
+{
+	KASSERT((offset & (PAGE_SIZE - 1)) == 0, "offset %x not page-aligned", (int)offset);
+
+	struct VM_PAGE* vmpage = vmpage_create_shared(dentry->d_inode, offset, VM_PAGE_FLAG_PENDING);
+	// vmpage will be locked at this point!
+	if (vmpage->vp_flags & VM_PAGE_FLAG_PENDING) {
+		errorcode_t err = fill_dentry_page(dentry, vmpage, offset);
+		if (ananas_is_failure(err)) {
+			// Leave the page pending; the next user will try to read it again
+			vmpage_unlock(vmpage);
+			return err;
+		}
+	}
+
+	*vp_out = vmpage;
+	return ananas_success();
+}
+
+errorcode_t
+vmspace_handle_fault(vmspace_t* vs, addr_t virt, int flags)
+{
+	TRACE(VM, INFO, "vmspace_handle_fault(): vs=%p, virt=%p, flags=0x%x", vs, virt, flags);
+	//kprintf("vmspace_handle_fault(): vs=%p, virt=%p, flags=0x%x\n", vs, virt, flags);
+
+	/* Walk through the areas one by one */
+	LIST_FOREACH(&vs->vs_areas, va, vmarea_t) {
+		if (!(virt >= va->va_virt && (virt < (va->va_virt + va->va_len))))
+			continue;
+
+		return vmspace_handle_fault_area(vs, va, virt, flags);
 	}
 
 	return ANANAS_ERROR(BAD_ADDRESS);
 }
 
+errorcode_t
+vmspace_area_populate(vmspace_t* vs, vmarea_t* va)
+{
+	TRACE(VM, INFO, "vmspace_area_populate(): vs=%p, va=%p", vs, va);
+
+	// Fault every page in; writable areas are faulted as if written to
+	int flags = (va->va_flags & VM_FLAG_WRITE) ? VM_FLAG_WRITE : VM_FLAG_READ;
+	for (addr_t virt = va->va_virt; virt < va->va_virt + va->va_len; virt += PAGE_SIZE) {
+		// Skip any page we already have (fault-around may have mapped it)
+		struct VM_PAGE* vp = vmpage_lookup_vaddr_locked(va, virt);
+		if (vp != nullptr) {
+			vmpage_unlock(vp);
+			continue;
+		}
+
+		errorcode_t err = vmspace_handle_fault_area(vs, va, virt, flags);
+		ANANAS_ERROR_RETURN(err);
+	}
+	return ananas_success();
+}
+
+INIT_FUNCTION(vmfault_init, SUBSYSTEM_THREAD, ORDER_FIRST);
+
 /* vim:set ts=2 sw=2: */
@@ -3,15 +3,19 @@
 #include <ananas/init.h>
 #include <ananas/lock.h>
 #include <ananas/mm.h>
+#include <ananas/page.h>
 #include <ananas/lib.h>
 #include <ananas/vmspace.h>
 #include <ananas/error.h>
 #include <ananas/vfs/types.h>
 #include <ananas/kmem.h>
+#include <ananas/trace.h>
 #include <ananas/vm.h>
 #include <machine/param.h> // for PAGE_SIZE
 #include <machine/vm.h> /* for md_{,un}map_pages() */
 
+TRACE_SETUP;
+
 #define DEBUG 0
 
 #if DEBUG
@@ -33,6 +37,33 @@ static inline int get_pid()
 
 namespace {
 
+/*
+ * Page filled with zeroes, shared by all anonymous read faults. It is marked
+ * COW, so any write to it will yield a fresh private page. We hold a
+ * reference to it, so it will never be freed.
+ */
+struct VM_PAGE* vmpage_zero_page;
+
+/*
+ * All pages in inode page caches, in the order in which they are considered
+ * for reclaiming (clock). Pages that were used since the hand last passed get
+ * a second chance. Reclaimed VM_PAGE structures are kept on a separate list
+ * until they can be freed; we may be called from within kmalloc().
+ */
+spinlock_t vmpage_cache_lock = SPINLOCK_DEFAULT_INIT;
+struct VM_PAGE_LIST vmpage_cache;
+size_t vmpage_cache_count;
+struct VM_PAGE_LIST vmpage_reclaimed;
+
+void
+vmpage_cache_add(struct VM_PAGE* vp)
+{
+  spinlock_lock(&vmpage_cache_lock);
+  LIST_APPEND_IP(&vmpage_cache, cache, vp);
+  vmpage_cache_count++;
+  spinlock_unlock(&vmpage_cache_lock);
+}
+
 void
 vmpage_free(struct VM_PAGE* vmpage)
 {
@@ -218,10 +249,18 @@ vmpage_promote(vmspace_t* vs, vmarea_t* va, struct VM_PAGE* vp)
       DPRINTF("%d: vmpage_promote(): vp %p, we are the last page - using it! (page %p @ %p)\n", get_pid(), vp, vp->vp_page, vp->vp_vaddr);
     }
   } else /* vp_source->vp_refcount > 1 */ {
-    /* (2) - multiple references, need to make a copy */
+    /* (2) - multiple references, need to make a copy; get the page first so we can still back out */
+    struct PAGE* new_page = (vp_source == vmpage_zero_page) ? page_alloc_zeroed() : page_alloc_single();
+    if (new_page == nullptr) {
+      if (vp_source != vp)
+        vmpage_unlock(vp_source);
+      return nullptr;
+    }
+
     if (vp_source == vp) {
       // We have the original page - must allocate a new one, as we can't touch this one
-      vp = vmpage_create_private(va, vp_source->vp_flags | VM_PAGE_FLAG_PRIVATE);
+      vp = vmpage_alloc(va, nullptr, 0, vp_source->vp_flags | VM_PAGE_FLAG_PRIVATE);
+      vp->vp_page = new_page;
       vp->vp_vaddr = vp_source->vp_vaddr;
 
       // Remove the original source from the vmarea
@@ -232,17 +271,17 @@ vmpage_promote(vmspace_t* vs, vmarea_t* va, struct VM_PAGE* vp)
     } else /* vp_source != vp */ {
       KASSERT((vp->vp_flags & VM_PAGE_FLAG_LINK) != 0, "destination vp not linked?");
 
-      // We need t allocate a new page for the destination and hook it up
-      vp->vp_page = page_alloc_single();
-      KASSERT(vp->vp_page != nullptr, "out of pages");
+      // Hook the new page up to the destination
+      vp->vp_page = new_page;
       vp->vp_flags &= ~VM_PAGE_FLAG_LINK;
 
       // And we can continue copying things into it
       DPRINTF("%d: vmpage_promote(): vp %p, must copy page %p -> page %p @ %p!\n", get_pid(), vp, vp_source->vp_page, vp->vp_page, vp->vp_vaddr);
     }
 
-    // Copy the data over and throw away the source; this never deletes it
-    vmpage_copy(vp_source, vp);
+    // Copy the data over (not needed for the zero page) and throw away the source; this never deletes it
+    if (vp_source != vmpage_zero_page)
+      vmpage_copy(vp_source, vp);
     vmpage_deref(vp_source);
   }
 
@@ -296,6 +335,7 @@ vmpage_lookup_locked(vmarea_t* va, struct VFS_INODE* inode, off_t offs)
 
     vmpage_lock(vmpage); // XXX is this order wise?
     INODE_UNLOCK(inode);
+    vmpage->vp_flags |= VM_PAGE_FLAG_REFERENCED;
     return vmpage;
   }
 	INODE_UNLOCK(inode);
@@ -304,6 +344,41 @@ vmpage_lookup_locked(vmarea_t* va, struct VFS_INODE* inode, off_t offs)
   return nullptr;
 }
 
+void
+vmpage_lookup_cached_range_locked(struct VFS_INODE* inode, off_t offs, size_t num_pages, struct VM_PAGE** vp_out)
+{
+  /*
+   * Fills vp_out[n] with the locked page at offset offs + n * PAGE_SIZE, or
+   * nullptr if there is none. Only considers the inode's pages, which are
+   * walked just once; anything that is busy (i.e. locked or still pending a
+   * read) is skipped as the caller does not want to wait.
+   */
+  for (size_t n = 0; n < num_pages; n++)
+    vp_out[n] = nullptr;
+
+  off_t offs_end = offs + num_pages * PAGE_SIZE;
+  INODE_LOCK(inode);
+  LIST_FOREACH(&inode->i_pages, vmpage, struct VM_PAGE) {
+    if (vmpage->vp_offset < offs || vmpage->vp_offset >= offs_end)
+      continue;
+    if ((vmpage->vp_offset - offs) & (PAGE_SIZE - 1))
+      continue;
+    size_t n = (vmpage->vp_offset - offs) / PAGE_SIZE;
+    if (vp_out[n] != nullptr)
+      continue;
+
+    if (!mutex_trylock(&vmpage->vp_mtx))
+      continue;
+    if (vmpage->vp_flags & VM_PAGE_FLAG_PENDING) {
+      vmpage_unlock(vmpage);
+      continue;
+    }
+    vmpage->vp_flags |= VM_PAGE_FLAG_REFERENCED;
+    vp_out[n] = vmpage;
+  }
+  INODE_UNLOCK(inode);
+}
+
 struct VM_PAGE*
 vmpage_lookup_vaddr_locked(vmarea_t* va, addr_t vaddr)
 {
@@ -341,8 +416,15 @@ vmpage_clone(vmspace_t* vs, vmarea_t* va_source, vmarea_t* va_dest, struct VM_PA
   struct VM_PAGE* vp_dst;
   if (va_source->va_flags & VM_FLAG_MD) {
     vp_dst = vmpage_create_private(va_dest, vp_source->vp_flags | VM_PAGE_FLAG_PRIVATE);
-    vp_dst->vp_vaddr = vp_source->vp_vaddr;
-    vmpage_copy(vp_source, vp_dst);
+    if (vp_dst != nullptr) {
+      vp_dst->vp_vaddr = vp_source->vp_vaddr;
+      vmpage_copy(vp_source, vp_dst);
+    }
+  } else if (vp_source == vmpage_zero_page) {
+    // The zero page is never mapped writable, so we only need another COW link to it
+    vp_dst = vmpage_link(va_dest, vp_source);
+    vp_dst->vp_flags |= VM_PAGE_FLAG_COW;
+    vp_dst->vp_vaddr = vp_orig->vp_vaddr;
   } else if (vp_source->vp_flags & VM_PAGE_FLAG_READONLY) {
     // (1) If the source is read-only, we can always share it
     vp_dst = vmpage_link(va_dest, vp_source);
@@ -383,6 +465,7 @@ vmpage_create_shared(struct VFS_INODE* inode, off_t offs, int flags)
     // Page is already present - return the one already in use
     vmpage_lock(vmpage); // XXX is this order wise?
     INODE_UNLOCK(inode);
+    vmpage->vp_flags |= VM_PAGE_FLAG_REFERENCED;
 
     // And throw the new page away, we won't need it
     vmpage_unlock(new_page);
@@ -392,6 +475,7 @@ vmpage_create_shared(struct VFS_INODE* inode, off_t offs, int flags)
 
   // Not yet present; add the new page and return it
   LIST_APPEND(&inode->i_pages, new_page);
+  vmpage_cache_add(new_page);
   INODE_UNLOCK(inode);
   return new_page;
 }
@@ -399,11 +483,13 @@ vmpage_create_shared(struct VFS_INODE* inode, off_t offs, int flags)
 struct VM_PAGE*
 vmpage_create_private(vmarea_t* va, int flags)
 {
-  auto new_page = vmpage_alloc(va, nullptr, 0, flags);
-
   // Hook a page to here as well, as the caller needs it anyway
-  new_page->vp_page = page_alloc_single();
-	KASSERT(new_page->vp_page != nullptr, "out of pages");
+  struct PAGE* p = page_alloc_single();
+  if (p == nullptr)
+    return nullptr;
+
+  auto new_page = vmpage_alloc(va, nullptr, 0, flags);
+  new_page->vp_page = p;
   return new_page;
 }
 
@@ -420,13 +506,28 @@ vmpage_map(vmspace_t* vs, vmarea_t* va, struct VM_PAGE* vp)
 	md_map_pages(vs, vp->vp_vaddr, page_get_paddr(p), 1, flags);
 }
 
-void
-vmpage_zero(vmspace_t* vs, struct VM_PAGE* vp)
+struct VM_PAGE*
+vmpage_create_zeroed(vmarea_t* va, int flags)
 {
-	// Clear the page XXX This is unfortunate, we should have a supply of pre-zeroed pages
-	struct PAGE* p = vmpage_get_page(vp);
-	md_map_pages(vs, vp->vp_vaddr, page_get_paddr(p), 1, VM_FLAG_READ | VM_FLAG_WRITE);
-	memset((void*)vp->vp_vaddr, 0, PAGE_SIZE);
+  struct PAGE* p = page_alloc_zeroed();
+  if (p == nullptr)
+    return nullptr;
+
+  auto new_page = vmpage_alloc(va, nullptr, 0, flags);
+  new_page->vp_page = p;
+  return new_page;
+}
+
+struct VM_PAGE*
+vmpage_link_zero(vmarea_t* va)
+{
+  vmpage_lock(vmpage_zero_page);
+  struct VM_PAGE* vp = vmpage_link(va, vmpage_zero_page);
+  vmpage_unlock(vmpage_zero_page);
+
+  // Writes must yield a private copy
+  vp->vp_flags |= VM_PAGE_FLAG_COW;
+  return vp;
 }
 
 void vmpage_dump(struct VM_PAGE* vp, const char* prefix)
@@ -449,4 +550,144 @@ void vmpage_dump(struct VM_PAGE* vp, const char* prefix)
   kprintf("\n");
 }
 
+size_t
+vmpage_reclaim(size_t num_pages)
+{
+  size_t num_freed = 0;
+
+  spinlock_lock(&vmpage_cache_lock);
+  // Each page is visited at most twice: once to clear the referenced flag, once to evict it
+  for (size_t n = 2 * vmpage_cache_count; n > 0 && num_freed < num_pages && !LIST_EMPTY(&vmpage_cache); n--) {
+    struct VM_PAGE* vp = LIST_HEAD(&vmpage_cache);
+    LIST_POP_HEAD_IP(&vmpage_cache, cache);
+
+    // We must never wait here; anything that is busy is skipped
+    struct VFS_INODE* inode = vp->vp_inode;
+    if (!mutex_trylock(&inode->i_mutex)) {
+      LIST_APPEND_IP(&vmpage_cache, cache, vp);
+      continue;
+    }
+    if (!mutex_trylock(&vp->vp_mtx)) {
+      INODE_UNLOCK(inode);
+      LIST_APPEND_IP(&vmpage_cache, cache, vp);
+      continue;
+    }
+
+    // Only the cache may hold a reference; anything else means it is mapped or being read
+    if (vp->vp_refcount > 1 || (vp->vp_flags & (VM_PAGE_FLAG_PENDING | VM_PAGE_FLAG_REFERENCED))) {
+      vp->vp_flags &= ~VM_PAGE_FLAG_REFERENCED;
+      vmpage_unlock(vp);
+      INODE_UNLOCK(inode);
+      LIST_APPEND_IP(&vmpage_cache, cache, vp);
+      continue;
+    }
+
+    // Page is clean and unused; remove it from the inode so nothing can find it anymore
+    LIST_REMOVE(&inode->i_pages, vp);
+    INODE_UNLOCK(inode);
+    vmpage_cache_count--;
+
+    DPRINTF("vmpage_reclaim(): evicting vp %p (inode %p offset %d)\n", vp, inode, (int)vp->vp_offset);
+    page_free(vp->vp_page);
+    vp->vp_page = nullptr;
+    vp->vp_refcount = 0;
+    vmpage_unlock(vp);
+    LIST_APPEND(&vmpage_reclaimed, vp);
+    num_freed++;
+  }
+  spinlock_unlock(&vmpage_cache_lock);
+  return num_freed;
+}
+
+void
+vmpage_reclaim_finish()
+{
+  while(true) {
+    spinlock_lock(&vmpage_cache_lock);
+    if (LIST_EMPTY(&vmpage_reclaimed)) {
+      spinlock_unlock(&vmpage_cache_lock);
+      break;
+    }
+    struct VM_PAGE* vp = LIST_HEAD(&vmpage_reclaimed);
+    LIST_POP_HEAD(&vmpage_reclaimed);
+    spinlock_unlock(&vmpage_cache_lock);
+
+    kfree(vp);
+  }
+}
+
+void
+vmpage_discard_inode(struct VFS_INODE* inode)
+{
+  mutex_assert(&inode->i_mutex, MTX_LOCKED);
+
+  while(!LIST_EMPTY(&inode->i_pages)) {
+    struct VM_PAGE* vp = LIST_HEAD(&inode->i_pages);
+    LIST_POP_HEAD(&inode->i_pages);
+
+    spinlock_lock(&vmpage_cache_lock);
+    LIST_REMOVE_IP(&vmpage_cache, cache, vp);
+    vmpage_cache_count--;
+    spinlock_unlock(&vmpage_cache_lock);
+
+    // Drop the cache's reference; anyone still linked to the page keeps it alive
+    vmpage_lock(vp);
+    vmpage_deref(vp);
+  }
+}
+
+void
+vmpage_update_inode(struct VFS_INODE* inode, off_t offset, const void* buf, size_t len)
+{
+  auto src = static_cast<const char*>(buf);
+  while (len > 0) {
+    off_t page_offset = offset & ~(PAGE_SIZE - 1);
+    size_t in_page = offset - page_offset;
+    size_t chunk_len = PAGE_SIZE - in_page;
+    if (chunk_len > len)
+      chunk_len = len;
+
+    struct VM_PAGE* vp = nullptr;
+    INODE_LOCK(inode);
+    LIST_FOREACH(&inode->i_pages, vmpage, struct VM_PAGE) {
+      if (vmpage->vp_offset != page_offset)
+        continue;
+      vp = vmpage;
+      vmpage_lock(vp); // XXX is this order wise?
+      break;
+    }
+    INODE_UNLOCK(inode);
+
+    /*
+     * Pages still pending could not be read; they will be read again once
+     * someone needs them, so there is nothing to update there.
+     */
+    if (vp != nullptr) {
+      if ((vp->vp_flags & VM_PAGE_FLAG_PENDING) == 0) {
+        auto dst = static_cast<char*>(kmem_map(page_get_paddr(vmpage_get_page(vp)), PAGE_SIZE, VM_FLAG_READ | VM_FLAG_WRITE));
+        memcpy(dst + in_page, src, chunk_len);
+        kmem_unmap(dst, PAGE_SIZE);
+      }
+      vmpage_unlock(vp);
+    }
+
+    src += chunk_len;
+    offset += chunk_len;
+    len -= chunk_len;
+  }
+}
+
+static errorcode_t
+vmpage_init()
+{
+  vmpage_zero_page = vmpage_alloc(nullptr, nullptr, 0, VM_PAGE_FLAG_COW);
+  vmpage_zero_page->vp_page = page_alloc_zeroed();
+  vmpage_unlock(vmpage_zero_page);
+  if (vmpage_zero_page->vp_page == nullptr)
+    return ANANAS_ERROR(OUT_OF_MEMORY);
+  return ananas_success();
+}
+
+INIT_FUNCTION(vmpage_init, SUBSYSTEM_PROCESS, ORDER_FIRST);
+
 /* vim:set ts=2 sw=2: */
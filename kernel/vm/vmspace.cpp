@@ -71,48 +71,127 @@ vmspace_destroy(vmspace_t* vs)
 	kfree(vs);
 }
 
-static bool
+/* Throws away the pages of 'va' within [start, end) */
+static void
+vmspace_area_drop_pages(vmarea_t* va, addr_t start, addr_t end)
+{
+	LIST_FOREACH_SAFE(&va->va_pages, vp, struct VM_PAGE) {
+		if (vp->vp_vaddr < start || vp->vp_vaddr >= end)
+			continue;
+		vmpage_lock(vp);
+		LIST_REMOVE(&va->va_pages, vp);
+		vp->vp_vmarea = nullptr;
+		vmpage_deref(vp);
+	}
+}
+
+/* Moves the pages of 'va_from' at or beyond 'start' to 'va_to' */
+static void
+vmspace_area_move_pages(vmarea_t* va_from, vmarea_t* va_to, addr_t start)
+{
+	LIST_FOREACH_SAFE(&va_from->va_pages, vp, struct VM_PAGE) {
+		if (vp->vp_vaddr < start)
+			continue;
+		vmpage_lock(vp);
+		LIST_REMOVE(&va_from->va_pages, vp);
+		LIST_APPEND(&va_to->va_pages, vp);
+		vp->vp_vmarea = va_to;
+		vmpage_unlock(vp);
+	}
+}
+
+/* Makes 'va' begin at page-aligned 'virt'; the pages before it must be gone */
+static void
+vmspace_area_trim_front(vmarea_t* va, addr_t virt)
+{
+	size_t cut = virt - va->va_virt;
+	va->va_virt = virt;
+	va->va_len -= cut;
+	if (va->va_dentry == nullptr)
+		return;
+
+	// The dentry data starts va_dvskip bytes into the area; only the first page is skipped into
+	size_t data_end = va->va_dvskip + va->va_dlength;
+	va->va_doffset += cut;
+	va->va_dlength = data_end > cut ? data_end - cut : 0;
+	va->va_dvskip = 0;
+}
+
+/* Makes 'va' end at page-aligned 'virt'; the pages beyond it must be gone */
+static void
+vmspace_area_trim_back(vmarea_t* va, addr_t virt)
+{
+	va->va_len = virt - va->va_virt;
+	if (va->va_dentry == nullptr)
+		return;
+
+	size_t data_end = va->va_dvskip + va->va_dlength;
+	if (data_end > va->va_len)
+		va->va_dlength = va->va_len > (size_t)va->va_dvskip ? va->va_len - va->va_dvskip : 0;
+}
+
+/*
+ * Removes [virt, virt + len) from the vmspace, trimming or splitting any area
+ * that overlaps it. Areas the kernel relies on (VM_FLAG_NO_CLONE, i.e. the
+ * process information) are never touched; the range is rejected instead.
+ */
+static errorcode_t
 vmspace_free_range(vmspace_t* vs, addr_t virt, size_t len)
 {
+	addr_t start = ROUND_DOWN(virt, PAGE_SIZE);
+	addr_t end = ROUND_UP(virt + len, PAGE_SIZE);
+
 	LIST_FOREACH(&vs->vs_areas, va, vmarea_t) {
-		/*
-		 * To keep things simple, we will only break up mappings if they occur
-		 * completely within a single - this avoids complicated merging logic.
-		 */
-		if (virt >= va->va_virt + va->va_len || virt + len < va->va_virt)
+		addr_t va_end = ROUND_UP(va->va_virt + va->va_len, PAGE_SIZE);
+		if (end <= va->va_virt || start >= va_end)
 			continue; // not within our area, skip
+		if (va->va_flags & VM_FLAG_NO_CLONE)
+			return ANANAS_ERROR(BAD_RANGE);
+	}
 
-		// See if this range extends before or beyond our va - if that is the case, we
-		// will reject it
-		if (virt < va->va_virt || virt + len > va->va_virt + va->va_len)
-			return false;
+	LIST_FOREACH_SAFE(&vs->vs_areas, va, vmarea_t) {
+		addr_t va_end = ROUND_UP(va->va_virt + va->va_len, PAGE_SIZE);
+		if (end <= va->va_virt || start >= va_end)
+			continue; // not within our area, skip
 
-		// Okay, we can alter this va to exclude our mapping. If it matches 1-to-1, just throw it away
-		if (virt == va->va_virt && len == va->va_len) {
+		// If the range covers the entire area, just throw it away
+		if (start <= va->va_virt && end >= va_end) {
 			vmspace_area_free(vs, va);
-			return true;
+			continue;
 		}
 
-		// Not a full match; maybe at the start?
-		if (virt == va->va_virt) {
-			// Shift the entire range
-			KASSERT(va->va_dvskip == 0, "deal with non-zero dvskip %d", va->va_dvskip); // XXX maybe just reject here?
-			va->va_virt += len;
-			va->va_len -= len;
-			va->va_doffset += len;
-			if (va->va_dlength >= len)
-				va->va_dlength -= len;
-			else
-				va->va_dlength = 0;
-			return true;
+		vmspace_area_drop_pages(va, start, end);
+		if (start <= va->va_virt) {
+			// Range covers the start of the area
+			vmspace_area_trim_front(va, end);
+		} else if (end >= va_end) {
+			// Range covers the end of the area
+			vmspace_area_trim_back(va, start);
+		} else {
+			// Range is in the middle; the part beyond it becomes an area of its own
+			auto va_tail = new vmarea_t;
+			memset(va_tail, 0, sizeof(*va_tail));
+			LIST_INIT(&va_tail->va_pages);
+			va_tail->va_flags = va->va_flags;
+			va_tail->va_virt = va->va_virt;
+			va_tail->va_len = va->va_len;
+			va_tail->va_dentry = va->va_dentry;
+			va_tail->va_dvskip = va->va_dvskip;
+			va_tail->va_doffset = va->va_doffset;
+			va_tail->va_dlength = va->va_dlength;
+			if (va_tail->va_dentry != nullptr)
+				dentry_ref(va_tail->va_dentry);
+			vmspace_area_trim_front(va_tail, end);
+			vmspace_area_move_pages(va, va_tail, end);
+			vmspace_area_trim_back(va, start);
+			LIST_APPEND(&vs->vs_areas, va_tail);
+
+			// Areas do not overlap, so nothing else can be in the range
+			break;
 		}
-
-		// XXX we need to cover the other use cases here as well (range at end, range in the middle)
-		panic("implement me! virt=%p..%p, va=%p..%p", virt, virt+len, va->va_virt, va->va_virt+va->va_len);
 	}
 
-	// No ranges match; this is okay
-	return true;
+	return ananas_success();
 }
 
 errorcode_t
@@ -122,8 +201,8 @@ vmspace_mapto(vmspace_t* vs, addr_t virt, size_t len /* bytes */, uint32_t flags
 		return ANANAS_ERROR(BAD_LENGTH);
 
 	// If the virtual address space is already in use, we need to break it up
-	if (!vmspace_free_range(vs, virt, len))
-		return ANANAS_ERROR(NO_SPACE);
+	errorcode_t err = vmspace_free_range(vs, virt, len);
+	ANANAS_ERROR_RETURN(err);
 
 	auto va = new vmarea_t;
 	memset(va, 0, sizeof(*va));
@@ -173,10 +252,13 @@ vmspace_map(vmspace_t* vs, size_t len /* bytes */, uint32_t flags, vmarea_t** va
 }
 
 /*
- * vmspace_clone() is used for two scenarios:
+ * vmspace_clone() is used for three scenarios:
  *
  * (1) fork() uses it to copy the parent's vmspace to a new child
  * (2) exec() uses it to fill the current vmspace with the new one
+ * (3) exec() after vfork() needs the MD-specific areas (i.e. the stack) in
+ *     the process' own vmspace before (2) can be done; their contents are not
+ *     needed as the new program will not use them
  *
  * In the first case, we just need to make things as identical as possible; yet
  * for (2), the destination vmspace will not have MD-specific data as no
@@ -200,6 +282,9 @@ vmspace_clone_area_must_copy(vmarea_t* va, int flags)
 	/* Scenario (2) does copy MD-specific parts */
 	if ((flags & VMSPACE_CLONE_EXEC) && (va->va_flags & VM_FLAG_MD))
 		return 1;
+	/* Scenario (3) only needs the MD-specific parts */
+	if (flags & VMSPACE_CLONE_VFORK)
+		return (va->va_flags & VM_FLAG_MD) != 0;
 	return (va->va_flags & VM_FLAG_NO_CLONE) == 0;
 }
 
@@ -235,13 +320,19 @@ vmspace_clone(vmspace_t* vs_source, vmspace_t* vs_dest, int flags)
 			dentry_ref(va_dst->va_dentry);
 		}
 
-		// Copy the area page-wise
+		// Copy the area page-wise; scenario (3) will fault the pages in as needed
+		if (flags & VMSPACE_CLONE_VFORK)
+			continue;
 		LIST_FOREACH(&va_src->va_pages, vp, struct VM_PAGE) {
 			vmpage_lock(vp);
 			KASSERT(vmpage_get_page(vp)->p_order == 0, "unexpected %d order page here", vmpage_get_page(vp)->p_order);
 
 			// Create a clone of the data; it is up to the vmpage how to do this (it may go for COW)
 			struct VM_PAGE* new_vp = vmpage_clone(vs_source, va_src, va_dst, vp);
+			if (new_vp == nullptr) {
+				vmpage_unlock(vp);
+				return ANANAS_ERROR(OUT_OF_MEMORY);
+			}
 
 			// Map the page into the cloned vmspace
 			vmpage_map(vs_dest, va_dst, new_vp);
@@ -250,21 +341,26 @@ vmspace_clone(vmspace_t* vs_source, vmspace_t* vs_dest, int flags)
 		}
 	}
 
+	vmspace_set_next_mapping(vs_dest, 0);
+	return ananas_success();
+}
+
+void
+vmspace_set_next_mapping(vmspace_t* vs, addr_t min)
+{
 	/*
 	 * See where the next mapping can be placed; we should use something more
 	 * clever than vs_next_mapping someday but this will have to suffice for
 	 * now.
 	 */
-	vs_dest->vs_next_mapping = 0;
-	LIST_FOREACH(&vs_dest->vs_areas, va, vmarea_t) {
+	vs->vs_next_mapping = min;
+	LIST_FOREACH(&vs->vs_areas, va, vmarea_t) {
 		addr_t next = va->va_virt + va->va_len;
 		if (next & (PAGE_SIZE - 1))
 			next = (next | (PAGE_SIZE - 1)) + 1; // round up
-		if (vs_dest->vs_next_mapping < next)
-			vs_dest->vs_next_mapping = next;
+		if (vs->vs_next_mapping < next)
+			vs->vs_next_mapping = next;
 	}
-
-	return ananas_success();
 }
 
 void
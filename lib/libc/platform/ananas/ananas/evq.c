@@ -0,0 +1,44 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/poll.h>
+#include <ananas/syscalls.h>
+#include <_posix/error.h>
+
+int
+evq_create(void)
+{
+	handleindex_t index;
+	errorcode_t err = sys_evq_create(&index);
+	if (err != ANANAS_ERROR_NONE) {
+		_posix_map_error(err);
+		return -1;
+	}
+	return index;
+}
+
+int
+evq_ctl(int evq, int op, int fd, unsigned int events, void* data)
+{
+	struct EVQ_EVENT ev;
+	ev.ev_handle = fd;
+	ev.ev_events = events;
+	ev.ev_data = data;
+	errorcode_t err = sys_evq_ctl(evq, op, &ev);
+	if (err != ANANAS_ERROR_NONE) {
+		_posix_map_error(err);
+		return -1;
+	}
+	return 0;
+}
+
+int
+evq_wait(int evq, struct EVQ_EVENT* events, int max, int timeout)
+{
+	size_t num = max;
+	errorcode_t err = sys_evq_wait(evq, events, &num, timeout);
+	if (err != ANANAS_ERROR_NONE) {
+		_posix_map_error(err);
+		return -1;
+	}
+	return num;
+}
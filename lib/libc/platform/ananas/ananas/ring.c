@@ -0,0 +1,76 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/syscalls.h>
+#include <ananas/syscall-ring.h>
+#include <_posix/error.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct RING*
+ring_create(unsigned int sq_entries, unsigned int cq_entries)
+{
+	size_t len = RING_LENGTH(sq_entries, cq_entries);
+	struct RING* r = malloc(len);
+	if (r == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset(r, 0, len);
+	r->r_sq_entries = sq_entries;
+	r->r_cq_entries = cq_entries;
+
+	errorcode_t err = sys_ring_setup(r, len);
+	if (err != ANANAS_ERROR_NONE) {
+		free(r);
+		_posix_map_error(err);
+		return NULL;
+	}
+	return r;
+}
+
+void
+ring_destroy(struct RING* r)
+{
+	sys_ring_setup(NULL, 0);
+	free(r);
+}
+
+struct RING_SQE*
+ring_get_sqe(struct RING* r)
+{
+	if (r->r_sq_tail - r->r_sq_head >= r->r_sq_entries)
+		return NULL; /* full; submit first */
+
+	struct RING_SQE* sqe = ring_sqe(r, r->r_sq_tail);
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->sqe_offset = -1;
+	r->r_sq_tail++;
+	return sqe;
+}
+
+int
+ring_submit(struct RING* r)
+{
+	unsigned int num = 0; /* everything */
+	errorcode_t err = sys_ring_enter(&num);
+	if (err != ANANAS_ERROR_NONE) {
+		_posix_map_error(err);
+		return -1;
+	}
+	return num;
+}
+
+struct RING_CQE*
+ring_peek_cqe(struct RING* r)
+{
+	if (r->r_cq_head == r->r_cq_tail)
+		return NULL;
+	return ring_cqe(r, r->r_cq_head);
+}
+
+void
+ring_cqe_seen(struct RING* r)
+{
+	r->r_cq_head++;
+}
@@ -9,7 +9,10 @@
 int
 dup2(int fildes, int fildes2)
 {
-	handleindex_t out;
+	if (fildes == fildes2)
+		return fildes;
+
+	handleindex_t out = fildes2;
 	errorcode_t err = sys_dupfd(fildes, HANDLE_DUPFD_TO, &out);
 	if (err != ANANAS_ERROR_NONE) {
 		_posix_map_error(err);
@@ -46,6 +46,10 @@ _posix_map_error(errorcode_t err)
 			SET_ERRNO(ENOSPC);
 		case ANANAS_ERROR_CROSS_DEVICE:
 			SET_ERRNO(EXDEV);
+		case ANANAS_ERROR_BROKEN_PIPE:
+			SET_ERRNO(EPIPE);
+		case ANANAS_ERROR_WOULD_BLOCK:
+			SET_ERRNO(EAGAIN);
 		case ANANAS_ERROR_CLONED: /* should never end up here */
 		case ANANAS_ERROR_UNKNOWN:
 		default:
@@ -9,6 +9,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+extern char** environ;
+
 int execl(const char *path, const char* arg0, ...)
 {
 	va_list va;
@@ -41,7 +43,7 @@ int execl(const char *path, const char* arg0, ...)
 	args[pos] = NULL;
 	va_end(va);
 
-	execve(path, (char* const*)args, NULL);
+	execve(path, (char* const*)args, environ);
 
 	/* If we got here, execve() failed and we must clean up after ourselves */
 	free(args);
@@ -9,6 +9,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+extern char** environ;
+
 /* XXX This is just a copy of execl() for now ... */
 int execlp(const char *path, const char* arg0, ...)
 {
@@ -42,7 +44,7 @@ int execlp(const char *path, const char* arg0, ...)
 	args[pos] = NULL;
 	va_end(va);
 
-	execve(path, (char* const*)args, NULL);
+	execve(path, (char* const*)args, environ);
 
 	/* If we got here, execve() failed and we must clean up after ourselves */
 	free(args);
@@ -1,7 +1,9 @@
 #include <unistd.h>
 #include <stdlib.h>
 
+extern char** environ;
+
 int execv(const char *path, char *const argv[])
 {
-	return execve(path, argv, NULL);
+	return execve(path, argv, environ);
 }
@@ -25,6 +25,10 @@ void* mmap(void* ptr, size_t len, int prot, int flags, int fd, off_t offset)
 		vo.vo_flags |= VMOP_FLAG_PRIVATE;
 	else
 		vo.vo_flags |= VMOP_FLAG_SHARED;
+	if (flags & MAP_POPULATE)
+		vo.vo_flags |= VMOP_FLAG_POPULATE;
+	if (flags & MAP_FIXED)
+		vo.vo_flags |= VMOP_FLAG_FIXED;
 
 	if (flags & MAP_ANONYMOUS) {
 		vo.vo_handle = -1;
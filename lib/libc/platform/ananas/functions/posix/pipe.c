@@ -0,0 +1,26 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/syscalls.h>
+#include <_posix/error.h>
+#include <unistd.h>
+
+int pipe(int fildes[2])
+{
+	/*
+	 * The kernel hands us two handles; the first is for reading and the second
+	 * for writing. Once all write handles are closed, reads will return zero
+	 * bytes; writing without any read handles fails with EPIPE.
+	 */
+	handleindex_t hindex[2];
+	errorcode_t err = sys_pipe(hindex);
+	if (err != ANANAS_ERROR_NONE) {
+		_posix_map_error(err);
+		return -1;
+	}
+
+	fildes[0] = hindex[0];
+	fildes[1] = hindex[1];
+	return 0;
+}
+
+/* vim:set ts=2 sw=2: */
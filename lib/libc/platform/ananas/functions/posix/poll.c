@@ -0,0 +1,16 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/syscalls.h>
+#include <_posix/error.h>
+#include <poll.h>
+
+int poll(struct pollfd fds[], nfds_t nfds, int timeout)
+{
+	size_t nready;
+	errorcode_t err = sys_poll(fds, nfds, timeout, &nready);
+	if (err != ANANAS_ERROR_NONE) {
+		_posix_map_error(err);
+		return -1;
+	}
+	return nready;
+}
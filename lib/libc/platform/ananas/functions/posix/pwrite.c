@@ -0,0 +1,15 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/syscalls.h>
+#include <_posix/error.h>
+#include <unistd.h>
+
+ssize_t pwrite(int fd, const void* buf, size_t len, off_t offset)
+{
+	errorcode_t err = sys_pwrite(fd, buf, &len, &offset);
+	if (err != ANANAS_ERROR_NONE) {
+		_posix_map_error(err);
+		return -1;
+	}
+	return len;
+}
@@ -0,0 +1,75 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/syscalls.h>
+#include <_posix/error.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/select.h>
+#include <sys/time.h>
+
+int select(int nfds, fd_set* readfds, fd_set* writefds, fd_set* errorfds, struct timeval* timeout)
+{
+	if (nfds < 0 || nfds > FD_SETSIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Convert the sets to poll entries; errors are always reported by poll() */
+	struct pollfd pfd[FD_SETSIZE];
+	int num = 0;
+	for (int fd = 0; fd < nfds; fd++) {
+		short events = 0;
+		if (readfds != NULL && FD_ISSET(fd, readfds))
+			events |= POLLIN;
+		if (writefds != NULL && FD_ISSET(fd, writefds))
+			events |= POLLOUT;
+		if (events == 0 && (errorfds == NULL || !FD_ISSET(fd, errorfds)))
+			continue;
+		pfd[num].fd = fd;
+		pfd[num].events = events;
+		pfd[num].revents = 0;
+		num++;
+	}
+
+	int ms = -1;
+	if (timeout != NULL)
+		ms = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+
+	size_t nready;
+	errorcode_t err = sys_poll(pfd, num, ms, &nready);
+	if (err != ANANAS_ERROR_NONE) {
+		_posix_map_error(err);
+		return -1;
+	}
+
+	/* Only keep what is ready; a hangup or error counts as readable */
+	if (readfds != NULL)
+		FD_ZERO(readfds);
+	if (writefds != NULL)
+		FD_ZERO(writefds);
+	if (errorfds != NULL)
+		FD_ZERO(errorfds);
+	int result = 0;
+	for (int n = 0; n < num; n++) {
+		short revents = pfd[n].revents;
+		if (revents & POLLNVAL) {
+			errno = EBADF;
+			return -1;
+		}
+		if ((pfd[n].events & POLLIN) && (revents & (POLLIN | POLLHUP | POLLERR))) {
+			FD_SET(pfd[n].fd, readfds);
+			result++;
+		}
+		if ((pfd[n].events & POLLOUT) && (revents & (POLLOUT | POLLERR))) {
+			FD_SET(pfd[n].fd, writefds);
+			result++;
+		}
+		if (errorfds != NULL && (revents & POLLERR)) {
+			FD_SET(pfd[n].fd, errorfds);
+			result++;
+		}
+	}
+	return result;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,15 @@
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <_posix/error.h>
+
+/* Called by vfork() for anything but a successful return to the parent */
+pid_t _vfork_result(errorcode_t err)
+{
+	if (ANANAS_ERROR_CODE(err) == ANANAS_ERROR_CLONED) {
+		/* We are the child */
+		return 0;
+	}
+
+	_posix_map_error(err);
+	return -1;
+}
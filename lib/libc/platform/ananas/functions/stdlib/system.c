@@ -12,6 +12,7 @@
 extern int fork( void );
 extern int execve( const char * filename, char * const argv[], char * const envp[] );
 extern int wait( int * status );
+extern char * * environ;
 
 int system( const char * string )
 {
@@ -21,7 +22,7 @@ int system( const char * string )
         int pid = fork();
         if ( pid == 0 )
         {
-            execve( "/bin/sh", (char * * const)argv, NULL );
+            execve( "/bin/sh", (char * * const)argv, environ );
         }
         else if ( pid > 0 )
         {
@@ -0,0 +1,69 @@
+/*
+ * amd64-specific relocation processing.
+ */
+#include "rtld.h"
+
+/*
+ * Applies our own relocations. This runs before anything is relocated, so it
+ * must not use any global data; as we are linked with -Bsymbolic and hide
+ * all our symbols, only relative relocations are to be expected.
+ */
+void
+rtld_relocate_self(addr_t base, const Elf64_Dyn* dynamic)
+{
+	const Elf64_Rela* rela = NULL;
+	size_t relasz = 0;
+	for (const Elf64_Dyn* dyn = dynamic; dyn->d_tag != DT_NULL; dyn++) {
+		if (dyn->d_tag == DT_RELA)
+			rela = (const Elf64_Rela*)(base + dyn->d_un.d_ptr);
+		else if (dyn->d_tag == DT_RELASZ)
+			relasz = dyn->d_un.d_val;
+	}
+
+	for (size_t n = 0; n < relasz / sizeof(Elf64_Rela); n++) {
+		if (ELF64_R_TYPE(rela[n].r_info) == R_X86_64_RELATIVE)
+			*(addr_t*)(base + rela[n].r_offset) = base + rela[n].r_addend;
+	}
+}
+
+static void
+rtld_relocate_rela(struct OBJECT* obj, const Elf64_Rela* rela, size_t relasz)
+{
+	for (size_t n = 0; n < relasz / sizeof(Elf64_Rela); n++) {
+		const Elf64_Rela* r = &rela[n];
+		addr_t* where = (addr_t*)(obj->o_base + r->r_offset);
+		unsigned long symnum = ELF64_R_SYM(r->r_info);
+		switch(ELF64_R_TYPE(r->r_info)) {
+			case R_X86_64_NONE:
+				break;
+			case R_X86_64_RELATIVE:
+				*where = obj->o_base + r->r_addend;
+				break;
+			case R_X86_64_64:
+				*where = rtld_resolve(obj, symnum) + r->r_addend;
+				break;
+			case R_X86_64_GLOB_DAT:
+			case R_X86_64_JUMP_SLOT:
+				/* We always bind immediately; there is no lazy binding */
+				*where = rtld_resolve(obj, symnum);
+				break;
+			case R_X86_64_COPY: {
+				struct OBJECT* def_obj;
+				const Elf64_Sym* sym = rtld_find_symbol(obj, symnum, &def_obj, 1);
+				if (sym == NULL)
+					rtld_fatal("undefined symbol", obj->o_strtab + obj->o_symtab[symnum].st_name);
+				memcpy(where, (const void*)(def_obj->o_base + sym->st_value), sym->st_size);
+				break;
+			}
+			default:
+				rtld_fatal("unsupported relocation type", obj->o_name);
+		}
+	}
+}
+
+void
+rtld_relocate(struct OBJECT* obj)
+{
+	rtld_relocate_rela(obj, obj->o_rela, obj->o_relasz);
+	rtld_relocate_rela(obj, obj->o_jmprel, obj->o_jmprelsz);
+}
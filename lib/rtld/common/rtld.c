@@ -0,0 +1,476 @@
+/*
+ * Runtime loader; this is the interpreter of dynamically-linked programs.
+ *
+ * The kernel maps both the program and us, and enters rtld_start() with the
+ * PROCINFO and an ANANAS_ELF_INFO describing the program. We load all
+ * libraries the program needs, relocate everything and run the library
+ * initializers before handing control to the program's own entry point.
+ *
+ * Libraries are mapped straight from their files; the kernel shares such
+ * pages between all processes through the inode's page cache, so only pages
+ * that get written to (data, GOT) are ever copied.
+ *
+ * We cannot use libc as we are the one loading it, so we make do with the
+ * system call stubs and the few helpers below.
+ */
+#include <ananas/types.h>
+#include <ananas/elfinfo.h>
+#include <ananas/error.h>
+#include <ananas/flags.h>
+#include <ananas/procinfo.h>
+#include <ananas/syscalls.h>
+#include <machine/param.h>
+#include "rtld.h"
+
+#define RTLD_CHUNK_SIZE		(16 * PAGE_SIZE)
+#define RTLD_EXIT_FAILURE	127
+
+static struct OBJECT* rtld_objects;	/* Program, followed by the libraries */
+static struct OBJECT* rtld_objects_tail;
+
+static char* rtld_chunk;
+static size_t rtld_chunk_left;
+
+static const char* rtld_library_path[] = { RTLD_LIBRARY_PATH, NULL };
+
+void*
+memcpy(void* dst, const void* src, size_t len)
+{
+	char* d = dst;
+	const char* s = src;
+	while (len-- > 0)
+		*d++ = *s++;
+	return dst;
+}
+
+void*
+memset(void* dst, int c, size_t len)
+{
+	char* d = dst;
+	while (len-- > 0)
+		*d++ = c;
+	return dst;
+}
+
+static size_t
+rtld_strlen(const char* s)
+{
+	size_t len = 0;
+	while (s[len] != '\0')
+		len++;
+	return len;
+}
+
+static int
+rtld_strcmp(const char* a, const char* b)
+{
+	while (*a != '\0' && *a == *b)
+		a++, b++;
+	return (unsigned char)*a - (unsigned char)*b;
+}
+
+static int
+rtld_has_slash(const char* s)
+{
+	for (/* nothing */; *s != '\0'; s++)
+		if (*s == '/')
+			return 1;
+	return 0;
+}
+
+static void
+rtld_puts(const char* s)
+{
+	size_t len = rtld_strlen(s);
+	sys_write(2, s, &len);
+}
+
+void
+rtld_fatal(const char* msg, const char* arg)
+{
+	rtld_puts("rtld: ");
+	rtld_puts(msg);
+	if (arg != NULL) {
+		rtld_puts(": ");
+		rtld_puts(arg);
+	}
+	rtld_puts("\n");
+	sys_exit(RTLD_EXIT_FAILURE);
+	for(;;);
+}
+
+/* Maps memory; backed by 'fd' at 'offset' if VMOP_FLAG_HANDLE is given */
+static void*
+rtld_map(void* addr, size_t len, int flags, handleindex_t fd, off_t offset)
+{
+	struct VMOP_OPTIONS vo;
+	memset(&vo, 0, sizeof(vo));
+	vo.vo_size = sizeof(vo);
+	vo.vo_op = OP_MAP;
+	vo.vo_addr = addr;
+	vo.vo_len = len;
+	vo.vo_flags = flags;
+	vo.vo_handle = fd;
+	vo.vo_offset = offset;
+	if (sys_vmop(&vo) != ANANAS_ERROR_NONE)
+		return NULL;
+	return vo.vo_addr;
+}
+
+/* Allocates memory which is never freed; we only need a handful of objects */
+static void*
+rtld_alloc(size_t len)
+{
+	len = (len + 15) & ~15;
+	if (len > rtld_chunk_left) {
+		size_t chunk_len = len > RTLD_CHUNK_SIZE ? len : RTLD_CHUNK_SIZE;
+		rtld_chunk = rtld_map(NULL, chunk_len, VMOP_FLAG_READ | VMOP_FLAG_WRITE | VMOP_FLAG_PRIVATE, -1, 0);
+		if (rtld_chunk == NULL)
+			rtld_fatal("out of memory", NULL);
+		rtld_chunk_left = chunk_len;
+	}
+
+	void* p = rtld_chunk;
+	rtld_chunk += len;
+	rtld_chunk_left -= len;
+	return p;
+}
+
+static void
+rtld_parse_dynamic(struct OBJECT* obj)
+{
+	addr_t init_array = 0;
+	for (const Elf64_Dyn* dyn = obj->o_dynamic; dyn->d_tag != DT_NULL; dyn++) {
+		switch(dyn->d_tag) {
+			case DT_SYMTAB:
+				obj->o_symtab = (const Elf64_Sym*)(obj->o_base + dyn->d_un.d_ptr);
+				break;
+			case DT_STRTAB:
+				obj->o_strtab = (const char*)(obj->o_base + dyn->d_un.d_ptr);
+				break;
+			case DT_HASH: {
+				const Elf64_Word* hash = (const Elf64_Word*)(obj->o_base + dyn->d_un.d_ptr);
+				obj->o_nbuckets = hash[0];
+				obj->o_buckets = &hash[2];
+				obj->o_chains = &hash[2 + hash[0]];
+				break;
+			}
+			case DT_RELA:
+				obj->o_rela = (const Elf64_Rela*)(obj->o_base + dyn->d_un.d_ptr);
+				break;
+			case DT_RELASZ:
+				obj->o_relasz = dyn->d_un.d_val;
+				break;
+			case DT_JMPREL:
+				obj->o_jmprel = (const Elf64_Rela*)(obj->o_base + dyn->d_un.d_ptr);
+				break;
+			case DT_PLTRELSZ:
+				obj->o_jmprelsz = dyn->d_un.d_val;
+				break;
+			case DT_PLTREL:
+				if (dyn->d_un.d_val != DT_RELA)
+					rtld_fatal("unsupported PLT relocation type", obj->o_name);
+				break;
+			case DT_REL:
+				rtld_fatal("DT_REL relocations are not supported", obj->o_name);
+			case DT_TEXTREL:
+				/* Text is mapped read-only and shared; it must never be relocated */
+				rtld_fatal("text relocations are not supported", obj->o_name);
+			case DT_INIT:
+				obj->o_init = obj->o_base + dyn->d_un.d_ptr;
+				break;
+			case DT_INIT_ARRAY:
+				init_array = obj->o_base + dyn->d_un.d_ptr;
+				break;
+			case DT_INIT_ARRAYSZ:
+				obj->o_init_arraysz = dyn->d_un.d_val / sizeof(addr_t);
+				break;
+		}
+	}
+	obj->o_init_array = (const addr_t*)init_array;
+
+	if (obj->o_symtab == NULL || obj->o_strtab == NULL)
+		rtld_fatal("no symbol table", obj->o_name);
+	if (obj->o_buckets == NULL)
+		rtld_fatal("no DT_HASH section", obj->o_name);
+}
+
+static void
+rtld_add_object(struct OBJECT* obj)
+{
+	if (rtld_objects == NULL)
+		rtld_objects = obj;
+	else
+		rtld_objects_tail->o_next = obj;
+	rtld_objects_tail = obj;
+}
+
+/*
+ * Maps a shared library. We reserve the entire address range first, so that
+ * the segments keep their relative position, and then map every segment on
+ * top of it; the kernel splits the reservation as needed, and whatever lies
+ * between the segments stays reserved but inaccessible. Read-only segments
+ * are mapped shared, as the kernel does for programs; writable ones are
+ * private so our changes stay ours.
+ */
+static struct OBJECT*
+rtld_map_object(const char* path, const char* name)
+{
+	handleindex_t fd;
+	if (sys_open(path, O_RDONLY, 0, &fd) != ANANAS_ERROR_NONE)
+		return NULL;
+
+	/* Both the ELF header and the program headers must be in the first page */
+	char header[PAGE_SIZE];
+	size_t len = sizeof(header);
+	off_t offset = 0;
+	if (sys_pread(fd, header, &len, &offset) != ANANAS_ERROR_NONE)
+		rtld_fatal("cannot read", path);
+
+	const Elf64_Ehdr* ehdr = (const Elf64_Ehdr*)header;
+	if (len < sizeof(*ehdr) ||
+	    ehdr->e_ident[EI_MAG0] != ELFMAG0 || ehdr->e_ident[EI_MAG1] != ELFMAG1 ||
+	    ehdr->e_ident[EI_MAG2] != ELFMAG2 || ehdr->e_ident[EI_MAG3] != ELFMAG3 ||
+	    ehdr->e_ident[EI_CLASS] != ELFCLASS64 || ehdr->e_ident[EI_DATA] != ELFDATA2LSB ||
+	    ehdr->e_type != ET_DYN || ehdr->e_machine != EM_X86_64 ||
+	    ehdr->e_phentsize < sizeof(Elf64_Phdr) ||
+	    ehdr->e_phoff + ehdr->e_phnum * ehdr->e_phentsize > len)
+		rtld_fatal("not a shared library", path);
+
+#define PHDR(n) ((const Elf64_Phdr*)(header + ehdr->e_phoff + (n) * ehdr->e_phentsize))
+	addr_t v_lo = (addr_t)-1, v_hi = 0;
+	for (unsigned int n = 0; n < ehdr->e_phnum; n++) {
+		const Elf64_Phdr* phdr = PHDR(n);
+		if (phdr->p_type != PT_LOAD)
+			continue;
+		if (v_lo > ROUND_DOWN(phdr->p_vaddr, PAGE_SIZE))
+			v_lo = ROUND_DOWN(phdr->p_vaddr, PAGE_SIZE);
+		if (v_hi < ROUND_UP(phdr->p_vaddr + phdr->p_memsz, PAGE_SIZE))
+			v_hi = ROUND_UP(phdr->p_vaddr + phdr->p_memsz, PAGE_SIZE);
+	}
+	if (v_hi <= v_lo)
+		rtld_fatal("nothing to load", path);
+
+	void* region = rtld_map(NULL, v_hi - v_lo, VMOP_FLAG_PRIVATE, -1, 0);
+	if (region == NULL)
+		rtld_fatal("out of address space", path);
+
+	struct OBJECT* obj = rtld_alloc(sizeof(*obj));
+	memset(obj, 0, sizeof(*obj));
+	obj->o_base = (addr_t)region - v_lo;
+
+	for (unsigned int n = 0; n < ehdr->e_phnum; n++) {
+		const Elf64_Phdr* phdr = PHDR(n);
+		if (phdr->p_type == PT_DYNAMIC)
+			obj->o_dynamic = (const Elf64_Dyn*)(obj->o_base + phdr->p_vaddr);
+		if (phdr->p_type != PT_LOAD)
+			continue;
+
+		int flags = VMOP_FLAG_FIXED;
+		if (phdr->p_flags & PF_R)
+			flags |= VMOP_FLAG_READ;
+		if (phdr->p_flags & PF_W)
+			flags |= VMOP_FLAG_WRITE | VMOP_FLAG_PRIVATE;
+		else
+			flags |= VMOP_FLAG_SHARED;
+		if (phdr->p_flags & PF_X)
+			flags |= VMOP_FLAG_EXECUTE;
+
+		addr_t v_start = obj->o_base + ROUND_DOWN(phdr->p_vaddr, PAGE_SIZE);
+		addr_t v_file_end = obj->o_base + phdr->p_vaddr + phdr->p_filesz;
+		addr_t v_end = obj->o_base + ROUND_UP(phdr->p_vaddr + phdr->p_memsz, PAGE_SIZE);
+		if (phdr->p_filesz > 0) {
+			size_t file_len = ROUND_UP(v_file_end, PAGE_SIZE) - v_start;
+			off_t file_offset = ROUND_DOWN(phdr->p_offset, PAGE_SIZE);
+			if (rtld_map((void*)v_start, file_len, flags | VMOP_FLAG_HANDLE, fd, file_offset) == NULL)
+				rtld_fatal("cannot map", path);
+
+			/* Whatever follows in the final file page is not part of the segment */
+			if ((phdr->p_flags & PF_W) && (v_file_end & (PAGE_SIZE - 1)) != 0)
+				memset((void*)v_file_end, 0, ROUND_UP(v_file_end, PAGE_SIZE) - v_file_end);
+			v_start += file_len;
+		}
+
+		/* Anything beyond the file contents is zero-filled (.bss) */
+		if (v_start < v_end) {
+			flags = (flags & ~VMOP_FLAG_SHARED) | VMOP_FLAG_PRIVATE;
+			if (rtld_map((void*)v_start, v_end - v_start, flags, -1, 0) == NULL)
+				rtld_fatal("cannot map", path);
+		}
+	}
+#undef PHDR
+
+	/* The mappings hold on to the file, so we need not */
+	sys_close(fd);
+
+	if (obj->o_dynamic == NULL)
+		rtld_fatal("no dynamic section", path);
+
+	char* obj_name = rtld_alloc(rtld_strlen(name) + 1);
+	memcpy(obj_name, name, rtld_strlen(name) + 1);
+	obj->o_name = obj_name;
+	rtld_parse_dynamic(obj);
+	rtld_add_object(obj);
+	return obj;
+}
+
+static void
+rtld_load_library(const char* name)
+{
+	/* Nothing to do if we already have it */
+	for (struct OBJECT* obj = rtld_objects; obj != NULL; obj = obj->o_next)
+		if (rtld_strcmp(obj->o_name, name) == 0)
+			return;
+
+	if (rtld_has_slash(name)) {
+		if (rtld_map_object(name, name) != NULL)
+			return;
+	} else {
+		for (const char** dir = rtld_library_path; *dir != NULL; dir++) {
+			char path[RTLD_MAX_PATH];
+			size_t dir_len = rtld_strlen(*dir), name_len = rtld_strlen(name);
+			if (dir_len + 1 + name_len + 1 > sizeof(path))
+				continue;
+			memcpy(path, *dir, dir_len);
+			path[dir_len] = '/';
+			memcpy(&path[dir_len + 1], name, name_len + 1);
+			if (rtld_map_object(path, name) != NULL)
+				return;
+		}
+	}
+	rtld_fatal("cannot find library", name);
+}
+
+static unsigned long
+rtld_elf_hash(const char* name)
+{
+	unsigned long h = 0;
+	for (/* nothing */; *name != '\0'; name++) {
+		h = (h << 4) + (unsigned char)*name;
+		unsigned long g = h & 0xf0000000;
+		if (g != 0)
+			h ^= g >> 24;
+		h &= ~g;
+	}
+	return h;
+}
+
+static const Elf64_Sym*
+rtld_lookup(struct OBJECT* obj, const char* name, unsigned long hash)
+{
+	for (Elf64_Word n = obj->o_buckets[hash % obj->o_nbuckets]; n != STN_UNDEF; n = obj->o_chains[n]) {
+		const Elf64_Sym* sym = &obj->o_symtab[n];
+		if (sym->st_shndx == SHN_UNDEF)
+			continue;
+		int bind = ELF32_ST_BIND(sym->st_info);
+		if (bind != STB_GLOBAL && bind != STB_WEAK)
+			continue;
+		if (rtld_strcmp(obj->o_strtab + sym->st_name, name) == 0)
+			return sym;
+	}
+	return NULL;
+}
+
+/*
+ * Locates the definition of symbol 'symnum' of 'ref'; the first object that
+ * defines it wins. COPY relocations skip the program, as it is the one that
+ * needs the initial value.
+ */
+const Elf64_Sym*
+rtld_find_symbol(struct OBJECT* ref, unsigned long symnum, struct OBJECT** def_obj, int skip_program)
+{
+	const Elf64_Sym* ref_sym = &ref->o_symtab[symnum];
+	if (ELF32_ST_BIND(ref_sym->st_info) == STB_LOCAL) {
+		*def_obj = ref;
+		return ref_sym;
+	}
+
+	const char* name = ref->o_strtab + ref_sym->st_name;
+	unsigned long hash = rtld_elf_hash(name);
+	for (struct OBJECT* obj = rtld_objects; obj != NULL; obj = obj->o_next) {
+		if (skip_program && obj == rtld_objects)
+			continue;
+		const Elf64_Sym* sym = rtld_lookup(obj, name, hash);
+		if (sym != NULL) {
+			*def_obj = obj;
+			return sym;
+		}
+	}
+	return NULL;
+}
+
+/* Returns the address of symbol 'symnum' of 'ref'; weak symbols may be absent */
+addr_t
+rtld_resolve(struct OBJECT* ref, unsigned long symnum)
+{
+	struct OBJECT* def_obj;
+	const Elf64_Sym* sym = rtld_find_symbol(ref, symnum, &def_obj, 0);
+	if (sym != NULL)
+		return def_obj->o_base + sym->st_value;
+
+	const Elf64_Sym* ref_sym = &ref->o_symtab[symnum];
+	if (ELF32_ST_BIND(ref_sym->st_info) != STB_WEAK)
+		rtld_fatal("undefined symbol", ref->o_strtab + ref_sym->st_name);
+	return 0;
+}
+
+/* Initializes libraries last-loaded first, so that dependencies tend to go first */
+static void
+rtld_init_objects(struct OBJECT* obj)
+{
+	if (obj == NULL)
+		return;
+	rtld_init_objects(obj->o_next);
+
+	/* The program's crt0 takes care of its own initialization */
+	if (obj == rtld_objects || obj->o_initialized)
+		return;
+	obj->o_initialized = 1;
+
+	if (obj->o_init != 0)
+		((void (*)(void))obj->o_init)();
+	for (size_t n = 0; n < obj->o_init_arraysz; n++)
+		((void (*)(void))obj->o_init_array[n])();
+}
+
+/* Called by rtld_start() once we are relocated; returns the program entry point */
+addr_t
+rtld(struct PROCINFO* pi, const struct ANANAS_ELF_INFO* ei)
+{
+	if (ei->ei_size != sizeof(*ei))
+		rtld_fatal("ELF information mismatch", NULL);
+
+	/* Describe the program; the first argument is its name */
+	struct OBJECT* prog = rtld_alloc(sizeof(*prog));
+	memset(prog, 0, sizeof(*prog));
+	prog->o_name = pi->pi_argc > 0 ? pi->pi_argv[0] : "program";
+	prog->o_base = ei->ei_base;
+	const Elf64_Phdr* phdr = (const Elf64_Phdr*)ei->ei_phdr;
+	for (size_t n = 0; n < ei->ei_phdr_entries; n++)
+		if (phdr[n].p_type == PT_DYNAMIC)
+			prog->o_dynamic = (const Elf64_Dyn*)(prog->o_base + phdr[n].p_vaddr);
+	if (prog->o_dynamic == NULL)
+		rtld_fatal("program is not dynamically linked", prog->o_name);
+	rtld_parse_dynamic(prog);
+	rtld_add_object(prog);
+
+	/* Load everything needed; new libraries are appended so they are processed too */
+	for (struct OBJECT* obj = rtld_objects; obj != NULL; obj = obj->o_next)
+		for (const Elf64_Dyn* dyn = obj->o_dynamic; dyn->d_tag != DT_NULL; dyn++)
+			if (dyn->d_tag == DT_NEEDED)
+				rtld_load_library(obj->o_strtab + dyn->d_un.d_val);
+
+	/*
+	 * Relocate the libraries before the program; COPY relocations in the
+	 * program need the final contents of library data.
+	 */
+	for (struct OBJECT* obj = prog->o_next; obj != NULL; obj = obj->o_next)
+		rtld_relocate(obj);
+	rtld_relocate(prog);
+
+	// XXX We do not run DT_FINI / DT_FINI_ARRAY of libraries on exit
+	rtld_init_objects(rtld_objects);
+	return ei->ei_entry;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,57 @@
+#ifndef __RTLD_H__
+#define __RTLD_H__
+
+#include <ananas/types.h>
+#include <elf.h>
+
+/* Directories searched for DT_NEEDED libraries, in order */
+#define RTLD_LIBRARY_PATH	"/lib", "/usr/lib"
+
+#define RTLD_MAX_PATH		256
+
+#define ROUND_UP(n, mult)	(((n) + (mult) - 1) & ~((mult) - 1))
+#define ROUND_DOWN(n, mult)	((n) & ~((mult) - 1))
+
+/* End of a DT_HASH chain */
+#define STN_UNDEF		0
+
+/*
+ * Every loaded ELF file is an object; the program itself is the first one,
+ * followed by the libraries in the order in which they were loaded. Symbols
+ * are looked up in the same order.
+ */
+struct OBJECT {
+	const char*		o_name;
+	addr_t			o_base;		/* Relocation base */
+	const Elf64_Dyn*	o_dynamic;
+
+	/* Obtained from the dynamic section */
+	const Elf64_Sym*	o_symtab;
+	const char*		o_strtab;
+	const Elf64_Word*	o_buckets;	/* DT_HASH */
+	Elf64_Word		o_nbuckets;
+	const Elf64_Word*	o_chains;
+	const Elf64_Rela*	o_rela;
+	size_t			o_relasz;
+	const Elf64_Rela*	o_jmprel;
+	size_t			o_jmprelsz;
+	addr_t			o_init;
+	const addr_t*		o_init_array;
+	size_t			o_init_arraysz;
+
+	int			o_initialized;
+	struct OBJECT*		o_next;
+};
+
+/* rtld.c */
+void rtld_fatal(const char* msg, const char* arg) __attribute__((noreturn));
+const Elf64_Sym* rtld_find_symbol(struct OBJECT* ref, unsigned long symnum, struct OBJECT** def_obj, int skip_program);
+addr_t rtld_resolve(struct OBJECT* ref, unsigned long symnum);
+void* memcpy(void* dst, const void* src, size_t len);
+void* memset(void* dst, int c, size_t len);
+
+/* Machine-dependant: <arch>/reloc.c */
+void rtld_relocate_self(addr_t base, const Elf64_Dyn* dynamic);
+void rtld_relocate(struct OBJECT* obj);
+
+#endif /* __RTLD_H__ */
@@ -79,6 +79,9 @@ crtend.o%s crtn.o%s			\
 
 #undef LINK_SPEC
 #define LINK_SPEC " \
+%{shared:-shared} \
+%{!shared:%{!static:-dynamic-linker /lib/ld-ananas.so}} \
+--hash-style=sysv \
 "
 
 #undef LIB_SPEC